@@ -0,0 +1,69 @@
+#ifndef ASM_H
+#define ASM_H
+
+#include <stddef.h>
+#include <stdbool.h>
+
+// The macros in emit.h don't print assembly directly, but append it to a buffer of lines.
+// The buffer is printed by asm_flush, once for every function, so it can be optimized as a whole first.
+
+typedef enum
+{
+    ASM_INSTRUCTION, ASM_LABEL, ASM_DIRECTIVE
+} asm_kind_t;
+
+#define ASM_MAX_OPERANDS 3
+
+typedef struct asm_line
+{
+    asm_kind_t kind;
+    char *text; // The line as printed, without indentation or newline. Labels include their colon
+
+    // Instructions are also split into their mnemonic and operands
+    char *mnemonic;
+    char *operands[ASM_MAX_OPERANDS];
+    int n_operands;
+} asm_line_t;
+
+typedef struct asm_buffer
+{
+    asm_line_t *lines;
+    size_t n_lines;
+    size_t capacity;
+} asm_buffer_t;
+
+extern asm_buffer_t asm_buffer;
+
+// When writing an object file, asm_flush moves the lines of every function here instead of printing them
+extern asm_buffer_t asm_program;
+
+// Appends a line to the buffer, formatted like printf
+void asm_instruction ( const char *format, ... );
+void asm_label ( const char *format, ... );
+void asm_directive ( const char *format, ... );
+
+// Replaces the instruction on the line. Operands may be NULL
+void asm_set_instruction ( asm_line_t *line, const char *mnemonic, const char *first, const char *second );
+
+// Removes the line from the buffer
+void asm_delete_line ( asm_buffer_t *buffer, size_t position );
+
+// Tests on operands and mnemonics as printed
+bool asm_is_register ( const char *operand );
+bool asm_is_memory ( const char *operand );
+// Conditional jumps, sets, conditional moves and adds and subtracts with carry
+bool asm_reads_flags ( const char *mnemonic );
+
+// Prints and empties the buffer, running the peephole optimizer first when optimizing
+void asm_flush ( void );
+
+// Frees all lines of the buffer
+void asm_clear_buffer ( asm_buffer_t *buffer );
+
+// Rewrites inefficient instruction sequences in the buffer, from peephole.c
+void peephole_optimize ( asm_buffer_t *buffer );
+
+// Reorders the instructions within the basic blocks of the buffer, to hide their latencies, from scheduler.c
+void schedule_instructions ( asm_buffer_t *buffer );
+
+#endif // ASM_H
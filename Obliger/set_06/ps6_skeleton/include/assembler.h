@@ -0,0 +1,67 @@
+#ifndef ASSEMBLER_H
+#define ASSEMBLER_H
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "asm.h"
+
+// The built-in assembler turns the buffered assembly of a whole program into machine code and data,
+// laid out in sections, with relocations for what can only be resolved when the program is linked.
+
+typedef enum
+{
+    SECTION_TEXT, SECTION_RODATA, SECTION_BSS, NUM_SECTIONS
+} section_t;
+
+typedef struct object_symbol
+{
+    char *name;
+    int section;        // -1 for symbols only referenced, which are defined somewhere else
+    uint64_t offset;
+    bool global;
+} object_symbol_t;
+
+typedef enum
+{
+    RELOCATION_PC32,    // A 32 bit displacement from the end of the field, like for %rip relative operands
+    RELOCATION_PLT32    // The same, for calls and jumps to functions defined somewhere else
+} relocation_type_t;
+
+typedef struct object_relocation
+{
+    section_t section;  // Where the field is
+    uint64_t offset;
+    relocation_type_t type;
+    int target_section; // The section relative to, or -1 when relative to the symbol
+    size_t symbol;
+    int64_t addend;
+} object_relocation_t;
+
+typedef struct object
+{
+    uint8_t *contents[NUM_SECTIONS];    // NULL for .bss, which is all zeros
+    size_t sizes[NUM_SECTIONS];
+    size_t alignments[NUM_SECTIONS];
+    object_symbol_t *symbols;
+    size_t n_symbols;
+    object_relocation_t *relocations;
+    size_t n_relocations;
+} object_t;
+
+// Assembles the lines of a whole program, from assembler.c. Errors in the assembly end the compilation
+object_t *assemble_program ( asm_buffer_t *buffer );
+void destroy_object ( object_t *object );
+
+// Returns the contents of a quoted string literal, with escapes decoded like gas does and a terminating NUL.
+// The length excludes the NUL
+uint8_t *decode_string_literal ( const char *literal, size_t *length );
+
+// Writes the object as an ELF64 relocatable object file, from elf.c
+void write_elf_object ( object_t *object, FILE *file );
+
+// Loads the object into the compiler's own process and calls its main with the arguments, from jit.c
+int run_object ( object_t *object, int argc, char **argv );
+
+#endif // ASSEMBLER_H
@@ -0,0 +1,91 @@
+#ifndef BYTECODE_H
+#define BYTECODE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "symbols.h"
+
+// The register based bytecode run by the interpreter in vm.c, for running programs without the native toolchain.
+// The bound syntax tree of every function is compiled into one instruction stream for the whole program.
+//
+// Each call has a frame of registers. Parameters and local variables use their sequence number as their register,
+// temporaries are numbered after them. The arguments of a call are evaluated into consecutive registers at the top
+// of the caller's frame, which become the first registers of the callee's frame.
+// Global variables and arrays live in one array of quadwords, laid out like .bss in the native code.
+
+typedef enum
+{
+    BC_MOVE,          // a := b
+    BC_LOAD_INT,      // a := the immediate b
+    BC_LOAD_CONSTANT, // a := constant number b
+    BC_LOAD_GLOBAL,   // a := globals[b]
+    BC_STORE_GLOBAL,  // globals[a] := b
+    BC_LOAD_ELEMENT,  // a := globals[b + c]
+    BC_STORE_ELEMENT, // globals[a + b] := c
+    BC_CHECK_BOUNDS,  // stop the program with an error unless 0 <= a < constant number b, for -fbounds-check
+    BC_ADD,           // a := b + c
+    BC_SUB,           // a := b - c
+    BC_MUL,           // a := b * c
+    BC_DIV,           // a := b / c
+    BC_ADD_INT,       // a := b + the immediate c
+    BC_MUL_INT,       // a := b * the immediate c
+    BC_NEG,           // a := -b
+    BC_JUMP,          // continue at instruction a
+    BC_JUMP_EQ,       // if a = b, continue at instruction c
+    BC_JUMP_NE,       // if a != b, ...
+    BC_JUMP_LT,       // if a < b, ...
+    BC_JUMP_GE,       // if a >= b, ...
+    BC_JUMP_GT,       // if a > b, ...
+    BC_JUMP_LE,       // if a <= b, ...
+    BC_FOR_LOOP,      // a := a + 1, and if a < b, continue at instruction c
+    BC_CALL,          // a := function number b, with its frame starting at register c
+    BC_RETURN,        // return a
+    BC_PRINT_INT,     // print a
+    BC_PRINT_STRING,  // print string number a
+    BC_PRINT_NEWLINE, // end the line of a print statement
+    BC_NUM_OPCODES
+} bc_opcode_t;
+
+typedef struct bc_instruction
+{
+    const void *handler; // Where the interpreter's code for the opcode is, filled in when the program starts
+    int32_t a, b, c;
+    uint8_t opcode;      // bc_opcode_t
+} bc_instruction_t;
+
+typedef struct bc_function
+{
+    symbol_t *symbol;
+    size_t start;       // Position of the first instruction in the program's code
+    int n_parameters;
+    int n_variables;    // Parameters and local variables, so the locals are the registers in between
+    int frame_size;     // Registers needed, including temporaries
+} bc_function_t;
+
+typedef struct bc_program
+{
+    bc_instruction_t *code;
+    size_t n_instructions;
+    size_t capacity;
+
+    bc_function_t *functions; // By global sequence number, so only the entries of functions are used
+    size_t n_functions;
+
+    int64_t *constants;       // Numbers too large to be immediates
+    size_t n_constants;
+    size_t constants_capacity;
+
+    char **strings;           // The string list, with quotes removed and escapes decoded
+    size_t n_strings;
+
+    size_t n_globals;         // Quadwords of global variables and arrays
+} bc_program_t;
+
+// Compiles the bound syntax tree into bytecode, from bytecode.c. Needs the tables from create_tables
+bc_program_t *bc_compile_program ( void );
+void bc_destroy_program ( bc_program_t *program );
+
+// Runs the program like its native main would, parsing argv, and returns the exit code. From vm.c
+int bc_run_program ( bc_program_t *program, int argc, char **argv );
+
+#endif // BYTECODE_H
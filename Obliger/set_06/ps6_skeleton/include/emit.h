@@ -1,6 +1,8 @@
 #ifndef EMIT_H_
 #define EMIT_H_
 
+#include "asm.h"
+
 #define RAX "%rax"
 #define RBX "%rbx"
 #define RCX "%rcx"
@@ -22,9 +24,10 @@
 #define MEM(reg) "("reg")"
 #define ARRAY_MEM(array,index,stride) "("array","index","stride")"
 
-#define DIRECTIVE(fmt, ...) printf(fmt "\n" __VA_OPT__(,) __VA_ARGS__)
-#define LABEL(name, ...) printf(name":\n" __VA_OPT__(,) __VA_ARGS__)
-#define EMIT(fmt, ...) printf("\t" fmt "\n" __VA_OPT__(,) __VA_ARGS__)
+// Lines are collected in the buffer from asm.h, and printed by asm_flush
+#define DIRECTIVE(fmt, ...) asm_directive(fmt __VA_OPT__(,) __VA_ARGS__)
+#define LABEL(name, ...) asm_label(name":" __VA_OPT__(,) __VA_ARGS__)
+#define EMIT(fmt, ...) asm_instruction(fmt __VA_OPT__(,) __VA_ARGS__)
 
 #define MOVQ(src,dst)     EMIT("movq %s, %s", (src), (dst))
 #define PUSHQ(src)        EMIT("pushq %s", (src))
@@ -33,6 +36,7 @@
 #define ADDQ(src,dst)     EMIT("addq %s, %s", (src), (dst))
 #define SUBQ(src,dst)     EMIT("subq %s, %s", (src), (dst))
 #define NEGQ(reg)         EMIT("negq %s", (reg))
+#define INCQ(reg)         EMIT("incq %s", (reg))
 
 #define IMULQ(src,dst)    EMIT("imulq %s, %s", (src), (dst))
 #define CQO               EMIT("cqo"); // Sign extend RAX -> RDX:RAX
@@ -40,35 +44,48 @@
 
 #define ANDQ(src,dst)     EMIT("andq %s, %s", (src), (dst))
 #define ORQ(src,dst)      EMIT("orq %s, %s", (src), (dst))
+#define XORQ(src,dst)     EMIT("xorq %s, %s", (src), (dst))
 
 #define RET               EMIT("ret")
 
 #define CMPQ(op1,op2)     EMIT("cmpq %s, %s", (op1), (op2))
+#define TESTQ(op1,op2)    EMIT("testq %s, %s", (op1), (op2))
 #define JMP(label, code)  EMIT("jmp %s%d", (label), (code))
 #define JGE(label, code)  EMIT("jge %s%d", (label), (code))
 #define JLE(label, code)  EMIT("jle %s%d", (label), (code))
+#define JL(label, code)   EMIT("jl %s%d", (label), (code))
 #define JE(label, code)   EMIT("je %s%d", (label), (code))
 #define JNE(label, code)  EMIT("jne %s%d", (label), (code))
 
 // These directives are set based on platform,
 // allowing the compiler to work on macOS as well
 // Section names are different,
-// and exported and imported function labels start with _
+// and exported and imported function labels start with _.
+// The runtime library in runtime.c talks to the kernel directly, with the system calls numbered differently too
 #ifdef __APPLE__
 #define ASM_BSS_SECTION "__DATA, __bss"
 #define ASM_STRING_SECTION "__TEXT, __cstring"
 #define ASM_DECLARE_SYMBOLS                     \
-    ".set printf, _printf"                 "\n" \
-    ".set putchar, _putchar"               "\n" \
-    ".set puts, _puts"                     "\n" \
-    ".set strtol, _strtol"                 "\n" \
-    ".set exit, _exit"                     "\n" \
     ".set _main, main"                     "\n" \
     ".global _main"
+#define ASM_SYSCALL_WRITE "$0x2000004"
+#define ASM_SYSCALL_EXIT "$0x2000001"
+#define ASM_SYSCALL_OPEN "$0x2000005"
+#define ASM_SYSCALL_DUP2 "$0x200005A"
+#define ASM_SYSCALL_IOCTL "$0x2000036"
+#define ASM_IOCTL_GET_TERMINAL "$0x40487413" // TIOCGETA
+#define ASM_OPEN_FOR_WRITING "$0x601" // O_WRONLY | O_CREAT | O_TRUNC
 #else
 #define ASM_BSS_SECTION ".bss"
 #define ASM_STRING_SECTION ".rodata"
 #define ASM_DECLARE_SYMBOLS ".global main"
+#define ASM_SYSCALL_WRITE "$1"
+#define ASM_SYSCALL_EXIT "$231" // exit_group, ending every thread like exit does
+#define ASM_SYSCALL_OPEN "$2"
+#define ASM_SYSCALL_DUP2 "$33"
+#define ASM_SYSCALL_IOCTL "$16"
+#define ASM_IOCTL_GET_TERMINAL "$0x5401" // TCGETS
+#define ASM_OPEN_FOR_WRITING "$0x241" // O_WRONLY | O_CREAT | O_TRUNC
 #endif
 
 #endif // EMIT_H_
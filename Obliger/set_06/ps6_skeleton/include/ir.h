@@ -0,0 +1,339 @@
+#ifndef IR_H
+#define IR_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "symbols.h"
+
+// The intermediate representation used by the optimizing code generator (-O).
+// Each function is lowered into a list of basic blocks, each holding an array of three-address instructions.
+// Instructions are small structs stored by value, so passes walk over contiguous memory.
+//
+// Instructions read and write operands. An operand is either
+//  - a virtual register (>= 0). Parameters and local variables use their sequence number as their register,
+//    temporaries are numbered after them.
+//  - a constant (< 0), indexing the function's constant pool.
+
+typedef int32_t ir_operand_t;
+
+#define IR_NO_OPERAND INT32_MIN
+#define IR_IS_CONSTANT(operand) ((operand) < 0 && (operand) != IR_NO_OPERAND)
+#define IR_IS_REGISTER(operand) ((operand) >= 0)
+
+typedef enum
+{
+    IR_PARAM,         // dst := parameter number a, as passed by the caller
+    IR_COPY,          // dst := a
+    IR_ADD,           // dst := a + b
+    IR_SUB,           // dst := a - b
+    IR_MUL,           // dst := a * b
+    IR_DIV,           // dst := a / b
+    IR_NEG,           // dst := -a
+    IR_SELECT,        // dst := the third operand if the first <relation> the second, otherwise the fourth.
+                      // The b = 4 operands start at position a in the argument pool
+    IR_LOAD_GLOBAL,   // dst := global variable symbol
+    IR_STORE_GLOBAL,  // global variable symbol := a
+    IR_LOAD_ELEMENT,  // dst := global array symbol [a]
+    IR_STORE_ELEMENT, // global array symbol [a] := b
+    IR_CHECK_BOUNDS,  // stop the program with an error unless 0 <= a < the length of global array symbol
+    IR_COUNT,         // add one to profile counter number symbol, for -fprofile-generate, see profile.h
+    IR_ADDRESS,       // dst := the address of global array symbol
+    IR_CALL,          // dst := function symbol (the b arguments starting at position a in the argument pool)
+    IR_PRINT,         // print with format number symbol, from print_format.h (the b integers starting at
+                      // position a in the argument pool)
+    IR_VECTOR_LOOP,   // dst := the sum from running vector kernel symbol, from vectorize.h, with the counter going
+                      // from the first operand to the second, and the invariants after. The b operands start at
+                      // position a in the argument pool. The kernel stores to arrays, and clobbers registers like a call
+    IR_JUMP,          // continue at successors[0]
+    IR_BRANCH,        // if a <relation> b, continue at successors[0], otherwise at successors[1]
+    IR_RETURN,        // return a
+    IR_TAIL_CALL,     // return function symbol (arguments like IR_CALL), jumping to it with the frame of the caller
+    IR_PHI,           // dst := the value coming from the predecessor we arrived from, while in SSA form.
+                      // The b (block, value) pairs start at position a in the argument pool
+} ir_opcode_t;
+
+typedef enum
+{
+    IR_EQ, IR_NE, IR_LT, IR_GE, IR_GT, IR_LE
+} ir_relation_t;
+
+// What the profile read with -fprofile-use tells about a branch or a call
+typedef enum
+{
+    IR_UNPROFILED,    // Nothing
+    IR_LIKELY,        // The branch continued at successors[0] at least as often as at successors[1],
+                      // or the call was made often
+    IR_UNLIKELY,      // The branch continued at successors[1] more often, or the call was made, but not often
+    IR_ALWAYS,        // The branch never continued at successors[1]
+    IR_NEVER          // The branch never continued at successors[0], or the call was never made
+} ir_profile_t;
+
+typedef struct ir_instruction
+{
+    uint8_t opcode;    // ir_opcode_t
+    uint8_t relation;  // ir_relation_t, for branches and selects
+    uint8_t profile;   // ir_profile_t, for branches and calls
+    int32_t symbol;    // Global symbol sequence number, print format number, or vector kernel number
+    ir_operand_t dst, a, b;
+    ir_operand_t base; // Element accesses: a register holding the address index a counts from, or IR_NO_OPERAND
+                       // to count from the start of the array
+} ir_instruction_t;
+
+typedef struct ir_block
+{
+    ir_instruction_t *instructions; // The last instruction is always a jump, branch or return
+    size_t n_instructions;
+    size_t capacity;
+
+    int successors[2];
+    int loop_depth; // How many loops the block is nested inside in the source program
+} ir_block_t;
+
+typedef struct ir_function
+{
+    symbol_t *symbol;
+
+    ir_block_t *blocks; // Block 0 is the entry block
+    size_t n_blocks;
+    size_t blocks_capacity;
+
+    size_t n_registers; // Virtual registers. The first ones belong to the parameters and local variables
+
+    int64_t *constants;
+    size_t n_constants;
+    size_t constants_capacity;
+
+    ir_operand_t *arguments; // Argument lists of calls, and (block, value) pairs of phis
+    size_t n_arguments;
+    size_t arguments_capacity;
+} ir_function_t;
+
+// Lowers the body of the function symbol into IR. Names must already be bound by create_tables
+ir_function_t *ir_lower_function ( symbol_t *function );
+
+// Frees the function, and all its blocks
+void ir_destroy_function ( ir_function_t *function );
+
+// Prints the IR of the function in a readable format
+void ir_print_function ( ir_function_t *function );
+
+// Removes blocks that can not be reached from the entry block, and renumbers the rest
+void ir_remove_unreachable_blocks ( ir_function_t *function );
+
+// Makes jumps and branches to blocks that only jump on go straight to the final target,
+// and merges blocks with the block they jump to when they are its only predecessor.
+// Must not be used on functions with phis
+void ir_simplify_cfg ( ir_function_t *function );
+
+// Rotates while loops testing their condition at the top, into a test in front of the loop, and one at the
+// bottom branching back to the start of the body. Must not be used on functions with phis.
+// Returns true if any loop was rotated. From layout.c
+bool ir_rotate_loops ( ir_function_t *function );
+
+// Orders the blocks so each one is followed by the successor it most likely continues in, keeping the entry
+// block first. Must not be used on functions with phis
+void ir_order_blocks ( ir_function_t *function );
+
+// Returns the constant operand representing the value, adding it to the constant pool if needed
+ir_operand_t ir_constant ( ir_function_t *function, int64_t value );
+
+// Returns the value of a constant operand
+int64_t ir_constant_value ( ir_function_t *function, ir_operand_t operand );
+
+// Allocates a new virtual register
+ir_operand_t ir_new_register ( ir_function_t *function );
+
+// Appends the instruction to the end of the block, and returns its position
+size_t ir_append ( ir_block_t *block, ir_instruction_t instruction );
+
+// Places the instruction right in front of the terminator of the block
+void ir_insert_before_terminator ( ir_block_t *block, ir_instruction_t instruction );
+
+// Returns true if the instruction defines its dst operand
+bool ir_has_dst ( const ir_instruction_t *instruction );
+
+// Returns true if the instruction ends its block
+bool ir_is_terminator ( const ir_instruction_t *instruction );
+
+// Returns true if the instruction may have effects beyond defining dst, or may clobber caller-saved registers
+bool ir_has_side_effects ( ir_function_t *function, const ir_instruction_t *instruction );
+
+// Returns true if the instruction is a division that can trap, which is all but those by a constant other than 0 and -1
+bool ir_may_trap ( ir_function_t *function, const ir_instruction_t *instruction );
+bool ir_is_call ( const ir_instruction_t *instruction );
+
+// Calls visit on every operand read by the instruction, including call arguments
+void ir_for_each_use ( ir_function_t *function, ir_instruction_t *instruction,
+                       void (*visit) ( ir_operand_t *operand, void *context ), void *context );
+
+// Returns the number of successors of the block, given by its terminator
+int ir_successor_count ( const ir_block_t *block );
+bool ir_is_successor ( const ir_block_t *block, int successor );
+
+// Swapping the operands of a relation, and negating it
+ir_relation_t ir_swap_relation ( ir_relation_t relation );
+ir_relation_t ir_negate_relation ( ir_relation_t relation );
+
+// Returns true if a <relation> b
+bool ir_relation_holds ( ir_relation_t relation, int64_t a, int64_t b );
+
+// Returns the number of parameters the function takes
+size_t ir_count_parameters ( ir_function_t *function );
+
+// Appends a new, empty block to the function, and returns its index
+int ir_new_block ( ir_function_t *function, int loop_depth );
+
+// Places a new block on the edge from the predecessor to the block, jumping on to the block, and returns it.
+// Phis in the block are not updated
+int ir_split_edge ( ir_function_t *function, int predecessor, int block );
+
+// Appends the operands to the argument pool, and returns the position of the first one
+int32_t ir_add_arguments ( ir_function_t *function, const ir_operand_t *arguments, size_t n );
+
+// Sets of virtual registers or blocks, one bit per member
+#define IR_SET_WORDS(n_registers) (((n_registers) + 63) / 64)
+#define IR_SET_CONTAINS(set, r) (((set)[(r) / 64] >> ((r) % 64)) & 1)
+#define IR_SET_ADD(set, r) ((set)[(r) / 64] |= (uint64_t) 1 << ((r) % 64))
+#define IR_SET_REMOVE(set, r) ((set)[(r) / 64] &= ~((uint64_t) 1 << ((r) % 64)))
+
+// The virtual registers live at the start and the end of each block
+typedef struct ir_liveness
+{
+    uint64_t **live_in, **live_out; // Indexed by block
+    size_t n_blocks;
+    size_t words; // Length of each set
+} ir_liveness_t;
+
+ir_liveness_t *ir_compute_liveness ( ir_function_t *function );
+void ir_destroy_liveness ( ir_liveness_t *liveness );
+
+// The predecessors and dominator tree of the blocks in a function
+typedef struct ir_cfg
+{
+    int **predecessors; // Indexed by block
+    size_t *n_predecessors;
+    int *immediate_dominator; // -1 for unreachable blocks. The entry block is its own immediate dominator
+    int **dominated;          // The children of each block in the dominator tree
+    size_t *n_dominated;
+    int *dominator_preorder;  // When each block is entered and left in a walk over the dominator tree,
+    int *dominator_postorder; // so a block dominates the blocks entered and left in between
+    int *reverse_postorder;   // The reachable blocks, each one before its successors except along back edges
+    size_t n_reachable;
+    size_t n_blocks;
+} ir_cfg_t;
+
+ir_cfg_t *ir_analyze_cfg ( ir_function_t *function );
+void ir_destroy_cfg ( ir_cfg_t *cfg );
+bool ir_dominates ( ir_cfg_t *cfg, int dominator, int block );
+
+// Returns the block defining each virtual register, or -1 for registers that are never defined.
+// Only meaningful in SSA form, where every register has one definition. The array must be freed
+int *ir_find_definitions ( ir_function_t *function );
+
+// Loops, found from their back edges. From loops.c
+bool ir_is_loop_header ( ir_cfg_t *cfg, int block );
+
+// Fills the set with the blocks of the loop with the given header, and returns how many there are
+size_t ir_find_loop_body ( ir_cfg_t *cfg, int header, uint64_t *body );
+bool ir_in_loop ( ir_cfg_t *cfg, const uint64_t *body, int block );
+
+// Returns the preheader of the loop, the only block outside it jumping to the header, placing a new block
+// in front of the header if needed, and adding it to the CFG and the loops being transformed.
+// Returns -1 for loops entered from several blocks
+int ir_find_preheader ( ir_function_t *function, ir_cfg_t *cfg, int header, const uint64_t *body );
+
+// A loop of the function, found from its back edges
+typedef struct ir_loop
+{
+    int header;
+    int parent;     // The innermost loop around this one, or -1
+    size_t size;    // Blocks in the body
+    uint64_t *body; // Has room for one new block in front of every loop of the function
+} ir_loop_t;
+
+// The loop forest of a function, with the CFG it was found in
+typedef struct ir_loops
+{
+    ir_cfg_t *cfg;
+    ir_loop_t *loops;
+    size_t n_loops;
+    int *loop_of_header; // Indexed by block, -1 for blocks that aren't headers
+} ir_loops_t;
+
+// Finds the loops once for the passes transforming them. The loops and their CFG stay up to date as long as
+// the passes only add blocks through ir_find_preheader, and don't change the jumps and branches otherwise
+ir_loops_t *ir_find_loops ( ir_function_t *function );
+void ir_destroy_loops ( ir_loops_t *loops );
+
+// Calls transform once for every loop, either from the innermost loops out, or the other way around.
+// Returns true if any call did
+bool ir_transform_loops ( ir_function_t *function, ir_loops_t *loops, bool innermost_first,
+                          bool (*transform) ( ir_function_t *function, ir_cfg_t *cfg, int header,
+                                              const uint64_t *body ) );
+
+// Removes instructions without side effects whose result is never used. Returns true if anything was removed
+bool ir_eliminate_dead_code ( ir_function_t *function );
+
+// Converts the function to SSA form, giving every variable assigned more than once a new register
+// for each assignment, and inserting phis where control flow merges. From ssa.c
+void ir_construct_ssa ( ir_function_t *function );
+
+// Replaces every use of a register copied from another register by the original, and removes the copies.
+// Returns true if anything changed. From ssa.c
+bool ir_propagate_copies ( ir_function_t *function );
+
+// Replaces the phis by copies at the end of the predecessors, splitting critical edges. From ssa.c
+void ir_destruct_ssa ( ir_function_t *function );
+
+// Sparse conditional constant propagation, on a function in SSA form. Uses of values found to be constant
+// are replaced by the constant, branches with a known outcome become jumps, and blocks that can never
+// run are removed. Returns true if anything changed. From sccp.c
+bool ir_propagate_constants ( ir_function_t *function );
+
+// Global value numbering, on a function in SSA form. Instructions computing a value that an instruction
+// dominating them already did, including loads of variables and array elements nothing could have stored to
+// in between, become copies of it. Returns true if anything changed. From gvn.c
+bool ir_number_values ( ir_function_t *function );
+
+// Moves computations that give the same result in every iteration of a loop out in front of it, on a function
+// in SSA form. Accesses to arrays inside loops get their address computed in front of the loop too.
+// Returns true if anything changed. From licm.c
+bool ir_hoist_loop_invariants ( ir_function_t *function, ir_loops_t *loops );
+
+// Removes the bounds checks of indices that value range analysis finds are always inside their array,
+// on a function in SSA form. Returns true if anything changed. From ranges.c
+bool ir_eliminate_bounds_checks ( ir_function_t *function );
+
+// Strength reduction of array accesses in loops, indexed by a variable stepping by a constant each iteration.
+// They get a pointer that steps along with the variable instead, on a function in SSA form where the arrays'
+// addresses have been moved out of the loops. Returns true if anything changed. From induction.c
+bool ir_reduce_induction_variables ( ir_function_t *function, ir_loops_t *loops );
+
+// If-conversion: branches choosing between values that are cheap to compute become selects, computing both
+// values, on a function in SSA form. Returns true if anything changed. From if_conversion.c
+bool ir_convert_branches ( ir_function_t *function );
+
+// Turns calls a function makes to itself right before returning into jumps back to its start.
+// Runs on lowered functions, before SSA form. Returns true if anything changed. From tail_calls.c
+bool ir_eliminate_tail_recursion ( ir_function_t *function );
+
+// Turns the remaining calls right before returning into tail calls, when the arguments fit in registers
+bool ir_form_tail_calls ( ir_function_t *function );
+
+// Runs the optimization passes over the lowered function
+void ir_optimize_function ( ir_function_t *function );
+
+// Inlines calls to small functions that don't call other functions, given the functions of the program
+// indexed by global symbol sequence number. Returns true if any call was inlined. From inline.c
+bool ir_inline_calls ( ir_function_t *function, ir_function_t **functions );
+
+// Lowers and optimizes every function of the program, including inlining.
+// Returns the functions indexed by global symbol sequence number, with NULL for the other symbols
+ir_function_t **ir_lower_program ( void );
+void ir_destroy_program ( ir_function_t **functions );
+
+// Emits x86-64 assembly for the function, from ir_generator.c
+void generate_ir_function ( ir_function_t *function );
+
+#endif // IR_H
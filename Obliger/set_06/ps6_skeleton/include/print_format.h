@@ -0,0 +1,34 @@
+#ifndef PRINT_FORMAT_H
+#define PRINT_FORMAT_H
+
+#include <stddef.h>
+#include <stdbool.h>
+#include "tree.h"
+
+// Print statements are compiled into one printf call per statement, with a format string built at compile time.
+// String items and the trailing newline are part of the format, and the integer items are passed after it.
+// Statements without integer items become a single call to puts instead.
+//
+// A statement is printed in chunks, each with its own format. A chunk holds at most PRINT_MAX_VALUES integers,
+// which is what fits in the argument registers next to the format, and items making calls start a new chunk,
+// since the called function may print something itself before the items in front of the call are printed.
+
+#define PRINT_MAX_VALUES 5
+
+// Returns the end of the chunk of items starting at the item first
+size_t print_chunk_end ( node_t *statement, size_t first );
+
+// Returns the number of the format printing the items from first up to end, adding it to the table if needed.
+// The format is emitted with the label format<number>
+size_t add_print_format ( node_t *statement, size_t first, size_t end );
+
+// Returns true if the format is a whole line without integers, printed by puts, which adds the newline itself
+bool print_format_is_line ( size_t format );
+
+// The format as the contents of a .asciz directive, without the quotes
+const char *print_format_text ( size_t format );
+
+// Emits the .asciz entries of all formats added so far, and empties the table
+void generate_print_formats ( void );
+
+#endif // PRINT_FORMAT_H
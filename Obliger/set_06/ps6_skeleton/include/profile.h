@@ -0,0 +1,53 @@
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include "tree.h"
+
+// Profile-guided optimization.
+// Programs compiled with -fprofile-generate count how often each if statement, loop and function call in them is
+// reached, and how often the then part or the loop body runs, and write the counts to the profile file when they
+// exit. -fprofile-use reads the file back, for -O to lay out blocks along the paths that were taken, move code
+// that never ran out of the way, unroll loops running many iterations, and inline calls made often.
+//
+// The statements and calls counted are the sites of their function, numbered in the order they appear in it.
+// The profile has one line for each, with the name of the function, the number, the kind of site, and the counts:
+//     main 3 for 10 10240
+// Lines whose function or kind of site no longer match the program are left out when the profile is read,
+// so a profile of an older version of the program still counts for the functions that haven't changed.
+
+// The two counters of each site
+typedef enum
+{
+    PROFILE_REACHED, // Times the site was reached
+    PROFILE_TAKEN,   // Times the then part of an if statement, or the body of a loop, ran. Not used by calls
+} profile_counter_t;
+
+// Set by -fprofile-generate and -fprofile-use, the file the program writes its profile to, or it is read from.
+// NULL without the options. Defined in vslc.c
+extern const char *profile_generate_path;
+extern const char *profile_use_path;
+
+// The number of the counter of the IF_STATEMENT, WHILE_STATEMENT, FOR_STATEMENT or call expression.
+// Counters are numbered through the whole program
+size_t profile_counter ( node_t *site, profile_counter_t counter );
+
+// Emits the instruction adding one to the counter with the given number
+void generate_profile_increment ( size_t counter );
+
+// Emits the counters, and the routine write_profile, which exit_program calls to write them to the profile file.
+// It first writes out what the program printed, since the profile is printed through the same buffer
+void generate_profile_writer ( void );
+
+// Reads the profile file for -fprofile-use. Names must already be bound by create_tables
+void read_profile ( const char *path );
+
+// Gives the counts of the site from the profile. Returns false if the profile has none for it
+bool profile_counts ( node_t *site, int64_t *reached, int64_t *taken );
+
+// Frees the sites and counts
+void destroy_profile ( void );
+
+#endif // PROFILE_H
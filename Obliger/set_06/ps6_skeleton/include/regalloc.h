@@ -0,0 +1,34 @@
+#ifndef REGALLOC_H
+#define REGALLOC_H
+
+#include <stddef.h>
+#include <stdbool.h>
+#include "ir.h"
+
+// The callee-saved registers that values live across calls can be kept in
+#define NUM_CALLEE_SAVED_REGISTERS 5
+
+// The result of register allocation for the virtual registers of one function.
+// Both arrays are indexed by virtual register
+typedef struct register_allocation
+{
+    const char **registers; // The register holding the value, or NULL if it lives on the stack
+    int *stack_offsets;     // The %rbp-relative position of values living on the stack
+    size_t n_registers;
+
+    // The callee-saved registers used, which the function must save and restore
+    const char *used_callee_saved[NUM_CALLEE_SAVED_REGISTERS];
+    size_t n_used_callee_saved;
+
+    // Bytes to reserve below %rbp for saved registers and stack slots, a multiple of 16
+    int frame_size;
+} register_allocation_t;
+
+// Runs linear scan register allocation over the virtual registers of the function.
+// Values live across a call are only given callee-saved registers.
+register_allocation_t *allocate_registers ( ir_function_t *function );
+
+// Frees the memory used by the register allocation
+void destroy_register_allocation ( register_allocation_t *allocation );
+
+#endif // REGALLOC_H
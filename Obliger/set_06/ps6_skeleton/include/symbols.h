@@ -39,4 +39,12 @@ void create_tables ( void );
 void print_tables ( void );
 void destroy_tables ( void );
 
+/* Checks on the bound syntax tree for the code generators, exiting with an error if they fail */
+// The array symbol indexed by the ARRAY_INDEXING node
+symbol_t *get_array_symbol ( node_t *indexing );
+// The symbol of the identifier, which must be a variable, and not a function or array
+symbol_t *get_variable_symbol ( node_t *identifier );
+// The function called by the call expression, which must be given as many arguments as it has parameters
+symbol_t *get_called_function ( node_t *call );
+
 #endif // SYMBOLS_H
@@ -2,6 +2,7 @@
 #define TREE_H
 
 #include <stdint.h>
+#include <stdbool.h>
 #include "nodetypes.h"
 
 /* This is the tree node structure, for the parse tree and abstract syntax tree */
@@ -24,6 +25,9 @@ void print_syntax_tree ( void );
 void simplify_syntax_tree ( void );
 void destroy_syntax_tree ( void );
 
+// Returns true if evaluating the expression involves calling a function
+bool contains_call ( node_t *expression );
+
 // Special function used when syntax trees are output as graphviz graphs.
 // Implemented in graphviz_output.c
 void graphviz_node_print ( node_t *root );
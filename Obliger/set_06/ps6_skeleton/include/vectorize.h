@@ -0,0 +1,50 @@
+#ifndef VECTORIZE_H
+#define VECTORIZE_H
+
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include "tree.h"
+#include "symbols.h"
+
+// Vectorization of simple for loops over global arrays, for the optimizing code generator (-O).
+// A loop qualifies when its body only assigns array elements indexed by the counter plus or minus a constant,
+// and sums values into a local variable it reads nowhere else, from expressions of array elements, the counter,
+// constants and variables the loop doesn't change, combined with +, - and *.
+// Such a loop is turned into a kernel doing VECTOR_WIDTH iterations at once in SSE2 registers, or in AVX2
+// registers with -mavx2. The kernel runs for as many iterations as it evenly can, and the ordinary loop does
+// the rest. Since both run the same iterations in the same order, with the same wrapping arithmetic,
+// the results are the same.
+//
+// Iterations are only run together when no element one of them assigns is read by another one that would have
+// read it before, or after, the assignment otherwise. Runs indexing outside the arrays are left to the
+// ordinary loop altogether, so the kernel never touches anything but the arrays themselves.
+
+// Tells how a loop was vectorized
+typedef struct vector_loop
+{
+    size_t kernel;
+    node_t **invariants;    // The constants and variables the kernel needs, in order, to be freed by the caller
+    size_t n_invariants;
+    symbol_t *sum;          // The variable the kernel sums into, or NULL
+    int64_t first, last;    // Where the counter may start and end, for the kernel to stay inside the arrays
+} vector_loop_t;
+
+// Returns true if the FOR_STATEMENT was vectorized, filling in the loop
+bool vectorize_for_statement ( node_t *statement, vector_loop_t *loop );
+
+// How many iterations the kernels do at once
+int vector_width ( void );
+
+// Broadcasts %rax into all lanes of the register for the invariant number of the kernel
+void generate_vector_broadcast ( size_t kernel, size_t invariant );
+
+// Emits the kernel, running from the counter in %rcx up to the end in %rdx, a multiple of the width away.
+// The invariants must already be broadcast. The sum is left in %rax.
+// Clobbers %rax, %rcx, %rdx, %rsi, %rdi, %r8 to %r11 and the vector registers
+void generate_vector_loop ( size_t kernel );
+
+// Emits the constants used by the kernels generated so far, and empties the table of kernels
+void generate_vector_constants ( void );
+
+#endif // VECTORIZE_H
@@ -17,6 +17,27 @@
 /* Function for generating machine code, in generator.c */
 void generate_program ( void );
 
+/* Function emitting the routines generated programs use for output, argument parsing and exiting, in runtime.c */
+void generate_runtime ( void );
+
+/* Function for printing the intermediate representation used by the optimizing code generator, in ir.c */
+void print_intermediate_representation ( void );
+
+/* Command line option enabling the optimizing code generator, defined in vslc.c */
+extern bool optimize_generated_code;
+
+/* Command line option making vectorized loops use AVX2 instead of SSE2, defined in vslc.c */
+extern bool vectorize_with_avx2;
+
+/* Command line option making the generated code check array indices against the array lengths, defined in vslc.c */
+extern bool check_array_bounds;
+
+/* Command line option making the compiler write an ELF object file instead of assembly, defined in vslc.c */
+extern bool emit_object_file;
+
+/* Command line option making the compiler run the program itself, defined in vslc.c */
+extern bool run_in_process;
+
 /* The main driver function of the parser generated by bison */
 int yyparse ();
 
@@ -0,0 +1,186 @@
+#include <vslc.h>
+#include "asm.h"
+
+asm_buffer_t asm_buffer = {.lines = NULL, .n_lines = 0, .capacity = 0};
+asm_buffer_t asm_program = {.lines = NULL, .n_lines = 0, .capacity = 0};
+
+/* Splits an instruction into its mnemonic and its operands, at the commas outside parentheses */
+static void parse_instruction(asm_line_t *line)
+{
+    const char *text = line->text;
+    size_t length = strcspn(text, " \t");
+    line->mnemonic = strndup(text, length);
+    line->n_operands = 0;
+
+    const char *p = text + length;
+    while (*p != '\0' && line->n_operands < ASM_MAX_OPERANDS)
+    {
+        while (*p == ' ' || *p == '\t')
+            p++;
+        if (*p == '\0')
+            break;
+
+        const char *start = p;
+        int depth = 0;
+        while (*p != '\0' && (*p != ',' || depth > 0))
+        {
+            if (*p == '(')
+                depth++;
+            else if (*p == ')')
+                depth--;
+            p++;
+        }
+        const char *end = p;
+        while (end > start && (end[-1] == ' ' || end[-1] == '\t'))
+            end--;
+        line->operands[line->n_operands++] = strndup(start, end - start);
+        if (*p == ',')
+            p++;
+    }
+}
+
+static void free_line(asm_line_t *line)
+{
+    free(line->text);
+    free(line->mnemonic);
+    for (int i = 0; i < line->n_operands; i++)
+        free(line->operands[i]);
+}
+
+static void append_line(asm_kind_t kind, const char *format, va_list arguments)
+{
+    if (asm_buffer.n_lines == asm_buffer.capacity)
+    {
+        asm_buffer.capacity = asm_buffer.capacity * 2 + 64;
+        asm_buffer.lines = realloc(asm_buffer.lines, asm_buffer.capacity * sizeof(asm_line_t));
+    }
+
+    asm_line_t *line = &asm_buffer.lines[asm_buffer.n_lines++];
+    *line = (asm_line_t) {.kind = kind, .text = NULL, .mnemonic = NULL, .n_operands = 0};
+
+    va_list copy;
+    va_copy(copy, arguments);
+    int length = vsnprintf(NULL, 0, format, copy);
+    va_end(copy);
+    line->text = malloc(length + 1);
+    vsnprintf(line->text, length + 1, format, arguments);
+
+    if (kind == ASM_INSTRUCTION)
+        parse_instruction(line);
+}
+
+void asm_instruction(const char *format, ...)
+{
+    va_list arguments;
+    va_start(arguments, format);
+    append_line(ASM_INSTRUCTION, format, arguments);
+    va_end(arguments);
+}
+
+void asm_label(const char *format, ...)
+{
+    va_list arguments;
+    va_start(arguments, format);
+    append_line(ASM_LABEL, format, arguments);
+    va_end(arguments);
+}
+
+void asm_directive(const char *format, ...)
+{
+    va_list arguments;
+    va_start(arguments, format);
+    append_line(ASM_DIRECTIVE, format, arguments);
+    va_end(arguments);
+}
+
+void asm_set_instruction(asm_line_t *line, const char *mnemonic, const char *first, const char *second)
+{
+    char *text;
+    if (first == NULL)
+        text = strdup(mnemonic);
+    else
+    {
+        size_t length = strlen(mnemonic) + strlen(first) + (second != NULL ? strlen(second) : 0) + 4;
+        text = malloc(length);
+        if (second == NULL)
+            snprintf(text, length, "%s %s", mnemonic, first);
+        else
+            snprintf(text, length, "%s %s, %s", mnemonic, first, second);
+    }
+
+    free_line(line);
+    *line = (asm_line_t) {.kind = ASM_INSTRUCTION, .text = text, .mnemonic = NULL, .n_operands = 0};
+    parse_instruction(line);
+}
+
+void asm_delete_line(asm_buffer_t *buffer, size_t position)
+{
+    free_line(&buffer->lines[position]);
+    memmove(&buffer->lines[position], &buffer->lines[position + 1],
+            (buffer->n_lines - position - 1) * sizeof(asm_line_t));
+    buffer->n_lines--;
+}
+
+void asm_clear_buffer(asm_buffer_t *buffer)
+{
+    for (size_t i = 0; i < buffer->n_lines; i++)
+        free_line(&buffer->lines[i]);
+    free(buffer->lines);
+    *buffer = (asm_buffer_t) {.lines = NULL, .n_lines = 0, .capacity = 0};
+}
+
+bool asm_is_register(const char *operand)
+{
+    return operand[0] == '%';
+}
+
+bool asm_is_memory(const char *operand)
+{
+    return strchr(operand, '(') != NULL;
+}
+
+bool asm_reads_flags(const char *mnemonic)
+{
+    return (mnemonic[0] == 'j' && strcmp(mnemonic, "jmp") != 0) || strncmp(mnemonic, "set", 3) == 0
+           || strncmp(mnemonic, "cmov", 4) == 0 || strncmp(mnemonic, "adc", 3) == 0 || strncmp(mnemonic, "sbb", 3) == 0;
+}
+
+void asm_flush(void)
+{
+    if (optimize_generated_code)
+    {
+        peephole_optimize(&asm_buffer);
+        schedule_instructions(&asm_buffer);
+    }
+
+    // The assembler needs the whole program at once, so the lines are kept instead
+    if (emit_object_file || run_in_process)
+    {
+        if (asm_program.n_lines + asm_buffer.n_lines > asm_program.capacity)
+        {
+            asm_program.capacity = (asm_program.n_lines + asm_buffer.n_lines) * 2;
+            asm_program.lines = realloc(asm_program.lines, asm_program.capacity * sizeof(asm_line_t));
+        }
+        memcpy(&asm_program.lines[asm_program.n_lines], asm_buffer.lines, asm_buffer.n_lines * sizeof(asm_line_t));
+        asm_program.n_lines += asm_buffer.n_lines;
+        asm_buffer.n_lines = 0;
+        return;
+    }
+
+    for (size_t i = 0; i < asm_buffer.n_lines; i++)
+    {
+        asm_line_t *line = &asm_buffer.lines[i];
+        switch (line->kind)
+        {
+            case ASM_INSTRUCTION:
+                printf("\t%s\n", line->text);
+                break;
+            case ASM_LABEL:
+            case ASM_DIRECTIVE:
+                printf("%s\n", line->text);
+                break;
+        }
+        free_line(line);
+    }
+    asm_buffer.n_lines = 0;
+}
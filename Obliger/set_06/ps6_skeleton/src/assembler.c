@@ -0,0 +1,1466 @@
+#include <vslc.h>
+#include <ctype.h>
+#include "assembler.h"
+
+/* An assembler for the AT&T syntax the code generators emit, so programs can be compiled without gas.
+ * Each line becomes an item: the encoding of an instruction, some data, an alignment, a label or a branch.
+ * Branches are encoded with 8 bit displacements where their targets are close enough, which is decided by
+ * laying the sections out over and over, making the branches that don't reach long, until none change.
+ * Whatever refers to another section, or to a symbol defined somewhere else, is left to the linker.
+ */
+
+#define MAX_INSTRUCTION_LENGTH 15
+#define NO_REGISTER (-1)
+#define RIP 16
+
+// The registers in the order of their encodings, by their 64, 32 and 8 bit names
+static const char *REGISTER_NAMES[][3] = {
+    {"%rax", "%eax", "%al"}, {"%rcx", "%ecx", "%cl"}, {"%rdx", "%edx", "%dl"}, {"%rbx", "%ebx", "%bl"},
+    {"%rsp", "%esp", "%spl"}, {"%rbp", "%ebp", "%bpl"}, {"%rsi", "%esi", "%sil"}, {"%rdi", "%edi", "%dil"},
+    {"%r8", "%r8d", "%r8b"}, {"%r9", "%r9d", "%r9b"}, {"%r10", "%r10d", "%r10b"}, {"%r11", "%r11d", "%r11b"},
+    {"%r12", "%r12d", "%r12b"}, {"%r13", "%r13d", "%r13b"}, {"%r14", "%r14d", "%r14b"}, {"%r15", "%r15d", "%r15b"}
+};
+#define NUM_REGISTERS 16
+static const int REGISTER_SIZES[3] = {64, 32, 8};
+
+// The suffixes of conditional jumps, moves and sets, and their encodings
+static const struct
+{
+    const char *name;
+    int code;
+} CONDITIONS[] = {
+    {"o", 0x0}, {"no", 0x1}, {"b", 0x2}, {"c", 0x2}, {"nae", 0x2}, {"ae", 0x3}, {"nb", 0x3}, {"nc", 0x3},
+    {"e", 0x4}, {"z", 0x4}, {"ne", 0x5}, {"nz", 0x5}, {"be", 0x6}, {"na", 0x6}, {"a", 0x7}, {"nbe", 0x7},
+    {"s", 0x8}, {"ns", 0x9}, {"p", 0xA}, {"np", 0xB}, {"l", 0xC}, {"nge", 0xC}, {"ge", 0xD}, {"nl", 0xD},
+    {"le", 0xE}, {"ng", 0xE}, {"g", 0xF}, {"nle", 0xF}
+};
+#define NUM_CONDITIONS (sizeof(CONDITIONS) / sizeof(CONDITIONS[0]))
+
+// Two operand arithmetic, with the opcode of the form writing a register or memory from a register,
+// and the extension of the reg field selecting it in the forms with an immediate
+static const struct
+{
+    const char *mnemonic;
+    uint8_t opcode;
+    int extension;
+    bool wide;
+} ARITHMETIC[] = {
+    {"addq", 0x00, 0, true}, {"orq", 0x08, 1, true}, {"andq", 0x20, 4, true}, {"subq", 0x28, 5, true},
+    {"xorq", 0x30, 6, true}, {"cmpq", 0x38, 7, true}, {"xorl", 0x30, 6, false}, {"addl", 0x00, 0, false},
+    {"subl", 0x28, 5, false}, {"andl", 0x20, 4, false}, {"orl", 0x08, 1, false}, {"cmpl", 0x38, 7, false}
+};
+#define NUM_ARITHMETIC (sizeof(ARITHMETIC) / sizeof(ARITHMETIC[0]))
+
+// Instructions with a single register or memory operand, and the extension selecting them
+static const struct
+{
+    const char *mnemonic;
+    uint8_t opcode;
+    int extension;
+} UNARY[] = {
+    {"notq", 0xF7, 2}, {"negq", 0xF7, 3}, {"idivq", 0xF7, 7}, {"divq", 0xF7, 6}, {"mulq", 0xF7, 4}, {"incq", 0xFF, 0}, {"decq", 0xFF, 1}
+};
+#define NUM_UNARY (sizeof(UNARY) / sizeof(UNARY[0]))
+
+static const struct
+{
+    const char *mnemonic;
+    int extension;
+} SHIFTS[] = {
+    {"shlq", 4}, {"salq", 4}, {"shrq", 5}, {"sarq", 7}
+};
+#define NUM_SHIFTS (sizeof(SHIFTS) / sizeof(SHIFTS[0]))
+
+// The SSE2 instructions on vector registers, which also have AVX forms named with a v in front.
+// All of them have a 66 prefix, and are in the 0F opcode map. Those with an extension shift their operand by an
+// immediate count, the rest take a source operand and a destination register, like the arithmetic instructions.
+// The AVX forms write a separate destination, after the operand they read it from
+static const struct
+{
+    const char *mnemonic;
+    uint8_t opcode;
+    int extension;
+} VECTOR_ARITHMETIC[] = {
+    {"paddq", 0xD4, -1}, {"psubq", 0xFB, -1}, {"pmuludq", 0xF4, -1}, {"pxor", 0xEF, -1}, {"punpcklqdq", 0x6C, -1},
+    {"psrlq", 0x73, 2}, {"psllq", 0x73, 6}, {"pslldq", 0x73, 7}
+};
+#define NUM_VECTOR_ARITHMETIC (sizeof(VECTOR_ARITHMETIC) / sizeof(VECTOR_ARITHMETIC[0]))
+
+typedef enum
+{
+    OPERAND_REGISTER, OPERAND_IMMEDIATE, OPERAND_MEMORY, OPERAND_SYMBOL
+} operand_kind_t;
+
+typedef struct operand
+{
+    operand_kind_t kind;
+    int reg, size;              // Registers
+    int64_t value;              // Immediates, and the displacement of memory operands
+    int base, index, scale;     // Memory operands
+    int symbol;                 // The symbol of the displacement, or the target of a branch, or -1
+} operand_t;
+
+typedef enum
+{
+    ITEM_CODE, ITEM_DATA, ITEM_BRANCH, ITEM_ALIGN, ITEM_LABEL
+} item_kind_t;
+
+typedef enum
+{
+    BRANCH_JUMP, BRANCH_CONDITIONAL, BRANCH_CALL, BRANCH_LOOP
+} branch_kind_t;
+
+typedef struct item
+{
+    item_kind_t kind;
+    section_t section;
+    uint64_t offset, size;      // Decided by the layout
+
+    // The encoded instruction, with a %rip relative displacement of a symbol at fixup_position
+    uint8_t code[MAX_INSTRUCTION_LENGTH];
+    size_t length;
+    int fixup_symbol;
+    size_t fixup_position;
+    int64_t fixup_addend;
+
+    // Data, where NULL means zeros
+    uint8_t *data;
+
+    branch_kind_t branch;
+    int condition;
+    bool long_form;
+
+    int symbol;                 // The label defined, or the target of the branch
+    uint64_t alignment, max_skip;
+    size_t region;              // How many alignments there are in front of the item in its section
+} item_t;
+
+static item_t *items;
+static size_t n_items, items_capacity;
+static section_t current_section;
+static size_t section_alignments[NUM_SECTIONS];
+static size_t section_regions[NUM_SECTIONS];
+static const char *current_line;
+
+static object_symbol_t *symbols;
+static size_t n_symbols, symbols_capacity;
+
+// An open addressing hash table of indices into the symbols, with -1 for empty slots
+static int *symbol_table;
+static size_t symbol_table_size;
+
+static void assembler_error(const char *message)
+{
+    fprintf(stderr, "error: %s, in assembly line '%s'\n", message, current_line);
+    exit(EXIT_FAILURE);
+}
+
+static uint64_t hash_name(const char *name, size_t length)
+{
+    uint64_t hash = 14695981039346656037ull;
+    for (size_t i = 0; i < length; i++)
+        hash = (hash ^ (uint8_t) name[i]) * 1099511628211ull;
+    return hash;
+}
+
+static void insert_into_table(size_t symbol)
+{
+    const char *name = symbols[symbol].name;
+    size_t slot = hash_name(name, strlen(name)) & (symbol_table_size - 1);
+    while (symbol_table[slot] >= 0)
+        slot = (slot + 1) & (symbol_table_size - 1);
+    symbol_table[slot] = symbol;
+}
+
+/* Returns the index of the symbol with the name, adding it as undefined if it isn't known yet */
+static int find_symbol(const char *name, size_t length)
+{
+    if (2 * (n_symbols + 1) > symbol_table_size)
+    {
+        free(symbol_table);
+        symbol_table_size = symbol_table_size == 0 ? 64 : symbol_table_size * 2;
+        symbol_table = malloc(symbol_table_size * sizeof(int));
+        for (size_t i = 0; i < symbol_table_size; i++)
+            symbol_table[i] = -1;
+        for (size_t i = 0; i < n_symbols; i++)
+            insert_into_table(i);
+    }
+
+    size_t slot = hash_name(name, length) & (symbol_table_size - 1);
+    for (; symbol_table[slot] >= 0; slot = (slot + 1) & (symbol_table_size - 1))
+    {
+        const char *existing = symbols[symbol_table[slot]].name;
+        if (strncmp(existing, name, length) == 0 && existing[length] == '\0')
+            return symbol_table[slot];
+    }
+
+    if (n_symbols == symbols_capacity)
+    {
+        symbols_capacity = symbols_capacity * 2 + 64;
+        symbols = realloc(symbols, symbols_capacity * sizeof(object_symbol_t));
+    }
+    symbols[n_symbols] = (object_symbol_t) {.name = strndup(name, length), .section = -1, .offset = 0, .global = false};
+    symbol_table[slot] = n_symbols;
+    return n_symbols++;
+}
+
+static item_t *new_item(item_kind_t kind)
+{
+    if (n_items == items_capacity)
+    {
+        items_capacity = items_capacity * 2 + 256;
+        items = realloc(items, items_capacity * sizeof(item_t));
+    }
+    item_t *item = &items[n_items++];
+    memset(item, 0, sizeof(item_t));
+    item->kind = kind;
+    item->section = current_section;
+    item->fixup_symbol = -1;
+    item->symbol = -1;
+    item->region = section_regions[current_section];
+    return item;
+}
+
+static void define_label(const char *name, size_t length)
+{
+    int symbol = find_symbol(name, length);
+    new_item(ITEM_LABEL)->symbol = symbol;
+}
+
+static bool fits_in_8_bits(int64_t value)
+{
+    return value >= INT8_MIN && value <= INT8_MAX;
+}
+
+static bool fits_in_32_bits(int64_t value)
+{
+    return value >= INT32_MIN && value <= INT32_MAX;
+}
+
+/* Reads a character of a string or character literal, following backslash escapes like gas does */
+static const char *read_character(const char *p, uint8_t *character)
+{
+    if (*p != '\\')
+    {
+        *character = *p;
+        return p + 1;
+    }
+    p++;
+    switch (*p)
+    {
+        case 'n': *character = '\n'; return p + 1;
+        case 't': *character = '\t'; return p + 1;
+        case 'r': *character = '\r'; return p + 1;
+        case 'b': *character = '\b'; return p + 1;
+        case 'f': *character = '\f'; return p + 1;
+        case 'x':
+        {
+            unsigned value = 0;
+            for (p++; isxdigit((unsigned char) *p); p++)
+                value = value * 16 + (isdigit((unsigned char) *p) ? *p - '0' : tolower((unsigned char) *p) - 'a' + 10);
+            *character = value;
+            return p;
+        }
+        default:
+            if (*p >= '0' && *p <= '7')
+            {
+                unsigned value = 0;
+                for (int digits = 0; digits < 3 && *p >= '0' && *p <= '7'; digits++, p++)
+                    value = value * 8 + (*p - '0');
+                *character = value;
+                return p;
+            }
+            if (*p == '\0')
+                assembler_error("unfinished escape sequence");
+            *character = *p;
+            return p + 1;
+    }
+}
+
+/* Parses a number, or a character literal like 'a or 'a' */
+static int64_t parse_value(const char *text)
+{
+    if (text[0] == '\'')
+    {
+        uint8_t character;
+        read_character(text + 1, &character);
+        return character;
+    }
+    char *end;
+    int64_t value = strtoll(text, &end, 0);
+    if (end == text || *end != '\0')
+        assembler_error("expected a number");
+    return value;
+}
+
+static int register_number(const char *name, int *size)
+{
+    // The vector registers, %xmm0 to %xmm15 and their 256 bit extensions %ymm0 to %ymm15
+    if ((strncmp(name, "%xmm", 4) == 0 || strncmp(name, "%ymm", 4) == 0) && isdigit((unsigned char) name[4]))
+    {
+        char *end;
+        long number = strtol(name + 4, &end, 10);
+        if (*end == '\0' && number < NUM_REGISTERS)
+        {
+            *size = name[1] == 'x' ? 128 : 256;
+            return number;
+        }
+    }
+    for (int r = 0; r < NUM_REGISTERS; r++)
+    {
+        for (int s = 0; s < 3; s++)
+        {
+            if (strcmp(name, REGISTER_NAMES[r][s]) == 0)
+            {
+                *size = REGISTER_SIZES[s];
+                return r;
+            }
+        }
+    }
+    assembler_error("unknown register");
+    return NO_REGISTER;
+}
+
+/* Parses a register inside the parentheses of a memory operand, which may be empty */
+static int parse_address_register(const char *start, size_t length)
+{
+    while (length > 0 && isspace((unsigned char) *start))
+        start++, length--;
+    while (length > 0 && isspace((unsigned char) start[length - 1]))
+        length--;
+    if (length == 0)
+        return NO_REGISTER;
+    if (length == 4 && strncmp(start, "%rip", 4) == 0)
+        return RIP;
+
+    char name[8];
+    if (length >= sizeof(name))
+        assembler_error("unknown register");
+    memcpy(name, start, length);
+    name[length] = '\0';
+    int size;
+    int reg = register_number(name, &size);
+    if (size != 64)
+        assembler_error("addresses must use 64 bit registers");
+    return reg;
+}
+
+static void parse_operand(const char *text, operand_t *operand)
+{
+    *operand = (operand_t) {.base = NO_REGISTER, .index = NO_REGISTER, .scale = 1, .symbol = -1};
+    if (text[0] == '%')
+    {
+        operand->kind = OPERAND_REGISTER;
+        operand->reg = register_number(text, &operand->size);
+        return;
+    }
+    if (text[0] == '$')
+    {
+        operand->kind = OPERAND_IMMEDIATE;
+        operand->value = parse_value(text + 1);
+        return;
+    }
+
+    const char *parenthesis = strchr(text, '(');
+    size_t displacement_length = parenthesis != NULL ? (size_t) (parenthesis - text) : strlen(text);
+
+    // The displacement is a number, a symbol, or a symbol plus or minus a number
+    if (displacement_length > 0 && (isdigit((unsigned char) text[0]) || text[0] == '-'))
+    {
+        char number[32];
+        if (displacement_length >= sizeof(number))
+            assembler_error("displacement too long");
+        memcpy(number, text, displacement_length);
+        number[displacement_length] = '\0';
+        operand->value = parse_value(number);
+    }
+    else if (displacement_length > 0)
+    {
+        size_t name_length = strcspn(text, "+-(");
+        if (name_length > displacement_length)
+            name_length = displacement_length;
+        operand->symbol = find_symbol(text, name_length);
+        if (name_length < displacement_length)
+        {
+            char number[32];
+            size_t length = displacement_length - name_length;
+            if (length >= sizeof(number))
+                assembler_error("displacement too long");
+            memcpy(number, text + name_length + (text[name_length] == '+'), length - (text[name_length] == '+'));
+            number[length - (text[name_length] == '+')] = '\0';
+            operand->value = parse_value(number);
+        }
+    }
+
+    if (parenthesis == NULL)
+    {
+        if (operand->symbol < 0)
+            assembler_error("absolute addresses are not supported");
+        operand->kind = OPERAND_SYMBOL;
+        return;
+    }
+
+    operand->kind = OPERAND_MEMORY;
+    const char *p = parenthesis + 1;
+    const char *close = strchr(p, ')');
+    if (close == NULL)
+        assembler_error("missing parenthesis");
+    size_t part = strcspn(p, ",)");
+    operand->base = parse_address_register(p, part);
+    p += part;
+    if (*p == ',')
+    {
+        p++;
+        part = strcspn(p, ",)");
+        operand->index = parse_address_register(p, part);
+        p += part;
+        if (*p == ',')
+        {
+            p++;
+            operand->scale = strtol(p, NULL, 10);
+        }
+    }
+    if (operand->index == RIP || operand->index == 4 || (operand->base == RIP && operand->index != NO_REGISTER)
+        || (operand->scale != 1 && operand->scale != 2 && operand->scale != 4 && operand->scale != 8))
+        assembler_error("invalid memory operand");
+    if (operand->symbol >= 0 && operand->base != RIP)
+        assembler_error("symbols can only be addressed relative to %rip");
+}
+
+static void put_byte(item_t *item, uint8_t byte)
+{
+    if (item->length == MAX_INSTRUCTION_LENGTH)
+        assembler_error("instruction too long");
+    item->code[item->length++] = byte;
+}
+
+static void put_value(item_t *item, int64_t value, int bytes)
+{
+    for (int i = 0; i < bytes; i++)
+        put_byte(item, (uint8_t) ((uint64_t) value >> (8 * i)));
+}
+
+/* Encodes the ModRM byte addressing the register or memory operand, and what follows it.
+ * reg goes in the reg field, which is either a register or an extension of the opcode.
+ * An immediate of immediate_size bytes goes last, after the displacement
+ */
+static void encode_address(item_t *item, int reg, operand_t *rm, int immediate_size, int64_t immediate)
+{
+    int field = (reg & 7) << 3;
+    if (rm->kind == OPERAND_REGISTER)
+        put_byte(item, 0xC0 | field | (rm->reg & 7));
+    else if (rm->base == RIP)
+    {
+        put_byte(item, 0x05 | field);
+        item->fixup_symbol = rm->symbol;
+        item->fixup_position = item->length;
+        item->fixup_addend = rm->value;
+        put_value(item, rm->symbol >= 0 ? 0 : rm->value, 4);
+    }
+    else
+    {
+        int base = rm->base, index = rm->index;
+        bool sib = index != NO_REGISTER || base == NO_REGISTER || (base & 7) == 4;
+        int mod;
+        if (base == NO_REGISTER || (rm->value == 0 && (base & 7) != 5))
+            mod = 0;
+        else if (fits_in_8_bits(rm->value))
+            mod = 1;
+        else
+            mod = 2;
+        if (!fits_in_32_bits(rm->value))
+            assembler_error("displacement out of range");
+
+        put_byte(item, (mod << 6) | field | (sib ? 4 : (base & 7)));
+        if (sib)
+        {
+            int scale = rm->scale == 1 ? 0 : rm->scale == 2 ? 1 : rm->scale == 4 ? 2 : 3;
+            put_byte(item, (scale << 6) | ((index == NO_REGISTER ? 4 : index & 7) << 3)
+                           | (base == NO_REGISTER ? 5 : base & 7));
+        }
+        if (base == NO_REGISTER || mod == 2)
+            put_value(item, rm->value, 4);
+        else if (mod == 1)
+            put_value(item, rm->value, 1);
+    }
+    put_value(item, immediate, immediate_size);
+}
+
+/* Returns true if the register or memory operand needs the REX.X or REX.B extension bit */
+static bool extends_index(operand_t *rm)
+{
+    return rm->kind == OPERAND_MEMORY && rm->index != NO_REGISTER && rm->index >= 8;
+}
+
+static bool extends_base(operand_t *rm)
+{
+    if (rm->kind == OPERAND_REGISTER)
+        return rm->reg >= 8;
+    return rm->base != NO_REGISTER && rm->base != RIP && rm->base >= 8;
+}
+
+/* Encodes an instruction addressing a register or memory operand through a ModRM byte, see encode_address */
+static void encode_modrm(item_t *item, bool wide, const uint8_t *opcode, size_t opcode_length, int reg,
+                         operand_t *rm, int immediate_size, int64_t immediate)
+{
+    if (rm->kind != OPERAND_REGISTER && rm->kind != OPERAND_MEMORY)
+        assembler_error("expected a register or memory operand");
+    uint8_t rex = 0x40 | (wide ? 0x08 : 0) | (reg >= 8 ? 0x04 : 0) | (extends_index(rm) ? 0x02 : 0)
+                  | (extends_base(rm) ? 0x01 : 0);
+    // Without a REX prefix, these encode %ah, %ch, %dh and %bh instead
+    bool force_rex = rm->kind == OPERAND_REGISTER && rm->size == 8 && rm->reg >= 4 && rm->reg < 8;
+    if (rex != 0x40 || force_rex)
+        put_byte(item, rex);
+    for (size_t i = 0; i < opcode_length; i++)
+        put_byte(item, opcode[i]);
+    encode_address(item, reg, rm, immediate_size, immediate);
+}
+
+// The opcode maps of VEX prefixed instructions, and the prefixes they imply
+#define MAP_0F 1
+#define MAP_0F38 2
+#define MAP_0F3A 3
+#define VEX_66 1
+#define VEX_F3 2
+
+/* Encodes an instruction with a VEX prefix, which holds the REX bits, the implied prefix and opcode map,
+ * the vector length, and the extra source register vvvv. The two byte form is used when it can be, like gas does
+ */
+static void encode_vex(item_t *item, int prefix, int map, bool wide, bool long_vector, uint8_t opcode, int reg,
+                       int vvvv, operand_t *rm, int immediate_size, int64_t immediate)
+{
+    if (rm->kind != OPERAND_REGISTER && rm->kind != OPERAND_MEMORY)
+        assembler_error("expected a register or memory operand");
+    uint8_t last = (wide ? 0x80 : 0) | ((~vvvv & 15) << 3) | (long_vector ? 0x04 : 0) | prefix;
+    if (map == MAP_0F && !wide && !extends_index(rm) && !extends_base(rm))
+    {
+        put_byte(item, 0xC5);
+        put_byte(item, (reg >= 8 ? 0 : 0x80) | (last & 0x7F));
+    }
+    else
+    {
+        put_byte(item, 0xC4);
+        put_byte(item, (reg >= 8 ? 0 : 0x80) | (extends_index(rm) ? 0 : 0x40) | (extends_base(rm) ? 0 : 0x20) | map);
+        put_byte(item, last);
+    }
+    put_byte(item, opcode);
+    encode_address(item, reg, rm, immediate_size, immediate);
+}
+
+/* Encodes an instruction with the register in the low bits of its opcode, like pushq %r */
+static void encode_register_in_opcode(item_t *item, bool wide, uint8_t opcode, operand_t *reg)
+{
+    uint8_t rex = 0x40 | (wide ? 0x08 : 0) | (reg->reg >= 8 ? 0x01 : 0);
+    if (rex != 0x40)
+        put_byte(item, rex);
+    put_byte(item, opcode + (reg->reg & 7));
+}
+
+static void expect_operands(asm_line_t *line, int n)
+{
+    if (line->n_operands != n)
+        assembler_error("wrong number of operands");
+}
+
+static void expect_size(operand_t *operand, int size)
+{
+    if (operand->kind == OPERAND_REGISTER && operand->size != size)
+        assembler_error("wrong register size");
+}
+
+static int parse_condition(const char *suffix)
+{
+    for (size_t i = 0; i < NUM_CONDITIONS; i++)
+        if (strcmp(suffix, CONDITIONS[i].name) == 0)
+            return CONDITIONS[i].code;
+    return -1;
+}
+
+static bool encode_arithmetic(item_t *item, asm_line_t *line, operand_t *operands)
+{
+    for (size_t i = 0; i < NUM_ARITHMETIC; i++)
+    {
+        if (strcmp(line->mnemonic, ARITHMETIC[i].mnemonic) != 0)
+            continue;
+        expect_operands(line, 2);
+        bool wide = ARITHMETIC[i].wide;
+        operand_t *source = &operands[0], *destination = &operands[1];
+        expect_size(source, wide ? 64 : 32);
+        expect_size(destination, wide ? 64 : 32);
+
+        if (source->kind == OPERAND_IMMEDIATE)
+        {
+            if (!fits_in_32_bits(source->value))
+                assembler_error("immediate out of range");
+            if (fits_in_8_bits(source->value))
+                encode_modrm(item, wide, (uint8_t[]) {0x83}, 1, ARITHMETIC[i].extension, destination, 1, source->value);
+            else if (destination->kind == OPERAND_REGISTER && destination->reg == 0)
+            {
+                // There is a shorter form for %rax
+                if (wide)
+                    put_byte(item, 0x48);
+                put_byte(item, ARITHMETIC[i].opcode + 5);
+                put_value(item, source->value, 4);
+            }
+            else
+                encode_modrm(item, wide, (uint8_t[]) {0x81}, 1, ARITHMETIC[i].extension, destination, 4, source->value);
+        }
+        else if (source->kind == OPERAND_REGISTER)
+            encode_modrm(item, wide, (uint8_t[]) {ARITHMETIC[i].opcode + 1}, 1, source->reg, destination, 0, 0);
+        else if (destination->kind == OPERAND_REGISTER)
+            encode_modrm(item, wide, (uint8_t[]) {ARITHMETIC[i].opcode + 3}, 1, destination->reg, source, 0, 0);
+        else
+            assembler_error("invalid operands");
+        return true;
+    }
+    return false;
+}
+
+static bool encode_unary(item_t *item, asm_line_t *line, operand_t *operands)
+{
+    for (size_t i = 0; i < NUM_UNARY; i++)
+    {
+        if (strcmp(line->mnemonic, UNARY[i].mnemonic) != 0)
+            continue;
+        expect_operands(line, 1);
+        expect_size(&operands[0], 64);
+        encode_modrm(item, true, &UNARY[i].opcode, 1, UNARY[i].extension, &operands[0], 0, 0);
+        return true;
+    }
+    for (size_t i = 0; i < NUM_SHIFTS; i++)
+    {
+        if (strcmp(line->mnemonic, SHIFTS[i].mnemonic) != 0)
+            continue;
+        expect_operands(line, 2);
+        operand_t *count = &operands[0], *destination = &operands[1];
+        expect_size(destination, 64);
+        if (count->kind == OPERAND_REGISTER && count->reg == 1 && count->size == 8)
+            encode_modrm(item, true, (uint8_t[]) {0xD3}, 1, SHIFTS[i].extension, destination, 0, 0);
+        else if (count->kind == OPERAND_IMMEDIATE && count->value == 1)
+            encode_modrm(item, true, (uint8_t[]) {0xD1}, 1, SHIFTS[i].extension, destination, 0, 0);
+        else if (count->kind == OPERAND_IMMEDIATE && count->value >= 0 && count->value < 64)
+            encode_modrm(item, true, (uint8_t[]) {0xC1}, 1, SHIFTS[i].extension, destination, 1, count->value);
+        else
+            assembler_error("invalid shift count");
+        return true;
+    }
+    return false;
+}
+
+static bool is_vector_register(operand_t *operand)
+{
+    return operand->kind == OPERAND_REGISTER && operand->size >= 128;
+}
+
+static void expect_vector_register(operand_t *operand)
+{
+    if (!is_vector_register(operand))
+        assembler_error("expected a vector register");
+}
+
+/* Moves between a general purpose register or memory, and the low quadword of a vector register */
+static void encode_vector_quadword_move(item_t *item, operand_t *source, operand_t *destination, bool vex)
+{
+    operand_t *vector = is_vector_register(destination) ? destination : source;
+    operand_t *other = vector == destination ? source : destination;
+    if (vector->size != 128 || is_vector_register(other) || other->kind == OPERAND_IMMEDIATE)
+        assembler_error("invalid operands");
+    expect_size(other, 64);
+    uint8_t opcode = vector == destination ? 0x6E : 0x7E;
+    if (vex)
+        encode_vex(item, VEX_66, MAP_0F, true, false, opcode, vector->reg, 0, other, 0, 0);
+    else
+    {
+        put_byte(item, 0x66);
+        encode_modrm(item, true, (uint8_t[]) {0x0F, opcode}, 2, vector->reg, other, 0, 0);
+    }
+}
+
+/* Encodes the instructions on vector registers, returning false if the mnemonic isn't one of them */
+static bool encode_vector(item_t *item, asm_line_t *line, operand_t *operands)
+{
+    const char *mnemonic = line->mnemonic;
+    int n = line->n_operands;
+    if (strcmp(mnemonic, "vzeroupper") == 0)
+    {
+        expect_operands(line, 0);
+        put_byte(item, 0xC5);
+        put_byte(item, 0xF8);
+        put_byte(item, 0x77);
+        return true;
+    }
+    if (strcmp(mnemonic, "vmovq") == 0)
+    {
+        expect_operands(line, 2);
+        encode_vector_quadword_move(item, &operands[0], &operands[1], true);
+        return true;
+    }
+    if (strcmp(mnemonic, "vpbroadcastq") == 0)
+    {
+        expect_operands(line, 2);
+        expect_vector_register(&operands[1]);
+        if (operands[0].kind == OPERAND_REGISTER && operands[0].size != 128)
+            assembler_error("invalid operands");
+        encode_vex(item, VEX_66, MAP_0F38, false, operands[1].size == 256, 0x59, operands[1].reg, 0, &operands[0],
+                   0, 0);
+        return true;
+    }
+    if (strcmp(mnemonic, "vextracti128") == 0)
+    {
+        expect_operands(line, 3);
+        if (operands[0].kind != OPERAND_IMMEDIATE || operands[1].kind != OPERAND_REGISTER || operands[1].size != 256
+            || (operands[2].kind == OPERAND_REGISTER && operands[2].size != 128))
+            assembler_error("invalid operands");
+        encode_vex(item, VEX_66, MAP_0F3A, false, true, 0x39, operands[1].reg, 0, &operands[2], 1, operands[0].value);
+        return true;
+    }
+
+    bool vex = mnemonic[0] == 'v';
+    const char *name = vex ? mnemonic + 1 : mnemonic;
+    operand_t *destination = &operands[n - 1];
+    if (strcmp(name, "movdqu") == 0 || strcmp(name, "movdqa") == 0)
+    {
+        expect_operands(line, 2);
+        int prefix = name[5] == 'u' ? VEX_F3 : VEX_66;
+        operand_t *source = &operands[0];
+        // Stores have the register in the reg field. So do moves between registers out of %xmm8 and up, with AVX,
+        // since the two byte VEX prefix can only extend the reg field
+        bool store = destination->kind == OPERAND_MEMORY
+                     || (vex && is_vector_register(source) && source->reg >= 8 && destination->reg < 8);
+        operand_t *reg = store ? source : destination, *rm = store ? destination : source;
+        expect_vector_register(reg);
+        if (rm->kind == OPERAND_REGISTER && rm->size != reg->size)
+            assembler_error("invalid operands");
+        uint8_t opcode = store ? 0x7F : 0x6F;
+        if (vex)
+            encode_vex(item, prefix, MAP_0F, false, reg->size == 256, opcode, reg->reg, 0, rm, 0, 0);
+        else
+        {
+            if (reg->size != 128)
+                assembler_error("invalid operands");
+            put_byte(item, prefix == VEX_F3 ? 0xF3 : 0x66);
+            encode_modrm(item, false, (uint8_t[]) {0x0F, opcode}, 2, reg->reg, rm, 0, 0);
+        }
+        return true;
+    }
+    if (strcmp(name, "pshufd") == 0)
+    {
+        expect_operands(line, 3);
+        expect_vector_register(destination);
+        if (operands[0].kind != OPERAND_IMMEDIATE || (!vex && destination->size != 128))
+            assembler_error("invalid operands");
+        if (vex)
+            encode_vex(item, VEX_66, MAP_0F, false, destination->size == 256, 0x70, destination->reg, 0, &operands[1],
+                       1, operands[0].value);
+        else
+        {
+            put_byte(item, 0x66);
+            encode_modrm(item, false, (uint8_t[]) {0x0F, 0x70}, 2, destination->reg, &operands[1], 1, operands[0].value);
+        }
+        return true;
+    }
+
+    for (size_t i = 0; i < NUM_VECTOR_ARITHMETIC; i++)
+    {
+        if (strcmp(name, VECTOR_ARITHMETIC[i].mnemonic) != 0)
+            continue;
+        expect_operands(line, vex ? 3 : 2);
+        expect_vector_register(destination);
+        if (!vex && destination->size != 128)
+            assembler_error("invalid operands");
+        uint8_t opcode = VECTOR_ARITHMETIC[i].opcode;
+        bool shift = VECTOR_ARITHMETIC[i].extension >= 0;
+        if (shift && operands[0].kind != OPERAND_IMMEDIATE)
+            assembler_error("invalid shift count");
+        if (vex && shift)
+            encode_vex(item, VEX_66, MAP_0F, false, destination->size == 256, opcode, VECTOR_ARITHMETIC[i].extension,
+                       destination->reg, &operands[1], 1, operands[0].value);
+        else if (vex)
+        {
+            expect_vector_register(&operands[1]);
+            encode_vex(item, VEX_66, MAP_0F, false, destination->size == 256, opcode, destination->reg,
+                       operands[1].reg, &operands[0], 0, 0);
+        }
+        else
+        {
+            put_byte(item, 0x66);
+            if (shift)
+                encode_modrm(item, false, (uint8_t[]) {0x0F, opcode}, 2, VECTOR_ARITHMETIC[i].extension, destination,
+                             1, operands[0].value);
+            else
+                encode_modrm(item, false, (uint8_t[]) {0x0F, opcode}, 2, destination->reg, &operands[0], 0, 0);
+        }
+        return true;
+    }
+    return false;
+}
+
+static void encode_move(item_t *item, asm_line_t *line, operand_t *operands)
+{
+    expect_operands(line, 2);
+    operand_t *source = &operands[0], *destination = &operands[1];
+    if (is_vector_register(source) || is_vector_register(destination))
+    {
+        encode_vector_quadword_move(item, source, destination, false);
+        return;
+    }
+    expect_size(source, 64);
+    expect_size(destination, 64);
+    if (source->kind == OPERAND_IMMEDIATE)
+    {
+        if (fits_in_32_bits(source->value))
+            encode_modrm(item, true, (uint8_t[]) {0xC7}, 1, 0, destination, 4, source->value);
+        else if (destination->kind == OPERAND_REGISTER)
+        {
+            encode_register_in_opcode(item, true, 0xB8, destination);
+            put_value(item, source->value, 8);
+        }
+        else
+            assembler_error("immediate out of range");
+    }
+    else if (source->kind == OPERAND_REGISTER)
+        encode_modrm(item, true, (uint8_t[]) {0x89}, 1, source->reg, destination, 0, 0);
+    else if (destination->kind == OPERAND_REGISTER)
+        encode_modrm(item, true, (uint8_t[]) {0x8B}, 1, destination->reg, source, 0, 0);
+    else
+        assembler_error("invalid operands");
+}
+
+/* Only stores of bytes are emitted, from the low byte of the legacy registers or an immediate */
+static void encode_byte_move(item_t *item, asm_line_t *line, operand_t *operands)
+{
+    expect_operands(line, 2);
+    operand_t *source = &operands[0], *destination = &operands[1];
+    if (destination->kind != OPERAND_MEMORY)
+        assembler_error("invalid operands");
+    if (source->kind == OPERAND_IMMEDIATE && source->value >= -128 && source->value <= 255)
+        encode_modrm(item, false, (uint8_t[]) {0xC6}, 1, 0, destination, 1, source->value);
+    // %spl, %bpl, %sil and %dil need a REX prefix, which is only given for the rm operand
+    else if (source->kind == OPERAND_REGISTER && source->size == 8 && (source->reg < 4 || source->reg >= 8))
+        encode_modrm(item, false, (uint8_t[]) {0x88}, 1, source->reg, destination, 0, 0);
+    else
+        assembler_error("invalid operands");
+}
+
+static void encode_multiply(item_t *item, asm_line_t *line, operand_t *operands)
+{
+    if (line->n_operands == 1)
+    {
+        expect_size(&operands[0], 64);
+        encode_modrm(item, true, (uint8_t[]) {0xF7}, 1, 5, &operands[0], 0, 0);
+        return;
+    }
+
+    // imulq $k, %r is imulq $k, %r, %r
+    operand_t *factor = &operands[0], *source = &operands[1], *destination = &operands[line->n_operands - 1];
+    if (line->n_operands == 2 && factor->kind != OPERAND_IMMEDIATE)
+    {
+        factor = NULL;
+        source = &operands[0];
+    }
+    if (line->n_operands > 3 || destination->kind != OPERAND_REGISTER)
+        assembler_error("invalid operands");
+    expect_size(source, 64);
+    expect_size(destination, 64);
+
+    if (factor == NULL)
+        encode_modrm(item, true, (uint8_t[]) {0x0F, 0xAF}, 2, destination->reg, source, 0, 0);
+    else if (factor->kind != OPERAND_IMMEDIATE || !fits_in_32_bits(factor->value))
+        assembler_error("invalid factor");
+    else if (fits_in_8_bits(factor->value))
+        encode_modrm(item, true, (uint8_t[]) {0x6B}, 1, destination->reg, source, 1, factor->value);
+    else
+        encode_modrm(item, true, (uint8_t[]) {0x69}, 1, destination->reg, source, 4, factor->value);
+}
+
+static void encode_stack(item_t *item, asm_line_t *line, operand_t *operands, bool push)
+{
+    expect_operands(line, 1);
+    operand_t *operand = &operands[0];
+    expect_size(operand, 64);
+    if (operand->kind == OPERAND_REGISTER)
+        encode_register_in_opcode(item, false, push ? 0x50 : 0x58, operand);
+    else if (operand->kind == OPERAND_MEMORY)
+        encode_modrm(item, false, (uint8_t[]) {push ? 0xFF : 0x8F}, 1, push ? 6 : 0, operand, 0, 0);
+    else if (push && fits_in_8_bits(operand->value))
+    {
+        put_byte(item, 0x6A);
+        put_value(item, operand->value, 1);
+    }
+    else if (push && fits_in_32_bits(operand->value))
+    {
+        put_byte(item, 0x68);
+        put_value(item, operand->value, 4);
+    }
+    else
+        assembler_error("invalid operand");
+}
+
+/* Turns the instruction into a branch item, if it is a jump, call or loop */
+static bool parse_branch(item_t *item, asm_line_t *line, operand_t *operands)
+{
+    const char *mnemonic = line->mnemonic;
+    if (strcmp(mnemonic, "jmp") == 0)
+        item->branch = BRANCH_JUMP;
+    else if (strcmp(mnemonic, "call") == 0)
+        item->branch = BRANCH_CALL;
+    else if (strcmp(mnemonic, "loop") == 0)
+        item->branch = BRANCH_LOOP;
+    else if (mnemonic[0] == 'j' && parse_condition(mnemonic + 1) >= 0)
+    {
+        item->branch = BRANCH_CONDITIONAL;
+        item->condition = parse_condition(mnemonic + 1);
+    }
+    else
+        return false;
+
+    expect_operands(line, 1);
+    if (operands[0].kind != OPERAND_SYMBOL || operands[0].value != 0)
+        assembler_error("branches must go to labels");
+    item->kind = ITEM_BRANCH;
+    item->symbol = operands[0].symbol;
+    return true;
+}
+
+static void assemble_instruction(asm_line_t *line)
+{
+    operand_t operands[ASM_MAX_OPERANDS];
+    for (int i = 0; i < line->n_operands; i++)
+        parse_operand(line->operands[i], &operands[i]);
+
+    item_t *item = new_item(ITEM_CODE);
+    const char *mnemonic = line->mnemonic;
+    size_t length = strlen(mnemonic);
+    if (parse_branch(item, line, operands) || encode_arithmetic(item, line, operands)
+        || encode_unary(item, line, operands) || encode_vector(item, line, operands))
+        return;
+
+    if (strcmp(mnemonic, "movq") == 0)
+        encode_move(item, line, operands);
+    else if (strcmp(mnemonic, "movb") == 0)
+        encode_byte_move(item, line, operands);
+    else if (strcmp(mnemonic, "movabsq") == 0)
+    {
+        expect_operands(line, 2);
+        if (operands[0].kind != OPERAND_IMMEDIATE || operands[1].kind != OPERAND_REGISTER)
+            assembler_error("invalid operands");
+        expect_size(&operands[1], 64);
+        encode_register_in_opcode(item, true, 0xB8, &operands[1]);
+        put_value(item, operands[0].value, 8);
+    }
+    else if (strcmp(mnemonic, "movzbl") == 0)
+    {
+        expect_operands(line, 2);
+        expect_size(&operands[0], 8);
+        if (operands[1].kind != OPERAND_REGISTER || operands[1].size != 32)
+            assembler_error("invalid operands");
+        encode_modrm(item, false, (uint8_t[]) {0x0F, 0xB6}, 2, operands[1].reg, &operands[0], 0, 0);
+    }
+    else if (strcmp(mnemonic, "leaq") == 0)
+    {
+        expect_operands(line, 2);
+        if (operands[0].kind != OPERAND_MEMORY || operands[1].kind != OPERAND_REGISTER)
+            assembler_error("invalid operands");
+        expect_size(&operands[1], 64);
+        encode_modrm(item, true, (uint8_t[]) {0x8D}, 1, operands[1].reg, &operands[0], 0, 0);
+    }
+    else if (strcmp(mnemonic, "testq") == 0)
+    {
+        expect_operands(line, 2);
+        expect_size(&operands[0], 64);
+        expect_size(&operands[1], 64);
+        if (operands[0].kind == OPERAND_REGISTER)
+            encode_modrm(item, true, (uint8_t[]) {0x85}, 1, operands[0].reg, &operands[1], 0, 0);
+        else if (operands[0].kind == OPERAND_IMMEDIATE && fits_in_32_bits(operands[0].value))
+            encode_modrm(item, true, (uint8_t[]) {0xF7}, 1, 0, &operands[1], 4, operands[0].value);
+        else
+            assembler_error("invalid operands");
+    }
+    else if (strcmp(mnemonic, "imulq") == 0)
+        encode_multiply(item, line, operands);
+    else if (strcmp(mnemonic, "pushq") == 0 || strcmp(mnemonic, "popq") == 0)
+        encode_stack(item, line, operands, mnemonic[1] == 'u');
+    else if (strcmp(mnemonic, "cqo") == 0)
+    {
+        expect_operands(line, 0);
+        put_byte(item, 0x48);
+        put_byte(item, 0x99);
+    }
+    else if (strcmp(mnemonic, "syscall") == 0)
+    {
+        expect_operands(line, 0);
+        put_byte(item, 0x0F);
+        put_byte(item, 0x05);
+    }
+    else if (strcmp(mnemonic, "ret") == 0 || strcmp(mnemonic, "leave") == 0 || strcmp(mnemonic, "nop") == 0)
+    {
+        expect_operands(line, 0);
+        put_byte(item, mnemonic[0] == 'r' ? 0xC3 : mnemonic[0] == 'l' ? 0xC9 : 0x90);
+    }
+    else if (strncmp(mnemonic, "cmov", 4) == 0 && parse_condition(mnemonic + 4) >= 0)
+    {
+        expect_operands(line, 2);
+        expect_size(&operands[0], 64);
+        if (operands[1].kind != OPERAND_REGISTER || operands[1].size != 64)
+            assembler_error("invalid operands");
+        encode_modrm(item, true, (uint8_t[]) {0x0F, 0x40 + parse_condition(mnemonic + 4)}, 2, operands[1].reg,
+                     &operands[0], 0, 0);
+    }
+    else if (strncmp(mnemonic, "set", 3) == 0 && parse_condition(mnemonic + 3) >= 0)
+    {
+        expect_operands(line, 1);
+        expect_size(&operands[0], 8);
+        encode_modrm(item, false, (uint8_t[]) {0x0F, 0x90 + parse_condition(mnemonic + 3)}, 2, 0, &operands[0], 0, 0);
+    }
+    else
+    {
+        (void) length;
+        assembler_error("unknown instruction");
+    }
+}
+
+uint8_t *decode_string_literal(const char *literal, size_t *length)
+{
+    const char *saved_line = current_line;
+    current_line = literal;
+    if (*literal != '"')
+        assembler_error("expected a string");
+    uint8_t *data = malloc(strlen(literal) + 1);
+    *length = 0;
+    const char *p = literal + 1;
+    while (*p != '"')
+    {
+        if (*p == '\0')
+            assembler_error("unterminated string");
+        p = read_character(p, &data[(*length)++]);
+    }
+    data[*length] = '\0';
+    current_line = saved_line;
+    return data;
+}
+
+static void assemble_string(const char *text, bool terminate)
+{
+    if (current_section == SECTION_BSS)
+        assembler_error("data in .bss must be zero");
+    item_t *item = new_item(ITEM_DATA);
+    item->data = decode_string_literal(text, &item->size);
+    if (terminate)
+        item->size++;
+}
+
+static void assemble_alignment(uint64_t alignment, uint64_t max_skip)
+{
+    if (alignment == 0 || (alignment & (alignment - 1)) != 0)
+        assembler_error("alignment must be a power of two");
+    item_t *item = new_item(ITEM_ALIGN);
+    item->alignment = alignment;
+    item->max_skip = max_skip;
+    section_regions[current_section]++;
+    if (alignment > section_alignments[current_section])
+        section_alignments[current_section] = alignment;
+}
+
+/* Assembles one line of a directive, which may start with a label */
+static void assemble_directive_line(char *text)
+{
+    while (isspace((unsigned char) *text))
+        text++;
+    size_t name_length = strcspn(text, ": \t");
+    if (text[name_length] == ':')
+    {
+        define_label(text, name_length);
+        text += name_length + 1;
+        while (isspace((unsigned char) *text))
+            text++;
+    }
+    if (*text == '\0')
+        return;
+
+    size_t directive_length = strcspn(text, " \t");
+    char *arguments = text + directive_length;
+    while (isspace((unsigned char) *arguments))
+        arguments++;
+    text[directive_length] = '\0';
+    for (size_t end = strlen(arguments); end > 0 && isspace((unsigned char) arguments[end - 1]); end--)
+        arguments[end - 1] = '\0';
+
+    if (strcmp(text, ".text") == 0)
+        current_section = SECTION_TEXT;
+    else if (strcmp(text, ".section") == 0)
+    {
+        size_t length = strcspn(arguments, ", \t");
+        if (strncmp(arguments, ".text", length) == 0 && length == 5)
+            current_section = SECTION_TEXT;
+        else if (strncmp(arguments, ".rodata", length) == 0 && length == 7)
+            current_section = SECTION_RODATA;
+        else if (strncmp(arguments, ".bss", length) == 0 && length == 4)
+            current_section = SECTION_BSS;
+        else
+            assembler_error("unknown section");
+    }
+    else if (strcmp(text, ".global") == 0 || strcmp(text, ".globl") == 0)
+        symbols[find_symbol(arguments, strlen(arguments))].global = true;
+    else if (strcmp(text, ".asciz") == 0 || strcmp(text, ".string") == 0 || strcmp(text, ".ascii") == 0)
+        assemble_string(arguments, strcmp(text, ".ascii") != 0);
+    else if (strcmp(text, ".quad") == 0)
+    {
+        if (current_section == SECTION_BSS)
+            assembler_error("data in .bss must be zero");
+        size_t n_values = 1;
+        for (char *c = arguments; *c != '\0'; c++)
+            n_values += *c == ',';
+        item_t *item = new_item(ITEM_DATA);
+        item->size = 8 * n_values;
+        item->data = malloc(item->size);
+        char *value = arguments;
+        for (size_t i = 0; i < n_values; i++)
+        {
+            size_t length = strcspn(value, ",");
+            char number[32];
+            while (length > 0 && isspace((unsigned char) *value))
+                value++, length--;
+            while (length > 0 && isspace((unsigned char) value[length - 1]))
+                length--;
+            if (length >= sizeof(number))
+                assembler_error("expected a number");
+            memcpy(number, value, length);
+            number[length] = '\0';
+            uint64_t quadword = parse_value(number);
+            for (int b = 0; b < 8; b++)
+                item->data[8 * i + b] = (uint8_t) (quadword >> (8 * b));
+            value += strcspn(value, ",") + (value[strcspn(value, ",")] == ',');
+        }
+    }
+    else if (strcmp(text, ".zero") == 0 || strcmp(text, ".skip") == 0)
+    {
+        int64_t size = parse_value(arguments);
+        if (size < 0)
+            assembler_error("negative size");
+        item_t *item = new_item(ITEM_DATA);
+        item->size = size;
+    }
+    else if (strcmp(text, ".align") == 0 || strcmp(text, ".balign") == 0)
+        assemble_alignment(parse_value(arguments), UINT64_MAX);
+    else if (strcmp(text, ".p2align") == 0)
+    {
+        // .p2align power[,fill[,max_skip]], where the fill is left to us
+        char *fill = strchr(arguments, ',');
+        char *max_skip = fill != NULL ? strchr(fill + 1, ',') : NULL;
+        if (fill != NULL)
+            *fill = '\0';
+        int64_t power = parse_value(arguments);
+        if (power < 0 || power > 12)
+            assembler_error("alignment out of range");
+        assemble_alignment(1ull << power, max_skip != NULL ? (uint64_t) parse_value(max_skip + 1) : UINT64_MAX);
+    }
+    else
+        assembler_error("unknown directive");
+}
+
+static void assemble_line(asm_line_t *line)
+{
+    current_line = line->text;
+    switch (line->kind)
+    {
+        case ASM_LABEL:
+            define_label(line->text, strlen(line->text) - 1);
+            break;
+        case ASM_DIRECTIVE:
+        {
+            // A directive may be several lines
+            char *text = strdup(line->text);
+            for (char *start = text, *end; start != NULL; start = end)
+            {
+                end = strchr(start, '\n');
+                if (end != NULL)
+                    *end++ = '\0';
+                assemble_directive_line(start);
+            }
+            free(text);
+            break;
+        }
+        case ASM_INSTRUCTION:
+            if (current_section != SECTION_TEXT)
+                assembler_error("instructions must be in .text");
+            assemble_instruction(line);
+            break;
+    }
+}
+
+static uint64_t branch_size(item_t *item)
+{
+    switch (item->branch)
+    {
+        case BRANCH_JUMP:
+            return item->long_form ? 5 : 2;
+        case BRANCH_CONDITIONAL:
+            return item->long_form ? 6 : 2;
+        case BRANCH_CALL:
+            return 5;
+        case BRANCH_LOOP:
+            return 2;
+    }
+    return 0;
+}
+
+/* Places every item in its section, making the branches long that can't reach their target with the short form.
+ * Like gas, the items are placed in order, and a label further ahead is taken to have moved as far as the branch
+ * has since the last layout, unless there is an alignment in between, which may take up the difference.
+ * The first layout only places the items. Returns true if anything moved
+ */
+static bool lay_out(bool relax)
+{
+    bool *placed = calloc(n_symbols, sizeof(bool));
+    size_t *label_regions = calloc(n_symbols, sizeof(size_t));
+    for (size_t i = 0; i < n_items; i++)
+        if (items[i].kind == ITEM_LABEL)
+            label_regions[items[i].symbol] = items[i].region;
+
+    uint64_t offsets[NUM_SECTIONS] = {0};
+    bool moved = false;
+    for (size_t i = 0; i < n_items; i++)
+    {
+        item_t *item = &items[i];
+        uint64_t *offset = &offsets[item->section];
+        int64_t stretch = (int64_t) *offset - (int64_t) item->offset;
+        if (stretch != 0)
+            moved = true;
+        item->offset = *offset;
+        switch (item->kind)
+        {
+            case ITEM_CODE:
+                item->size = item->length;
+                break;
+            case ITEM_DATA:
+                break;
+            case ITEM_BRANCH:
+            {
+                object_symbol_t *target = &symbols[item->symbol];
+                int64_t target_offset = target->offset;
+                bool estimated = relax && !item->long_form && item->branch != BRANCH_CALL;
+                if (estimated && !placed[item->symbol] && stretch != 0)
+                {
+                    if (stretch < 0 || label_regions[item->symbol] == item->region)
+                        target_offset += stretch;
+                    else if (target_offset < (int64_t) item->offset)
+                        estimated = false;
+                }
+                int64_t displacement = target_offset - (int64_t) (item->offset + branch_size(item));
+                if (estimated && (target->section != (int) item->section || !fits_in_8_bits(displacement)))
+                {
+                    if (item->branch == BRANCH_LOOP)
+                    {
+                        current_line = target->name;
+                        assembler_error("loop target out of range");
+                    }
+                    item->long_form = true;
+                    moved = true;
+                }
+                item->size = branch_size(item);
+                break;
+            }
+            case ITEM_ALIGN:
+            {
+                uint64_t padding = (item->alignment - *offset % item->alignment) % item->alignment;
+                item->size = padding <= item->max_skip ? padding : 0;
+                break;
+            }
+            case ITEM_LABEL:
+                item->size = 0;
+                symbols[item->symbol].section = item->section;
+                symbols[item->symbol].offset = *offset;
+                placed[item->symbol] = true;
+                break;
+        }
+        *offset += item->size;
+    }
+    free(placed);
+    free(label_regions);
+    return moved;
+}
+
+static void add_relocation(object_t *object, section_t section, uint64_t offset, relocation_type_t type, int symbol,
+                           int64_t addend)
+{
+    object->relocations = realloc(object->relocations, (object->n_relocations + 1) * sizeof(object_relocation_t));
+    object_symbol_t *target = &symbols[symbol];
+    object->relocations[object->n_relocations++] = (object_relocation_t) {
+        .section = section,
+        .offset = offset,
+        .type = target->section >= 0 ? RELOCATION_PC32 : type,
+        .target_section = target->section,
+        .symbol = symbol,
+        .addend = target->section >= 0 ? (int64_t) target->offset + addend : addend
+    };
+}
+
+/* Writes the 32 bit displacement of a symbol from the end of the instruction at the position in the code,
+ * or leaves it for the linker if the symbol is in another section
+ */
+static void resolve_displacement(object_t *object, item_t *item, uint8_t *code, size_t position, int symbol,
+                                 int64_t addend, relocation_type_t type)
+{
+    object_symbol_t *target = &symbols[symbol];
+    int64_t distance_to_end = item->size - position;
+    int64_t value = 0;
+    if (target->section == (int) item->section)
+        value = (int64_t) target->offset + addend - (int64_t) (item->offset + item->size);
+    else
+        add_relocation(object, item->section, item->offset + position, type, symbol, addend - distance_to_end);
+    for (int i = 0; i < 4; i++)
+        code[position + i] = (uint8_t) ((uint64_t) value >> (8 * i));
+}
+
+static void emit_branch(object_t *object, item_t *item, uint8_t *code)
+{
+    size_t position;
+    switch (item->branch)
+    {
+        case BRANCH_JUMP:
+            code[0] = item->long_form ? 0xE9 : 0xEB;
+            position = 1;
+            break;
+        case BRANCH_CONDITIONAL:
+            if (item->long_form)
+            {
+                code[0] = 0x0F;
+                code[1] = 0x80 + item->condition;
+                position = 2;
+            }
+            else
+            {
+                code[0] = 0x70 + item->condition;
+                position = 1;
+            }
+            break;
+        case BRANCH_CALL:
+            code[0] = 0xE8;
+            position = 1;
+            break;
+        case BRANCH_LOOP:
+            code[0] = 0xE2;
+            position = 1;
+            break;
+    }
+
+    if (item->size - position == 4)
+        resolve_displacement(object, item, code, position, item->symbol, 0, RELOCATION_PLT32);
+    else
+        code[position] = (uint8_t) (symbols[item->symbol].offset - (item->offset + item->size));
+}
+
+/* The no-op instructions recommended for padding code, by their lengths */
+static const uint8_t NOPS[][11] = {
+    {0x90},
+    {0x66, 0x90},
+    {0x0F, 0x1F, 0x00},
+    {0x0F, 0x1F, 0x40, 0x00},
+    {0x0F, 0x1F, 0x44, 0x00, 0x00},
+    {0x66, 0x0F, 0x1F, 0x44, 0x00, 0x00},
+    {0x0F, 0x1F, 0x80, 0x00, 0x00, 0x00, 0x00},
+    {0x0F, 0x1F, 0x84, 0x00, 0x00, 0x00, 0x00, 0x00},
+    {0x66, 0x0F, 0x1F, 0x84, 0x00, 0x00, 0x00, 0x00, 0x00},
+    {0x66, 0x2E, 0x0F, 0x1F, 0x84, 0x00, 0x00, 0x00, 0x00, 0x00},
+    {0x66, 0x66, 0x2E, 0x0F, 0x1F, 0x84, 0x00, 0x00, 0x00, 0x00, 0x00}
+};
+
+static void emit_padding(item_t *item, uint8_t *code)
+{
+    if (item->section != SECTION_TEXT)
+    {
+        memset(code, 0, item->size);
+        return;
+    }
+    for (uint64_t done = 0; done < item->size;)
+    {
+        uint64_t length = item->size - done < 11 ? item->size - done : 11;
+        memcpy(code + done, NOPS[length - 1], length);
+        done += length;
+    }
+}
+
+object_t *assemble_program(asm_buffer_t *buffer)
+{
+    current_section = SECTION_TEXT;
+    for (int s = 0; s < NUM_SECTIONS; s++)
+    {
+        section_alignments[s] = 1;
+        section_regions[s] = 0;
+    }
+    for (size_t i = 0; i < buffer->n_lines; i++)
+        assemble_line(&buffer->lines[i]);
+
+    lay_out(false);
+    while (lay_out(true))
+        ;
+
+    object_t *object = calloc(1, sizeof(object_t));
+    for (size_t i = 0; i < n_items; i++)
+    {
+        item_t *item = &items[i];
+        if (item->offset + item->size > object->sizes[item->section])
+            object->sizes[item->section] = item->offset + item->size;
+    }
+    for (int s = 0; s < NUM_SECTIONS; s++)
+    {
+        object->alignments[s] = section_alignments[s];
+        if (s != SECTION_BSS)
+            object->contents[s] = calloc(object->sizes[s] + 1, 1);
+    }
+
+    for (size_t i = 0; i < n_items; i++)
+    {
+        item_t *item = &items[i];
+        if (item->section == SECTION_BSS)
+            continue;
+        uint8_t *code = object->contents[item->section] + item->offset;
+        switch (item->kind)
+        {
+            case ITEM_CODE:
+                memcpy(code, item->code, item->length);
+                if (item->fixup_symbol >= 0)
+                    resolve_displacement(object, item, code, item->fixup_position, item->fixup_symbol,
+                                         item->fixup_addend, RELOCATION_PC32);
+                break;
+            case ITEM_DATA:
+                if (item->data != NULL)
+                    memcpy(code, item->data, item->size);
+                break;
+            case ITEM_BRANCH:
+                emit_branch(object, item, code);
+                break;
+            case ITEM_ALIGN:
+                emit_padding(item, code);
+                break;
+            case ITEM_LABEL:
+                break;
+        }
+    }
+
+    for (size_t i = 0; i < n_items; i++)
+        free(items[i].data);
+    free(items);
+    items = NULL;
+    n_items = items_capacity = 0;
+    free(symbol_table);
+    symbol_table = NULL;
+    symbol_table_size = 0;
+
+    object->symbols = symbols;
+    object->n_symbols = n_symbols;
+    symbols = NULL;
+    n_symbols = symbols_capacity = 0;
+    return object;
+}
+
+void destroy_object(object_t *object)
+{
+    for (int s = 0; s < NUM_SECTIONS; s++)
+        free(object->contents[s]);
+    for (size_t i = 0; i < object->n_symbols; i++)
+        free(object->symbols[i].name);
+    free(object->symbols);
+    free(object->relocations);
+    free(object);
+}
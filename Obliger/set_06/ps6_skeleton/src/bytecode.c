@@ -0,0 +1,479 @@
+#include <vslc.h>
+#include "bytecode.h"
+#include "assembler.h"
+
+/* Compilation of the bound syntax tree into bytecode.
+ * Expressions are evaluated in exactly the order of the unoptimized code generator, since calls may print
+ * and change global variables. Temporaries are allocated like a stack, and freed again once a value is used.
+ */
+
+static bc_program_t *program;
+static bc_function_t *function;
+static int next_register;
+
+// Jumps to the end of the innermost loop, to be patched once the end is known
+static size_t *break_jumps;
+static size_t n_break_jumps, break_jumps_capacity;
+
+// Where each global variable or array starts in the globals, by sequence number
+static size_t *global_offsets;
+
+static void compile_statement(node_t *node);
+static int compile_expression(node_t *expression, int target);
+
+static size_t emit(bc_opcode_t opcode, int32_t a, int32_t b, int32_t c)
+{
+    if (program->n_instructions == program->capacity)
+    {
+        program->capacity = program->capacity * 2 + 256;
+        program->code = realloc(program->code, program->capacity * sizeof(bc_instruction_t));
+    }
+    program->code[program->n_instructions] = (bc_instruction_t) {
+        .handler = NULL, .a = a, .b = b, .c = c, .opcode = opcode
+    };
+    return program->n_instructions++;
+}
+
+static int new_register(void)
+{
+    int reg = next_register++;
+    if (next_register > function->frame_size)
+        function->frame_size = next_register;
+    return reg;
+}
+
+/* The target register if there is one, or a new temporary */
+static int destination(int target)
+{
+    return target >= 0 ? target : new_register();
+}
+
+static size_t add_constant(int64_t value)
+{
+    if (program->n_constants == program->constants_capacity)
+    {
+        program->constants_capacity = program->constants_capacity * 2 + 16;
+        program->constants = realloc(program->constants, program->constants_capacity * sizeof(int64_t));
+    }
+    program->constants[program->n_constants] = value;
+    return program->n_constants++;
+}
+
+/* Checks the index against the length of the array, when checking bounds */
+static void check_index(symbol_t *array, int index)
+{
+    if (check_array_bounds)
+        emit(BC_CHECK_BOUNDS, index, add_constant(*(int64_t *) array->node->children[1]->data), 0);
+}
+
+static bool fits_immediate(int64_t value)
+{
+    return value >= INT32_MIN && value <= INT32_MAX;
+}
+
+static int compile_function_call(node_t *call, int target)
+{
+    symbol_t *symbol = get_called_function(call);
+    node_t *argument_list = call->children[1];
+    size_t parameter_count = argument_list->n_children;
+
+    // The arguments go in the registers at the top of the frame, evaluated from right to left
+    int first = next_register;
+    for (size_t i = 0; i < parameter_count; i++)
+        new_register();
+    for (size_t i = parameter_count; i-- > 0;)
+    {
+        compile_expression(argument_list->children[i], first + i);
+        next_register = first + parameter_count;
+    }
+
+    next_register = first;
+    int dst = destination(target);
+    emit(BC_CALL, dst, symbol->sequence_number, first);
+    return dst;
+}
+
+static int compile_binary_expression(node_t *expression, int target)
+{
+    int first = next_register;
+    char operator = *(char *) expression->data;
+    node_t *left = expression->children[0];
+    node_t *right = expression->children[1];
+
+    // Small constants on the right are immediates, except for division
+    if (right->type == NUMBER_DATA && operator != '/')
+    {
+        int64_t value = *(int64_t *) right->data;
+        if (operator == '-' && value != INT64_MIN)
+            value = -value;
+        if (fits_immediate(value))
+        {
+            int lhs = compile_expression(left, -1);
+            next_register = first;
+            int dst = destination(target);
+            emit(operator == '*' ? BC_MUL_INT : BC_ADD_INT, dst, lhs, value);
+            return dst;
+        }
+    }
+
+    // The unoptimized generator evaluates the RHS first for - and /, and the LHS first otherwise
+    int lhs, rhs;
+    if (operator == '-' || operator == '/')
+    {
+        rhs = compile_expression(right, -1);
+        lhs = compile_expression(left, -1);
+    }
+    else
+    {
+        lhs = compile_expression(left, -1);
+        rhs = compile_expression(right, -1);
+    }
+
+    bc_opcode_t opcode;
+    switch (operator)
+    {
+        case '+': opcode = BC_ADD; break;
+        case '-': opcode = BC_SUB; break;
+        case '*': opcode = BC_MUL; break;
+        case '/': opcode = BC_DIV; break;
+        default:
+            assert (false && "Unknown expression operation");
+            return -1;
+    }
+    next_register = first;
+    int dst = destination(target);
+    emit(opcode, dst, lhs, rhs);
+    return dst;
+}
+
+/* Emits the instructions evaluating the expression, and returns the register holding its value.
+ * With a target register, the value is placed there. Otherwise, variables are used where they are
+ */
+static int compile_expression(node_t *expression, int target)
+{
+    switch (expression->type)
+    {
+        case NUMBER_DATA:
+        {
+            int64_t value = *(int64_t *) expression->data;
+            int dst = destination(target);
+            if (fits_immediate(value))
+                emit(BC_LOAD_INT, dst, value, 0);
+            else
+                emit(BC_LOAD_CONSTANT, dst, add_constant(value), 0);
+            return dst;
+        }
+        case IDENTIFIER_DATA:
+        {
+            symbol_t *symbol = get_variable_symbol(expression);
+            if (symbol->type == SYMBOL_GLOBAL_VAR)
+            {
+                int dst = destination(target);
+                emit(BC_LOAD_GLOBAL, dst, global_offsets[symbol->sequence_number], 0);
+                return dst;
+            }
+            if (target >= 0 && target != (int) symbol->sequence_number)
+                emit(BC_MOVE, target, symbol->sequence_number, 0);
+            return target >= 0 ? target : (int) symbol->sequence_number;
+        }
+        case ARRAY_INDEXING:
+        {
+            symbol_t *symbol = get_array_symbol(expression);
+            int first = next_register;
+            int index = compile_expression(expression->children[1], -1);
+            next_register = first;
+            check_index(symbol, index);
+            int dst = destination(target);
+            emit(BC_LOAD_ELEMENT, dst, global_offsets[symbol->sequence_number], index);
+            return dst;
+        }
+        case EXPRESSION:
+        {
+            char *data = expression->data;
+            if (strcmp(data, "call") == 0)
+                return compile_function_call(expression, target);
+            if (expression->n_children == 1)
+            {
+                assert (strcmp(data, "-") == 0);
+                int first = next_register;
+                int operand = compile_expression(expression->children[0], -1);
+                next_register = first;
+                int dst = destination(target);
+                emit(BC_NEG, dst, operand, 0);
+                return dst;
+            }
+            return compile_binary_expression(expression, target);
+        }
+        default:
+            assert (false && "Unknown expression type");
+            return -1;
+    }
+}
+
+static void compile_assignment_statement(node_t *statement)
+{
+    node_t *dest = statement->children[0];
+    if (dest->type == ARRAY_INDEXING)
+    {
+        // The value is evaluated before the index, like in the unoptimized code generator
+        symbol_t *symbol = get_array_symbol(dest);
+        int value = compile_expression(statement->children[1], -1);
+        int index = compile_expression(dest->children[1], -1);
+        check_index(symbol, index);
+        emit(BC_STORE_ELEMENT, global_offsets[symbol->sequence_number], index, value);
+        return;
+    }
+
+    symbol_t *symbol = get_variable_symbol(dest);
+    if (symbol->type == SYMBOL_GLOBAL_VAR)
+    {
+        int value = compile_expression(statement->children[1], -1);
+        emit(BC_STORE_GLOBAL, global_offsets[symbol->sequence_number], value, 0);
+        return;
+    }
+    compile_expression(statement->children[1], symbol->sequence_number);
+}
+
+static void compile_print_statement(node_t *statement)
+{
+    for (size_t i = 0; i < statement->n_children; i++)
+    {
+        node_t *item = statement->children[i];
+        if (item->type == STRING_DATA)
+            emit(BC_PRINT_STRING, *(uint64_t *) item->data, 0, 0);
+        else
+        {
+            int value = compile_expression(item, -1);
+            emit(BC_PRINT_INT, value, 0, 0);
+            next_register = function->n_variables;
+        }
+    }
+    emit(BC_PRINT_NEWLINE, 0, 0, 0);
+}
+
+/* Emits a jump to be patched later, taken if the relation is as wanted */
+static size_t compile_relation(node_t *relation, bool jump_if_true)
+{
+    int lhs = compile_expression(relation->children[0], -1);
+    int rhs = compile_expression(relation->children[1], -1);
+
+    bc_opcode_t opcode;
+    switch (*(char *) relation->data)
+    {
+        case '=': opcode = jump_if_true ? BC_JUMP_EQ : BC_JUMP_NE; break;
+        case '!': opcode = jump_if_true ? BC_JUMP_NE : BC_JUMP_EQ; break;
+        case '<': opcode = jump_if_true ? BC_JUMP_LT : BC_JUMP_GE; break;
+        case '>': opcode = jump_if_true ? BC_JUMP_GT : BC_JUMP_LE; break;
+        default:
+            assert (false && "Unknown relation");
+            return 0;
+    }
+    return emit(opcode, lhs, rhs, -1);
+}
+
+static void patch_jump(size_t jump)
+{
+    bc_instruction_t *instruction = &program->code[jump];
+    if (instruction->opcode == BC_JUMP)
+        instruction->a = program->n_instructions;
+    else
+        instruction->c = program->n_instructions;
+}
+
+static void compile_if_statement(node_t *statement)
+{
+    size_t skip_then = compile_relation(statement->children[0], false);
+    next_register = function->n_variables;
+    compile_statement(statement->children[1]);
+    if (statement->n_children == 2)
+    {
+        patch_jump(skip_then);
+        return;
+    }
+
+    size_t skip_else = emit(BC_JUMP, -1, 0, 0);
+    patch_jump(skip_then);
+    compile_statement(statement->children[2]);
+    patch_jump(skip_else);
+}
+
+static void push_break_jump(size_t jump)
+{
+    if (n_break_jumps == break_jumps_capacity)
+    {
+        break_jumps_capacity = break_jumps_capacity * 2 + 8;
+        break_jumps = realloc(break_jumps, break_jumps_capacity * sizeof(size_t));
+    }
+    break_jumps[n_break_jumps++] = jump;
+}
+
+/* Points the breaks of the loop at the instruction following it */
+static void patch_break_jumps(size_t first)
+{
+    for (size_t i = first; i < n_break_jumps; i++)
+        patch_jump(break_jumps[i]);
+    n_break_jumps = first;
+}
+
+/* While loops test at the bottom, so each iteration dispatches a single branch */
+static void compile_while_statement(node_t *statement)
+{
+    size_t outer_breaks = n_break_jumps;
+    size_t to_test = emit(BC_JUMP, -1, 0, 0);
+    size_t body = program->n_instructions;
+    compile_statement(statement->children[1]);
+
+    patch_jump(to_test);
+    size_t back_edge = compile_relation(statement->children[0], true);
+    program->code[back_edge].c = body;
+    next_register = function->n_variables;
+    patch_break_jumps(outer_breaks);
+}
+
+static void compile_for_statement(node_t *statement)
+{
+    int counter = get_variable_symbol(statement->children[0])->sequence_number;
+    int end = statement->symbol->sequence_number;
+    compile_expression(statement->children[1], counter);
+    compile_expression(statement->children[2], end);
+    next_register = function->n_variables;
+
+    size_t outer_breaks = n_break_jumps;
+    size_t skip = emit(BC_JUMP_GE, counter, end, -1);
+    size_t body = program->n_instructions;
+    compile_statement(statement->children[3]);
+    emit(BC_FOR_LOOP, counter, end, body);
+    patch_jump(skip);
+    patch_break_jumps(outer_breaks);
+}
+
+static void compile_statement(node_t *node)
+{
+    switch (node->type)
+    {
+        case BLOCK:
+        {
+            node_t *statement_list = node->children[node->n_children - 1];
+            for (size_t i = 0; i < statement_list->n_children; i++)
+                compile_statement(statement_list->children[i]);
+            break;
+        }
+        case ASSIGNMENT_STATEMENT:
+            compile_assignment_statement(node);
+            break;
+        case PRINT_STATEMENT:
+            compile_print_statement(node);
+            break;
+        case RETURN_STATEMENT:
+            emit(BC_RETURN, compile_expression(node->children[0], -1), 0, 0);
+            break;
+        case IF_STATEMENT:
+            compile_if_statement(node);
+            break;
+        case WHILE_STATEMENT:
+            compile_while_statement(node);
+            break;
+        case FOR_STATEMENT:
+            compile_for_statement(node);
+            break;
+        case BREAK_STATEMENT:
+            push_break_jump(emit(BC_JUMP, -1, 0, 0));
+            break;
+        default:
+            assert (false && "Unknown statement type");
+    }
+    next_register = function->n_variables;
+}
+
+static void compile_function(symbol_t *symbol)
+{
+    function->symbol = symbol;
+    function->start = program->n_instructions;
+    function->n_parameters = symbol->node->children[1]->n_children;
+    function->n_variables = symbol->function_symtable->n_symbols;
+    function->frame_size = function->n_variables;
+    next_register = function->n_variables;
+
+    compile_statement(symbol->node->children[2]);
+
+    // In case the function didn't return, return 0 here
+    int zero = new_register();
+    emit(BC_LOAD_INT, zero, 0, 0);
+    emit(BC_RETURN, zero, 0, 0);
+}
+
+/* Lays the globals out like the .bss section, so indexing out of bounds reaches the same neighbours */
+static void lay_out_globals(void)
+{
+    global_offsets = malloc(global_symbols->n_symbols * sizeof(size_t) + 1);
+    for (size_t i = 0; i < global_symbols->n_symbols; i++)
+    {
+        symbol_t *symbol = global_symbols->symbols[i];
+        global_offsets[i] = program->n_globals;
+        if (symbol->type == SYMBOL_GLOBAL_VAR)
+            program->n_globals++;
+        else if (symbol->type == SYMBOL_GLOBAL_ARRAY)
+        {
+            if (symbol->node->children[1]->type != NUMBER_DATA)
+            {
+                fprintf(stderr, "error: length of array '%s' is not compile time known", symbol->name);
+                exit(EXIT_FAILURE);
+            }
+            program->n_globals += *(int64_t *) symbol->node->children[1]->data;
+        }
+    }
+}
+
+bc_program_t *bc_compile_program(void)
+{
+    program = calloc(1, sizeof(bc_program_t));
+    lay_out_globals();
+
+    program->n_strings = string_list_len;
+    program->strings = malloc(string_list_len * sizeof(char *) + 1);
+    for (size_t i = 0; i < string_list_len; i++)
+    {
+        size_t length;
+        program->strings[i] = (char *) decode_string_literal(string_list[i], &length);
+    }
+
+    // Functions are numbered by their global sequence number, so calls need no lookup
+    program->n_functions = global_symbols->n_symbols;
+    program->functions = calloc(global_symbols->n_symbols + 1, sizeof(bc_function_t));
+    bool found_function = false;
+    for (size_t i = 0; i < global_symbols->n_symbols; i++)
+    {
+        symbol_t *symbol = global_symbols->symbols[i];
+        if (symbol->type != SYMBOL_FUNCTION)
+            continue;
+        function = &program->functions[i];
+        compile_function(symbol);
+        found_function = true;
+    }
+    if (!found_function)
+    {
+        fprintf(stderr, "error: program contained no functions\n");
+        exit(EXIT_FAILURE);
+    }
+
+    free(global_offsets);
+    free(break_jumps);
+    break_jumps = NULL;
+    n_break_jumps = break_jumps_capacity = 0;
+    function = NULL;
+
+    bc_program_t *result = program;
+    program = NULL;
+    return result;
+}
+
+void bc_destroy_program(bc_program_t *program)
+{
+    for (size_t i = 0; i < program->n_strings; i++)
+        free(program->strings[i]);
+    free(program->strings);
+    free(program->functions);
+    free(program->constants);
+    free(program->code);
+    free(program);
+}
@@ -0,0 +1,239 @@
+#include <vslc.h>
+#include "assembler.h"
+
+/* Writes assembled objects as ELF64 relocatable object files for x86-64, ready for the linker.
+ * The file has the three sections of the program, a symbol table, the relocations of .text,
+ * and a note telling the linker that the stack need not be executable.
+ * Everything is written little endian, with the section headers last.
+ */
+
+// The section headers, in the order they are written
+typedef enum
+{
+    HEADER_NULL, HEADER_TEXT, HEADER_RODATA, HEADER_BSS, HEADER_NOTE, HEADER_RELA, HEADER_SYMTAB,
+    HEADER_STRTAB, HEADER_SHSTRTAB, NUM_HEADERS
+} header_t;
+
+static const char *HEADER_NAMES[NUM_HEADERS] = {
+    "", ".text", ".rodata", ".bss", ".note.GNU-stack", ".rela.text", ".symtab", ".strtab", ".shstrtab"
+};
+
+#define ELF_HEADER_SIZE 64
+#define SECTION_HEADER_SIZE 64
+#define SYMBOL_SIZE 24
+#define RELOCATION_SIZE 24
+
+#define SHT_PROGBITS 1
+#define SHT_SYMTAB 2
+#define SHT_STRTAB 3
+#define SHT_RELA 4
+#define SHT_NOBITS 8
+
+#define SHF_WRITE 0x1
+#define SHF_ALLOC 0x2
+#define SHF_EXECINSTR 0x4
+#define SHF_INFO_LINK 0x40
+
+#define STB_LOCAL 0
+#define STB_GLOBAL 1
+#define STT_NOTYPE 0
+#define STT_SECTION 3
+
+#define R_X86_64_PC32 2
+#define R_X86_64_PLT32 4
+
+typedef struct bytes
+{
+    uint8_t *data;
+    size_t length, capacity;
+} bytes_t;
+
+typedef struct section_header
+{
+    uint32_t name, type;
+    uint64_t flags, offset, size;
+    uint32_t link, info;
+    uint64_t alignment, entry_size;
+} section_header_t;
+
+static void put(bytes_t *bytes, uint64_t value, int size)
+{
+    if (bytes->length + size > bytes->capacity)
+    {
+        bytes->capacity = bytes->capacity * 2 + size + 256;
+        bytes->data = realloc(bytes->data, bytes->capacity);
+    }
+    for (int i = 0; i < size; i++)
+        bytes->data[bytes->length++] = (uint8_t) (value >> (8 * i));
+}
+
+static void put_data(bytes_t *bytes, const void *data, size_t size)
+{
+    for (size_t i = 0; i < size; i++)
+        put(bytes, ((const uint8_t *) data)[i], 1);
+}
+
+static void pad_to(bytes_t *bytes, uint64_t alignment)
+{
+    while (bytes->length % alignment != 0)
+        put(bytes, 0, 1);
+}
+
+/* Adds the string to a string table, returning its offset */
+static uint32_t put_string(bytes_t *table, const char *string)
+{
+    uint32_t offset = table->length;
+    put_data(table, string, strlen(string) + 1);
+    return offset;
+}
+
+static void put_symbol(bytes_t *symtab, uint32_t name, int binding, int type, uint16_t section, uint64_t value)
+{
+    put(symtab, name, 4);
+    put(symtab, (binding << 4) | type, 1);
+    put(symtab, 0, 1);
+    put(symtab, section, 2);
+    put(symtab, value, 8);
+    put(symtab, 0, 8);
+}
+
+void write_elf_object(object_t *object, FILE *file)
+{
+    bytes_t strtab = {0}, symtab = {0}, rela = {0}, shstrtab = {0};
+    put(&strtab, 0, 1);
+
+    // Local symbols must come before the global ones: first the sections, then the labels
+    size_t *indices = malloc(object->n_symbols * sizeof(size_t) + 1);
+    size_t n_written = 0;
+    put_symbol(&symtab, 0, STB_LOCAL, STT_NOTYPE, 0, 0);
+    n_written++;
+    for (int s = 0; s < NUM_SECTIONS; s++, n_written++)
+        put_symbol(&symtab, 0, STB_LOCAL, STT_SECTION, HEADER_TEXT + s, 0);
+    for (size_t i = 0; i < object->n_symbols; i++)
+    {
+        object_symbol_t *symbol = &object->symbols[i];
+        if (symbol->global || symbol->section < 0)
+            continue;
+        put_symbol(&symtab, put_string(&strtab, symbol->name), STB_LOCAL, STT_NOTYPE,
+                   HEADER_TEXT + symbol->section, symbol->offset);
+        indices[i] = n_written++;
+    }
+    size_t first_global = n_written;
+
+    // Symbols only referenced are global, and left undefined for the linker
+    for (size_t i = 0; i < object->n_symbols; i++)
+    {
+        object_symbol_t *symbol = &object->symbols[i];
+        if (!symbol->global && symbol->section >= 0)
+            continue;
+        bool defined = symbol->section >= 0;
+        put_symbol(&symtab, put_string(&strtab, symbol->name), STB_GLOBAL, STT_NOTYPE,
+                   defined ? HEADER_TEXT + symbol->section : 0, defined ? symbol->offset : 0);
+        indices[i] = n_written++;
+    }
+
+    for (size_t i = 0; i < object->n_relocations; i++)
+    {
+        object_relocation_t *relocation = &object->relocations[i];
+        assert(relocation->section == SECTION_TEXT);
+        uint64_t symbol = relocation->target_section >= 0 ? 1 + relocation->target_section
+                                                          : indices[relocation->symbol];
+        uint64_t type = relocation->type == RELOCATION_PLT32 ? R_X86_64_PLT32 : R_X86_64_PC32;
+        put(&rela, relocation->offset, 8);
+        put(&rela, (symbol << 32) | type, 8);
+        put(&rela, (uint64_t) relocation->addend, 8);
+    }
+    free(indices);
+
+    section_header_t headers[NUM_HEADERS] = {{0}};
+    for (int h = 0; h < NUM_HEADERS; h++)
+        headers[h].name = put_string(&shstrtab, HEADER_NAMES[h]);
+
+    headers[HEADER_TEXT].type = SHT_PROGBITS;
+    headers[HEADER_TEXT].flags = SHF_ALLOC | SHF_EXECINSTR;
+    headers[HEADER_RODATA].type = SHT_PROGBITS;
+    headers[HEADER_RODATA].flags = SHF_ALLOC;
+    headers[HEADER_BSS].type = SHT_NOBITS;
+    headers[HEADER_BSS].flags = SHF_WRITE | SHF_ALLOC;
+    for (int s = 0; s < NUM_SECTIONS; s++)
+    {
+        headers[HEADER_TEXT + s].size = object->sizes[s];
+        headers[HEADER_TEXT + s].alignment = object->alignments[s];
+    }
+    headers[HEADER_NOTE].type = SHT_PROGBITS;
+    headers[HEADER_NOTE].alignment = 1;
+
+    headers[HEADER_RELA] = (section_header_t) {
+        .name = headers[HEADER_RELA].name, .type = SHT_RELA, .flags = SHF_INFO_LINK, .size = rela.length,
+        .link = HEADER_SYMTAB, .info = HEADER_TEXT, .alignment = 8, .entry_size = RELOCATION_SIZE
+    };
+    headers[HEADER_SYMTAB] = (section_header_t) {
+        .name = headers[HEADER_SYMTAB].name, .type = SHT_SYMTAB, .size = symtab.length,
+        .link = HEADER_STRTAB, .info = first_global, .alignment = 8, .entry_size = SYMBOL_SIZE
+    };
+    headers[HEADER_STRTAB] = (section_header_t) {
+        .name = headers[HEADER_STRTAB].name, .type = SHT_STRTAB, .size = strtab.length, .alignment = 1
+    };
+    headers[HEADER_SHSTRTAB] = (section_header_t) {
+        .name = headers[HEADER_SHSTRTAB].name, .type = SHT_STRTAB, .size = shstrtab.length, .alignment = 1
+    };
+
+    // The file is the ELF header, the contents of the sections, and then the section headers
+    bytes_t contents = {0};
+    const uint8_t *section_data[NUM_HEADERS] = {
+        [HEADER_TEXT] = object->contents[SECTION_TEXT], [HEADER_RODATA] = object->contents[SECTION_RODATA],
+        [HEADER_RELA] = rela.data, [HEADER_SYMTAB] = symtab.data, [HEADER_STRTAB] = strtab.data,
+        [HEADER_SHSTRTAB] = shstrtab.data
+    };
+    put_data(&contents, (uint8_t[ELF_HEADER_SIZE]) {0}, ELF_HEADER_SIZE);
+    for (int h = HEADER_TEXT; h < NUM_HEADERS; h++)
+    {
+        pad_to(&contents, headers[h].alignment);
+        headers[h].offset = contents.length;
+        if (headers[h].type != SHT_NOBITS)
+            put_data(&contents, section_data[h], headers[h].size);
+    }
+    pad_to(&contents, 8);
+    uint64_t headers_offset = contents.length;
+    for (int h = 0; h < NUM_HEADERS; h++)
+    {
+        put(&contents, headers[h].name, 4);
+        put(&contents, headers[h].type, 4);
+        put(&contents, headers[h].flags, 8);
+        put(&contents, 0, 8);
+        put(&contents, headers[h].offset, 8);
+        put(&contents, headers[h].size, 8);
+        put(&contents, headers[h].link, 4);
+        put(&contents, headers[h].info, 4);
+        put(&contents, headers[h].alignment, 8);
+        put(&contents, headers[h].entry_size, 8);
+    }
+
+    // 64 bit, little endian, version 1, System V
+    bytes_t header = {0};
+    put_data(&header, "\177ELF\2\1\1", 7);
+    put_data(&header, (uint8_t[9]) {0}, 9);
+    put(&header, 1, 2);                      // ET_REL
+    put(&header, 62, 2);                     // EM_X86_64
+    put(&header, 1, 4);
+    put(&header, 0, 8);                      // No entry point
+    put(&header, 0, 8);                      // No program headers
+    put(&header, headers_offset, 8);
+    put(&header, 0, 4);
+    put(&header, ELF_HEADER_SIZE, 2);
+    put(&header, 0, 2);
+    put(&header, 0, 2);
+    put(&header, SECTION_HEADER_SIZE, 2);
+    put(&header, NUM_HEADERS, 2);
+    put(&header, HEADER_SHSTRTAB, 2);
+    memcpy(contents.data, header.data, ELF_HEADER_SIZE);
+
+    fwrite(contents.data, 1, contents.length, file);
+
+    free(header.data);
+    free(contents.data);
+    free(strtab.data);
+    free(symtab.data);
+    free(rela.data);
+    free(shstrtab.data);
+}
@@ -3,12 +3,27 @@
 // This header defines a bunch of macros we can use to emit assembly to stdout
 #include "emit.h"
 
+// The intermediate representation used by the optimizing code generator, with -O
+#include "ir.h"
+
+// The format strings print statements are compiled into
+#include "print_format.h"
+
+// The kernels of vectorized loops, emitted along with the optimized functions
+#include "vectorize.h"
+
+// The counters of -fprofile-generate
+#include "profile.h"
+
 // In the System V calling convention, the first 6 integer parameters are passed in registers
 #define NUM_REGISTER_PARAMS 6
 static const char *REGISTER_PARAMS[6] = {RDI, RSI, RDX, RCX, R8, R9};
 static int global_if_counter = 0;
 static int global_while_counter = 0;
 
+// With -O, the IR of every function, indexed by global symbol sequence number
+static ir_function_t **optimized_functions = NULL;
+
 typedef struct while_stack
 {
     int *stack;
@@ -75,6 +90,8 @@ static void generate_global_variables(void);
 
 static void generate_function(symbol_t *function);
 
+static void generate_optimized_function(symbol_t *function);
+
 static void generate_expression(node_t *expression);
 
 static void generate_statement(node_t *node);
@@ -85,10 +102,14 @@ static void generate_main(symbol_t *first);
 void generate_program(void)
 {
     generate_stringtable();
+    generate_runtime();
     generate_global_variables();
+    asm_flush();
     while_stack = while_init();
     
     DIRECTIVE (".text");
+    if (optimize_generated_code)
+        optimized_functions = ir_lower_program();
     symbol_t *first_function = NULL;
     for (size_t i = 0; i < global_symbols->n_symbols; i++)
     {
@@ -97,8 +118,14 @@ void generate_program(void)
             continue;
         if (!first_function)
             first_function = symbol;
-        generate_function(symbol);
+        if (optimize_generated_code)
+            generate_optimized_function(symbol);
+        else
+            generate_function(symbol);
+        asm_flush();
     }
+    if (optimize_generated_code)
+        ir_destroy_program(optimized_functions);
     
     if (first_function == NULL)
     {
@@ -106,6 +133,9 @@ void generate_program(void)
         exit(EXIT_FAILURE);
     }
     generate_main(first_function);
+    generate_print_formats();
+    generate_vector_constants();
+    asm_flush();
     destroy_while(while_stack);
 }
 
@@ -113,9 +143,6 @@ void generate_program(void)
 static void generate_stringtable(void)
 {
     DIRECTIVE (".section %s", ASM_STRING_SECTION);
-    // These strings are used by printf
-    DIRECTIVE ("intout: .asciz \"%s\"", "%ld ");
-    DIRECTIVE ("strout: .asciz \"%s\"", "%s ");
     // This string is used by the entry point-wrapper
     DIRECTIVE ("errout: .asciz \"%s\"", "Wrong number of arguments");
     
@@ -179,6 +206,19 @@ static void generate_function(symbol_t *function)
     RET;
 }
 
+/* Generates code from the optimized IR of the function */
+static void generate_optimized_function(symbol_t *function)
+{
+    generate_ir_function(optimized_functions[function->sequence_number]);
+}
+
+/* With -fprofile-generate, emits the increment of the counter of the site */
+static void generate_profile_count(node_t *site, profile_counter_t counter)
+{
+    if (profile_generate_path != NULL)
+        generate_profile_increment(profile_counter(site, counter));
+}
+
 static void generate_function_call(node_t *call)
 {
     symbol_t *symbol = call->children[0]->symbol;
@@ -209,6 +249,7 @@ static void generate_function_call(node_t *call)
     for (size_t i = 0; i < parameter_count && i < NUM_REGISTER_PARAMS; i++)
     POPQ (REGISTER_PARAMS[i]);
     
+    generate_profile_count(call, PROFILE_REACHED);
     EMIT ("call .%s", symbol->name);
     
     // Now pop away any stack passed parameters still left on the stack, by moving %rsp upwards
@@ -216,14 +257,11 @@ static void generate_function_call(node_t *call)
     EMIT ("addq $%d, %s", (parameter_count - NUM_REGISTER_PARAMS) * 8, RSP);
 }
 
-/* Returns a string for accessing the quadword referenced by node */
-static const char *generate_variable_access(node_t *node)
+/* Returns a string for accessing the quadword holding the variable */
+static const char *generate_symbol_access(symbol_t *symbol)
 {
     static char result[100];
     
-    assert (node->type == IDENTIFIER_DATA);
-    
-    symbol_t *symbol = node->symbol;
     switch (symbol->type)
     {
         case SYMBOL_GLOBAL_VAR:
@@ -266,6 +304,13 @@ static const char *generate_variable_access(node_t *node)
     }
 }
 
+/* Returns a string for accessing the quadword referenced by node */
+static const char *generate_variable_access(node_t *node)
+{
+    assert (node->type == IDENTIFIER_DATA);
+    return generate_symbol_access(node->symbol);
+}
+
 /* Returns a string for accessing the quadword referenced by the ARRAY_INDEXING node.
  * Code for evaluating the index will be emitted, which can potentially mess with all registers.
  * The resulting memory access string will not make use of the %rax register.
@@ -283,6 +328,13 @@ static const char *generate_array_access(node_t *node)
     
     // Calculate the index of the array into %rax
     generate_expression(node->children[1]);
+
+    // Negative indices are above the length when compared as unsigned, so one comparison covers both ends
+    if (check_array_bounds)
+    {
+        EMIT ("cmpq $%ld, %s", *(int64_t *) symbol->node->children[1]->data, RAX);
+        EMIT ("jae bounds_error");
+    }
     
     // Place the base of the array into %r10
     EMIT ("leaq .%s(%s), %s", symbol->name, RIP, R10);
@@ -389,27 +441,31 @@ static void generate_assignment_statement(node_t *statement)
     }
 }
 
+/* Prints the items in chunks, each with one call to printf or puts, see print_format.h.
+ * The integers of a chunk are pushed as they are evaluated, and popped into the argument registers after the format
+ */
 static void generate_print_statement(node_t *statement)
 {
-    for (size_t i = 0; i < statement->n_children; i++)
+    for (size_t first = 0; first < statement->n_children;)
     {
-        node_t *item = statement->children[i];
-        if (item->type == STRING_DATA)
+        size_t end = print_chunk_end(statement, first);
+        size_t n_values = 0;
+        for (size_t i = first; i < end; i++)
         {
-            EMIT ("leaq strout(%s), %s", RIP, RDI);
-            EMIT ("leaq string%ld(%s), %s", *(uint64_t *) item->data, RIP, RSI);
+            if (statement->children[i]->type == STRING_DATA)
+                continue;
+            generate_expression(statement->children[i]);
+            PUSHQ (RAX);
+            n_values++;
         }
-        else
-        {
-            generate_expression(item);
-            MOVQ (RAX, RSI);
-            EMIT ("leaq intout(%s), %s", RIP, RDI);
-        }
-        EMIT ("call safe_printf");
+        while (n_values > 0)
+            POPQ (REGISTER_PARAMS[n_values--]);
+        
+        size_t format = add_print_format(statement, first, end);
+        EMIT ("leaq format%zu(%s), %s", format, RIP, RDI);
+        EMIT ("call %s", print_format_is_line(format) ? "print_line" : "print_formatted");
+        first = end;
     }
-    
-    MOVQ ("$'\\n'", RDI);
-    EMIT ("call putchar");
 }
 
 static void generate_return_statement(node_t *statement)
@@ -470,6 +526,7 @@ static void generate_if_statement(node_t *statement)
     // so consider using a global counter. Remember that
     
     int unique_code = global_if_counter++;
+    generate_profile_count(statement, PROFILE_REACHED);
     switch (statement->n_children)
     {
         //if_statement -> IF relation THEN statement
@@ -477,6 +534,7 @@ static void generate_if_statement(node_t *statement)
         {
             const char *label = "_IFTHENEND";
             generate_relation(statement->children[0], label, unique_code);
+            generate_profile_count(statement, PROFILE_TAKEN);
             
             generate_statement(statement->children[1]);
             LABEL("%s%d", label, unique_code);
@@ -488,6 +546,7 @@ static void generate_if_statement(node_t *statement)
             const char *else_label = "_IFTHENELSE";
             const char *end_label = "_IFTHENELSEEND";
             generate_relation(statement->children[0], else_label, unique_code);
+            generate_profile_count(statement, PROFILE_TAKEN);
             generate_statement(statement->children[1]);
             JMP(end_label, unique_code);
             LABEL("%s%d", else_label, unique_code);
@@ -512,14 +571,52 @@ static void generate_while_statement(node_t *statement)
     int unique_code = global_while_counter++;
     push_while(unique_code);
     
+    generate_profile_count(statement, PROFILE_REACHED);
     LABEL("%s%d", start_label, unique_code);
     generate_relation(statement->children[0], end_label, unique_code);
+    generate_profile_count(statement, PROFILE_TAKEN);
     generate_statement(statement->children[1]);
     JMP(start_label, unique_code);
     LABEL("%s%d", end_label, unique_code);
     pop_while();
 }
 
+static void generate_for_statement(node_t *statement)
+{
+    //for_statement -> FOR identifier IN expression '..' expression DO statement
+    // The end value is evaluated once, into a hidden variable, and the loop tests at the bottom,
+    // after a test in front deciding whether to enter it at all.
+    // The labels are shared with while loops, so break jumps past the end of either
+    const char *body_label = "_WHILE";
+    const char *end_label = "_WHILEEND";
+    int unique_code = global_while_counter++;
+    push_while(unique_code);
+    
+    char counter[100], end[100];
+    strcpy(counter, generate_variable_access(statement->children[0]));
+    strcpy(end, generate_symbol_access(statement->symbol));
+    
+    generate_profile_count(statement, PROFILE_REACHED);
+    generate_expression(statement->children[1]);
+    MOVQ(RAX, counter);
+    generate_expression(statement->children[2]);
+    MOVQ(RAX, end);
+    MOVQ(counter, RAX);
+    CMPQ(end, RAX);
+    JGE(end_label, unique_code);
+    
+    LABEL("%s%d", body_label, unique_code);
+    generate_profile_count(statement, PROFILE_TAKEN);
+    generate_statement(statement->children[3]);
+    MOVQ(counter, RAX);
+    INCQ(RAX);
+    MOVQ(RAX, counter);
+    CMPQ(end, RAX);
+    JL(body_label, unique_code);
+    LABEL("%s%d", end_label, unique_code);
+    pop_while();
+}
+
 static void generate_break_statement()
 {
     // TODO (2.3):
@@ -557,6 +654,9 @@ static void generate_statement(node_t *node)
         case WHILE_STATEMENT:
             generate_while_statement(node);
             break;
+        case FOR_STATEMENT:
+            generate_for_statement(node);
+            break;
         case BREAK_STATEMENT:
             generate_break_statement();
             break;
@@ -565,26 +665,6 @@ static void generate_statement(node_t *node)
     }
 }
 
-static void generate_safe_printf(void)
-{
-    LABEL ("safe_printf");
-    
-    // This is the hack that used to work
-    //MOVQ ( "$0", RAX );
-    //JMP ( "printf" );
-    
-    PUSHQ (RBP);
-    MOVQ (RSP, RBP);
-    // This is a bitmask that abuses how negative numbers work, to clear the last 4 bits
-    // A stack pointer that is not 16-byte aligned, will be moved down to a 16-byte boundary
-    ANDQ ("$-16", RSP);
-    EMIT ("call printf");
-    // Cleanup the stack back to how it was
-    MOVQ (RBP, RSP);
-    POPQ (RBP);
-    RET;
-}
-
 static void generate_main(symbol_t *first)
 {
     // Make the globally available main function
@@ -593,6 +673,9 @@ static void generate_main(symbol_t *first)
     // Save old base pointer, and set new base pointer
     PUSHQ (RBP);
     MOVQ (RSP, RBP);
+
+    // Before anything is printed, so prints know whether to write their lines out right away
+    EMIT ("call find_terminal");
     
     // Which registers argc and argv are passed in
     const char *argc = RDI;
@@ -619,11 +702,9 @@ static void generate_main(symbol_t *first)
     PUSHQ (argv); // push registers to caller save them
     PUSHQ (RCX);
     
-    // Now call strtol to parse the argument
-    EMIT ("movq (%s), %s", argv, RDI); // 1st argument, the char *
-    MOVQ ("$0", RSI); // 2nd argument, a null pointer
-    MOVQ ("$10", RDX); //3rd argument, we want base 10
-    EMIT ("call strtol");
+    // Now call parse_integer from the runtime to parse the argument
+    EMIT ("movq (%s), %s", argv, RDI);
+    EMIT ("call parse_integer");
     
     // Restore caller saved registers
     POPQ (RCX);
@@ -641,16 +722,14 @@ static void generate_main(symbol_t *first)
 
 EMIT ("call .%s", first->name);
     MOVQ (RAX, RDI); // Move the return value of the function into RDI
-    EMIT ("call exit"); // Exit with the return value as exit code
+    EMIT ("call exit_program"); // Exit with the return value as exit code
     
     LABEL ("ABORT"); // In case of incorrect number of arguments
     EMIT ("leaq errout(%s), %s", RIP, RDI);
-    EMIT ("call puts"); // print the errout string
+    EMIT ("call print_line"); // print the errout string
     MOVQ ("$1", RDI);
-    EMIT ("call exit"); // Exit with return code 1
-    
-    generate_safe_printf();
+    EMIT ("call exit_program"); // Exit with return code 1
     
-    // Declares global symbols we use or emit, such as main, printf and putchar
+    // Declares the global symbols we emit, which is main
     DIRECTIVE ("%s", ASM_DECLARE_SYMBOLS);
 }
@@ -0,0 +1,360 @@
+#include <vslc.h>
+#include "ir.h"
+
+/* Global value numbering, on a function in SSA form.
+ * The blocks are visited down the dominator tree, with a scoped hash table of the values computed by the blocks
+ * dominating the current one. An instruction computing a value already in the table becomes a copy of it,
+ * which copy propagation removes afterwards.
+ * Loads of global variables and array elements are values too, as long as nothing could have stored to them
+ * since. Every variable and array has a generation, which a store to it, or a call, moves on, and loads only
+ * match loads and stores from the same generation. Entering a block moves on the generations of what is stored
+ * on the paths to it from its immediate dominator, other than through it. Stores give the value they store to
+ * the loads after them.
+ */
+
+// What an instruction computes, from its opcode and the value numbers of its operands
+typedef struct value_key
+{
+    uint8_t opcode;
+    int32_t symbol;
+    ir_operand_t a, b, base;
+} value_key_t;
+
+typedef struct value_entry
+{
+    value_key_t key;
+    ir_operand_t value;  // The register or constant holding it
+    int64_t generation;  // Of the variable or array, for loads
+    size_t bucket;
+    int next;            // The next entry in the same bucket, or -1
+} value_entry_t;
+
+static ir_function_t *function;
+static ir_cfg_t *cfg;
+static ir_operand_t *leaders;   // The value number of each register, the first register or constant holding it
+
+static value_entry_t *entries;  // A stack, popped when leaving a block's subtree of the dominator tree
+static size_t n_entries, entries_capacity;
+static int *buckets;            // The last entry pushed into each bucket, or -1
+static size_t n_buckets;
+
+static int64_t *generations;    // Indexed by global symbol sequence number
+static int64_t last_generation;
+
+static int **children;          // Of each block in the dominator tree
+static size_t *n_children;
+static uint64_t **stored;       // The global symbols stored to in each block, all of them if it calls a function
+static size_t symbol_words;
+static bool changed;
+
+static ir_operand_t value_number(ir_operand_t operand)
+{
+    return IR_IS_REGISTER(operand) ? leaders[operand] : operand;
+}
+
+static bool is_load(uint8_t opcode)
+{
+    return opcode == IR_LOAD_GLOBAL || opcode == IR_LOAD_ELEMENT;
+}
+
+/* Returns true if the instruction only computes its dst from its operands, and the variables and arrays,
+ * so another one computing the same can be reused
+ */
+static bool is_numbered(ir_instruction_t *instruction)
+{
+    switch (instruction->opcode)
+    {
+        case IR_ADD:
+        case IR_SUB:
+        case IR_MUL:
+        case IR_DIV:
+        case IR_NEG:
+        case IR_ADDRESS:
+        case IR_LOAD_GLOBAL:
+        case IR_LOAD_ELEMENT:
+            return true;
+        default:
+            return false;
+    }
+}
+
+/* Stores are keyed like the loads they give their value to. Element accesses counting from an address in a
+ * register are keyed by the address, and only match accesses counting from the same one
+ */
+static value_key_t make_key(ir_instruction_t *instruction)
+{
+    value_key_t key = {
+        .opcode = instruction->opcode, .symbol = 0, .a = IR_NO_OPERAND, .b = IR_NO_OPERAND, .base = IR_NO_OPERAND
+    };
+    switch (instruction->opcode)
+    {
+        case IR_STORE_GLOBAL:
+            key.opcode = IR_LOAD_GLOBAL;
+            // Fall through
+        case IR_LOAD_GLOBAL:
+        case IR_ADDRESS:
+            key.symbol = instruction->symbol;
+            break;
+        case IR_STORE_ELEMENT:
+            key.opcode = IR_LOAD_ELEMENT;
+            // Fall through
+        case IR_LOAD_ELEMENT:
+            key.symbol = instruction->symbol;
+            key.a = value_number(instruction->a);
+            if (instruction->base != IR_NO_OPERAND)
+                key.base = value_number(instruction->base);
+            break;
+        case IR_NEG:
+            key.a = value_number(instruction->a);
+            break;
+        default:
+            key.a = value_number(instruction->a);
+            key.b = value_number(instruction->b);
+            if ((instruction->opcode == IR_ADD || instruction->opcode == IR_MUL) && key.a > key.b)
+            {
+                ir_operand_t swap = key.a;
+                key.a = key.b;
+                key.b = swap;
+            }
+            break;
+    }
+    return key;
+}
+
+static size_t hash_key(value_key_t key)
+{
+    uint64_t hash = key.opcode;
+    hash = hash * 31 + (uint32_t) key.symbol;
+    hash = hash * 31 + (uint32_t) key.a;
+    hash = hash * 31 + (uint32_t) key.b;
+    hash = hash * 31 + (uint32_t) key.base;
+    return (hash ^ (hash >> 17)) & (n_buckets - 1);
+}
+
+/* Returns the entry of the value, or NULL if it isn't computed by the blocks dominating the current one,
+ * or is a load from an older generation
+ */
+static value_entry_t *find_value(value_key_t key)
+{
+    for (int e = buckets[hash_key(key)]; e >= 0; e = entries[e].next)
+    {
+        value_entry_t *entry = &entries[e];
+        if (entry->key.opcode != key.opcode || entry->key.symbol != key.symbol || entry->key.a != key.a
+            || entry->key.b != key.b || entry->key.base != key.base)
+            continue;
+        if (is_load(key.opcode) && entry->generation != generations[key.symbol])
+            return NULL;
+        return entry;
+    }
+    return NULL;
+}
+
+static void push_value(value_key_t key, ir_operand_t value)
+{
+    if (n_entries == entries_capacity)
+    {
+        entries_capacity = entries_capacity * 2 + 64;
+        entries = realloc(entries, entries_capacity * sizeof(value_entry_t));
+    }
+    size_t bucket = hash_key(key);
+    entries[n_entries] = (value_entry_t) {
+        .key = key, .value = value, .generation = is_load(key.opcode) ? generations[key.symbol] : 0,
+        .bucket = bucket, .next = buckets[bucket]
+    };
+    buckets[bucket] = n_entries++;
+}
+
+static void pop_values(size_t n)
+{
+    while (n_entries > n)
+    {
+        n_entries--;
+        buckets[entries[n_entries].bucket] = entries[n_entries].next;
+    }
+}
+
+/* Moves on the generations of the symbols in the set */
+static void kill_stored(const uint64_t *set)
+{
+    for (size_t s = 0; s < global_symbols->n_symbols; s++)
+        if (IR_SET_CONTAINS(set, s))
+            generations[s] = ++last_generation;
+}
+
+/* Finds the symbols stored to in the blocks on the paths from the immediate dominator of the block to it,
+ * searching backwards from it. The block itself is only on them if it is in a loop the dominator is outside of
+ */
+static void find_stores_on_paths(int block, uint64_t *set)
+{
+    int dominator = cfg->immediate_dominator[block];
+    bool visited[cfg->n_blocks];
+    int worklist[cfg->n_blocks];
+    size_t n_worklist = 0;
+    memset(visited, 0, sizeof(visited));
+    visited[dominator] = true;
+    worklist[n_worklist++] = block;
+    while (n_worklist > 0)
+    {
+        int b = worklist[--n_worklist];
+        if (b != block || visited[block])
+            for (size_t w = 0; w < symbol_words; w++)
+                set[w] |= stored[b][w];
+        for (size_t k = 0; k < cfg->n_predecessors[b]; k++)
+        {
+            int predecessor = cfg->predecessors[b][k];
+            if (!visited[predecessor] && cfg->immediate_dominator[predecessor] >= 0)
+            {
+                visited[predecessor] = true;
+                worklist[n_worklist++] = predecessor;
+            }
+        }
+    }
+}
+
+static void number_instruction(ir_instruction_t *instruction)
+{
+    switch (instruction->opcode)
+    {
+        case IR_COPY:
+            leaders[instruction->dst] = value_number(instruction->a);
+            return;
+        case IR_STORE_GLOBAL:
+        case IR_STORE_ELEMENT:
+        {
+            // Stores to other elements of the array may be to the same one, through another index
+            generations[instruction->symbol] = ++last_generation;
+            ir_operand_t value = instruction->opcode == IR_STORE_GLOBAL ? instruction->a : instruction->b;
+            push_value(make_key(instruction), value_number(value));
+            return;
+        }
+        case IR_CALL:
+        case IR_VECTOR_LOOP:
+            // Called functions may store to any variable or array, and vector kernels store to arrays
+            for (size_t s = 0; s < global_symbols->n_symbols; s++)
+                generations[s] = ++last_generation;
+            return;
+        default:
+            break;
+    }
+    if (!is_numbered(instruction))
+        return;
+
+    value_key_t key = make_key(instruction);
+    value_entry_t *entry = find_value(key);
+    if (entry == NULL)
+    {
+        push_value(key, instruction->dst);
+        return;
+    }
+    leaders[instruction->dst] = entry->value;
+    *instruction = (ir_instruction_t) {
+        .opcode = IR_COPY, .dst = instruction->dst, .a = entry->value, .b = IR_NO_OPERAND, .base = IR_NO_OPERAND
+    };
+    changed = true;
+}
+
+/* Numbers the values of the block, and then of the blocks it immediately dominates */
+static void number_block(int block)
+{
+    size_t n_scope = n_entries;
+    int64_t saved[global_symbols->n_symbols + 1];
+    memcpy(saved, generations, global_symbols->n_symbols * sizeof(int64_t));
+
+    if (block != 0)
+    {
+        uint64_t set[symbol_words + 1];
+        memset(set, 0, sizeof(set));
+        find_stores_on_paths(block, set);
+        kill_stored(set);
+    }
+
+    ir_block_t *b = &function->blocks[block];
+    for (size_t j = 0; j < b->n_instructions; j++)
+        number_instruction(&b->instructions[j]);
+
+    // Each child leaves the generations as they were at the end of this block
+    for (size_t c = 0; c < n_children[block]; c++)
+        number_block(children[block][c]);
+
+    memcpy(generations, saved, global_symbols->n_symbols * sizeof(int64_t));
+    pop_values(n_scope);
+}
+
+/* Fills in the symbols stored to by each block, and the children of each block in the dominator tree */
+static void find_stores_and_children(void)
+{
+    size_t n_blocks = function->n_blocks;
+    symbol_words = IR_SET_WORDS(global_symbols->n_symbols);
+    stored = malloc(n_blocks * sizeof(uint64_t *));
+    children = malloc(n_blocks * sizeof(int *));
+    n_children = calloc(n_blocks, sizeof(size_t));
+    for (size_t i = 0; i < n_blocks; i++)
+    {
+        stored[i] = calloc(symbol_words + 1, sizeof(uint64_t));
+        ir_block_t *block = &function->blocks[i];
+        for (size_t j = 0; j < block->n_instructions; j++)
+        {
+            ir_instruction_t *instruction = &block->instructions[j];
+            if (instruction->opcode == IR_STORE_GLOBAL || instruction->opcode == IR_STORE_ELEMENT)
+                IR_SET_ADD(stored[i], instruction->symbol);
+            else if (instruction->opcode == IR_CALL || instruction->opcode == IR_VECTOR_LOOP)
+                memset(stored[i], 0xff, symbol_words * sizeof(uint64_t));
+        }
+    }
+    for (size_t r = 1; r < cfg->n_reachable; r++)
+        n_children[cfg->immediate_dominator[cfg->reverse_postorder[r]]]++;
+    for (size_t i = 0; i < n_blocks; i++)
+    {
+        children[i] = malloc((n_children[i] + 1) * sizeof(int));
+        n_children[i] = 0;
+    }
+    for (size_t r = 1; r < cfg->n_reachable; r++)
+    {
+        int block = cfg->reverse_postorder[r];
+        int dominator = cfg->immediate_dominator[block];
+        children[dominator][n_children[dominator]++] = block;
+    }
+}
+
+bool ir_number_values(ir_function_t *ir_function)
+{
+    function = ir_function;
+    cfg = ir_analyze_cfg(function);
+    find_stores_and_children();
+
+    leaders = malloc(function->n_registers * sizeof(ir_operand_t));
+    for (size_t r = 0; r < function->n_registers; r++)
+        leaders[r] = r;
+    size_t n_instructions = 0;
+    for (size_t i = 0; i < function->n_blocks; i++)
+        n_instructions += function->blocks[i].n_instructions;
+    for (n_buckets = 16; n_buckets < n_instructions * 2; n_buckets *= 2)
+        ;
+    buckets = malloc(n_buckets * sizeof(int));
+    for (size_t i = 0; i < n_buckets; i++)
+        buckets[i] = -1;
+    generations = calloc(global_symbols->n_symbols + 1, sizeof(int64_t));
+    last_generation = 0;
+    changed = false;
+
+    number_block(0);
+
+    for (size_t i = 0; i < function->n_blocks; i++)
+    {
+        free(stored[i]);
+        free(children[i]);
+    }
+    free(stored);
+    free(children);
+    free(n_children);
+    free(leaders);
+    free(buckets);
+    free(entries);
+    free(generations);
+    entries = NULL;
+    n_entries = entries_capacity = 0;
+    ir_destroy_cfg(cfg);
+    cfg = NULL;
+    function = NULL;
+    return changed;
+}
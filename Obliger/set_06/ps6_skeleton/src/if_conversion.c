@@ -0,0 +1,193 @@
+#include <vslc.h>
+#include "ir.h"
+
+/* If-conversion, on a function in SSA form.
+ * An if statement whose branches only compute values ends in a block with phis choosing between them.
+ * When the values are cheap, both are computed in front of the branch, and the phis become selects,
+ * which the code generator emits as a compare and a conditional move. The branch is gone, and so is its
+ * misprediction when the condition depends on the data in ways the processor can't predict.
+ */
+
+// What a branch the processor guesses wrong about half the time costs, in instructions.
+// Both sides of the if statement, and the selects, must not cost more than this to be worth it
+#define BRANCH_COST 8
+#define SELECT_COST 2
+
+static ir_function_t *function;
+static ir_cfg_t *cfg;
+
+/* Returns what running the instruction costs in the branchless form, or -1 if it can't run
+ * when its branch wasn't taken: it could trap or have effects, or might read past the end of an array
+ */
+static int speculation_cost(ir_instruction_t *instruction)
+{
+    switch (instruction->opcode)
+    {
+        case IR_COPY:
+        case IR_ADD:
+        case IR_SUB:
+        case IR_NEG:
+        case IR_ADDRESS:
+        case IR_LOAD_GLOBAL:
+            return 1;
+        case IR_MUL:
+            return 3;
+        case IR_DIV:
+            // Division by constants that can't trap is done by multiplication
+            return ir_may_trap(function, instruction) ? -1 : 4;
+        default:
+            return -1;
+    }
+}
+
+/* Returns the cost of the instructions of the side of the if statement, or -1 if they can't be speculated.
+ * The branch itself is its own side, when the if statement has no else
+ */
+static int side_cost(int branch, int side)
+{
+    if (side == branch)
+        return 0;
+    ir_block_t *block = &function->blocks[side];
+    int cost = 0;
+    for (size_t j = 0; j + 1 < block->n_instructions; j++)
+    {
+        int instruction_cost = speculation_cost(&block->instructions[j]);
+        if (instruction_cost < 0)
+            return -1;
+        cost += instruction_cost;
+    }
+    return cost;
+}
+
+/* Returns the value the phi takes when arriving from the block */
+static ir_operand_t phi_value(ir_instruction_t *phi, int predecessor)
+{
+    for (int32_t k = 0; k < phi->b; k++)
+        if (function->arguments[phi->a + 2 * k] == predecessor)
+            return function->arguments[phi->a + 2 * k + 1];
+    return IR_NO_OPERAND;
+}
+
+/* Finds the block the two sides of the branch meet in, and returns -1 if they don't meet right away.
+ * Each side is either a block only the branch jumps to, jumping on to the meeting block, or the branch block
+ * itself, when it jumps to the meeting block directly
+ */
+static int find_join(int branch, int sides[2])
+{
+    int targets[2];
+    for (int s = 0; s < 2; s++)
+    {
+        int side = function->blocks[branch].successors[s];
+        ir_block_t *block = &function->blocks[side];
+        if (side != 0 && cfg->n_predecessors[side] == 1
+            && block->instructions[block->n_instructions - 1].opcode == IR_JUMP)
+        {
+            sides[s] = side;
+            targets[s] = block->successors[0];
+        }
+        else
+        {
+            sides[s] = branch;
+            targets[s] = side;
+        }
+    }
+    int join = targets[0];
+    if (targets[1] != join || sides[0] == sides[1] || join == 0 || join == branch
+        || cfg->n_predecessors[join] != 2)
+        return -1;
+    return join;
+}
+
+/* Moves the instructions of the side, but not its jump, to the end of the branch block */
+static void speculate_side(int branch, int side)
+{
+    if (side == branch)
+        return;
+    ir_block_t *block = &function->blocks[side];
+    for (size_t j = 0; j + 1 < block->n_instructions; j++)
+        ir_insert_before_terminator(&function->blocks[branch], block->instructions[j]);
+    block->n_instructions = 1;
+    block->instructions[0] = (ir_instruction_t) {
+        .opcode = IR_JUMP, .dst = IR_NO_OPERAND, .a = IR_NO_OPERAND, .b = IR_NO_OPERAND
+    };
+}
+
+static bool convert_branch(int branch)
+{
+    ir_block_t *block = &function->blocks[branch];
+    if (block->instructions[block->n_instructions - 1].opcode != IR_BRANCH)
+        return false;
+    int sides[2];
+    int join = find_join(branch, sides);
+    if (join < 0)
+        return false;
+
+    size_t n_phis = 0;
+    ir_block_t *join_block = &function->blocks[join];
+    while (n_phis < join_block->n_instructions && join_block->instructions[n_phis].opcode == IR_PHI)
+        n_phis++;
+    int taken_cost = side_cost(branch, sides[0]), not_taken_cost = side_cost(branch, sides[1]);
+    if (taken_cost < 0 || not_taken_cost < 0
+        || taken_cost + not_taken_cost + (int) n_phis * SELECT_COST > BRANCH_COST)
+        return false;
+
+    speculate_side(branch, sides[0]);
+    speculate_side(branch, sides[1]);
+
+    // The phis become selects at the end of the branch block, which jumps straight to the join
+    block = &function->blocks[branch];
+    ir_instruction_t condition = block->instructions[block->n_instructions - 1];
+    block->n_instructions--;
+    join_block = &function->blocks[join];
+    for (size_t j = 0; j < n_phis; j++)
+    {
+        ir_instruction_t *phi = &join_block->instructions[j];
+        ir_operand_t operands[4] = {
+            condition.a, condition.b, phi_value(phi, sides[0]), phi_value(phi, sides[1])
+        };
+        ir_operand_t dst = phi->dst;
+        int32_t position = ir_add_arguments(function, operands, 4);
+        ir_append(&function->blocks[branch], (ir_instruction_t) {
+            .opcode = IR_SELECT, .relation = condition.relation, .dst = dst, .a = position, .b = 4,
+            .base = IR_NO_OPERAND
+        });
+        join_block = &function->blocks[join];
+    }
+    memmove(&join_block->instructions[0], &join_block->instructions[n_phis],
+            (join_block->n_instructions - n_phis) * sizeof(ir_instruction_t));
+    join_block->n_instructions -= n_phis;
+
+    block = &function->blocks[branch];
+    ir_append(block, (ir_instruction_t) {
+        .opcode = IR_JUMP, .dst = IR_NO_OPERAND, .a = IR_NO_OPERAND, .b = IR_NO_OPERAND
+    });
+    block->successors[0] = join;
+    block->successors[1] = -1;
+
+    // The sides can no longer be reached, and the join is only reached from the branch block
+    for (int s = 0; s < 2; s++)
+        if (sides[s] != branch)
+            cfg->n_predecessors[sides[s]] = 0;
+    cfg->n_predecessors[join] = 1;
+    return true;
+}
+
+bool ir_convert_branches(ir_function_t *ir_function)
+{
+    function = ir_function;
+    cfg = ir_analyze_cfg(function);
+
+    // The branches are visited in postorder, so the ones inside the sides of an if statement come first.
+    // Each conversion keeps the predecessor counts of the blocks it changes up to date, and the sides it
+    // leaves unreachable are removed at the end
+    bool changed = false;
+    for (size_t r = cfg->n_reachable; r-- > 0;)
+        changed |= convert_branch(cfg->reverse_postorder[r]);
+    ir_destroy_cfg(cfg);
+    if (changed)
+        ir_remove_unreachable_blocks(function);
+
+    function = NULL;
+    cfg = NULL;
+    return changed;
+}
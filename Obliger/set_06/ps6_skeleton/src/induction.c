@@ -0,0 +1,270 @@
+#include <vslc.h>
+#include "ir.h"
+
+/* Strength reduction of array accesses indexed by induction variables, on a function in SSA form.
+ * A basic induction variable is a phi in a loop header, starting from a value from outside the loop,
+ * and increased by a constant step each time around the loop.
+ * Accesses to array[i + k] get a pointer that starts at the address of array[i], and is moved along with i,
+ * so the access itself only needs the constant displacement k, and no index register or address arithmetic.
+ */
+
+typedef struct induction_variable
+{
+    ir_operand_t current;   // The phi in the header
+    ir_operand_t initial;   // The value coming from the preheader
+    ir_operand_t next;      // current + step, coming back from the latch
+    int64_t step;
+    int latch;
+} induction_variable_t;
+
+// A pointer following an induction variable through one array
+typedef struct pointer
+{
+    ir_operand_t array;     // The register holding the address of the array
+    induction_variable_t *variable;
+    ir_operand_t current, next;
+} pointer_t;
+
+static ir_function_t *function;
+static ir_cfg_t *cfg;
+static int *definitions; // The block defining each virtual register, kept up to date as registers are added
+static size_t n_definitions;
+
+/* Records the block defining a register, growing the definitions for registers added since they were found */
+static void set_definition(ir_operand_t reg, int block)
+{
+    if ((size_t) reg >= n_definitions)
+    {
+        definitions = realloc(definitions, function->n_registers * sizeof(int));
+        for (size_t r = n_definitions; r < function->n_registers; r++)
+            definitions[r] = -1;
+        n_definitions = function->n_registers;
+    }
+    definitions[reg] = block;
+}
+
+/* Copies the instruction defining the register into the result. Returns false if it has no definition */
+static bool find_definition(ir_operand_t reg, ir_instruction_t *result, size_t *position)
+{
+    if (!IR_IS_REGISTER(reg) || (size_t) reg >= n_definitions || definitions[reg] < 0)
+        return false;
+    ir_block_t *block = &function->blocks[definitions[reg]];
+    for (size_t j = 0; j < block->n_instructions; j++)
+    {
+        if (ir_has_dst(&block->instructions[j]) && block->instructions[j].dst == reg)
+        {
+            *result = block->instructions[j];
+            if (position != NULL)
+                *position = j;
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Recognizes a + constant, constant + a and a - constant, giving a and the constant */
+static bool is_constant_offset(ir_instruction_t *instruction, ir_operand_t *reg, int64_t *offset)
+{
+    if (instruction->opcode == IR_ADD && IR_IS_CONSTANT(instruction->b) && IR_IS_REGISTER(instruction->a))
+    {
+        *reg = instruction->a;
+        *offset = ir_constant_value(function, instruction->b);
+        return true;
+    }
+    if (instruction->opcode == IR_ADD && IR_IS_CONSTANT(instruction->a) && IR_IS_REGISTER(instruction->b))
+    {
+        *reg = instruction->b;
+        *offset = ir_constant_value(function, instruction->a);
+        return true;
+    }
+    if (instruction->opcode == IR_SUB && IR_IS_CONSTANT(instruction->b) && IR_IS_REGISTER(instruction->a))
+    {
+        *reg = instruction->a;
+        *offset = (int64_t) -(uint64_t) ir_constant_value(function, instruction->b);
+        return true;
+    }
+    return false;
+}
+
+/* Finds the basic induction variables among the phis of the loop header */
+static size_t find_induction_variables(int header, const uint64_t *body, induction_variable_t *variables)
+{
+    size_t n = 0;
+    ir_block_t *block = &function->blocks[header];
+    for (size_t j = 0; j < block->n_instructions && block->instructions[j].opcode == IR_PHI; j++)
+    {
+        ir_instruction_t *phi = &block->instructions[j];
+        if (phi->b != 2)
+            continue;
+        ir_operand_t *pairs = &function->arguments[phi->a];
+        int inside = ir_in_loop(cfg, body, pairs[0]) ? 0 : 1;
+        if (!ir_in_loop(cfg, body, pairs[2 * inside]) || ir_in_loop(cfg, body, pairs[2 * (1 - inside)]))
+            continue;
+
+        ir_instruction_t increment;
+        ir_operand_t reg;
+        int64_t step;
+        if (!find_definition(pairs[2 * inside + 1], &increment, NULL)
+            || !is_constant_offset(&increment, &reg, &step) || reg != phi->dst)
+            continue;
+
+        variables[n++] = (induction_variable_t) {
+            .current = phi->dst,
+            .initial = pairs[2 * (1 - inside) + 1],
+            .next = increment.dst,
+            .step = step,
+            .latch = pairs[2 * inside]
+        };
+    }
+    return n;
+}
+
+/* Inserts the instruction at the position in the block */
+static void insert_instruction(int block, size_t position, ir_instruction_t instruction)
+{
+    ir_block_t *b = &function->blocks[block];
+    ir_append(b, instruction);
+    memmove(&b->instructions[position + 1], &b->instructions[position],
+            (b->n_instructions - position - 1) * sizeof(ir_instruction_t));
+    b->instructions[position] = instruction;
+}
+
+static ir_operand_t emit_arithmetic(int block, ir_opcode_t opcode, ir_operand_t a, ir_operand_t b)
+{
+    ir_operand_t dst = ir_new_register(function);
+    ir_insert_before_terminator(&function->blocks[block], (ir_instruction_t) {
+        .opcode = opcode, .dst = dst, .a = a, .b = b, .base = IR_NO_OPERAND
+    });
+    set_definition(dst, block);
+    return dst;
+}
+
+/* Creates the pointer to array[i], starting at the preheader and stepping along with i */
+static void create_pointer(pointer_t *pointer, int header, int preheader)
+{
+    induction_variable_t *variable = pointer->variable;
+    ir_operand_t start;
+    if (IR_IS_CONSTANT(variable->initial))
+    {
+        uint64_t offset = (uint64_t) ir_constant_value(function, variable->initial) * 8;
+        start = emit_arithmetic(preheader, IR_ADD, pointer->array, ir_constant(function, (int64_t) offset));
+    }
+    else
+    {
+        ir_operand_t offset = emit_arithmetic(preheader, IR_MUL, variable->initial, ir_constant(function, 8));
+        start = emit_arithmetic(preheader, IR_ADD, pointer->array, offset);
+    }
+
+    // The pointer is moved right after the induction variable, so it is available wherever that is
+    ir_instruction_t increment;
+    size_t position;
+    find_definition(variable->next, &increment, &position);
+    insert_instruction(definitions[variable->next], position + 1, (ir_instruction_t) {
+        .opcode = IR_ADD, .dst = pointer->next, .a = pointer->current,
+        .b = ir_constant(function, (int64_t) ((uint64_t) variable->step * 8)), .base = IR_NO_OPERAND
+    });
+    set_definition(pointer->next, definitions[variable->next]);
+
+    ir_operand_t pairs[4] = {preheader, start, variable->latch, pointer->next};
+    insert_instruction(header, 0, (ir_instruction_t) {
+        .opcode = IR_PHI, .dst = pointer->current, .a = ir_add_arguments(function, pairs, 4), .b = 2,
+        .base = IR_NO_OPERAND
+    });
+    set_definition(pointer->current, header);
+}
+
+/* Returns the induction variable the register is, either before or after its step */
+static induction_variable_t *find_variable(induction_variable_t *variables, size_t n, ir_operand_t reg, bool *after_step)
+{
+    for (size_t v = 0; v < n; v++)
+    {
+        if (reg == variables[v].current || reg == variables[v].next)
+        {
+            *after_step = reg == variables[v].next;
+            return &variables[v];
+        }
+    }
+    return NULL;
+}
+
+static bool reduce_loop(ir_function_t *ir_function, ir_cfg_t *loop_cfg, int header, const uint64_t *body)
+{
+    function = ir_function;
+    cfg = loop_cfg;
+
+    induction_variable_t variables[function->blocks[header].n_instructions];
+    size_t n_variables = find_induction_variables(header, body, variables);
+    if (n_variables == 0)
+        return false;
+
+    // The accesses are rewritten to use the pointers first, and the instructions computing them are added after,
+    // so no instructions move around while the loop is searched
+    pointer_t *pointers = NULL;
+    size_t n_pointers = 0;
+    for (size_t i = 0; i < cfg->n_blocks; i++)
+    {
+        if (!ir_in_loop(cfg, body, i))
+            continue;
+        for (size_t j = 0; j < function->blocks[i].n_instructions; j++)
+        {
+            ir_instruction_t *access = &function->blocks[i].instructions[j];
+            if ((access->opcode != IR_LOAD_ELEMENT && access->opcode != IR_STORE_ELEMENT)
+                || access->base == IR_NO_OPERAND || ir_in_loop(cfg, body, definitions[access->base]))
+                continue;
+
+            // The index is either an induction variable, or one plus or minus a constant
+            bool after_step = false;
+            int64_t offset = 0;
+            induction_variable_t *variable = find_variable(variables, n_variables, access->a, &after_step);
+            ir_instruction_t definition;
+            ir_operand_t reg;
+            if (variable == NULL && find_definition(access->a, &definition, NULL)
+                && is_constant_offset(&definition, &reg, &offset))
+                variable = find_variable(variables, n_variables, reg, &after_step);
+            if (variable == NULL)
+                continue;
+
+            pointer_t *pointer = NULL;
+            for (size_t p = 0; p < n_pointers && pointer == NULL; p++)
+                if (pointers[p].array == access->base && pointers[p].variable == variable)
+                    pointer = &pointers[p];
+            if (pointer == NULL)
+            {
+                pointers = realloc(pointers, (n_pointers + 1) * sizeof(pointer_t));
+                pointer = &pointers[n_pointers++];
+                *pointer = (pointer_t) {
+                    .array = access->base,
+                    .variable = variable,
+                    .current = ir_new_register(function),
+                    .next = ir_new_register(function)
+                };
+            }
+
+            access->base = after_step ? pointer->next : pointer->current;
+            access->a = ir_constant(function, offset);
+        }
+    }
+    if (n_pointers == 0)
+        return false;
+
+    // The loop was entered from one block, since the induction variables have one value coming from outside
+    int preheader = ir_find_preheader(function, cfg, header, body);
+    assert (preheader >= 0);
+    for (size_t p = 0; p < n_pointers; p++)
+        create_pointer(&pointers[p], header, preheader);
+    free(pointers);
+    return true;
+}
+
+bool ir_reduce_induction_variables(ir_function_t *ir_function, ir_loops_t *loops)
+{
+    definitions = ir_find_definitions(ir_function);
+    n_definitions = ir_function->n_registers;
+    bool changed = ir_transform_loops(ir_function, loops, true, reduce_loop);
+    free(definitions);
+    definitions = NULL;
+    n_definitions = 0;
+    function = NULL;
+    cfg = NULL;
+    return changed;
+}
@@ -0,0 +1,161 @@
+#include <vslc.h>
+#include "ir.h"
+
+/* Inlining of small functions into their callers.
+ * Only leaf functions are inlined, which call no other functions, so inlining always ends. Their blocks are
+ * copied into the caller with new virtual registers, parameters become copies of the arguments, and returns
+ * become copies into the result of the call, jumping to the code that followed the call.
+ * Parameters and local variables of the inlined function are only virtual registers in the caller,
+ * so the symbol tables, and the frames of the unoptimized code generator, are left as they are.
+ * With -fprofile-use, calls the profile shows were never made are left alone, and larger functions are inlined
+ * where the calls were made often.
+ */
+
+// Functions with more instructions than this are not inlined, not counting parameters and jumps
+#define INLINE_LIMIT 24
+
+// The limit for calls marked as likely by the profile
+#define INLINE_HOT_LIMIT 96
+
+static ir_function_t *function;
+static ir_function_t *callee;
+static ir_operand_t register_offset;
+
+/* Returns true if calls to the function are worth inlining, if it has at most limit instructions */
+static bool is_inlinable(ir_function_t *f, size_t limit)
+{
+    size_t size = 0;
+    for (size_t i = 0; i < f->n_blocks; i++)
+    {
+        for (size_t j = 0; j < f->blocks[i].n_instructions; j++)
+        {
+            ir_instruction_t *instruction = &f->blocks[i].instructions[j];
+            if (instruction->opcode == IR_CALL || instruction->opcode == IR_TAIL_CALL || instruction->opcode == IR_PHI)
+                return false;
+            if (instruction->opcode != IR_PARAM && instruction->opcode != IR_JUMP)
+                size++;
+        }
+    }
+    return size <= limit;
+}
+
+/* Translates an operand of the callee into the caller */
+static ir_operand_t map_operand(ir_operand_t operand)
+{
+    if (IR_IS_CONSTANT(operand))
+        return ir_constant(function, ir_constant_value(callee, operand));
+    if (IR_IS_REGISTER(operand))
+        return operand + register_offset;
+    return operand;
+}
+
+/* Replaces the call at the position in the block by the body of the callee */
+static void inline_call(int block, size_t position)
+{
+    ir_instruction_t call = function->blocks[block].instructions[position];
+    ir_operand_t arguments[call.b + 1];
+    memcpy(arguments, &function->arguments[call.a], call.b * sizeof(ir_operand_t));
+
+    register_offset = function->n_registers;
+    function->n_registers += callee->n_registers;
+
+    // The callee's blocks are placed after the caller's, followed by the rest of the calling block
+    int loop_depth = function->blocks[block].loop_depth;
+    int first_block = function->n_blocks;
+    for (size_t i = 0; i < callee->n_blocks; i++)
+        ir_new_block(function, loop_depth + callee->blocks[i].loop_depth);
+    int continuation = ir_new_block(function, loop_depth);
+
+    ir_block_t *calling_block = &function->blocks[block];
+    ir_block_t *rest = &function->blocks[continuation];
+    for (size_t j = position + 1; j < calling_block->n_instructions; j++)
+        ir_append(rest, calling_block->instructions[j]);
+    rest->successors[0] = calling_block->successors[0];
+    rest->successors[1] = calling_block->successors[1];
+    calling_block->n_instructions = position;
+    ir_append(calling_block, (ir_instruction_t) {
+        .opcode = IR_JUMP, .dst = IR_NO_OPERAND, .a = IR_NO_OPERAND, .b = IR_NO_OPERAND
+    });
+    calling_block->successors[0] = first_block;
+    calling_block->successors[1] = -1;
+
+    for (size_t i = 0; i < callee->n_blocks; i++)
+    {
+        ir_block_t *source = &callee->blocks[i];
+        ir_block_t *copy = &function->blocks[first_block + i];
+        for (int s = 0; s < 2; s++)
+            copy->successors[s] = source->successors[s] < 0 ? -1 : first_block + source->successors[s];
+
+        for (size_t j = 0; j < source->n_instructions; j++)
+        {
+            ir_instruction_t instruction = source->instructions[j];
+            if (instruction.opcode == IR_PARAM)
+            {
+                instruction = (ir_instruction_t) {
+                    .opcode = IR_COPY, .dst = map_operand(instruction.dst), .a = arguments[instruction.a],
+                    .b = IR_NO_OPERAND
+                };
+            }
+            else if (instruction.opcode == IR_RETURN)
+            {
+                ir_append(copy, (ir_instruction_t) {
+                    .opcode = IR_COPY, .dst = call.dst, .a = map_operand(instruction.a), .b = IR_NO_OPERAND
+                });
+                instruction = (ir_instruction_t) {
+                    .opcode = IR_JUMP, .dst = IR_NO_OPERAND, .a = IR_NO_OPERAND, .b = IR_NO_OPERAND
+                };
+                copy->successors[0] = continuation;
+            }
+            else if (instruction.opcode == IR_SELECT || instruction.opcode == IR_PRINT
+                     || instruction.opcode == IR_VECTOR_LOOP)
+            {
+                ir_operand_t operands[instruction.b + 1];
+                for (int k = 0; k < instruction.b; k++)
+                    operands[k] = map_operand(callee->arguments[instruction.a + k]);
+                if (ir_has_dst(&instruction))
+                    instruction.dst = map_operand(instruction.dst);
+                instruction.a = ir_add_arguments(function, operands, instruction.b);
+            }
+            else
+            {
+                if (ir_has_dst(&instruction))
+                    instruction.dst = map_operand(instruction.dst);
+                instruction.a = map_operand(instruction.a);
+                instruction.b = map_operand(instruction.b);
+                if (instruction.opcode == IR_LOAD_ELEMENT || instruction.opcode == IR_STORE_ELEMENT)
+                    instruction.base = map_operand(instruction.base);
+            }
+            ir_append(copy, instruction);
+        }
+    }
+}
+
+bool ir_inline_calls(ir_function_t *ir_function, ir_function_t **functions)
+{
+    function = ir_function;
+    bool changed = false;
+
+    // The rest of a block with an inlined call is moved to a new block at the end, which is visited later
+    for (size_t i = 0; i < function->n_blocks; i++)
+    {
+        for (size_t j = 0; j < function->blocks[i].n_instructions; j++)
+        {
+            ir_instruction_t *instruction = &function->blocks[i].instructions[j];
+            if (instruction->opcode != IR_CALL || instruction->profile == IR_NEVER)
+                continue;
+            callee = functions[instruction->symbol];
+            size_t limit = instruction->profile == IR_LIKELY ? INLINE_HOT_LIMIT : INLINE_LIMIT;
+            if (callee == NULL || callee == function || !is_inlinable(callee, limit)
+                || ir_count_parameters(callee) != (size_t) instruction->b)
+                continue;
+
+            inline_call(i, j);
+            changed = true;
+            break;
+        }
+    }
+
+    function = NULL;
+    callee = NULL;
+    return changed;
+}
@@ -0,0 +1,996 @@
+#include <vslc.h>
+#include "ir.h"
+#include "print_format.h"
+
+/* Helpers for building, inspecting and printing the IR, and the analyses shared by the optimization passes */
+
+ir_operand_t ir_constant(ir_function_t *function, int64_t value)
+{
+    for (size_t i = 0; i < function->n_constants; i++)
+        if (function->constants[i] == value)
+            return -1 - (ir_operand_t) i;
+
+    if (function->n_constants == function->constants_capacity)
+    {
+        function->constants_capacity = function->constants_capacity * 2 + 8;
+        function->constants = realloc(function->constants, function->constants_capacity * sizeof(int64_t));
+    }
+    function->constants[function->n_constants] = value;
+    return -1 - (ir_operand_t) function->n_constants++;
+}
+
+int64_t ir_constant_value(ir_function_t *function, ir_operand_t operand)
+{
+    assert (IR_IS_CONSTANT(operand));
+    return function->constants[-1 - operand];
+}
+
+ir_operand_t ir_new_register(ir_function_t *function)
+{
+    return function->n_registers++;
+}
+
+size_t ir_append(ir_block_t *block, ir_instruction_t instruction)
+{
+    if (block->n_instructions == block->capacity)
+    {
+        block->capacity = block->capacity * 2 + 8;
+        block->instructions = realloc(block->instructions, block->capacity * sizeof(ir_instruction_t));
+    }
+    block->instructions[block->n_instructions] = instruction;
+    return block->n_instructions++;
+}
+
+void ir_insert_before_terminator(ir_block_t *block, ir_instruction_t instruction)
+{
+    size_t position = ir_append(block, instruction);
+    block->instructions[position] = block->instructions[position - 1];
+    block->instructions[position - 1] = instruction;
+}
+
+int32_t ir_add_arguments(ir_function_t *function, const ir_operand_t *arguments, size_t n)
+{
+    // Calls without arguments, before any others, have nothing to copy into a pool that may not exist yet
+    if (n == 0)
+        return function->n_arguments;
+    if (function->n_arguments + n > function->arguments_capacity)
+    {
+        function->arguments_capacity = function->arguments_capacity * 2 + n + 8;
+        function->arguments = realloc(function->arguments, function->arguments_capacity * sizeof(ir_operand_t));
+    }
+    int32_t first = function->n_arguments;
+    memcpy(function->arguments + first, arguments, n * sizeof(ir_operand_t));
+    function->n_arguments += n;
+    return first;
+}
+
+size_t ir_count_parameters(ir_function_t *function)
+{
+    symbol_table_t *symtable = function->symbol->function_symtable;
+    size_t n = 0;
+    for (size_t i = 0; i < symtable->n_symbols; i++)
+        n += symtable->symbols[i]->type == SYMBOL_PARAMETER;
+    return n;
+}
+
+int ir_new_block(ir_function_t *function, int loop_depth)
+{
+    if (function->n_blocks == function->blocks_capacity)
+    {
+        function->blocks_capacity = function->blocks_capacity * 2 + 8;
+        function->blocks = realloc(function->blocks, function->blocks_capacity * sizeof(ir_block_t));
+    }
+    function->blocks[function->n_blocks] = (ir_block_t) {
+        .instructions = NULL,
+        .n_instructions = 0,
+        .capacity = 0,
+        .successors = {-1, -1},
+        .loop_depth = loop_depth
+    };
+    return function->n_blocks++;
+}
+
+int ir_split_edge(ir_function_t *function, int predecessor, int block)
+{
+    int loop_depth = function->blocks[block].loop_depth;
+    if (function->blocks[predecessor].loop_depth < loop_depth)
+        loop_depth = function->blocks[predecessor].loop_depth;
+
+    int middle = ir_new_block(function, loop_depth);
+    function->blocks[middle].successors[0] = block;
+    ir_append(&function->blocks[middle], (ir_instruction_t) {
+        .opcode = IR_JUMP, .dst = IR_NO_OPERAND, .a = IR_NO_OPERAND, .b = IR_NO_OPERAND
+    });
+
+    ir_block_t *p = &function->blocks[predecessor];
+    for (int s = 0; s < ir_successor_count(p); s++)
+        if (p->successors[s] == block)
+            p->successors[s] = middle;
+    return middle;
+}
+
+bool ir_has_dst(const ir_instruction_t *instruction)
+{
+    switch (instruction->opcode)
+    {
+        case IR_STORE_GLOBAL:
+        case IR_STORE_ELEMENT:
+        case IR_CHECK_BOUNDS:
+        case IR_COUNT:
+        case IR_PRINT:
+        case IR_JUMP:
+        case IR_BRANCH:
+        case IR_RETURN:
+        case IR_TAIL_CALL:
+            return false;
+        default:
+            return true;
+    }
+}
+
+bool ir_is_terminator(const ir_instruction_t *instruction)
+{
+    return instruction->opcode == IR_JUMP || instruction->opcode == IR_BRANCH || instruction->opcode == IR_RETURN
+           || instruction->opcode == IR_TAIL_CALL;
+}
+
+bool ir_is_call(const ir_instruction_t *instruction)
+{
+    switch (instruction->opcode)
+    {
+        case IR_CALL:
+        case IR_PRINT:
+        case IR_VECTOR_LOOP:
+            return true;
+        default:
+            return false;
+    }
+}
+
+bool ir_has_side_effects(ir_function_t *function, const ir_instruction_t *instruction)
+{
+    switch (instruction->opcode)
+    {
+        case IR_STORE_GLOBAL:
+        case IR_STORE_ELEMENT:
+        case IR_CHECK_BOUNDS:
+        case IR_COUNT:
+            return true;
+        case IR_DIV:
+            // The trap must still happen when the result is unused
+            return ir_may_trap(function, instruction);
+        default:
+            return ir_is_call(instruction) || ir_is_terminator(instruction);
+    }
+}
+
+bool ir_may_trap(ir_function_t *function, const ir_instruction_t *instruction)
+{
+    if (instruction->opcode != IR_DIV)
+        return false;
+    if (!IR_IS_CONSTANT(instruction->b))
+        return true;
+    int64_t divisor = ir_constant_value(function, instruction->b);
+    return divisor == 0 || divisor == -1;
+}
+
+void ir_for_each_use(ir_function_t *function, ir_instruction_t *instruction,
+                     void (*visit)(ir_operand_t *operand, void *context), void *context)
+{
+    switch (instruction->opcode)
+    {
+        case IR_PARAM:
+        case IR_LOAD_GLOBAL:
+        case IR_ADDRESS:
+        case IR_COUNT:
+        case IR_JUMP:
+            break;
+        case IR_CALL:
+        case IR_TAIL_CALL:
+        case IR_SELECT:
+        case IR_PRINT:
+        case IR_VECTOR_LOOP:
+            for (int32_t i = 0; i < instruction->b; i++)
+                visit(&function->arguments[instruction->a + i], context);
+            break;
+        case IR_PHI:
+            for (int32_t i = 0; i < instruction->b; i++)
+                visit(&function->arguments[instruction->a + 2 * i + 1], context);
+            break;
+        case IR_LOAD_ELEMENT:
+            visit(&instruction->a, context);
+            if (instruction->base != IR_NO_OPERAND)
+                visit(&instruction->base, context);
+            break;
+        case IR_STORE_ELEMENT:
+            visit(&instruction->a, context);
+            visit(&instruction->b, context);
+            if (instruction->base != IR_NO_OPERAND)
+                visit(&instruction->base, context);
+            break;
+        case IR_COPY:
+        case IR_NEG:
+        case IR_STORE_GLOBAL:
+        case IR_CHECK_BOUNDS:
+        case IR_RETURN:
+            visit(&instruction->a, context);
+            break;
+        default:
+            visit(&instruction->a, context);
+            visit(&instruction->b, context);
+            break;
+    }
+}
+
+int ir_successor_count(const ir_block_t *block)
+{
+    assert (block->n_instructions > 0);
+    switch (block->instructions[block->n_instructions - 1].opcode)
+    {
+        case IR_JUMP:
+            return 1;
+        case IR_BRANCH:
+            return 2;
+        default:
+            return 0;
+    }
+}
+
+bool ir_is_successor(const ir_block_t *block, int successor)
+{
+    for (int s = 0; s < ir_successor_count(block); s++)
+        if (block->successors[s] == successor)
+            return true;
+    return false;
+}
+
+ir_relation_t ir_swap_relation(ir_relation_t relation)
+{
+    switch (relation)
+    {
+        case IR_LT: return IR_GT;
+        case IR_GT: return IR_LT;
+        case IR_LE: return IR_GE;
+        case IR_GE: return IR_LE;
+        default: return relation;
+    }
+}
+
+ir_relation_t ir_negate_relation(ir_relation_t relation)
+{
+    switch (relation)
+    {
+        case IR_EQ: return IR_NE;
+        case IR_NE: return IR_EQ;
+        case IR_LT: return IR_GE;
+        case IR_GE: return IR_LT;
+        case IR_GT: return IR_LE;
+        default: return IR_GT;
+    }
+}
+
+bool ir_relation_holds(ir_relation_t relation, int64_t a, int64_t b)
+{
+    switch (relation)
+    {
+        case IR_EQ: return a == b;
+        case IR_NE: return a != b;
+        case IR_LT: return a < b;
+        case IR_GE: return a >= b;
+        case IR_GT: return a > b;
+        default: return a <= b;
+    }
+}
+
+void ir_destroy_function(ir_function_t *function)
+{
+    if (function == NULL)
+        return;
+
+    for (size_t i = 0; i < function->n_blocks; i++)
+        free(function->blocks[i].instructions);
+    free(function->blocks);
+    free(function->constants);
+    free(function->arguments);
+    free(function);
+}
+
+void ir_remove_unreachable_blocks(ir_function_t *function)
+{
+    // Depth first search from the entry block
+    int *new_index = malloc(function->n_blocks * sizeof(int));
+    int *stack = malloc(function->n_blocks * sizeof(int));
+    size_t n_stack = 0;
+    for (size_t i = 0; i < function->n_blocks; i++)
+        new_index[i] = -1;
+
+    new_index[0] = 0;
+    stack[n_stack++] = 0;
+    while (n_stack > 0)
+    {
+        ir_block_t *block = &function->blocks[stack[--n_stack]];
+        for (int s = 0; s < ir_successor_count(block); s++)
+        {
+            int successor = block->successors[s];
+            if (new_index[successor] == -1)
+            {
+                new_index[successor] = 0;
+                stack[n_stack++] = successor;
+            }
+        }
+    }
+
+    // Compact the reachable blocks, keeping their order
+    size_t n_blocks = 0;
+    for (size_t i = 0; i < function->n_blocks; i++)
+    {
+        if (new_index[i] == -1)
+        {
+            free(function->blocks[i].instructions);
+            continue;
+        }
+        new_index[i] = n_blocks;
+        function->blocks[n_blocks++] = function->blocks[i];
+    }
+    function->n_blocks = n_blocks;
+
+    for (size_t i = 0; i < n_blocks; i++)
+    {
+        ir_block_t *block = &function->blocks[i];
+        for (int s = 0; s < ir_successor_count(block); s++)
+            block->successors[s] = new_index[block->successors[s]];
+    }
+
+    // Phis only keep the values coming from predecessors that are still there
+    for (size_t i = 0; i < n_blocks; i++)
+    {
+        ir_block_t *block = &function->blocks[i];
+        for (size_t j = 0; j < block->n_instructions && block->instructions[j].opcode == IR_PHI; j++)
+        {
+            ir_instruction_t *phi = &block->instructions[j];
+            ir_operand_t *pairs = &function->arguments[phi->a];
+            int32_t n_pairs = 0;
+            for (int32_t k = 0; k < phi->b; k++)
+            {
+                int predecessor = new_index[pairs[2 * k]];
+                if (predecessor == -1 || !ir_is_successor(&function->blocks[predecessor], i))
+                    continue;
+                pairs[2 * n_pairs] = predecessor;
+                pairs[2 * n_pairs + 1] = pairs[2 * k + 1];
+                n_pairs++;
+            }
+            phi->b = n_pairs;
+        }
+    }
+
+    free(new_index);
+    free(stack);
+}
+
+void ir_simplify_cfg(ir_function_t *function)
+{
+    for (size_t i = 0; i < function->n_blocks; i++)
+    {
+        ir_block_t *block = &function->blocks[i];
+        for (int s = 0; s < ir_successor_count(block); s++)
+        {
+            // Follow chains of blocks that only jump on, giving up on cycles of them
+            int target = block->successors[s];
+            for (size_t steps = 0; steps < function->n_blocks; steps++)
+            {
+                ir_block_t *next = &function->blocks[target];
+                if (next->n_instructions != 1 || next->instructions[0].opcode != IR_JUMP)
+                    break;
+                target = next->successors[0];
+            }
+            block->successors[s] = target;
+        }
+    }
+    ir_remove_unreachable_blocks(function);
+
+    // Merge blocks ending in a jump with the target, when they are its only predecessor
+    size_t *n_predecessors = calloc(function->n_blocks, sizeof(size_t));
+    for (size_t i = 0; i < function->n_blocks; i++)
+        for (int s = 0; s < ir_successor_count(&function->blocks[i]); s++)
+            n_predecessors[function->blocks[i].successors[s]]++;
+
+    for (size_t i = 0; i < function->n_blocks; i++)
+    {
+        ir_block_t *block = &function->blocks[i];
+        while (block->instructions[block->n_instructions - 1].opcode == IR_JUMP)
+        {
+            int target = block->successors[0];
+            if (target == 0 || (size_t) target == i || n_predecessors[target] != 1)
+                break;
+
+            // The target is left behind as an unreachable block jumping to itself
+            ir_block_t *next = &function->blocks[target];
+            block->n_instructions--;
+            for (size_t j = 0; j < next->n_instructions; j++)
+                ir_append(block, next->instructions[j]);
+            block->successors[0] = next->successors[0];
+            block->successors[1] = next->successors[1];
+            next->n_instructions = 1;
+            next->instructions[0] = (ir_instruction_t) {
+                .opcode = IR_JUMP, .dst = IR_NO_OPERAND, .a = IR_NO_OPERAND, .b = IR_NO_OPERAND
+            };
+            next->successors[0] = target;
+        }
+    }
+    free(n_predecessors);
+    ir_remove_unreachable_blocks(function);
+}
+
+/* Liveness analysis */
+
+static void add_use(ir_operand_t *operand, void *context)
+{
+    if (IR_IS_REGISTER(*operand))
+        IR_SET_ADD((uint64_t *) context, *operand);
+}
+
+/* Updates the live set from after the instruction, to before it.
+ * The values used by a phi are live at the end of the predecessors instead, not at the phi itself.
+ */
+static void transfer(ir_function_t *function, ir_instruction_t *instruction, uint64_t *live)
+{
+    if (ir_has_dst(instruction))
+        IR_SET_REMOVE(live, instruction->dst);
+    if (instruction->opcode != IR_PHI)
+        ir_for_each_use(function, instruction, add_use, live);
+}
+
+/* Adds the values the phis of the successor use when coming from the given block */
+static void add_phi_uses(ir_function_t *function, ir_block_t *successor, int block, uint64_t *live)
+{
+    for (size_t j = 0; j < successor->n_instructions && successor->instructions[j].opcode == IR_PHI; j++)
+    {
+        ir_instruction_t *phi = &successor->instructions[j];
+        for (int32_t k = 0; k < phi->b; k++)
+            if (function->arguments[phi->a + 2 * k] == block)
+                add_use(&function->arguments[phi->a + 2 * k + 1], live);
+    }
+}
+
+ir_liveness_t *ir_compute_liveness(ir_function_t *function)
+{
+    ir_liveness_t *liveness = malloc(sizeof(ir_liveness_t));
+    size_t words = IR_SET_WORDS(function->n_registers);
+    liveness->n_blocks = function->n_blocks;
+    liveness->words = words;
+    liveness->live_in = malloc(function->n_blocks * sizeof(uint64_t *));
+    liveness->live_out = malloc(function->n_blocks * sizeof(uint64_t *));
+    for (size_t i = 0; i < function->n_blocks; i++)
+    {
+        liveness->live_in[i] = calloc(words, sizeof(uint64_t));
+        liveness->live_out[i] = calloc(words, sizeof(uint64_t));
+    }
+
+    // Iterate backwards through the blocks until nothing changes. Blocks are mostly in program order,
+    // so visiting them in reverse usually sees the successors first
+    uint64_t *live = malloc(words * sizeof(uint64_t));
+    bool changed = true;
+    while (changed)
+    {
+        changed = false;
+        for (size_t i = function->n_blocks; i-- > 0;)
+        {
+            ir_block_t *block = &function->blocks[i];
+            uint64_t *out = liveness->live_out[i];
+            for (int s = 0; s < ir_successor_count(block); s++)
+            {
+                uint64_t *successor_in = liveness->live_in[block->successors[s]];
+                for (size_t w = 0; w < words; w++)
+                    out[w] |= successor_in[w];
+                add_phi_uses(function, &function->blocks[block->successors[s]], i, out);
+            }
+
+            memcpy(live, out, words * sizeof(uint64_t));
+            for (size_t j = block->n_instructions; j-- > 0;)
+                transfer(function, &block->instructions[j], live);
+
+            if (memcmp(live, liveness->live_in[i], words * sizeof(uint64_t)) != 0)
+            {
+                memcpy(liveness->live_in[i], live, words * sizeof(uint64_t));
+                changed = true;
+            }
+        }
+    }
+    free(live);
+    return liveness;
+}
+
+void ir_destroy_liveness(ir_liveness_t *liveness)
+{
+    if (liveness == NULL)
+        return;
+
+    for (size_t i = 0; i < liveness->n_blocks; i++)
+    {
+        free(liveness->live_in[i]);
+        free(liveness->live_out[i]);
+    }
+    free(liveness->live_in);
+    free(liveness->live_out);
+    free(liveness);
+}
+
+/* Control flow analysis */
+
+static void number_postorder(ir_function_t *function, int block, bool *visited, int *postorder, size_t *n)
+{
+    visited[block] = true;
+    ir_block_t *b = &function->blocks[block];
+    for (int s = ir_successor_count(b); s-- > 0;)
+        if (!visited[b->successors[s]])
+            number_postorder(function, b->successors[s], visited, postorder, n);
+    postorder[(*n)++] = block;
+}
+
+/* Links the blocks to their children in the dominator tree, and numbers the tree in preorder and postorder,
+ * walking it without recursion since it can be as deep as the function is long.
+ * The numbers go in steps of two, leaving room for ir_find_preheader to place a block in front of a header
+ */
+static void number_dominator_tree(ir_cfg_t *cfg)
+{
+    size_t n_blocks = cfg->n_blocks;
+    cfg->dominated = malloc(n_blocks * sizeof(int *));
+    cfg->n_dominated = calloc(n_blocks, sizeof(size_t));
+    cfg->dominator_preorder = malloc(n_blocks * sizeof(int));
+    cfg->dominator_postorder = malloc(n_blocks * sizeof(int));
+
+    for (size_t i = 1; i < n_blocks; i++)
+        if (cfg->immediate_dominator[i] != -1)
+            cfg->n_dominated[cfg->immediate_dominator[i]]++;
+    for (size_t i = 0; i < n_blocks; i++)
+    {
+        cfg->dominated[i] = malloc((cfg->n_dominated[i] + 1) * sizeof(int));
+        cfg->n_dominated[i] = 0;
+        cfg->dominator_preorder[i] = cfg->dominator_postorder[i] = -1;
+    }
+    for (size_t i = 1; i < n_blocks; i++)
+    {
+        int idom = cfg->immediate_dominator[i];
+        if (idom != -1)
+            cfg->dominated[idom][cfg->n_dominated[idom]++] = i;
+    }
+
+    // The stack holds the blocks being walked, and how many of their children have been visited
+    int *stack = malloc((n_blocks + 1) * sizeof(int));
+    size_t *visited = calloc(n_blocks, sizeof(size_t));
+    size_t n_stack = 0;
+    int preorder = 0, postorder = 0;
+    stack[n_stack++] = 0;
+    cfg->dominator_preorder[0] = preorder;
+    preorder += 2;
+    while (n_stack > 0)
+    {
+        int block = stack[n_stack - 1];
+        if (visited[block] < cfg->n_dominated[block])
+        {
+            int child = cfg->dominated[block][visited[block]++];
+            cfg->dominator_preorder[child] = preorder;
+            preorder += 2;
+            stack[n_stack++] = child;
+            continue;
+        }
+        cfg->dominator_postorder[block] = postorder;
+        postorder += 2;
+        n_stack--;
+    }
+    free(visited);
+    free(stack);
+}
+
+ir_cfg_t *ir_analyze_cfg(ir_function_t *function)
+{
+    size_t n_blocks = function->n_blocks;
+    ir_cfg_t *cfg = malloc(sizeof(ir_cfg_t));
+    cfg->n_blocks = n_blocks;
+    cfg->predecessors = malloc(n_blocks * sizeof(int *));
+    cfg->n_predecessors = calloc(n_blocks, sizeof(size_t));
+    cfg->immediate_dominator = malloc(n_blocks * sizeof(int));
+    cfg->reverse_postorder = malloc(n_blocks * sizeof(int));
+
+    for (size_t i = 0; i < n_blocks; i++)
+        for (int s = 0; s < ir_successor_count(&function->blocks[i]); s++)
+            cfg->n_predecessors[function->blocks[i].successors[s]]++;
+    for (size_t i = 0; i < n_blocks; i++)
+    {
+        cfg->predecessors[i] = malloc((cfg->n_predecessors[i] + 1) * sizeof(int));
+        cfg->n_predecessors[i] = 0;
+    }
+    for (size_t i = 0; i < n_blocks; i++)
+        for (int s = 0; s < ir_successor_count(&function->blocks[i]); s++)
+        {
+            int successor = function->blocks[i].successors[s];
+            cfg->predecessors[successor][cfg->n_predecessors[successor]++] = i;
+        }
+
+    bool *visited = calloc(n_blocks, sizeof(bool));
+    int *postorder = malloc(n_blocks * sizeof(int));
+    size_t n_reachable = 0;
+    number_postorder(function, 0, visited, postorder, &n_reachable);
+    cfg->n_reachable = n_reachable;
+
+    int *order = malloc(n_blocks * sizeof(int)); // Position of each block in the postorder
+    for (size_t i = 0; i < n_reachable; i++)
+    {
+        cfg->reverse_postorder[i] = postorder[n_reachable - 1 - i];
+        order[postorder[i]] = i;
+    }
+
+    // The iterative dominator algorithm of Cooper, Harvey and Kennedy
+    int *idom = cfg->immediate_dominator;
+    for (size_t i = 0; i < n_blocks; i++)
+        idom[i] = -1;
+    idom[0] = 0;
+    bool changed = true;
+    while (changed)
+    {
+        changed = false;
+        for (size_t i = 1; i < n_reachable; i++)
+        {
+            int block = cfg->reverse_postorder[i];
+            int new_idom = -1;
+            for (size_t p = 0; p < cfg->n_predecessors[block]; p++)
+            {
+                int other = cfg->predecessors[block][p];
+                if (idom[other] == -1)
+                    continue;
+                if (new_idom == -1)
+                {
+                    new_idom = other;
+                    continue;
+                }
+                while (other != new_idom)
+                {
+                    while (order[other] < order[new_idom])
+                        other = idom[other];
+                    while (order[new_idom] < order[other])
+                        new_idom = idom[new_idom];
+                }
+            }
+            if (idom[block] != new_idom)
+            {
+                idom[block] = new_idom;
+                changed = true;
+            }
+        }
+    }
+
+    free(order);
+    free(postorder);
+    free(visited);
+    number_dominator_tree(cfg);
+    return cfg;
+}
+
+void ir_destroy_cfg(ir_cfg_t *cfg)
+{
+    if (cfg == NULL)
+        return;
+
+    for (size_t i = 0; i < cfg->n_blocks; i++)
+    {
+        free(cfg->predecessors[i]);
+        free(cfg->dominated[i]);
+    }
+    free(cfg->predecessors);
+    free(cfg->n_predecessors);
+    free(cfg->immediate_dominator);
+    free(cfg->dominated);
+    free(cfg->n_dominated);
+    free(cfg->dominator_preorder);
+    free(cfg->dominator_postorder);
+    free(cfg->reverse_postorder);
+    free(cfg);
+}
+
+bool ir_dominates(ir_cfg_t *cfg, int dominator, int block)
+{
+    if (cfg->immediate_dominator[block] == -1 || cfg->immediate_dominator[dominator] == -1)
+        return false;
+    return cfg->dominator_preorder[dominator] <= cfg->dominator_preorder[block]
+        && cfg->dominator_postorder[block] <= cfg->dominator_postorder[dominator];
+}
+
+int *ir_find_definitions(ir_function_t *function)
+{
+    int *definitions = malloc(function->n_registers * sizeof(int));
+    for (size_t r = 0; r < function->n_registers; r++)
+        definitions[r] = -1;
+    for (size_t i = 0; i < function->n_blocks; i++)
+        for (size_t j = 0; j < function->blocks[i].n_instructions; j++)
+            if (ir_has_dst(&function->blocks[i].instructions[j]))
+                definitions[function->blocks[i].instructions[j].dst] = i;
+    return definitions;
+}
+
+bool ir_eliminate_dead_code(ir_function_t *function)
+{
+    bool removed_any = false;
+    bool changed = true;
+    while (changed)
+    {
+        changed = false;
+        ir_liveness_t *liveness = ir_compute_liveness(function);
+        uint64_t *live = malloc(liveness->words * sizeof(uint64_t));
+
+        for (size_t i = 0; i < function->n_blocks; i++)
+        {
+            ir_block_t *block = &function->blocks[i];
+            memcpy(live, liveness->live_out[i], liveness->words * sizeof(uint64_t));
+
+            // Walk backwards, marking removed instructions as jumps, then compact the block
+            bool removed = false;
+            for (size_t j = block->n_instructions; j-- > 0;)
+            {
+                ir_instruction_t *instruction = &block->instructions[j];
+                if (ir_has_dst(instruction) && !ir_has_side_effects(function, instruction)
+                    && !IR_SET_CONTAINS(live, instruction->dst))
+                {
+                    instruction->opcode = IR_JUMP;
+                    removed = true;
+                    continue;
+                }
+                transfer(function, instruction, live);
+            }
+
+            if (removed)
+            {
+                size_t n = 0;
+                for (size_t j = 0; j + 1 < block->n_instructions; j++)
+                    if (block->instructions[j].opcode != IR_JUMP)
+                        block->instructions[n++] = block->instructions[j];
+                block->instructions[n++] = block->instructions[block->n_instructions - 1];
+                block->n_instructions = n;
+                changed = removed_any = true;
+            }
+        }
+
+        free(live);
+        ir_destroy_liveness(liveness);
+    }
+    return removed_any;
+}
+
+void ir_optimize_function(ir_function_t *function)
+{
+    ir_eliminate_tail_recursion(function);
+    ir_remove_unreachable_blocks(function);
+    ir_rotate_loops(function);
+
+    ir_construct_ssa(function);
+    ir_propagate_constants(function);
+    ir_propagate_copies(function);
+    if (ir_number_values(function))
+        ir_propagate_copies(function);
+    ir_eliminate_bounds_checks(function);
+    ir_loops_t *loops = ir_find_loops(function);
+    ir_hoist_loop_invariants(function, loops);
+    ir_reduce_induction_variables(function, loops);
+    ir_destroy_loops(loops);
+    // The addresses and values those two place in front of loops may already be computed there
+    if (ir_number_values(function))
+        ir_propagate_copies(function);
+    ir_convert_branches(function);
+    ir_destruct_ssa(function);
+    ir_simplify_cfg(function);
+
+    ir_eliminate_dead_code(function);
+    ir_order_blocks(function);
+}
+
+/* Printing */
+
+static const char *OPCODE_NAMES[] = {
+    [IR_PARAM] = "param",
+    [IR_COPY] = "copy",
+    [IR_ADD] = "add",
+    [IR_SUB] = "sub",
+    [IR_MUL] = "mul",
+    [IR_DIV] = "div",
+    [IR_NEG] = "neg",
+    [IR_SELECT] = "select",
+    [IR_LOAD_GLOBAL] = "load",
+    [IR_STORE_GLOBAL] = "store",
+    [IR_LOAD_ELEMENT] = "load",
+    [IR_STORE_ELEMENT] = "store",
+    [IR_CHECK_BOUNDS] = "check",
+    [IR_COUNT] = "count",
+    [IR_ADDRESS] = "address",
+    [IR_CALL] = "call",
+    [IR_PRINT] = "print",
+    [IR_VECTOR_LOOP] = "vector loop",
+    [IR_JUMP] = "jump",
+    [IR_BRANCH] = "branch",
+    [IR_RETURN] = "return",
+    [IR_TAIL_CALL] = "tail call",
+    [IR_PHI] = "phi",
+};
+
+static const char *RELATION_NAMES[] = {
+    [IR_EQ] = "=", [IR_NE] = "!=", [IR_LT] = "<", [IR_GE] = ">=", [IR_GT] = ">", [IR_LE] = "<="
+};
+
+static void print_operand(ir_function_t *function, ir_operand_t operand)
+{
+    if (IR_IS_CONSTANT(operand))
+        printf("%ld", ir_constant_value(function, operand));
+    else if ((size_t) operand < function->symbol->function_symtable->n_symbols)
+        printf("%s", function->symbol->function_symtable->symbols[operand]->name);
+    else
+        printf("%%%d", operand);
+}
+
+void ir_print_function(ir_function_t *function)
+{
+    symbol_table_t *symtable = function->symbol->function_symtable;
+    printf("function %s(", function->symbol->name);
+    for (size_t i = 0; i < symtable->n_symbols; i++)
+        if (symtable->symbols[i]->type == SYMBOL_PARAMETER)
+            printf("%s%s", i == 0 ? "" : ", ", symtable->symbols[i]->name);
+    printf(")\n");
+
+    for (size_t i = 0; i < function->n_blocks; i++)
+    {
+        ir_block_t *block = &function->blocks[i];
+        printf("B%zu:", i);
+        if (block->loop_depth > 0)
+            printf("  (loop depth %d)", block->loop_depth);
+        printf("\n");
+
+        for (size_t j = 0; j < block->n_instructions; j++)
+        {
+            ir_instruction_t *instruction = &block->instructions[j];
+            printf("    ");
+            if (ir_has_dst(instruction))
+            {
+                print_operand(function, instruction->dst);
+                printf(" := ");
+            }
+            printf("%s", OPCODE_NAMES[instruction->opcode]);
+
+            switch (instruction->opcode)
+            {
+                case IR_PARAM:
+                    printf(" %d", instruction->a);
+                    break;
+                case IR_COUNT:
+                    printf(" %d", instruction->symbol);
+                    break;
+                case IR_LOAD_GLOBAL:
+                case IR_STORE_GLOBAL:
+                case IR_LOAD_ELEMENT:
+                case IR_STORE_ELEMENT:
+                case IR_CHECK_BOUNDS:
+                case IR_ADDRESS:
+                    printf(" %s", global_symbols->symbols[instruction->symbol]->name);
+                    if (instruction->opcode == IR_LOAD_ELEMENT || instruction->opcode == IR_STORE_ELEMENT
+                        || instruction->opcode == IR_CHECK_BOUNDS)
+                    {
+                        if (instruction->base != IR_NO_OPERAND)
+                        {
+                            printf("@");
+                            print_operand(function, instruction->base);
+                        }
+                        printf("[");
+                        print_operand(function, instruction->a);
+                        printf("]");
+                    }
+                    if (instruction->opcode == IR_STORE_GLOBAL || instruction->opcode == IR_STORE_ELEMENT)
+                    {
+                        printf(", ");
+                        print_operand(function, instruction->opcode == IR_STORE_GLOBAL ? instruction->a : instruction->b);
+                    }
+                    break;
+                case IR_CALL:
+                case IR_TAIL_CALL:
+                case IR_VECTOR_LOOP:
+                    if (instruction->opcode == IR_VECTOR_LOOP)
+                        printf(" %d(", instruction->symbol);
+                    else
+                        printf(" %s(", global_symbols->symbols[instruction->symbol]->name);
+                    for (int32_t k = 0; k < instruction->b; k++)
+                    {
+                        if (k > 0)
+                            printf(", ");
+                        print_operand(function, function->arguments[instruction->a + k]);
+                    }
+                    printf(")");
+                    break;
+                case IR_SELECT:
+                {
+                    ir_operand_t *operands = &function->arguments[instruction->a];
+                    printf(" ");
+                    print_operand(function, operands[0]);
+                    printf(" %s ", RELATION_NAMES[instruction->relation]);
+                    print_operand(function, operands[1]);
+                    printf(" ? ");
+                    print_operand(function, operands[2]);
+                    printf(" : ");
+                    print_operand(function, operands[3]);
+                    break;
+                }
+                case IR_PRINT:
+                    printf(" \"%s\"", print_format_text(instruction->symbol));
+                    for (int32_t k = 0; k < instruction->b; k++)
+                    {
+                        printf(", ");
+                        print_operand(function, function->arguments[instruction->a + k]);
+                    }
+                    break;
+                case IR_PHI:
+                    for (int32_t k = 0; k < instruction->b; k++)
+                    {
+                        printf("%s[B%d: ", k == 0 ? " " : ", ", function->arguments[instruction->a + 2 * k]);
+                        print_operand(function, function->arguments[instruction->a + 2 * k + 1]);
+                        printf("]");
+                    }
+                    break;
+                case IR_JUMP:
+                    printf(" B%d", block->successors[0]);
+                    break;
+                case IR_BRANCH:
+                    printf(" ");
+                    print_operand(function, instruction->a);
+                    printf(" %s ", RELATION_NAMES[instruction->relation]);
+                    print_operand(function, instruction->b);
+                    printf(" ? B%d : B%d", block->successors[0], block->successors[1]);
+                    break;
+                default:
+                    printf(" ");
+                    print_operand(function, instruction->a);
+                    if (instruction->b != IR_NO_OPERAND)
+                    {
+                        printf(", ");
+                        print_operand(function, instruction->b);
+                    }
+                    break;
+            }
+            printf("\n");
+        }
+    }
+    printf("\n");
+}
+
+ir_function_t **ir_lower_program(void)
+{
+    ir_function_t **functions = calloc(global_symbols->n_symbols, sizeof(ir_function_t *));
+    for (size_t i = 0; i < global_symbols->n_symbols; i++)
+    {
+        if (global_symbols->symbols[i]->type != SYMBOL_FUNCTION)
+            continue;
+        functions[i] = ir_lower_function(global_symbols->symbols[i]);
+        ir_optimize_function(functions[i]);
+    }
+
+    // Functions are inlined as they look once optimized, and callers are optimized again with them in place
+    for (size_t i = 0; i < global_symbols->n_symbols; i++)
+        if (functions[i] != NULL && ir_inline_calls(functions[i], functions))
+            ir_optimize_function(functions[i]);
+
+    // Calls that are left are turned into tail calls last, since they can no longer be inlined
+    for (size_t i = 0; i < global_symbols->n_symbols; i++)
+        if (functions[i] != NULL)
+            ir_form_tail_calls(functions[i]);
+    return functions;
+}
+
+void ir_destroy_program(ir_function_t **functions)
+{
+    for (size_t i = 0; i < global_symbols->n_symbols; i++)
+        if (functions[i] != NULL)
+            ir_destroy_function(functions[i]);
+    free(functions);
+}
+
+void print_intermediate_representation(void)
+{
+    ir_function_t **functions = ir_lower_program();
+    for (size_t i = 0; i < global_symbols->n_symbols; i++)
+        if (functions[i] != NULL)
+            ir_print_function(functions[i]);
+    ir_destroy_program(functions);
+}
@@ -0,0 +1,1082 @@
+#include <vslc.h>
+#include "emit.h"
+#include "ir.h"
+#include "regalloc.h"
+#include "print_format.h"
+#include "vectorize.h"
+#include "profile.h"
+
+/* Emits x86-64 assembly from the IR of a function, for the optimizing code generator (-O).
+ * Virtual registers live where register allocation placed them. RAX, RDX and R11 are never allocated,
+ * and are used as scratch registers by the instructions emitted here.
+ */
+
+#define NUM_REGISTER_PARAMS 6
+static const char *REGISTER_PARAMS[NUM_REGISTER_PARAMS] = {RDI, RSI, RDX, RCX, R8, R9};
+
+// The condition code suffix of the jump taken when each relation holds
+static const char *CONDITION_CODES[] = {
+    [IR_EQ] = "e", [IR_NE] = "ne", [IR_LT] = "l", [IR_GE] = "ge", [IR_GT] = "g", [IR_LE] = "le"
+};
+
+#define LOCATION_LENGTH 32
+
+static ir_function_t *function;
+static register_allocation_t *allocation;
+static size_t current_block;
+
+// Leaf functions whose stack slots fit in the red zone below %rsp don't set up a frame at all,
+// and address their stack slots relative to %rsp instead of %rbp
+#define RED_ZONE_SIZE 128
+static bool frameless;
+
+// A function returning early without needing a frame is shrink-wrapped: the entry block and this block run
+// without a frame, which is only set up on the way into the rest of the function. -1 otherwise
+static int early_exit;
+// Set while generating code that runs before the frame, where the parameters are still where the caller put them
+static bool before_frame;
+
+// How many times each virtual register is used
+static size_t *use_counts;
+
+// The blocks starting loops, which are aligned so the loop starts at the beginning of a fetch block
+static bool *loop_headers;
+
+// Block labels are numbered from here, so they stay unique across functions
+static int label_base = 0;
+
+/* Writes the stack slot at the %rbp-relative offset into the buffer. Without a frame, %rbp would have been
+ * pushed right below the return address, so the slot is 8 bytes further down from %rsp
+ */
+static const char *format_stack_slot(int offset, char *buffer)
+{
+    if (frameless)
+        snprintf(buffer, LOCATION_LENGTH, "%d(%s)", offset - 8, RSP);
+    else
+        snprintf(buffer, LOCATION_LENGTH, "%d(%s)", offset, RBP);
+    return buffer;
+}
+
+/* Returns the register the caller passed the parameter in, or NULL if the register is no parameter */
+static const char *incoming_register(ir_operand_t reg)
+{
+    ir_block_t *entry = &function->blocks[0];
+    for (size_t j = 0; j < entry->n_instructions && entry->instructions[j].opcode == IR_PARAM; j++)
+        if (entry->instructions[j].dst == reg && entry->instructions[j].a < NUM_REGISTER_PARAMS)
+            return REGISTER_PARAMS[entry->instructions[j].a];
+    return NULL;
+}
+
+/* Writes the location of the operand into the buffer: an immediate, a register, or a stack slot */
+static const char *format_location(ir_operand_t operand, char *buffer)
+{
+    if (before_frame && IR_IS_REGISTER(operand) && incoming_register(operand) != NULL)
+        return incoming_register(operand);
+    if (IR_IS_CONSTANT(operand))
+        snprintf(buffer, LOCATION_LENGTH, "$%ld", ir_constant_value(function, operand));
+    else if (allocation->registers[operand] != NULL)
+        return allocation->registers[operand];
+    else
+        format_stack_slot(allocation->stack_offsets[operand], buffer);
+    return buffer;
+}
+
+/* Returns the location of the operand. The string is valid until a few more locations have been formatted */
+static const char *location(ir_operand_t operand)
+{
+    static char buffers[8][LOCATION_LENGTH];
+    static int next = 0;
+    next = (next + 1) % 8;
+    return format_location(operand, buffers[next]);
+}
+
+/* Instructions only take immediates that fit in a sign extended 32-bit field */
+static bool is_wide_immediate(const char *location)
+{
+    if (location[0] != '$')
+        return false;
+    int64_t value = strtol(location + 1, NULL, 10);
+    return value < INT32_MIN || value > INT32_MAX;
+}
+
+static bool same_location(const char *a, const char *b)
+{
+    return strcmp(a, b) == 0;
+}
+
+/* Moves between any two locations, going through the scratch register R11 when needed */
+static void generate_move(const char *src, const char *dst)
+{
+    if (same_location(src, dst))
+        return;
+
+    if (is_wide_immediate(src))
+    {
+        const char *reg = asm_is_register(dst) ? dst : R11;
+        EMIT ("movabsq %s, %s", src, reg);
+        if (reg != dst)
+            MOVQ (reg, dst);
+    }
+    else if (asm_is_memory(src) && asm_is_memory(dst))
+    {
+        MOVQ (src, R11);
+        MOVQ (R11, dst);
+    }
+    else
+        MOVQ (src, dst);
+}
+
+/* Returns the operand's location, usable as the source operand of an instruction.
+ * Immediates too wide for that are loaded into the given scratch register first.
+ */
+static const char *generate_source(ir_operand_t operand, const char *scratch)
+{
+    const char *source = location(operand);
+    if (!is_wide_immediate(source))
+        return source;
+    generate_move(source, scratch);
+    return scratch;
+}
+
+/* Performs all the moves as if they happened at the same time, so no source is overwritten before it is read */
+static void generate_parallel_move(const char **destinations, const char **sources, size_t n)
+{
+    bool done[n + 1];
+    const char *from[n + 1];
+    for (size_t i = 0; i < n; i++)
+    {
+        from[i] = sources[i];
+        done[i] = same_location(from[i], destinations[i]);
+    }
+
+    // Stores to the stack can not overwrite any source register, so do them first
+    for (size_t i = 0; i < n; i++)
+    {
+        if (!done[i] && asm_is_memory(destinations[i]))
+        {
+            generate_move(from[i], destinations[i]);
+            done[i] = true;
+        }
+    }
+
+    // Register to register moves are done once no other move needs to read the destination.
+    // If only cycles remain, one destination is saved in R11 to break its cycle.
+    while (true)
+    {
+        bool pending = false, progress = false;
+        for (size_t i = 0; i < n; i++)
+        {
+            if (done[i] || !asm_is_register(from[i]))
+                continue;
+            pending = true;
+
+            bool blocked = false;
+            for (size_t j = 0; j < n && !blocked; j++)
+                blocked = j != i && !done[j] && same_location(from[j], destinations[i]);
+            if (!blocked)
+            {
+                MOVQ (from[i], destinations[i]);
+                done[i] = progress = true;
+            }
+        }
+        if (!pending)
+            break;
+        if (progress)
+            continue;
+
+        for (size_t i = 0; i < n; i++)
+        {
+            if (done[i] || !asm_is_register(from[i]))
+                continue;
+            MOVQ (destinations[i], R11);
+            for (size_t j = 0; j < n; j++)
+                if (!done[j] && same_location(from[j], destinations[i]))
+                    from[j] = R11;
+            break;
+        }
+    }
+
+    // Finally load immediates and stack values into registers
+    for (size_t i = 0; i < n; i++)
+        if (!done[i])
+            generate_move(from[i], destinations[i]);
+}
+
+static void generate_block_label(int block)
+{
+    // At most 10 bytes of padding, which runs once when the loop is entered from right above
+    if (loop_headers[block])
+        DIRECTIVE (".p2align 4,,10");
+    LABEL ("_BB%d", label_base + block);
+}
+
+static void generate_jump(int target)
+{
+    // Jumps to the next block are not needed
+    if ((size_t) target != current_block + 1)
+        EMIT ("jmp _BB%d", label_base + target);
+}
+
+/* Saves %rbp and the callee-saved registers the function uses, and reserves its stack slots */
+static void generate_frame_setup(void)
+{
+    char slot[LOCATION_LENGTH];
+    if (!frameless)
+    {
+        PUSHQ (RBP);
+        MOVQ (RSP, RBP);
+        if (allocation->frame_size > 0)
+            EMIT ("subq $%d, %s", allocation->frame_size, RSP);
+    }
+    for (size_t i = 0; i < allocation->n_used_callee_saved; i++)
+        MOVQ (allocation->used_callee_saved[i], format_stack_slot(-8 * (int) (i + 1), slot));
+}
+
+/* Moves every parameter from where the caller passed it, to where it was allocated.
+ * The parameter 6 is at 16(%rbp), with further parameters moving up from there
+ */
+static void generate_parameter_moves(void)
+{
+    ir_block_t *entry = &function->blocks[0];
+    const char *destinations[entry->n_instructions + 1];
+    const char *sources[entry->n_instructions + 1];
+    char buffers[entry->n_instructions + 1][2][LOCATION_LENGTH];
+    size_t n = 0;
+    for (size_t j = 0; j < entry->n_instructions && entry->instructions[j].opcode == IR_PARAM; j++)
+    {
+        ir_instruction_t *instruction = &entry->instructions[j];
+        destinations[n] = format_location(instruction->dst, buffers[n][0]);
+        if (instruction->a < NUM_REGISTER_PARAMS)
+            sources[n] = REGISTER_PARAMS[instruction->a];
+        else
+            sources[n] = format_stack_slot(16 + (instruction->a - NUM_REGISTER_PARAMS) * 8, buffers[n][1]);
+        n++;
+    }
+    generate_parallel_move(destinations, sources, n);
+}
+
+/* Restores the callee-saved registers the function used, and takes down its frame */
+static void generate_frame_teardown(void)
+{
+    // The early exit of a shrink-wrapped function runs before there is a frame
+    if (current_block == (size_t) early_exit)
+        return;
+
+    char slot[LOCATION_LENGTH];
+    for (size_t i = 0; i < allocation->n_used_callee_saved; i++)
+        MOVQ (format_stack_slot(-8 * (int) (i + 1), slot), allocation->used_callee_saved[i]);
+    if (!frameless)
+    {
+        MOVQ (RBP, RSP);
+        POPQ (RBP);
+    }
+}
+
+static void generate_epilogue(void)
+{
+    generate_frame_teardown();
+    RET;
+}
+
+static bool is_callee_saved(const char *reg)
+{
+    for (size_t i = 0; i < allocation->n_used_callee_saved; i++)
+        if (allocation->used_callee_saved[i] == reg)
+            return true;
+    return false;
+}
+
+static void check_frame_free_use(ir_operand_t *operand, void *context)
+{
+    bool *frame_free = context;
+    if (IR_IS_REGISTER(*operand) && incoming_register(*operand) == NULL
+        && (allocation->registers[*operand] == NULL || is_callee_saved(allocation->registers[*operand])))
+        *frame_free = false;
+}
+
+/* Returns true if the block can run before the frame is set up: it makes no calls, reads only parameters
+ * and values in caller-saved registers, and writes only caller-saved registers no parameter is passed in
+ */
+static bool is_frame_free(ir_block_t *block)
+{
+    bool frame_free = true;
+    for (size_t j = 0; j < block->n_instructions && frame_free; j++)
+    {
+        ir_instruction_t *instruction = &block->instructions[j];
+        if (instruction->opcode == IR_PARAM)
+        {
+            frame_free = instruction->a < NUM_REGISTER_PARAMS;
+            continue;
+        }
+        if (ir_is_call(instruction) || instruction->opcode == IR_TAIL_CALL)
+            return false;
+        ir_for_each_use(function, instruction, check_frame_free_use, &frame_free);
+        if (!ir_has_dst(instruction))
+            continue;
+
+        const char *reg = allocation->registers[instruction->dst];
+        if (reg == NULL || is_callee_saved(reg))
+            return false;
+        ir_block_t *entry = &function->blocks[0];
+        for (size_t p = 0; p < entry->n_instructions && entry->instructions[p].opcode == IR_PARAM; p++)
+            if (REGISTER_PARAMS[entry->instructions[p].a] == reg)
+                return false;
+    }
+    return frame_free;
+}
+
+/* Decides how the frame of the function is set up */
+static void choose_frame_layout(void)
+{
+    // Vector loops clobber registers like calls, but leave the stack alone
+    bool leaf = true;
+    for (size_t i = 0; i < function->n_blocks && leaf; i++)
+        for (size_t j = 0; j < function->blocks[i].n_instructions && leaf; j++)
+            leaf = !ir_is_call(&function->blocks[i].instructions[j])
+                   || function->blocks[i].instructions[j].opcode == IR_VECTOR_LOOP;
+
+    // The red zone has to hold the slots, and the 8 bytes %rbp would have taken
+    frameless = leaf && allocation->frame_size + 8 <= RED_ZONE_SIZE;
+    early_exit = -1;
+    if (frameless)
+        return;
+
+    // Shrink-wrapping: the entry block must only test its parameters, and branch to a block only it jumps to,
+    // which returns. The parameters are moved into place with the frame, which would overwrite anything else
+    ir_block_t *entry = &function->blocks[0];
+    ir_instruction_t *branch = &entry->instructions[entry->n_instructions - 1];
+    size_t n_parameters = 0;
+    while (entry->instructions[n_parameters].opcode == IR_PARAM)
+        n_parameters++;
+    if (branch->opcode != IR_BRANCH || (IR_IS_CONSTANT(branch->a) && IR_IS_CONSTANT(branch->b))
+        || n_parameters + 1 != entry->n_instructions || !is_frame_free(entry))
+        return;
+    for (int s = 0; s < 2 && early_exit < 0; s++)
+    {
+        int exit = entry->successors[s];
+        ir_block_t *block = &function->blocks[exit];
+        if (exit == 0 || exit == entry->successors[1 - s]
+            || block->instructions[block->n_instructions - 1].opcode != IR_RETURN || !is_frame_free(block))
+            continue;
+
+        bool only_predecessor = true;
+        for (size_t i = 1; i < function->n_blocks && only_predecessor; i++)
+            only_predecessor = !ir_is_successor(&function->blocks[i], exit);
+        if (only_predecessor)
+            early_exit = exit;
+    }
+}
+
+/* Multiplication by a constant, using shifts, negation or lea where they do. Returns false for large constants */
+static bool generate_constant_multiplication(ir_operand_t dst_operand, ir_operand_t a_operand, int64_t factor)
+{
+    const char *dst = location(dst_operand);
+    const char *a = location(a_operand);
+    const char *target = asm_is_register(dst) ? dst : R11;
+
+    if (factor == 1)
+    {
+        generate_move(a, dst);
+        return true;
+    }
+
+    bool power_of_two = factor > 0 && (factor & (factor - 1)) == 0;
+    if (factor == -1 || power_of_two)
+    {
+        // Both neg and shl can work in place, even on memory
+        if (!same_location(dst, a))
+            generate_move(a, target);
+        else
+            target = dst;
+        if (factor == -1)
+            NEGQ (target);
+        else
+            EMIT ("shlq $%d, %s", __builtin_ctzll(factor), target);
+        generate_move(target, dst);
+        return true;
+    }
+
+    if (factor == 3 || factor == 5 || factor == 9)
+    {
+        const char *source = a;
+        if (!asm_is_register(source))
+        {
+            generate_move(a, target);
+            source = target;
+        }
+        EMIT ("leaq (%s, %s, %ld), %s", source, source, factor - 1, target);
+        generate_move(target, dst);
+        return true;
+    }
+
+    if (factor >= INT32_MIN && factor <= INT32_MAX)
+    {
+        EMIT ("imulq $%ld, %s, %s", factor, a, target);
+        generate_move(target, dst);
+        return true;
+    }
+    return false;
+}
+
+/* Addition, subtraction and multiplication, which x86 does in place on the destination */
+static void generate_arithmetic(ir_instruction_t *instruction)
+{
+    const char *mnemonic = instruction->opcode == IR_ADD ? "addq" : instruction->opcode == IR_SUB ? "subq" : "imulq";
+    ir_operand_t a_operand = instruction->a, b_operand = instruction->b;
+
+    // Immediates can only be the source operand, so put constants second where the order doesn't matter
+    if (instruction->opcode != IR_SUB && IR_IS_CONSTANT(a_operand) && !IR_IS_CONSTANT(b_operand))
+    {
+        a_operand = instruction->b;
+        b_operand = instruction->a;
+    }
+
+    if (instruction->opcode == IR_MUL && IR_IS_CONSTANT(b_operand) && !IR_IS_CONSTANT(a_operand)
+        && generate_constant_multiplication(instruction->dst, a_operand, ir_constant_value(function, b_operand)))
+        return;
+
+    const char *dst = location(instruction->dst);
+    const char *a = location(a_operand);
+    const char *b = generate_source(b_operand, RAX);
+
+    if (same_location(dst, a))
+    {
+        // imul can not write to memory, and only one operand can be in memory
+        if (asm_is_register(dst) || (instruction->opcode != IR_MUL && !asm_is_memory(b)))
+        {
+            EMIT ("%s %s, %s", mnemonic, b, dst);
+            return;
+        }
+    }
+    else if (asm_is_register(dst) && same_location(dst, b))
+    {
+        if (instruction->opcode != IR_SUB)
+            EMIT ("%s %s, %s", mnemonic, generate_source(a_operand, RAX), dst);
+        else
+        {
+            // dst := a - dst is the same as dst := -dst + a
+            NEGQ (dst);
+            EMIT ("addq %s, %s", generate_source(a_operand, RAX), dst);
+        }
+        return;
+    }
+
+    const char *target = asm_is_register(dst) ? dst : R11;
+    generate_move(a, target);
+    EMIT ("%s %s, %s", mnemonic, b, target);
+    generate_move(target, dst);
+}
+
+/* Finds the magic number and shift for signed division by a divisor that isn't a power of two,
+ * such that n / divisor is the high half of n * magic, shifted right, as described in Hacker's Delight.
+ */
+static void compute_division_magic(int64_t divisor, int64_t *magic, int *shift)
+{
+    const uint64_t two63 = (uint64_t) 1 << 63;
+    uint64_t absolute = divisor < 0 ? -(uint64_t) divisor : (uint64_t) divisor;
+    uint64_t t = two63 + ((uint64_t) divisor >> 63);
+    uint64_t absolute_nc = t - 1 - t % absolute;
+    int p = 63;
+    uint64_t q1 = two63 / absolute_nc, r1 = two63 - q1 * absolute_nc;
+    uint64_t q2 = two63 / absolute, r2 = two63 - q2 * absolute;
+    uint64_t delta;
+    do
+    {
+        p++;
+        q1 *= 2;
+        r1 *= 2;
+        if (r1 >= absolute_nc)
+        {
+            q1++;
+            r1 -= absolute_nc;
+        }
+        q2 *= 2;
+        r2 *= 2;
+        if (r2 >= absolute)
+        {
+            q2++;
+            r2 -= absolute;
+        }
+        delta = absolute - r2;
+    } while (q1 < delta || (q1 == delta && r1 == 0));
+
+    *magic = (int64_t) (q2 + 1);
+    if (divisor < 0)
+        *magic = (int64_t) -(uint64_t) *magic;
+    *shift = p - 64;
+}
+
+/* Signed division by a constant, rounding towards zero like idiv, without the slow idiv */
+static void generate_constant_division(ir_operand_t dst_operand, ir_operand_t a_operand, int64_t divisor)
+{
+    const char *a = location(a_operand);
+    uint64_t absolute = divisor < 0 ? -(uint64_t) divisor : (uint64_t) divisor;
+
+    if ((absolute & (absolute - 1)) == 0)
+    {
+        // Shifting rounds towards negative infinity, so negative dividends get 2^k - 1 added first
+        int k = __builtin_ctzll(absolute);
+        generate_move(a, RAX);
+        MOVQ (RAX, RDX);
+        if (k > 1)
+            EMIT ("sarq $63, %s", RDX);
+        EMIT ("shrq $%d, %s", 64 - k, RDX);
+        ADDQ (RDX, RAX);
+        EMIT ("sarq $%d, %s", k, RAX);
+        if (divisor < 0)
+            NEGQ (RAX);
+        generate_move(RAX, location(dst_operand));
+        return;
+    }
+
+    int64_t magic;
+    int shift;
+    compute_division_magic(divisor, &magic, &shift);
+
+    // The high half of the product lands in RDX
+    char immediate[LOCATION_LENGTH];
+    snprintf(immediate, sizeof(immediate), "$%ld", magic);
+    generate_move(immediate, RAX);
+    EMIT ("imulq %s", a);
+    if (divisor > 0 && magic < 0)
+        ADDQ (a, RDX);
+    if (divisor < 0 && magic > 0)
+        SUBQ (a, RDX);
+    if (shift > 0)
+        EMIT ("sarq $%d, %s", shift, RDX);
+
+    // Add one to negative quotients, to round towards zero
+    MOVQ (RDX, RAX);
+    EMIT ("shrq $63, %s", RAX);
+    ADDQ (RAX, RDX);
+    generate_move(RDX, location(dst_operand));
+}
+
+static void generate_division(ir_instruction_t *instruction)
+{
+    // Division by 0 and -1 can trap, which must still happen. The rest is done with shifts and multiplication
+    if (IR_IS_CONSTANT(instruction->b) && !IR_IS_CONSTANT(instruction->a))
+    {
+        int64_t divisor = ir_constant_value(function, instruction->b);
+        if (divisor == 1)
+        {
+            generate_move(location(instruction->a), location(instruction->dst));
+            return;
+        }
+        if (divisor != 0 && divisor != -1 && divisor != INT64_MIN)
+        {
+            generate_constant_division(instruction->dst, instruction->a, divisor);
+            return;
+        }
+    }
+
+    generate_move(location(instruction->a), RAX);
+    CQO;
+    const char *divisor = location(instruction->b);
+    if (divisor[0] == '$')
+    {
+        generate_move(divisor, R11);
+        divisor = R11;
+    }
+    IDIVQ (divisor);
+    generate_move(RAX, location(instruction->dst));
+}
+
+static void generate_negation(ir_instruction_t *instruction)
+{
+    const char *dst = location(instruction->dst);
+    const char *a = location(instruction->a);
+    if (!same_location(dst, a))
+    {
+        const char *target = asm_is_register(dst) ? dst : R11;
+        generate_move(a, target);
+        NEGQ (target);
+        generate_move(target, dst);
+    }
+    else
+        NEGQ (dst);
+}
+
+/* Stores the source into a memory location, through RDX if it can't be stored directly */
+static void generate_store(const char *source, const char *memory)
+{
+    if (asm_is_memory(source) || is_wide_immediate(source))
+    {
+        generate_move(source, RDX);
+        source = RDX;
+    }
+    MOVQ (source, memory);
+}
+
+/* Loads from a memory location into the destination, through R11 if the destination is in memory */
+static void generate_load(const char *memory, const char *dst)
+{
+    if (asm_is_register(dst))
+        MOVQ (memory, dst);
+    else
+    {
+        MOVQ (memory, R11);
+        MOVQ (R11, dst);
+    }
+}
+
+/* Returns the address of an element of the global array, using RAX and possibly R11.
+ * Accesses inside loops have the address of the array in a register already.
+ */
+static const char *generate_element_address(ir_instruction_t *instruction)
+{
+    static char result[64];
+    const char *base = RAX;
+    const char *name = global_symbols->symbols[instruction->symbol]->name;
+    // Constant elements of the array itself are addressed from the instruction pointer, like global variables
+    if (instruction->base == IR_NO_OPERAND && IR_IS_CONSTANT(instruction->a))
+    {
+        int64_t value = ir_constant_value(function, instruction->a);
+        if (value > -(1 << 27) && value < (1 << 27))
+        {
+            if (value == 0)
+                snprintf(result, sizeof(result), ".%s(%s)", name, RIP);
+            else
+                snprintf(result, sizeof(result), ".%s%+ld(%s)", name, value * 8, RIP);
+            return result;
+        }
+    }
+    if (instruction->base == IR_NO_OPERAND)
+        EMIT ("leaq .%s(%s), %s", name, RIP, RAX);
+    else
+    {
+        base = location(instruction->base);
+        if (!asm_is_register(base))
+        {
+            generate_move(base, RAX);
+            base = RAX;
+        }
+    }
+
+    ir_operand_t index = instruction->a;
+    if (IR_IS_CONSTANT(index))
+    {
+        int64_t value = ir_constant_value(function, index);
+        if (value > -(1 << 27) && value < (1 << 27))
+        {
+            if (value == 0)
+                snprintf(result, sizeof(result), "(%s)", base);
+            else
+                snprintf(result, sizeof(result), "%ld(%s)", value * 8, base);
+            return result;
+        }
+    }
+
+    const char *index_location = location(index);
+    if (!asm_is_register(index_location))
+    {
+        generate_move(index_location, R11);
+        index_location = R11;
+    }
+    snprintf(result, sizeof(result), "(%s, %s, 8)", base, index_location);
+    return result;
+}
+
+static void generate_call(ir_instruction_t *instruction)
+{
+    symbol_t *symbol = global_symbols->symbols[instruction->symbol];
+    ir_operand_t *arguments = &function->arguments[instruction->a];
+    int32_t n_arguments = instruction->b;
+
+    // Arguments after the first six are pushed, so the 7th ends up on top
+    for (int32_t i = n_arguments - 1; i >= NUM_REGISTER_PARAMS; i--)
+        PUSHQ (generate_source(arguments[i], R11));
+
+    const char *sources[NUM_REGISTER_PARAMS];
+    char buffers[NUM_REGISTER_PARAMS][LOCATION_LENGTH];
+    size_t n = 0;
+    for (; n < (size_t) n_arguments && n < NUM_REGISTER_PARAMS; n++)
+        sources[n] = format_location(arguments[n], buffers[n]);
+    generate_parallel_move(REGISTER_PARAMS, sources, n);
+
+    EMIT ("call .%s", symbol->name);
+    if (n_arguments > NUM_REGISTER_PARAMS)
+        EMIT ("addq $%d, %s", (n_arguments - NUM_REGISTER_PARAMS) * 8, RSP);
+    generate_move(RAX, location(instruction->dst));
+}
+
+/* Calls printf with the integers after the format, or puts when the format is a whole line */
+static void generate_print(ir_instruction_t *instruction)
+{
+    const char *sources[PRINT_MAX_VALUES];
+    char buffers[PRINT_MAX_VALUES][LOCATION_LENGTH];
+    size_t n = instruction->b;
+    for (size_t i = 0; i < n; i++)
+        sources[i] = format_location(function->arguments[instruction->a + i], buffers[i]);
+    generate_parallel_move(&REGISTER_PARAMS[1], sources, n);
+
+    EMIT ("leaq format%d(%s), %s", instruction->symbol, RIP, RDI);
+    EMIT ("call %s", print_format_is_line(instruction->symbol) ? "print_line" : "print_formatted");
+}
+
+/* Runs the vector kernel from the counter in %rcx to the end in %rdx, see vectorize.h */
+static void generate_vector_loop_instruction(ir_instruction_t *instruction)
+{
+    ir_operand_t *operands = &function->arguments[instruction->a];
+
+    // The invariants go first, since moving the counter and the end into place may overwrite them
+    for (int32_t i = 2; i < instruction->b; i++)
+    {
+        generate_move(location(operands[i]), RAX);
+        generate_vector_broadcast(instruction->symbol, i - 2);
+    }
+    const char *destinations[2] = {RCX, RDX};
+    const char *sources[2];
+    char buffers[2][LOCATION_LENGTH];
+    for (int i = 0; i < 2; i++)
+        sources[i] = format_location(operands[i], buffers[i]);
+    generate_parallel_move(destinations, sources, 2);
+
+    generate_vector_loop(instruction->symbol);
+    generate_move(RAX, location(instruction->dst));
+}
+
+/* Jumps to the function with our return address still on top of the stack, so it returns to our caller.
+ * The arguments are all passed in registers, which the teardown of our frame leaves alone.
+ */
+static void generate_tail_call(ir_instruction_t *instruction)
+{
+    const char *sources[NUM_REGISTER_PARAMS];
+    char buffers[NUM_REGISTER_PARAMS][LOCATION_LENGTH];
+    size_t n = instruction->b;
+    for (size_t i = 0; i < n; i++)
+        sources[i] = format_location(function->arguments[instruction->a + i], buffers[i]);
+    generate_parallel_move(REGISTER_PARAMS, sources, n);
+
+    generate_frame_teardown();
+    EMIT ("jmp .%s", global_symbols->symbols[instruction->symbol]->name);
+}
+
+static void count_use(ir_operand_t *operand, void *context)
+{
+    (void) context;
+    if (IR_IS_REGISTER(*operand))
+        use_counts[*operand]++;
+}
+
+/* Returns true if the two values are kept in the same register or stack slot */
+static bool same_home(ir_operand_t a, ir_operand_t b)
+{
+    if (!IR_IS_REGISTER(a) || !IR_IS_REGISTER(b))
+        return false;
+    if (allocation->registers[a] != NULL || allocation->registers[b] != NULL)
+        return allocation->registers[a] == allocation->registers[b];
+    return allocation->stack_offsets[a] == allocation->stack_offsets[b];
+}
+
+/* Returns the load in front of the branch ending the block, if the branch is its only use.
+ * The branch compares with memory directly then, and the load is not generated. Copies may come in between,
+ * as long as they leave the address of the load alone
+ */
+static ir_instruction_t *find_fused_load(ir_block_t *block)
+{
+    ir_instruction_t *branch = &block->instructions[block->n_instructions - 1];
+    if (branch->opcode != IR_BRANCH)
+        return NULL;
+    for (size_t j = block->n_instructions - 1; j-- > 0;)
+    {
+        ir_instruction_t *load = &block->instructions[j];
+        if (load->opcode == IR_LOAD_GLOBAL || load->opcode == IR_LOAD_ELEMENT)
+        {
+            if (use_counts[load->dst] != 1 || (branch->a != load->dst && branch->b != load->dst))
+                return NULL;
+            for (size_t k = j + 1; k < block->n_instructions - 1; k++)
+            {
+                ir_operand_t dst = block->instructions[k].dst;
+                if (load->opcode == IR_LOAD_ELEMENT
+                    && (same_home(dst, load->a) || (load->base != IR_NO_OPERAND && same_home(dst, load->base))))
+                    return NULL;
+            }
+            return load;
+        }
+        if (load->opcode != IR_COPY)
+            return NULL;
+    }
+    return NULL;
+}
+
+/* Compares a with b, or with the memory the load reads if it is one of them, and returns the relation
+ * the flags are to be tested for, which is swapped if the operands had to be
+ */
+static ir_relation_t generate_comparison(ir_operand_t a, ir_operand_t b, ir_relation_t relation,
+                                         ir_instruction_t *load)
+{
+    // cmp can only take an immediate as its first operand, and the memory operand of a fused load goes second
+    if (IR_IS_CONSTANT(a) || (load != NULL && b == load->dst))
+    {
+        ir_operand_t swap = a;
+        a = b;
+        b = swap;
+        relation = ir_swap_relation(relation);
+    }
+
+    if (load != NULL)
+    {
+        // The element address uses RAX and R11
+        const char *right = location(b);
+        if (asm_is_memory(right) || is_wide_immediate(right))
+        {
+            generate_move(right, RDX);
+            right = RDX;
+        }
+        char memory[64];
+        if (load->opcode == IR_LOAD_GLOBAL)
+            snprintf(memory, sizeof(memory), ".%s(%s)", global_symbols->symbols[load->symbol]->name, RIP);
+        else
+            snprintf(memory, sizeof(memory), "%s", generate_element_address(load));
+        CMPQ (right, memory);
+    }
+    else
+    {
+        const char *left = location(a);
+        const char *right = generate_source(b, RAX);
+        if (asm_is_memory(left) && asm_is_memory(right))
+        {
+            generate_move(left, R11);
+            left = R11;
+        }
+        // Comparing a register with zero, testing it against itself is shorter
+        if (asm_is_register(left) && strcmp(right, "$0") == 0)
+            TESTQ (left, left);
+        else
+            CMPQ (right, left);
+    }
+    return relation;
+}
+
+/* Jumps to bounds_error in the runtime unless the index is inside the array.
+ * Negative indices are above the length when compared as unsigned, so one comparison covers both ends
+ */
+static void generate_bounds_check(ir_instruction_t *instruction)
+{
+    int64_t length = *(int64_t *) global_symbols->symbols[instruction->symbol]->node->children[1]->data;
+    if (IR_IS_CONSTANT(instruction->a))
+    {
+        if ((uint64_t) ir_constant_value(function, instruction->a) >= (uint64_t) length)
+            EMIT ("jmp bounds_error");
+        return;
+    }
+
+    char immediate[LOCATION_LENGTH];
+    snprintf(immediate, sizeof(immediate), "$%ld", length);
+    const char *limit = immediate;
+    if (is_wide_immediate(limit))
+    {
+        generate_move(limit, R11);
+        limit = R11;
+    }
+    CMPQ (limit, location(instruction->a));
+    EMIT ("jae bounds_error");
+}
+
+static void generate_branch(ir_instruction_t *instruction)
+{
+    ir_block_t *block = &function->blocks[current_block];
+    ir_operand_t a = instruction->a, b = instruction->b;
+    if (IR_IS_CONSTANT(a) && IR_IS_CONSTANT(b))
+    {
+        bool holds = ir_relation_holds(instruction->relation, ir_constant_value(function, a),
+                                       ir_constant_value(function, b));
+        generate_jump(block->successors[holds ? 0 : 1]);
+        return;
+    }
+    ir_relation_t relation = generate_comparison(a, b, instruction->relation, find_fused_load(block));
+
+    int taken = block->successors[0], not_taken = block->successors[1];
+    if (current_block == 0 && early_exit >= 0)
+    {
+        // Shrink-wrapped: the frame is only set up once the early exit isn't taken
+        bool exit_taken = taken == early_exit;
+        EMIT ("j%s _BB%d", CONDITION_CODES[exit_taken ? relation : ir_negate_relation(relation)],
+              label_base + early_exit);
+        before_frame = false;
+        generate_frame_setup();
+        generate_parameter_moves();
+        generate_jump(exit_taken ? not_taken : taken);
+    }
+    else if ((size_t) taken == current_block + 1)
+        EMIT ("j%s _BB%d", CONDITION_CODES[ir_negate_relation(relation)], label_base + not_taken);
+    else
+    {
+        EMIT ("j%s _BB%d", CONDITION_CODES[relation], label_base + taken);
+        generate_jump(not_taken);
+    }
+}
+
+/* A compare and a conditional move, or a set for values that are 0 or 1 */
+static void generate_select(ir_instruction_t *instruction)
+{
+    ir_operand_t *operands = &function->arguments[instruction->a];
+    const char *dst = location(instruction->dst);
+    if (IR_IS_CONSTANT(operands[0]) && IR_IS_CONSTANT(operands[1]))
+    {
+        bool holds = ir_relation_holds(instruction->relation, ir_constant_value(function, operands[0]),
+                                       ir_constant_value(function, operands[1]));
+        generate_move(location(operands[holds ? 2 : 3]), dst);
+        return;
+    }
+    ir_relation_t relation = generate_comparison(operands[0], operands[1], instruction->relation, NULL);
+
+    if (IR_IS_CONSTANT(operands[2]) && IR_IS_CONSTANT(operands[3]))
+    {
+        int64_t if_true = ir_constant_value(function, operands[2]), if_false = ir_constant_value(function, operands[3]);
+        if ((if_true == 1 && if_false == 0) || (if_true == 0 && if_false == 1))
+        {
+            EMIT ("set%s %%al", CONDITION_CODES[if_true == 1 ? relation : ir_negate_relation(relation)]);
+            EMIT ("movzbl %%al, %%eax");
+            generate_move(RAX, dst);
+            return;
+        }
+    }
+
+    // The value for when the relation doesn't hold goes in first. Moves leave the flags as they are
+    generate_move(location(operands[3]), RAX);
+    const char *if_true = location(operands[2]);
+    if (IR_IS_CONSTANT(operands[2]))
+    {
+        generate_move(if_true, R11);
+        if_true = R11;
+    }
+    EMIT ("cmov%s %s, %s", CONDITION_CODES[relation], if_true, RAX);
+    generate_move(RAX, dst);
+}
+
+static void generate_instruction(ir_instruction_t *instruction)
+{
+    switch (instruction->opcode)
+    {
+        case IR_PARAM:
+            // Handled by the prologue
+            break;
+        case IR_COPY:
+            generate_move(location(instruction->a), location(instruction->dst));
+            break;
+        case IR_ADD:
+        case IR_SUB:
+        case IR_MUL:
+            generate_arithmetic(instruction);
+            break;
+        case IR_DIV:
+            generate_division(instruction);
+            break;
+        case IR_NEG:
+            generate_negation(instruction);
+            break;
+        case IR_SELECT:
+            generate_select(instruction);
+            break;
+        case IR_LOAD_GLOBAL:
+        {
+            char memory[64];
+            snprintf(memory, sizeof(memory), ".%s(%s)", global_symbols->symbols[instruction->symbol]->name, RIP);
+            generate_load(memory, location(instruction->dst));
+            break;
+        }
+        case IR_STORE_GLOBAL:
+        {
+            char memory[64];
+            snprintf(memory, sizeof(memory), ".%s(%s)", global_symbols->symbols[instruction->symbol]->name, RIP);
+            generate_store(location(instruction->a), memory);
+            break;
+        }
+        case IR_LOAD_ELEMENT:
+            generate_load(generate_element_address(instruction), location(instruction->dst));
+            break;
+        case IR_STORE_ELEMENT:
+        {
+            const char *value = location(instruction->b);
+            generate_store(value, generate_element_address(instruction));
+            break;
+        }
+        case IR_CHECK_BOUNDS:
+            generate_bounds_check(instruction);
+            break;
+        case IR_COUNT:
+            generate_profile_increment(instruction->symbol);
+            break;
+        case IR_ADDRESS:
+        {
+            const char *dst = location(instruction->dst);
+            const char *target = asm_is_register(dst) ? dst : R11;
+            EMIT ("leaq .%s(%s), %s", global_symbols->symbols[instruction->symbol]->name, RIP, target);
+            generate_move(target, dst);
+            break;
+        }
+        case IR_CALL:
+            generate_call(instruction);
+            break;
+        case IR_PRINT:
+            generate_print(instruction);
+            break;
+        case IR_VECTOR_LOOP:
+            generate_vector_loop_instruction(instruction);
+            break;
+        case IR_JUMP:
+            generate_jump(function->blocks[current_block].successors[0]);
+            break;
+        case IR_BRANCH:
+            generate_branch(instruction);
+            break;
+        case IR_RETURN:
+            generate_move(location(instruction->a), RAX);
+            generate_epilogue();
+            break;
+        case IR_TAIL_CALL:
+            generate_tail_call(instruction);
+            break;
+        default:
+            assert (false && "Unknown IR opcode");
+    }
+}
+
+void generate_ir_function(ir_function_t *ir_function)
+{
+    function = ir_function;
+    allocation = allocate_registers(function);
+
+    choose_frame_layout();
+
+    ir_cfg_t *cfg = ir_analyze_cfg(function);
+    loop_headers = malloc(function->n_blocks * sizeof(bool));
+    for (size_t i = 0; i < function->n_blocks; i++)
+        loop_headers[i] = cfg->immediate_dominator[i] >= 0 && ir_is_loop_header(cfg, i);
+    ir_destroy_cfg(cfg);
+
+    use_counts = calloc(function->n_registers, sizeof(size_t));
+    for (size_t i = 0; i < function->n_blocks; i++)
+        for (size_t j = 0; j < function->blocks[i].n_instructions; j++)
+            ir_for_each_use(function, &function->blocks[i].instructions[j], count_use, NULL);
+
+    LABEL (".%s", function->symbol->name);
+    before_frame = early_exit >= 0;
+    if (!before_frame)
+    {
+        generate_frame_setup();
+        generate_parameter_moves();
+    }
+
+    for (current_block = 0; current_block < function->n_blocks; current_block++)
+    {
+        ir_block_t *block = &function->blocks[current_block];
+        before_frame = current_block == 0 ? early_exit >= 0 : current_block == (size_t) early_exit;
+        generate_block_label(current_block);
+        ir_instruction_t *load = find_fused_load(block);
+        for (size_t j = 0; j < block->n_instructions; j++)
+            if (&block->instructions[j] != load)
+                generate_instruction(&block->instructions[j]);
+    }
+
+    label_base += function->n_blocks;
+    free(use_counts);
+    use_counts = NULL;
+    free(loop_headers);
+    loop_headers = NULL;
+    destroy_register_allocation(allocation);
+    allocation = NULL;
+    function = NULL;
+}
@@ -0,0 +1,765 @@
+#include <vslc.h>
+#include "ir.h"
+#include "print_format.h"
+#include "vectorize.h"
+#include "profile.h"
+
+/* Lowering of function bodies from the bound syntax tree into IR.
+ * Expressions are evaluated in the same order as the unoptimized code generator whenever a call is involved,
+ * since calls may change global variables and arrays. Otherwise, Sethi-Ullman numbering decides the order.
+ * With -fprofile-generate, the counters of the sites are incremented at the same points as in the unoptimized
+ * code, and with -fprofile-use, the branches and calls are marked with what the profile tells about them.
+ */
+
+// Calls made at least this many times are marked as likely, for the inliner
+#define HOT_CALL_COUNT 1000
+
+// For loops running at least this many iterations each time on average are unrolled four times,
+// and those running a quarter as many twice
+#define UNROLL_TRIP_COUNT 16
+
+// Unrolled loop bodies are kept within this many syntax tree nodes
+#define UNROLL_LIMIT 64
+
+static ir_function_t *function;
+static int current_block;
+static int loop_depth;
+
+// The exit blocks of the while loops we are currently inside, for break statements
+static int *break_targets;
+static size_t n_break_targets, break_targets_capacity;
+
+static void lower_statement(node_t *node);
+static ir_operand_t lower_expression(node_t *expression);
+static void assign_local_variable(symbol_t *symbol, ir_operand_t value);
+
+/* Creates a new, empty block at the current loop depth, and returns its index */
+static int new_block(void)
+{
+    return ir_new_block(function, loop_depth);
+}
+
+static void emit(ir_instruction_t instruction)
+{
+    ir_append(&function->blocks[current_block], instruction);
+}
+
+/* Ends the current block with a jump to the target block */
+static void emit_jump(int target)
+{
+    emit((ir_instruction_t) {.opcode = IR_JUMP, .dst = IR_NO_OPERAND, .a = IR_NO_OPERAND, .b = IR_NO_OPERAND});
+    function->blocks[current_block].successors[0] = target;
+}
+
+/* Statements following a return or break are unreachable, but still need a block to be placed in */
+static void start_unreachable_block(void)
+{
+    current_block = new_block();
+}
+
+/* Marks the instruction just emitted, a branch or a call, with what the profile tells about it */
+static void set_profile(ir_profile_t profile)
+{
+    ir_block_t *block = &function->blocks[current_block];
+    block->instructions[block->n_instructions - 1].profile = profile;
+}
+
+/* With -fprofile-generate, emits the increment of the counter of the site */
+static void count_site(node_t *site, profile_counter_t counter)
+{
+    if (profile_generate_path != NULL)
+        emit((ir_instruction_t) {.opcode = IR_COUNT, .symbol = profile_counter(site, counter), .dst = IR_NO_OPERAND,
+                                 .a = IR_NO_OPERAND, .b = IR_NO_OPERAND, .base = IR_NO_OPERAND});
+}
+
+/* With -fprofile-use, gives the counts of the site. Returns false if there are none */
+static bool site_counts(node_t *site, int64_t *reached, int64_t *taken)
+{
+    return profile_use_path != NULL && profile_counts(site, reached, taken) && *reached >= 0 && *taken >= 0;
+}
+
+/* What the profile tells about a branch continuing at successors[0] and at successors[1] the given number of times.
+ * A branch that never ran tells nothing, the block it is in is found to be cold from the branches leading to it
+ */
+static ir_profile_t branch_profile(int64_t taken, int64_t not_taken)
+{
+    if (taken <= 0 && not_taken <= 0)
+        return IR_UNPROFILED;
+    if (taken <= 0)
+        return IR_NEVER;
+    if (not_taken <= 0)
+        return IR_ALWAYS;
+    return taken >= not_taken ? IR_LIKELY : IR_UNLIKELY;
+}
+
+/* Emits an instruction defining a new temporary, and returns the temporary */
+static ir_operand_t emit_value(ir_opcode_t opcode, int32_t symbol, ir_operand_t a, ir_operand_t b)
+{
+    ir_operand_t dst = ir_new_register(function);
+    emit((ir_instruction_t) {.opcode = opcode, .symbol = symbol, .dst = dst, .a = a, .b = b, .base = IR_NO_OPERAND});
+    return dst;
+}
+
+/* Sethi-Ullman numbering: how many temporaries are live at most while the expression is evaluated.
+ * Constants and parameters or local variables are used directly, and need none.
+ */
+static int register_need(node_t *expression)
+{
+    switch (expression->type)
+    {
+        case NUMBER_DATA:
+            return 0;
+        case IDENTIFIER_DATA:
+            return expression->symbol->type == SYMBOL_GLOBAL_VAR ? 1 : 0;
+        case ARRAY_INDEXING:
+        {
+            int need = register_need(expression->children[1]);
+            return need < 1 ? 1 : need;
+        }
+        case EXPRESSION:
+        {
+            if (strcmp(expression->data, "call") == 0)
+                return 1;
+            int need_left = register_need(expression->children[0]);
+            if (expression->n_children == 1)
+                return need_left < 1 ? 1 : need_left;
+            int need_right = register_need(expression->children[1]);
+            if (need_left == need_right)
+                return need_left + 1;
+            return need_left > need_right ? need_left : need_right;
+        }
+        default:
+            assert (false && "Unknown expression type");
+            return 0;
+    }
+}
+
+/* With -fbounds-check, emits the check that the index is inside the array */
+static void check_index(symbol_t *array, ir_operand_t index)
+{
+    if (check_array_bounds)
+        emit((ir_instruction_t) {.opcode = IR_CHECK_BOUNDS, .symbol = array->sequence_number, .dst = IR_NO_OPERAND,
+                                 .a = index, .b = IR_NO_OPERAND, .base = IR_NO_OPERAND});
+}
+
+static ir_operand_t lower_function_call(node_t *call)
+{
+    symbol_t *symbol = get_called_function(call);
+    node_t *argument_list = call->children[1];
+    size_t parameter_count = argument_list->n_children;
+
+    // Arguments are evaluated from right to left, like the unoptimized code generator does
+    ir_operand_t arguments[parameter_count + 1];
+    for (size_t i = parameter_count; i-- > 0;)
+        arguments[i] = lower_expression(argument_list->children[i]);
+
+    int32_t first_argument = ir_add_arguments(function, arguments, parameter_count);
+    count_site(call, PROFILE_REACHED);
+    ir_operand_t result = emit_value(IR_CALL, symbol->sequence_number, first_argument, parameter_count);
+    int64_t reached, taken;
+    if (site_counts(call, &reached, &taken))
+        set_profile(reached == 0 ? IR_NEVER : reached >= HOT_CALL_COUNT ? IR_LIKELY : IR_UNLIKELY);
+    return result;
+}
+
+/* Emits the instructions evaluating the expression, and returns the operand holding its value */
+static ir_operand_t lower_expression(node_t *expression)
+{
+    switch (expression->type)
+    {
+        case NUMBER_DATA:
+            return ir_constant(function, *(int64_t *) expression->data);
+        case IDENTIFIER_DATA:
+        {
+            symbol_t *symbol = get_variable_symbol(expression);
+            if (symbol->type == SYMBOL_GLOBAL_VAR)
+                return emit_value(IR_LOAD_GLOBAL, symbol->sequence_number, IR_NO_OPERAND, IR_NO_OPERAND);
+            return symbol->sequence_number;
+        }
+        case ARRAY_INDEXING:
+        {
+            symbol_t *symbol = get_array_symbol(expression);
+            ir_operand_t index = lower_expression(expression->children[1]);
+            check_index(symbol, index);
+            return emit_value(IR_LOAD_ELEMENT, symbol->sequence_number, index, IR_NO_OPERAND);
+        }
+        case EXPRESSION:
+        {
+            char *data = expression->data;
+            if (strcmp(data, "call") == 0)
+                return lower_function_call(expression);
+            if (expression->n_children == 1)
+            {
+                assert (strcmp(data, "-") == 0);
+                ir_operand_t operand = lower_expression(expression->children[0]);
+                return emit_value(IR_NEG, 0, operand, IR_NO_OPERAND);
+            }
+
+            ir_opcode_t opcode;
+            switch (*data)
+            {
+                case '+': opcode = IR_ADD; break;
+                case '-': opcode = IR_SUB; break;
+                case '*': opcode = IR_MUL; break;
+                case '/': opcode = IR_DIV; break;
+                default:
+                    assert (false && "Unknown expression operation");
+                    return IR_NO_OPERAND;
+            }
+
+            // The unoptimized generator evaluates the RHS first for - and /, and the LHS first otherwise
+            node_t *left = expression->children[0];
+            node_t *right = expression->children[1];
+            bool right_first;
+            if (contains_call(left) || contains_call(right))
+                right_first = opcode == IR_SUB || opcode == IR_DIV;
+            else
+                right_first = register_need(right) > register_need(left);
+
+            ir_operand_t lhs, rhs;
+            if (right_first)
+            {
+                rhs = lower_expression(right);
+                lhs = lower_expression(left);
+            }
+            else
+            {
+                lhs = lower_expression(left);
+                rhs = lower_expression(right);
+            }
+            return emit_value(opcode, 0, lhs, rhs);
+        }
+        default:
+            assert (false && "Unknown expression type");
+            return IR_NO_OPERAND;
+    }
+}
+
+static void lower_assignment_statement(node_t *statement)
+{
+    node_t *dest = statement->children[0];
+    ir_operand_t value = lower_expression(statement->children[1]);
+
+    if (dest->type == ARRAY_INDEXING)
+    {
+        // The value is evaluated before the index, like in the unoptimized code generator
+        symbol_t *symbol = get_array_symbol(dest);
+        ir_operand_t index = lower_expression(dest->children[1]);
+        check_index(symbol, index);
+        emit((ir_instruction_t) {.opcode = IR_STORE_ELEMENT, .symbol = symbol->sequence_number,
+                                 .dst = IR_NO_OPERAND, .a = index, .b = value, .base = IR_NO_OPERAND});
+        return;
+    }
+
+    symbol_t *symbol = get_variable_symbol(dest);
+    if (symbol->type == SYMBOL_GLOBAL_VAR)
+    {
+        emit((ir_instruction_t) {.opcode = IR_STORE_GLOBAL, .symbol = symbol->sequence_number,
+                                 .dst = IR_NO_OPERAND, .a = value, .b = IR_NO_OPERAND});
+        return;
+    }
+
+    assign_local_variable(symbol, value);
+}
+
+/* Assigns the value to the register of the local variable */
+static void assign_local_variable(symbol_t *symbol, ir_operand_t value)
+{
+    // If the value is a temporary that was just computed, compute it straight into the variable instead
+    ir_block_t *block = &function->blocks[current_block];
+    if (IR_IS_REGISTER(value) && value >= function->symbol->function_symtable->n_symbols
+        && block->n_instructions > 0 && block->instructions[block->n_instructions - 1].dst == value)
+    {
+        block->instructions[block->n_instructions - 1].dst = symbol->sequence_number;
+        return;
+    }
+    emit((ir_instruction_t) {.opcode = IR_COPY, .dst = symbol->sequence_number, .a = value, .b = IR_NO_OPERAND});
+}
+
+/* Emits one print for each chunk of items, see print_format.h */
+static void lower_print_statement(node_t *statement)
+{
+    for (size_t first = 0; first < statement->n_children;)
+    {
+        size_t end = print_chunk_end(statement, first);
+        ir_operand_t values[PRINT_MAX_VALUES];
+        size_t n_values = 0;
+        for (size_t i = first; i < end; i++)
+            if (statement->children[i]->type != STRING_DATA)
+                values[n_values++] = lower_expression(statement->children[i]);
+
+        emit((ir_instruction_t) {
+            .opcode = IR_PRINT, .symbol = add_print_format(statement, first, end), .dst = IR_NO_OPERAND,
+            .a = ir_add_arguments(function, values, n_values), .b = n_values
+        });
+        first = end;
+    }
+}
+
+/* Ends the current block with a branch on the relation, to the true_block or the false_block */
+static void lower_relation(node_t *relation, int true_block, int false_block)
+{
+    ir_operand_t lhs = lower_expression(relation->children[0]);
+    ir_operand_t rhs = lower_expression(relation->children[1]);
+
+    ir_relation_t kind;
+    switch (*(char *) relation->data)
+    {
+        case '=': kind = IR_EQ; break;
+        case '!': kind = IR_NE; break;
+        case '<': kind = IR_LT; break;
+        case '>': kind = IR_GT; break;
+        default:
+            assert (false && "Unknown relation");
+            return;
+    }
+
+    emit((ir_instruction_t) {.opcode = IR_BRANCH, .relation = kind, .dst = IR_NO_OPERAND, .a = lhs, .b = rhs});
+    function->blocks[current_block].successors[0] = true_block;
+    function->blocks[current_block].successors[1] = false_block;
+}
+
+static void lower_if_statement(node_t *statement)
+{
+    int then_block = new_block();
+    int else_block = statement->n_children == 3 ? new_block() : -1;
+    int end_block = new_block();
+
+    count_site(statement, PROFILE_REACHED);
+    lower_relation(statement->children[0], then_block, else_block != -1 ? else_block : end_block);
+    int64_t reached, taken;
+    if (site_counts(statement, &reached, &taken))
+        set_profile(branch_profile(taken, reached - taken));
+
+    current_block = then_block;
+    count_site(statement, PROFILE_TAKEN);
+    lower_statement(statement->children[1]);
+    emit_jump(end_block);
+
+    if (else_block != -1)
+    {
+        current_block = else_block;
+        lower_statement(statement->children[2]);
+        emit_jump(end_block);
+    }
+    current_block = end_block;
+}
+
+static void push_break_target(int end_block)
+{
+    if (n_break_targets == break_targets_capacity)
+    {
+        break_targets_capacity = break_targets_capacity * 2 + 8;
+        break_targets = realloc(break_targets, break_targets_capacity * sizeof(int));
+    }
+    break_targets[n_break_targets++] = end_block;
+}
+
+static void lower_while_statement(node_t *statement)
+{
+    int end_block = new_block();
+    loop_depth++;
+    int header_block = new_block();
+    int body_block = new_block();
+
+    count_site(statement, PROFILE_REACHED);
+    emit_jump(header_block);
+    current_block = header_block;
+    lower_relation(statement->children[0], body_block, end_block);
+    int64_t reached, taken;
+    if (site_counts(statement, &reached, &taken))
+        set_profile(branch_profile(taken, reached));
+
+    push_break_target(end_block);
+
+    current_block = body_block;
+    count_site(statement, PROFILE_TAKEN);
+    lower_statement(statement->children[1]);
+    emit_jump(header_block);
+
+    n_break_targets--;
+    loop_depth--;
+    current_block = end_block;
+}
+
+/* Ends the current block with a branch on the relation between the operands */
+static void emit_branch(ir_relation_t relation, ir_operand_t a, ir_operand_t b, int true_block, int false_block)
+{
+    emit((ir_instruction_t) {.opcode = IR_BRANCH, .relation = relation, .dst = IR_NO_OPERAND, .a = a, .b = b});
+    function->blocks[current_block].successors[0] = true_block;
+    function->blocks[current_block].successors[1] = false_block;
+}
+
+/* Runs as many iterations of the for loop as evenly can be done by its vector kernel, see vectorize.h.
+ * The kernel only runs when the counter starts and ends where the kernel stays inside the arrays, and the
+ * counter is left where the rest of the iterations start
+ */
+static void lower_vector_loop(symbol_t *counter, symbol_t *end, vector_loop_t *loop)
+{
+    ir_operand_t start = counter->sequence_number;
+    ir_operand_t width = ir_constant(function, vector_width());
+    int scalar_block = new_block();
+    int started_block = new_block();
+    int counted_block = new_block();
+    int checked_block = new_block();
+    int vector_block = new_block();
+
+    emit_branch(IR_GE, start, ir_constant(function, loop->first), started_block, scalar_block);
+    current_block = started_block;
+    emit_branch(IR_LT, start, end->sequence_number, counted_block, scalar_block);
+
+    // The start is not negative and the end is above it, so the iteration count doesn't overflow
+    current_block = counted_block;
+    ir_operand_t count = emit_value(IR_SUB, 0, end->sequence_number, start);
+    ir_operand_t vectors = emit_value(IR_DIV, 0, count, width);
+    ir_operand_t vectorized = emit_value(IR_MUL, 0, vectors, width);
+    ir_operand_t stop = emit_value(IR_ADD, 0, start, vectorized);
+    emit_branch(IR_GT, vectorized, ir_constant(function, 0), checked_block, scalar_block);
+    current_block = checked_block;
+    emit_branch(IR_LE, stop, ir_constant(function, loop->last), vector_block, scalar_block);
+
+    current_block = vector_block;
+    ir_operand_t operands[loop->n_invariants + 2];
+    operands[0] = start;
+    operands[1] = stop;
+    for (size_t i = 0; i < loop->n_invariants; i++)
+        operands[i + 2] = lower_expression(loop->invariants[i]);
+    size_t n_operands = loop->n_invariants + 2;
+    ir_operand_t sum = emit_value(IR_VECTOR_LOOP, loop->kernel, ir_add_arguments(function, operands, n_operands),
+                                  n_operands);
+    if (loop->sum != NULL)
+    {
+        ir_operand_t variable = loop->sum->sequence_number;
+        emit((ir_instruction_t) {.opcode = IR_ADD, .dst = variable, .a = variable, .b = sum, .base = IR_NO_OPERAND});
+    }
+    assign_local_variable(counter, stop);
+    emit_jump(scalar_block);
+    current_block = scalar_block;
+}
+
+// Offsets from the counter beyond this are not looked at by find_counter_range, so the bounds don't overflow
+#define MAX_COUNTER_OFFSET (INT64_C(1) << 32)
+
+/* Returns the number of syntax tree nodes in the body of a for loop, or 0 if it assigns the counter, or holds
+ * loops, which are better left alone than copied
+ */
+static size_t loop_body_size(node_t *node, symbol_t *counter)
+{
+    if (node->type == FOR_STATEMENT || node->type == WHILE_STATEMENT
+        || (node->type == ASSIGNMENT_STATEMENT && node->children[0]->type == IDENTIFIER_DATA
+            && node->children[0]->symbol == counter))
+        return 0;
+    size_t size = 1;
+    for (size_t i = 0; i < node->n_children; i++)
+    {
+        if (node->children[i] == NULL)
+            continue;
+        size_t child_size = loop_body_size(node->children[i], counter);
+        if (child_size == 0)
+            return 0;
+        size += child_size;
+    }
+    return size;
+}
+
+/* Narrows first and last to where the counter can go, from first up to but not including last, without the
+ * accesses to arrays indexed by the counter plus or minus a constant in the body going outside them
+ */
+static void find_counter_range(node_t *node, symbol_t *counter, int64_t *first, int64_t *last, bool *found)
+{
+    switch (node->type)
+    {
+        case ARRAY_INDEXING:
+        {
+            node_t *index = node->children[1];
+            node_t *left = index, *right = NULL;
+            char operation = '+';
+            if (index->type == EXPRESSION && index->n_children == 2)
+            {
+                operation = *(char *) index->data;
+                left = index->children[0];
+                right = index->children[1];
+                if (operation == '+' && left->type == NUMBER_DATA)
+                {
+                    left = index->children[1];
+                    right = index->children[0];
+                }
+            }
+            if (left->type != IDENTIFIER_DATA || left->symbol != counter || (operation != '+' && operation != '-')
+                || (right != NULL && right->type != NUMBER_DATA))
+                break;
+            int64_t offset = right == NULL ? 0 : *(int64_t *) right->data;
+            if (offset <= -MAX_COUNTER_OFFSET || offset >= MAX_COUNTER_OFFSET)
+                break;
+            if (operation == '-')
+                offset = -offset;
+            int64_t length = *(int64_t *) node->children[0]->symbol->node->children[1]->data;
+            if (-offset > *first)
+                *first = -offset;
+            if (length - offset < *last)
+                *last = length - offset;
+            *found = true;
+            break;
+        }
+        default:
+            break;
+    }
+    for (size_t i = 0; i < node->n_children; i++)
+        if (node->children[i] != NULL)
+            find_counter_range(node->children[i], counter, first, last, found);
+}
+
+/* Emits a loop running the body of the for statement while the counter is below the stop value, testing at the
+ * bottom, and continues at the exit block. Breaks go to the end block. The branches entering and staying in the
+ * loop are marked with the given profiles
+ */
+static void lower_counted_loop(node_t *statement, ir_operand_t stop, int exit_block, int end_block,
+                               ir_profile_t enter, ir_profile_t stay)
+{
+    ir_operand_t counter = get_variable_symbol(statement->children[0])->sequence_number;
+    loop_depth++;
+    int body_block = new_block();
+
+    emit_branch(IR_LT, counter, stop, body_block, exit_block);
+    set_profile(enter);
+
+    push_break_target(end_block);
+    current_block = body_block;
+    count_site(statement, PROFILE_TAKEN);
+    lower_statement(statement->children[3]);
+    emit((ir_instruction_t) {.opcode = IR_ADD, .dst = counter, .a = counter, .b = ir_constant(function, 1),
+                             .base = IR_NO_OPERAND});
+    emit_branch(IR_LT, counter, stop, body_block, exit_block);
+    set_profile(stay);
+
+    n_break_targets--;
+    loop_depth--;
+    current_block = exit_block;
+}
+
+/* Emits a loop running the body of the for statement factor times over, for as long as the counter is at least
+ * that far below the stop value, and continues at the exit block. Each copy of the body sees the counter as the
+ * value at the top of the loop plus its place among them, and the counter steps by the factor at the bottom
+ */
+static void lower_unrolled_loop(node_t *statement, ir_operand_t stop, int factor, int exit_block, int end_block)
+{
+    ir_operand_t counter = get_variable_symbol(statement->children[0])->sequence_number;
+    int guarded_block = new_block();
+
+    // The stop value is far enough above the smallest integer to back off from it without overflowing
+    emit_branch(IR_GT, stop, ir_constant(function, INT64_MIN + factor - 1), guarded_block, exit_block);
+    current_block = guarded_block;
+    ir_operand_t limit = emit_value(IR_SUB, 0, stop, ir_constant(function, factor - 1));
+
+    loop_depth++;
+    int body_block = new_block();
+    emit_branch(IR_LT, counter, limit, body_block, exit_block);
+    set_profile(IR_LIKELY);
+
+    push_break_target(end_block);
+    current_block = body_block;
+    ir_operand_t base = emit_value(IR_COPY, 0, counter, IR_NO_OPERAND);
+    for (int i = 0; i < factor; i++)
+    {
+        if (i > 0)
+            emit((ir_instruction_t) {.opcode = IR_ADD, .dst = counter, .a = base, .b = ir_constant(function, i),
+                                     .base = IR_NO_OPERAND});
+        count_site(statement, PROFILE_TAKEN);
+        lower_statement(statement->children[3]);
+    }
+    emit((ir_instruction_t) {.opcode = IR_ADD, .dst = counter, .a = base, .b = ir_constant(function, factor),
+                             .base = IR_NO_OPERAND});
+    emit_branch(IR_LT, counter, limit, body_block, exit_block);
+    set_profile(IR_LIKELY);
+
+    n_break_targets--;
+    loop_depth--;
+    current_block = exit_block;
+}
+
+/* With -fprofile-use, returns how many times over to unroll the for loop, from how many iterations it ran on
+ * average each time it was reached. Only loops without loops inside them, and not assigning their counter,
+ * are unrolled
+ */
+static int unroll_factor(node_t *statement, symbol_t *counter)
+{
+    int64_t reached, taken;
+    if (!site_counts(statement, &reached, &taken) || reached == 0)
+        return 1;
+    size_t size = loop_body_size(statement->children[3], counter);
+    int64_t iterations = taken / reached;
+    int factor = iterations >= UNROLL_TRIP_COUNT ? 4 : iterations >= UNROLL_TRIP_COUNT / 4 ? 2 : 1;
+    while (factor > 1 && factor * size > UNROLL_LIMIT)
+        factor /= 2;
+    return size == 0 ? 1 : factor;
+}
+
+/* Emits the loop of the for statement up to the stop value, unrolled by the factor if it is above 1, with the
+ * iterations left over run by an ordinary loop after it
+ */
+static void lower_loop_copy(node_t *statement, ir_operand_t stop, int factor, int exit_block, int end_block)
+{
+    if (factor > 1)
+    {
+        int rest_block = new_block();
+        lower_unrolled_loop(statement, stop, factor, rest_block, end_block);
+        lower_counted_loop(statement, stop, exit_block, end_block, IR_UNPROFILED, IR_UNLIKELY);
+        return;
+    }
+
+    ir_profile_t enter = IR_UNPROFILED, stay = IR_UNPROFILED;
+    int64_t reached, taken;
+    if (site_counts(statement, &reached, &taken))
+    {
+        // Only the iterations are counted, so the loop is taken to be entered whenever it ran at all
+        enter = taken > 0 ? IR_LIKELY : branch_profile(0, reached);
+        stay = branch_profile(taken - reached, reached);
+    }
+    lower_counted_loop(statement, stop, exit_block, end_block, enter, stay);
+}
+
+/* With -fbounds-check, runs the iterations of the for loop where the counter indexes inside the arrays
+ * in a copy of the loop of their own, stopping at the first one that doesn't, and leaving the counter there.
+ * The checks of those accesses in the copy are found to always pass by ir_eliminate_bounds_checks, so only the
+ * ordinary loop, doing what is left, pays for them. Returns false if there is no such copy
+ */
+static bool lower_in_bounds_loop(node_t *statement, symbol_t *counter, symbol_t *end, int factor, int end_block)
+{
+    int64_t first = 0, last = INT64_MAX;
+    bool found = false;
+    node_t *body = statement->children[3];
+    if (loop_body_size(body, counter) == 0)
+        return false;
+    find_counter_range(body, counter, &first, &last, &found);
+    if (!found || first >= last)
+        return false;
+
+    int rest_block = new_block();
+    int started_block = new_block();
+    emit_branch(IR_GE, counter->sequence_number, ir_constant(function, first), started_block, rest_block);
+
+    current_block = started_block;
+    ir_operand_t limit = ir_constant(function, last);
+    ir_operand_t operands[4] = {end->sequence_number, limit, end->sequence_number, limit};
+    ir_operand_t stop = ir_new_register(function);
+    emit((ir_instruction_t) {.opcode = IR_SELECT, .relation = IR_LT, .dst = stop,
+                             .a = ir_add_arguments(function, operands, 4), .b = 4, .base = IR_NO_OPERAND});
+    lower_loop_copy(statement, stop, factor, rest_block, end_block);
+    return true;
+}
+
+/* For loops are counted loops, lowered with the test at the bottom, like a rotated while loop.
+ * The counter and the end value are both registers, so the back edge only increments, compares and branches.
+ * Loops over arrays run what they can with a vector kernel first, and loops the profile shows running many
+ * iterations are unrolled. Vector kernels don't count the iterations, so there are none with -fprofile-generate
+ */
+static void lower_for_statement(node_t *statement)
+{
+    symbol_t *counter = get_variable_symbol(statement->children[0]);
+    symbol_t *end = statement->symbol;
+    count_site(statement, PROFILE_REACHED);
+    assign_local_variable(counter, lower_expression(statement->children[1]));
+    assign_local_variable(end, lower_expression(statement->children[2]));
+
+    int factor = unroll_factor(statement, counter);
+    vector_loop_t vector_loop;
+    if (profile_generate_path == NULL && vectorize_for_statement(statement, &vector_loop))
+    {
+        lower_vector_loop(counter, end, &vector_loop);
+        free(vector_loop.invariants);
+        factor = 1;
+    }
+
+    int end_block = new_block();
+    if (check_array_bounds && lower_in_bounds_loop(statement, counter, end, factor, end_block))
+        factor = 1;
+    lower_loop_copy(statement, end->sequence_number, factor, end_block, end_block);
+}
+
+static void lower_statement(node_t *node)
+{
+    switch (node->type)
+    {
+        case BLOCK:
+        {
+            node_t *statement_list = node->children[node->n_children - 1];
+            for (size_t i = 0; i < statement_list->n_children; i++)
+                lower_statement(statement_list->children[i]);
+            break;
+        }
+        case ASSIGNMENT_STATEMENT:
+            lower_assignment_statement(node);
+            break;
+        case PRINT_STATEMENT:
+            lower_print_statement(node);
+            break;
+        case RETURN_STATEMENT:
+        {
+            ir_operand_t value = lower_expression(node->children[0]);
+            emit((ir_instruction_t) {.opcode = IR_RETURN, .dst = IR_NO_OPERAND, .a = value, .b = IR_NO_OPERAND});
+            start_unreachable_block();
+            break;
+        }
+        case IF_STATEMENT:
+            lower_if_statement(node);
+            break;
+        case WHILE_STATEMENT:
+            lower_while_statement(node);
+            break;
+        case FOR_STATEMENT:
+            lower_for_statement(node);
+            break;
+        case BREAK_STATEMENT:
+            emit_jump(break_targets[n_break_targets - 1]);
+            start_unreachable_block();
+            break;
+        default:
+            assert (false && "Unknown statement type");
+    }
+}
+
+ir_function_t *ir_lower_function(symbol_t *symbol)
+{
+    assert (symbol->type == SYMBOL_FUNCTION);
+    symbol_table_t *symtable = symbol->function_symtable;
+
+    function = malloc(sizeof(ir_function_t));
+    *function = (ir_function_t) {
+        .symbol = symbol,
+        .blocks = NULL,
+        .n_blocks = 0,
+        .blocks_capacity = 0,
+        .n_registers = symtable->n_symbols,
+        .constants = NULL,
+        .n_constants = 0,
+        .constants_capacity = 0,
+        .arguments = NULL,
+        .n_arguments = 0,
+        .arguments_capacity = 0
+    };
+    loop_depth = 0;
+    n_break_targets = 0;
+    current_block = new_block();
+
+    // Parameters arrive from the caller, and local variables start out as 0
+    for (size_t i = 0; i < symtable->n_symbols; i++)
+    {
+        if (symtable->symbols[i]->type == SYMBOL_PARAMETER)
+            emit((ir_instruction_t) {.opcode = IR_PARAM, .dst = i, .a = i, .b = IR_NO_OPERAND});
+        else
+            emit((ir_instruction_t) {.opcode = IR_COPY, .dst = i, .a = ir_constant(function, 0), .b = IR_NO_OPERAND});
+    }
+
+    lower_statement(symbol->node->children[2]);
+
+    // In case the function didn't return, return 0 here
+    emit((ir_instruction_t) {.opcode = IR_RETURN, .dst = IR_NO_OPERAND, .a = ir_constant(function, 0), .b = IR_NO_OPERAND});
+
+    free(break_targets);
+    break_targets = NULL;
+    break_targets_capacity = 0;
+
+    ir_function_t *result = function;
+    function = NULL;
+    return result;
+}
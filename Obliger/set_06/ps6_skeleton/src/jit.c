@@ -0,0 +1,96 @@
+#define _DEFAULT_SOURCE // For MAP_ANONYMOUS
+#include <vslc.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include "assembler.h"
+
+/* Runs assembled programs inside the compiler, instead of writing them out for gas and the linker.
+ * The sections are copied into memory from mmap, with .text first and the data on the pages after it.
+ * Programs carry their runtime library from runtime.c with them, so every symbol is defined in the object.
+ * Relocations are then applied like the linker would, and the code pages made executable.
+ */
+
+static const char *section_names[NUM_SECTIONS] = {".text", ".rodata", ".bss"};
+
+static size_t round_up(size_t size, size_t alignment)
+{
+    return (size + alignment - 1) / alignment * alignment;
+}
+
+int run_object(object_t *object, int argc, char **argv)
+{
+    size_t page_size = sysconf(_SC_PAGESIZE);
+    size_t code_size = round_up(object->sizes[SECTION_TEXT], page_size);
+    size_t rodata_offset = code_size;
+    // Like the linker does, .bss starts on a page of its own, so reading past the start of an array finds zeros
+    // instead of the strings in .rodata
+    size_t bss_offset = round_up(rodata_offset + object->sizes[SECTION_RODATA], page_size);
+    size_t total_size = round_up(bss_offset + object->sizes[SECTION_BSS], page_size);
+
+    uint8_t *memory = mmap(NULL, total_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (memory == MAP_FAILED)
+    {
+        perror("error: mmap");
+        exit(EXIT_FAILURE);
+    }
+    uint8_t *bases[NUM_SECTIONS] = {memory, memory + rodata_offset, memory + bss_offset};
+    memcpy(bases[SECTION_TEXT], object->contents[SECTION_TEXT], object->sizes[SECTION_TEXT]);
+    memcpy(bases[SECTION_RODATA], object->contents[SECTION_RODATA], object->sizes[SECTION_RODATA]);
+
+    // Where each symbol ends up
+    uint8_t **addresses = malloc((object->n_symbols + 1) * sizeof(uint8_t *));
+    for (size_t i = 0; i < object->n_symbols; i++)
+    {
+        object_symbol_t *symbol = &object->symbols[i];
+        if (symbol->section < 0)
+        {
+            fprintf(stderr, "error: undefined reference to '%s'\n", symbol->name);
+            exit(EXIT_FAILURE);
+        }
+        addresses[i] = bases[symbol->section] + symbol->offset;
+    }
+
+    for (size_t i = 0; i < object->n_relocations; i++)
+    {
+        object_relocation_t *relocation = &object->relocations[i];
+        uint8_t *field = bases[relocation->section] + relocation->offset;
+        uint8_t *target = relocation->target_section >= 0 ? bases[relocation->target_section]
+                                                          : addresses[relocation->symbol];
+        int64_t value = (int64_t) (target - field) + relocation->addend;
+        // Everything is in one mapping, so this only happens for programs of more than 2 GiB
+        if (value < INT32_MIN || value > INT32_MAX)
+        {
+            fprintf(stderr, "error: relocation at %s+0x%lx does not fit in 32 bits\n",
+                    section_names[relocation->section], (unsigned long) relocation->offset);
+            exit(EXIT_FAILURE);
+        }
+        int32_t displacement = value;
+        memcpy(field, &displacement, sizeof(displacement));
+    }
+
+    uint8_t *main_address = NULL;
+    for (size_t i = 0; i < object->n_symbols; i++)
+        if (strcmp(object->symbols[i].name, "main") == 0 && object->symbols[i].section == SECTION_TEXT)
+            main_address = addresses[i];
+    free(addresses);
+    if (main_address == NULL)
+    {
+        fprintf(stderr, "error: program has no main function\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (mprotect(memory, code_size, PROT_READ | PROT_EXEC) != 0)
+    {
+        perror("error: mprotect");
+        exit(EXIT_FAILURE);
+    }
+
+    // The generated main ends the process with a system call, so this only returns if it is changed not to.
+    // The program writes its output directly, after anything the compiler has printed itself
+    fflush(stdout);
+    int (*entry)(int, char **);
+    *(void **) &entry = main_address;
+    int result = entry(argc, argv);
+    munmap(memory, total_size);
+    return result;
+}
@@ -0,0 +1,212 @@
+#include <vslc.h>
+#include "ir.h"
+
+/* The order the blocks are placed in, for the code generator, which lets a block fall through into the next.
+ * While loops test their condition at the top, so every iteration jumps back up and tests again. Rotating them
+ * copies the test into the blocks jumping to it: in front of the loop it decides whether to enter it at all,
+ * and at the bottom of the body it branches straight back to the start of the body.
+ * The blocks are then laid out in chains, each block followed by the successor it most likely continues in.
+ * With -fprofile-use, branches tell which way they went most often, and blocks only reached along branches that
+ * never went their way are cold, and placed after all the others, out of the way of the code that runs.
+ */
+
+// Loop tests with more instructions than this, not counting the branch, are not copied
+#define ROTATION_LIMIT 8
+
+/* Adds the predecessor to the list of the block, once for each edge, like ir_analyze_cfg */
+static void add_predecessor(ir_cfg_t *cfg, int block, int predecessor)
+{
+    size_t n = cfg->n_predecessors[block];
+    cfg->predecessors[block] = realloc(cfg->predecessors[block], (n + 2) * sizeof(int));
+    cfg->predecessors[block][n] = predecessor;
+    cfg->n_predecessors[block] = n + 1;
+}
+
+/* Removes one edge from the predecessor to the block from the list of the block */
+static void remove_predecessor(ir_cfg_t *cfg, int block, int predecessor)
+{
+    for (size_t k = 0; k < cfg->n_predecessors[block]; k++)
+        if (cfg->predecessors[block][k] == predecessor)
+        {
+            cfg->predecessors[block][k] = cfg->predecessors[block][--cfg->n_predecessors[block]];
+            return;
+        }
+}
+
+/* Rotates the loop with the given header and body, if it tests whether to leave the loop at the top, and the
+ * test is jumped to from inside the loop. The blocks the test is copied into become predecessors of the
+ * successors of the header, in place of the header if nothing else jumps to it. Returns true if it did
+ */
+static bool rotate_loop(ir_function_t *function, ir_cfg_t *cfg, int header, const uint64_t *body)
+{
+    ir_block_t *block = &function->blocks[header];
+    if (header == 0 || block->instructions[block->n_instructions - 1].opcode != IR_BRANCH
+        || block->n_instructions - 1 > ROTATION_LIMIT)
+        return false;
+
+    if (ir_in_loop(cfg, body, block->successors[0]) == ir_in_loop(cfg, body, block->successors[1]))
+        return false;
+
+    // Loops that already branch back at the bottom are left alone
+    bool jumped_to = false;
+    for (size_t k = 0; k < cfg->n_predecessors[header]; k++)
+    {
+        ir_block_t *predecessor = &function->blocks[cfg->predecessors[header][k]];
+        jumped_to |= ir_in_loop(cfg, body, cfg->predecessors[header][k])
+                     && predecessor->instructions[predecessor->n_instructions - 1].opcode == IR_JUMP;
+    }
+    if (!jumped_to)
+        return false;
+
+    // Predecessors may be listed once for each edge
+    size_t n_kept = 0;
+    for (size_t k = 0; k < cfg->n_predecessors[header]; k++)
+    {
+        int p = cfg->predecessors[header][k];
+        ir_block_t *predecessor = &function->blocks[p];
+        if (p == header || predecessor->instructions[predecessor->n_instructions - 1].opcode != IR_JUMP
+            || predecessor->successors[0] != header)
+        {
+            cfg->predecessors[header][n_kept++] = p;
+            continue;
+        }
+
+        predecessor->n_instructions--;
+        block = &function->blocks[header];
+        for (size_t j = 0; j < block->n_instructions; j++)
+        {
+            // Every copy of a call, print or vector loop gets its own arguments, so SSA construction can rename
+            // them apart
+            ir_instruction_t instruction = block->instructions[j];
+            if (instruction.opcode == IR_CALL || instruction.opcode == IR_PRINT || instruction.opcode == IR_VECTOR_LOOP)
+            {
+                ir_operand_t arguments[instruction.b + 1];
+                memcpy(arguments, &function->arguments[instruction.a], instruction.b * sizeof(ir_operand_t));
+                instruction.a = ir_add_arguments(function, arguments, instruction.b);
+            }
+            ir_append(predecessor, instruction);
+        }
+        predecessor->successors[0] = block->successors[0];
+        predecessor->successors[1] = block->successors[1];
+        for (int s = 0; s < 2; s++)
+            add_predecessor(cfg, block->successors[s], p);
+    }
+    cfg->n_predecessors[header] = n_kept;
+
+    // The header is left unreachable when only itself jumps to it
+    bool reachable = false;
+    for (size_t k = 0; k < n_kept; k++)
+        reachable |= cfg->predecessors[header][k] != header;
+    if (!reachable)
+        for (int s = 0; s < 2; s++)
+            remove_predecessor(cfg, block->successors[s], header);
+    return true;
+}
+
+bool ir_rotate_loops(ir_function_t *function)
+{
+    // Rotating a loop only changes the blocks jumping to its header, which no other rotation changes, so the
+    // loops are all found in one analysis of the CFG. They are rotated from the innermost loops out, updating
+    // the predecessors of the successors of each header, and the headers left unreachable are removed at the end
+    ir_loops_t *loops = ir_find_loops(function);
+    bool changed = ir_transform_loops(function, loops, true, rotate_loop);
+    ir_destroy_loops(loops);
+    if (changed)
+        ir_remove_unreachable_blocks(function);
+    return changed;
+}
+
+/* Returns true if the profile shows the block never continuing at its successor number s */
+static bool never_taken(ir_block_t *block, int s)
+{
+    ir_instruction_t *branch = &block->instructions[block->n_instructions - 1];
+    if (branch->opcode != IR_BRANCH || block->successors[0] == block->successors[1])
+        return false;
+    return branch->profile == (s == 0 ? IR_NEVER : IR_ALWAYS);
+}
+
+/* Marks the blocks as cold unless they can be reached from the entry block along edges that were taken */
+static void find_cold_blocks(ir_function_t *function, bool *cold)
+{
+    int worklist[function->n_blocks];
+    size_t n_worklist = 0;
+    for (size_t i = 0; i < function->n_blocks; i++)
+        cold[i] = i != 0;
+    worklist[n_worklist++] = 0;
+    while (n_worklist > 0)
+    {
+        ir_block_t *block = &function->blocks[worklist[--n_worklist]];
+        for (int s = 0; s < ir_successor_count(block); s++)
+        {
+            int successor = block->successors[s];
+            if (cold[successor] && !never_taken(block, s))
+            {
+                cold[successor] = false;
+                worklist[n_worklist++] = successor;
+            }
+        }
+    }
+}
+
+/* Returns the successor the block should be followed by, or -1 if both have been placed already, or are not as
+ * cold as the block. Of two successors, the one the profile shows was taken more often is more likely. Without a
+ * profile, the one nested deeper in loops is, which enters and stays in loops, and otherwise the one taken when
+ * the condition holds, like the then part of an if statement
+ */
+static int preferred_successor(ir_function_t *function, int block, const bool *placed, const bool *cold)
+{
+    ir_block_t *b = &function->blocks[block];
+    ir_instruction_t *terminator = &b->instructions[b->n_instructions - 1];
+    int preferred = -1;
+    for (int s = 0; s < ir_successor_count(b); s++)
+    {
+        int successor = b->successors[s];
+        if (placed[successor] || cold[successor] != cold[block])
+            continue;
+        if (preferred < 0)
+            preferred = successor;
+        else if (terminator->opcode == IR_BRANCH && terminator->profile != IR_UNPROFILED)
+            preferred = terminator->profile == IR_LIKELY || terminator->profile == IR_ALWAYS ? preferred : successor;
+        else if (function->blocks[successor].loop_depth > function->blocks[preferred].loop_depth)
+            preferred = successor;
+    }
+    return preferred;
+}
+
+void ir_order_blocks(ir_function_t *function)
+{
+    size_t n_blocks = function->n_blocks;
+    bool placed[n_blocks], cold[n_blocks];
+    int order[n_blocks], new_index[n_blocks];
+    memset(placed, 0, sizeof(placed));
+    find_cold_blocks(function, cold);
+
+    // Chains start at the first block not placed yet, beginning with the entry block. The cold blocks get
+    // chains of their own, after the others
+    size_t n_placed = 0;
+    for (int pass = 0; pass < 2; pass++)
+    {
+        for (size_t start = 0; start < n_blocks; start++)
+        {
+            if (cold[start] != (pass == 1))
+                continue;
+            for (int block = start; block >= 0 && !placed[block];
+                 block = preferred_successor(function, block, placed, cold))
+            {
+                placed[block] = true;
+                new_index[block] = n_placed;
+                order[n_placed++] = block;
+            }
+        }
+    }
+
+    ir_block_t *blocks = malloc(function->blocks_capacity * sizeof(ir_block_t));
+    for (size_t i = 0; i < n_blocks; i++)
+    {
+        blocks[i] = function->blocks[order[i]];
+        for (int s = 0; s < ir_successor_count(&blocks[i]); s++)
+            blocks[i].successors[s] = new_index[blocks[i].successors[s]];
+    }
+    free(function->blocks);
+    function->blocks = blocks;
+}
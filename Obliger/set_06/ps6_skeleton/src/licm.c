@@ -0,0 +1,171 @@
+#include <vslc.h>
+#include "ir.h"
+
+/* Loop-invariant code motion, on a function in SSA form.
+ * Code is moved to the preheader of the loop, a block that jumps to the header and is the only way into the loop.
+ * The preheader runs even when the loop is left right away, so only instructions that can run without harm
+ * when they otherwise wouldn't have are moved.
+ */
+
+static ir_function_t *function;
+static ir_cfg_t *cfg;
+static int *definitions; // The block defining each virtual register
+
+/* Gives every array access in the loop a register holding the address of the array, computed in the preheader.
+ * Done for the outermost loops first, so a whole loop nest shares the same registers.
+ */
+static bool hoist_array_addresses(ir_function_t *ir_function, ir_cfg_t *loop_cfg, int header, const uint64_t *body)
+{
+    function = ir_function;
+    cfg = loop_cfg;
+
+    ir_operand_t addresses[global_symbols->n_symbols];
+    for (size_t s = 0; s < global_symbols->n_symbols; s++)
+        addresses[s] = IR_NO_OPERAND;
+
+    int preheader = -1;
+    bool changed = false;
+    for (size_t i = 0; i < cfg->n_blocks; i++)
+    {
+        if (!ir_in_loop(cfg, body, i))
+            continue;
+        for (size_t j = 0; j < function->blocks[i].n_instructions; j++)
+        {
+            ir_instruction_t *instruction = &function->blocks[i].instructions[j];
+            if ((instruction->opcode != IR_LOAD_ELEMENT && instruction->opcode != IR_STORE_ELEMENT)
+                || instruction->base != IR_NO_OPERAND)
+                continue;
+
+            if (preheader < 0 && (preheader = ir_find_preheader(function, cfg, header, body)) < 0)
+                return false;
+            instruction = &function->blocks[i].instructions[j];
+
+            if (addresses[instruction->symbol] == IR_NO_OPERAND)
+            {
+                addresses[instruction->symbol] = ir_new_register(function);
+                ir_insert_before_terminator(&function->blocks[preheader], (ir_instruction_t) {
+                    .opcode = IR_ADDRESS, .symbol = instruction->symbol, .dst = addresses[instruction->symbol],
+                    .a = IR_NO_OPERAND, .b = IR_NO_OPERAND, .base = IR_NO_OPERAND
+                });
+                instruction = &function->blocks[i].instructions[j];
+            }
+            instruction->base = addresses[instruction->symbol];
+            changed = true;
+        }
+    }
+    return changed;
+}
+
+typedef struct invariance_context
+{
+    const uint64_t *body;
+    bool invariant;
+} invariance_context_t;
+
+static void check_invariant_use(ir_operand_t *operand, void *context)
+{
+    invariance_context_t *c = context;
+    if (IR_IS_REGISTER(*operand) && ir_in_loop(cfg, c->body, definitions[*operand]))
+        c->invariant = false;
+}
+
+/* Returns true if the instruction gives the same result wherever it is placed in the loop,
+ * and can run in the preheader even if it was never reached in the loop
+ */
+static bool is_movable(ir_instruction_t *instruction, const uint64_t *body, bool loop_has_calls, const bool *stored)
+{
+    switch (instruction->opcode)
+    {
+        case IR_ADD:
+        case IR_SUB:
+        case IR_MUL:
+        case IR_NEG:
+        case IR_ADDRESS:
+            break;
+        case IR_DIV:
+            if (ir_may_trap(function, instruction))
+                return false;
+            break;
+        case IR_LOAD_GLOBAL:
+            // Called functions may assign to any global variable
+            if (loop_has_calls || stored[instruction->symbol])
+                return false;
+            break;
+        default:
+            return false;
+    }
+
+    invariance_context_t context = {.body = body, .invariant = true};
+    ir_for_each_use(function, instruction, check_invariant_use, &context);
+    return context.invariant;
+}
+
+/* Moves the invariant instructions of the loop to its preheader. Done for the innermost loops first,
+ * so code can move out of several loops
+ */
+static bool hoist_invariants(ir_function_t *ir_function, ir_cfg_t *loop_cfg, int header, const uint64_t *body)
+{
+    function = ir_function;
+    cfg = loop_cfg;
+
+    // The global variables assigned in the loop, and whether it calls any functions
+    bool stored[global_symbols->n_symbols];
+    memset(stored, 0, sizeof(stored));
+    bool loop_has_calls = false;
+    for (size_t i = 0; i < cfg->n_blocks; i++)
+    {
+        if (!ir_in_loop(cfg, body, i))
+            continue;
+        ir_block_t *block = &function->blocks[i];
+        for (size_t j = 0; j < block->n_instructions; j++)
+        {
+            if (block->instructions[j].opcode == IR_STORE_GLOBAL)
+                stored[block->instructions[j].symbol] = true;
+            loop_has_calls |= block->instructions[j].opcode == IR_CALL;
+        }
+    }
+
+    // Instructions are visited in reverse postorder, so the ones they depend on are visited first
+    int preheader = -1;
+    bool changed = false;
+    for (size_t r = 0; r < cfg->n_reachable; r++)
+    {
+        int i = cfg->reverse_postorder[r];
+        if (!ir_in_loop(cfg, body, i))
+            continue;
+        for (size_t j = 0; j < function->blocks[i].n_instructions;)
+        {
+            ir_instruction_t instruction = function->blocks[i].instructions[j];
+            if (!is_movable(&instruction, body, loop_has_calls, stored))
+            {
+                j++;
+                continue;
+            }
+            if (preheader < 0 && (preheader = ir_find_preheader(function, cfg, header, body)) < 0)
+                return false;
+
+            ir_block_t *block = &function->blocks[i];
+            memmove(&block->instructions[j], &block->instructions[j + 1],
+                    (block->n_instructions - j - 1) * sizeof(ir_instruction_t));
+            block->n_instructions--;
+            ir_insert_before_terminator(&function->blocks[preheader], instruction);
+            definitions[instruction.dst] = preheader;
+            changed = true;
+        }
+    }
+    return changed;
+}
+
+bool ir_hoist_loop_invariants(ir_function_t *ir_function, ir_loops_t *loops)
+{
+    bool changed = ir_transform_loops(ir_function, loops, false, hoist_array_addresses);
+    // Moving instructions keeps the blocks defining them up to date, so they are only found once
+    definitions = ir_find_definitions(ir_function);
+    changed |= ir_transform_loops(ir_function, loops, true, hoist_invariants);
+
+    free(definitions);
+    definitions = NULL;
+    function = NULL;
+    cfg = NULL;
+    return changed;
+}
@@ -0,0 +1,238 @@
+#include <vslc.h>
+#include "ir.h"
+
+/* Finding the loops of a function, for the passes that transform them.
+ * Loops are found from their back edges, which go to a block dominating the block they leave. That block is the
+ * loop header, and the loop is every block that can reach the back edge without passing through the header.
+ * This finds both while loops, and the while loops for loops are rewritten into.
+ */
+
+// The loops being transformed, or NULL outside ir_transform_loops
+static ir_loops_t *transformed;
+static bool sort_innermost_first; // How compare_loops orders them
+
+bool ir_is_loop_header(ir_cfg_t *cfg, int block)
+{
+    for (size_t k = 0; k < cfg->n_predecessors[block]; k++)
+        if (ir_dominates(cfg, block, cfg->predecessors[block][k]))
+            return true;
+    return false;
+}
+
+size_t ir_find_loop_body(ir_cfg_t *cfg, int header, uint64_t *body)
+{
+    memset(body, 0, IR_SET_WORDS(cfg->n_blocks) * sizeof(uint64_t));
+    int stack[cfg->n_blocks];
+    size_t n_stack = 0, size = 1;
+    IR_SET_ADD(body, header);
+
+    for (size_t k = 0; k < cfg->n_predecessors[header]; k++)
+    {
+        int latch = cfg->predecessors[header][k];
+        if (ir_dominates(cfg, header, latch) && !IR_SET_CONTAINS(body, latch))
+        {
+            IR_SET_ADD(body, latch);
+            stack[n_stack++] = latch;
+            size++;
+        }
+    }
+    while (n_stack > 0)
+    {
+        int block = stack[--n_stack];
+        for (size_t k = 0; k < cfg->n_predecessors[block]; k++)
+        {
+            int predecessor = cfg->predecessors[block][k];
+            if (cfg->immediate_dominator[predecessor] < 0 || IR_SET_CONTAINS(body, predecessor))
+                continue;
+            IR_SET_ADD(body, predecessor);
+            stack[n_stack++] = predecessor;
+            size++;
+        }
+    }
+    return size;
+}
+
+bool ir_in_loop(ir_cfg_t *cfg, const uint64_t *body, int block)
+{
+    return block >= 0 && (size_t) block < cfg->n_blocks && IR_SET_CONTAINS(body, block);
+}
+
+/* Updates the CFG and the loops around the header for a new block placed on the edge from entry to the header.
+ * The entry is the only way into the loop, so it is the immediate dominator of the header, and the new block
+ * goes in between. It gets the dominator tree numbers left free for it, and its place in the reverse postorder
+ */
+static void add_preheader(ir_cfg_t *cfg, int entry, int header, int preheader)
+{
+    assert ((size_t) preheader == cfg->n_blocks && cfg->immediate_dominator[header] == entry);
+    size_t n_blocks = cfg->n_blocks + 1;
+    cfg->predecessors = realloc(cfg->predecessors, n_blocks * sizeof(int *));
+    cfg->n_predecessors = realloc(cfg->n_predecessors, n_blocks * sizeof(size_t));
+    cfg->immediate_dominator = realloc(cfg->immediate_dominator, n_blocks * sizeof(int));
+    cfg->dominated = realloc(cfg->dominated, n_blocks * sizeof(int *));
+    cfg->n_dominated = realloc(cfg->n_dominated, n_blocks * sizeof(size_t));
+    cfg->dominator_preorder = realloc(cfg->dominator_preorder, n_blocks * sizeof(int));
+    cfg->dominator_postorder = realloc(cfg->dominator_postorder, n_blocks * sizeof(int));
+    cfg->reverse_postorder = realloc(cfg->reverse_postorder, n_blocks * sizeof(int));
+    cfg->n_blocks = n_blocks;
+
+    cfg->predecessors[preheader] = malloc(sizeof(int));
+    cfg->predecessors[preheader][0] = entry;
+    cfg->n_predecessors[preheader] = 1;
+    for (size_t k = 0; k < cfg->n_predecessors[header]; k++)
+        if (cfg->predecessors[header][k] == entry)
+            cfg->predecessors[header][k] = preheader;
+
+    cfg->immediate_dominator[preheader] = entry;
+    cfg->immediate_dominator[header] = preheader;
+    for (size_t c = 0; c < cfg->n_dominated[entry]; c++)
+        if (cfg->dominated[entry][c] == header)
+            cfg->dominated[entry][c] = preheader;
+    cfg->dominated[preheader] = malloc(sizeof(int));
+    cfg->dominated[preheader][0] = header;
+    cfg->n_dominated[preheader] = 1;
+    cfg->dominator_preorder[preheader] = cfg->dominator_preorder[header] - 1;
+    cfg->dominator_postorder[preheader] = cfg->dominator_postorder[header] + 1;
+
+    size_t position = 0;
+    while (cfg->reverse_postorder[position] != header)
+        position++;
+    memmove(&cfg->reverse_postorder[position + 1], &cfg->reverse_postorder[position],
+            (cfg->n_reachable - position) * sizeof(int));
+    cfg->reverse_postorder[position] = preheader;
+    cfg->n_reachable++;
+
+    // The new block is inside every loop around the one it is in front of
+    if (transformed == NULL || transformed->cfg != cfg || transformed->loop_of_header[header] < 0)
+        return;
+    ir_loop_t *loops = transformed->loops;
+    for (int l = loops[transformed->loop_of_header[header]].parent; l >= 0; l = loops[l].parent)
+    {
+        IR_SET_ADD(loops[l].body, preheader);
+        loops[l].size++;
+    }
+}
+
+int ir_find_preheader(ir_function_t *function, ir_cfg_t *cfg, int header, const uint64_t *body)
+{
+    int entry = -1;
+    for (size_t k = 0; k < cfg->n_predecessors[header]; k++)
+    {
+        int predecessor = cfg->predecessors[header][k];
+        if (ir_in_loop(cfg, body, predecessor) || cfg->immediate_dominator[predecessor] < 0)
+            continue;
+        if (entry >= 0 && entry != predecessor)
+            return -1;
+        entry = predecessor;
+    }
+    if (entry < 0)
+        return -1;
+    if (ir_successor_count(&function->blocks[entry]) == 1)
+        return entry;
+
+    int preheader = ir_split_edge(function, entry, header);
+    add_preheader(cfg, entry, header, preheader);
+    ir_block_t *block = &function->blocks[header];
+    for (size_t j = 0; j < block->n_instructions && block->instructions[j].opcode == IR_PHI; j++)
+    {
+        ir_instruction_t *phi = &block->instructions[j];
+        for (int32_t k = 0; k < phi->b; k++)
+            if (function->arguments[phi->a + 2 * k] == entry)
+                function->arguments[phi->a + 2 * k] = preheader;
+    }
+    return preheader;
+}
+
+/* Orders the loops to transform from the innermost out, or the other way around. Loops have more blocks than
+ * the loops inside them, and loops of the same size keep the order they were found in
+ */
+static int compare_loops(const void *a, const void *b)
+{
+    const ir_loop_t *first = &transformed->loops[*(const int *) a], *second = &transformed->loops[*(const int *) b];
+    if (first->size != second->size)
+        return (first->size < second->size) == sort_innermost_first ? -1 : 1;
+    return *(const int *) a - *(const int *) b;
+}
+
+/* Places the indices of the loops in the order compare_loops gives */
+static void sort_loops(ir_loops_t *loops, int *order, bool innermost_first)
+{
+    for (size_t l = 0; l < loops->n_loops; l++)
+        order[l] = l;
+    transformed = loops;
+    sort_innermost_first = innermost_first;
+    qsort(order, loops->n_loops, sizeof(int), compare_loops);
+    transformed = NULL;
+}
+
+ir_loops_t *ir_find_loops(ir_function_t *function)
+{
+    ir_loops_t *loops = malloc(sizeof(ir_loops_t));
+    ir_cfg_t *cfg = loops->cfg = ir_analyze_cfg(function);
+
+    // Each loop can get one new block in front of it, so the bodies have room for that many more blocks
+    size_t words = IR_SET_WORDS(cfg->n_blocks + cfg->n_reachable);
+    loops->loops = malloc((cfg->n_reachable + 1) * sizeof(ir_loop_t));
+    loops->n_loops = 0;
+    loops->loop_of_header = malloc(cfg->n_blocks * sizeof(int));
+    for (size_t i = 0; i < cfg->n_blocks; i++)
+        loops->loop_of_header[i] = -1;
+    for (size_t r = 0; r < cfg->n_reachable; r++)
+    {
+        int header = cfg->reverse_postorder[r];
+        if (!ir_is_loop_header(cfg, header))
+            continue;
+        ir_loop_t *loop = &loops->loops[loops->n_loops];
+        loop->header = header;
+        loop->parent = -1;
+        loop->body = calloc(words, sizeof(uint64_t));
+        loop->size = ir_find_loop_body(cfg, header, loop->body);
+        loops->loop_of_header[header] = loops->n_loops++;
+    }
+
+    // Going from the outermost loops in, each one is the innermost loop around the blocks of its body so far
+    int order[loops->n_loops + 1];
+    sort_loops(loops, order, false);
+    int *innermost = malloc(cfg->n_blocks * sizeof(int));
+    for (size_t i = 0; i < cfg->n_blocks; i++)
+        innermost[i] = -1;
+    for (size_t o = 0; o < loops->n_loops; o++)
+    {
+        ir_loop_t *loop = &loops->loops[order[o]];
+        loop->parent = innermost[loop->header];
+        for (size_t i = 0; i < cfg->n_blocks; i++)
+            if (IR_SET_CONTAINS(loop->body, i))
+                innermost[i] = order[o];
+    }
+    free(innermost);
+    return loops;
+}
+
+void ir_destroy_loops(ir_loops_t *loops)
+{
+    if (loops == NULL)
+        return;
+
+    for (size_t l = 0; l < loops->n_loops; l++)
+        free(loops->loops[l].body);
+    free(loops->loops);
+    free(loops->loop_of_header);
+    ir_destroy_cfg(loops->cfg);
+    free(loops);
+}
+
+bool ir_transform_loops(ir_function_t *function, ir_loops_t *loops, bool innermost_first,
+                        bool (*transform)(ir_function_t *function, ir_cfg_t *cfg, int header, const uint64_t *body))
+{
+    int order[loops->n_loops + 1];
+    sort_loops(loops, order, innermost_first);
+
+    bool changed = false;
+    transformed = loops;
+    for (size_t o = 0; o < loops->n_loops; o++)
+    {
+        ir_loop_t *loop = &loops->loops[order[o]];
+        changed |= transform(function, loops->cfg, loop->header, loop->body);
+    }
+    transformed = NULL;
+    return changed;
+}
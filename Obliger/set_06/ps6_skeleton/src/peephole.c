@@ -0,0 +1,215 @@
+#include <vslc.h>
+#include "asm.h"
+
+/* A window based peephole optimizer over the buffered assembly of one function.
+ * Each rule looks at a few lines starting at a position, and rewrites them if they match its pattern.
+ * The rules are applied over the whole buffer until none of them match anywhere.
+ */
+
+typedef struct peephole_rule
+{
+    const char *name;
+    size_t window; // How many lines the rule looks at
+    bool (*apply) ( asm_buffer_t *buffer, size_t position );
+} peephole_rule_t;
+
+static const char *REGISTERS_64[] = {"%rax", "%rbx", "%rcx", "%rdx", "%rsi", "%rdi", "%r8", "%r9",
+                                     "%r10", "%r11", "%r12", "%r13", "%r14", "%r15"};
+static const char *REGISTERS_32[] = {"%eax", "%ebx", "%ecx", "%edx", "%esi", "%edi", "%r8d", "%r9d",
+                                     "%r10d", "%r11d", "%r12d", "%r13d", "%r14d", "%r15d"};
+#define NUM_GENERAL_REGISTERS 14
+
+// Instructions that set all the flags later instructions test, without reading them first.
+// imulq and idivq are left out, since they leave ZF and SF undefined
+static const char *FLAG_SETTERS[] = {"cmpq", "testq", "addq", "subq", "andq", "orq", "xorq", "xorl", "negq"};
+#define NUM_FLAG_SETTERS 9
+
+static bool is_instruction(asm_line_t *line, const char *mnemonic)
+{
+    return line->kind == ASM_INSTRUCTION && strcmp(line->mnemonic, mnemonic) == 0;
+}
+
+/* Returns true if no instruction reads the flags left by the instruction at the position */
+static bool flags_dead_after(asm_buffer_t *buffer, size_t position)
+{
+    for (size_t i = position + 1; i < buffer->n_lines; i++)
+    {
+        asm_line_t *line = &buffer->lines[i];
+        if (line->kind != ASM_INSTRUCTION)
+            continue;
+        if (asm_reads_flags(line->mnemonic))
+            return false;
+        // Flags are never expected to survive jumps, calls or returns in the generated code
+        if (strcmp(line->mnemonic, "jmp") == 0 || strcmp(line->mnemonic, "call") == 0
+            || strcmp(line->mnemonic, "ret") == 0)
+            return true;
+        for (int s = 0; s < NUM_FLAG_SETTERS; s++)
+            if (strcmp(line->mnemonic, FLAG_SETTERS[s]) == 0)
+                return true;
+    }
+    return true;
+}
+
+/* movq x, y; movq y, x  ->  movq x, y
+ * A load into a register its own address is computed from can't be moved back, as the address changes
+ */
+static bool remove_move_back(asm_buffer_t *buffer, size_t position)
+{
+    asm_line_t *first = &buffer->lines[position];
+    asm_line_t *second = &buffer->lines[position + 1];
+    if (!is_instruction(first, "movq") || !is_instruction(second, "movq"))
+        return false;
+    if (strcmp(first->operands[0], second->operands[1]) != 0 || strcmp(first->operands[1], second->operands[0]) != 0)
+        return false;
+    if (asm_is_memory(first->operands[0]) && strstr(first->operands[0], first->operands[1]) != NULL)
+        return false;
+    asm_delete_line(buffer, position + 1);
+    return true;
+}
+
+/* movq %r, mem; movq mem, %s  ->  movq %r, mem; movq %r, %s */
+static bool forward_store(asm_buffer_t *buffer, size_t position)
+{
+    asm_line_t *store = &buffer->lines[position];
+    asm_line_t *load = &buffer->lines[position + 1];
+    if (!is_instruction(store, "movq") || !is_instruction(load, "movq"))
+        return false;
+    if (!asm_is_register(store->operands[0]) || !asm_is_memory(store->operands[1]) || !asm_is_register(load->operands[1]))
+        return false;
+    if (strcmp(store->operands[1], load->operands[0]) != 0)
+        return false;
+
+    char *source = strdup(store->operands[0]);
+    char *destination = strdup(load->operands[1]);
+    asm_set_instruction(load, "movq", source, destination);
+    free(source);
+    free(destination);
+    return true;
+}
+
+/* movq $0, %r  ->  xorl %r32, %r32, which is shorter, when the flags it sets are not needed */
+static bool zero_with_xor(asm_buffer_t *buffer, size_t position)
+{
+    asm_line_t *line = &buffer->lines[position];
+    if (!is_instruction(line, "movq") || strcmp(line->operands[0], "$0") != 0)
+        return false;
+    for (int r = 0; r < NUM_GENERAL_REGISTERS; r++)
+    {
+        if (strcmp(line->operands[1], REGISTERS_64[r]) != 0)
+            continue;
+        if (!flags_dead_after(buffer, position))
+            return false;
+        asm_set_instruction(line, "xorl", REGISTERS_32[r], REGISTERS_32[r]);
+        return true;
+    }
+    return false;
+}
+
+/* addq $0, x / subq $0, x / imulq $1, x, when the flags they set are not needed */
+static bool remove_identity_arithmetic(asm_buffer_t *buffer, size_t position)
+{
+    asm_line_t *line = &buffer->lines[position];
+    bool identity = ((is_instruction(line, "addq") || is_instruction(line, "subq")) && line->n_operands == 2
+                     && strcmp(line->operands[0], "$0") == 0)
+                    || (is_instruction(line, "imulq") && line->n_operands == 2 && strcmp(line->operands[0], "$1") == 0);
+    if (!identity || !flags_dead_after(buffer, position))
+        return false;
+    asm_delete_line(buffer, position);
+    return true;
+}
+
+static const peephole_rule_t RULES[] = {
+    {"remove move back", 2, remove_move_back},
+    {"forward store", 2, forward_store},
+    {"zero with xor", 1, zero_with_xor},
+    {"remove identity arithmetic", 1, remove_identity_arithmetic},
+};
+#define NUM_RULES (sizeof(RULES) / sizeof(RULES[0]))
+
+static uint64_t hash_name(const char *name, size_t length)
+{
+    uint64_t hash = 14695981039346656037ull;
+    for (size_t i = 0; i < length; i++)
+        hash = (hash ^ (uint8_t) name[i]) * 1099511628211ull;
+    return hash;
+}
+
+/* Local labels are the ones the code generators make up, which all start with _.
+ * The operands naming them are collected once into an open addressing hash table, with NULL for empty slots
+ */
+static bool remove_unused_labels(asm_buffer_t *buffer)
+{
+    size_t n_references = 0;
+    for (size_t j = 0; j < buffer->n_lines; j++)
+        if (buffer->lines[j].kind == ASM_INSTRUCTION)
+            for (int k = 0; k < buffer->lines[j].n_operands; k++)
+                n_references += buffer->lines[j].operands[k][0] == '_';
+
+    size_t table_size = 16;
+    while (table_size < 2 * n_references)
+        table_size *= 2;
+    const char **table = calloc(table_size, sizeof(const char *));
+    for (size_t j = 0; j < buffer->n_lines; j++)
+    {
+        asm_line_t *other = &buffer->lines[j];
+        if (other->kind != ASM_INSTRUCTION)
+            continue;
+        for (int k = 0; k < other->n_operands; k++)
+        {
+            const char *operand = other->operands[k];
+            if (operand[0] != '_')
+                continue;
+            size_t slot = hash_name(operand, strlen(operand)) & (table_size - 1);
+            while (table[slot] != NULL && strcmp(table[slot], operand) != 0)
+                slot = (slot + 1) & (table_size - 1);
+            table[slot] = operand;
+        }
+    }
+
+    // The unused labels are moved behind the lines that are kept, and deleted from the end
+    asm_line_t *unused = malloc((buffer->n_lines + 1) * sizeof(asm_line_t));
+    size_t n_kept = 0, n_unused = 0;
+    for (size_t i = 0; i < buffer->n_lines; i++)
+    {
+        asm_line_t *line = &buffer->lines[i];
+        bool used = true;
+        if (line->kind == ASM_LABEL && line->text[0] == '_')
+        {
+            size_t length = strlen(line->text) - 1; // Without the colon
+            size_t slot = hash_name(line->text, length) & (table_size - 1);
+            used = false;
+            for (; table[slot] != NULL && !used; slot = (slot + 1) & (table_size - 1))
+                used = strncmp(table[slot], line->text, length) == 0 && table[slot][length] == '\0';
+        }
+        if (used)
+            buffer->lines[n_kept++] = *line;
+        else
+            unused[n_unused++] = *line;
+    }
+    memcpy(&buffer->lines[n_kept], unused, n_unused * sizeof(asm_line_t));
+    for (size_t i = 0; i < n_unused; i++)
+        asm_delete_line(buffer, buffer->n_lines - 1);
+    free(unused);
+    free(table);
+    return n_unused > 0;
+}
+
+void peephole_optimize(asm_buffer_t *buffer)
+{
+    bool changed = true;
+    while (changed)
+    {
+        changed = false;
+        for (size_t i = 0; i < buffer->n_lines; i++)
+        {
+            for (size_t r = 0; r < NUM_RULES && i < buffer->n_lines; r++)
+            {
+                if (i + RULES[r].window > buffer->n_lines || buffer->lines[i].kind != ASM_INSTRUCTION)
+                    continue;
+                if (RULES[r].apply(buffer, i))
+                    changed = true;
+            }
+        }
+        changed |= remove_unused_labels(buffer);
+    }
+}
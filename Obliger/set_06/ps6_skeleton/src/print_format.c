@@ -0,0 +1,138 @@
+#include <vslc.h>
+#include "emit.h"
+#include "assembler.h"
+#include "print_format.h"
+
+/* The table of format strings for print statements, shared by both code generators.
+ * Every integer item prints as "%ld ", and every string item as its text followed by a space, like they did
+ * when each item was its own printf call. Percent signs in the text are doubled, except in lines for puts,
+ * and the text is escaped again for .asciz, so it can hold any character the string literal could.
+ */
+
+typedef struct print_format
+{
+    char *text;
+    bool line;
+} print_format_t;
+
+static print_format_t *formats;
+static size_t n_formats, formats_capacity;
+
+// The text of the format being built
+static char *text;
+static size_t text_length, text_capacity;
+
+size_t print_chunk_end(node_t *statement, size_t first)
+{
+    size_t end = first, n_values = 0;
+    for (; end < statement->n_children; end++)
+    {
+        node_t *item = statement->children[end];
+        if (item->type == STRING_DATA)
+            continue;
+        if (n_values == PRINT_MAX_VALUES || (end > first && contains_call(item)))
+            break;
+        n_values++;
+    }
+    return end;
+}
+
+static void append_text(const char *characters, size_t length)
+{
+    if (text_length + length + 1 > text_capacity)
+    {
+        text_capacity = (text_length + length + 1) * 2;
+        text = realloc(text, text_capacity);
+    }
+    memcpy(text + text_length, characters, length);
+    text_length += length;
+    text[text_length] = '\0';
+}
+
+/* Appends the character, escaped for .asciz if it is not printable as it is */
+static void append_character(uint8_t character)
+{
+    if (character == '"' || character == '\\')
+    {
+        char escaped[2] = {'\\', character};
+        append_text(escaped, 2);
+    }
+    else if (character < ' ' || character > '~')
+    {
+        char escaped[5];
+        snprintf(escaped, sizeof(escaped), "\\%03o", character);
+        append_text(escaped, 4);
+    }
+    else
+        append_text((const char *) &character, 1);
+}
+
+size_t add_print_format(node_t *statement, size_t first, size_t end)
+{
+    bool line = end == statement->n_children;
+    for (size_t i = first; i < end && line; i++)
+        line = statement->children[i]->type == STRING_DATA;
+
+    text_length = 0;
+    append_text("", 0);
+    for (size_t i = first; i < end; i++)
+    {
+        node_t *item = statement->children[i];
+        if (item->type != STRING_DATA)
+        {
+            append_text("%ld ", 4);
+            continue;
+        }
+
+        // printf stops at the first null character of the string, so the format does too
+        size_t length;
+        uint8_t *characters = decode_string_literal(string_list[*(uint64_t *) item->data], &length);
+        for (uint8_t *c = characters; *c != '\0'; c++)
+        {
+            if (*c == '%' && !line)
+                append_character('%');
+            append_character(*c);
+        }
+        append_character(' ');
+        free(characters);
+    }
+    if (end == statement->n_children && !line)
+        append_text("\\n", 2);
+
+    for (size_t i = 0; i < n_formats; i++)
+        if (formats[i].line == line && strcmp(formats[i].text, text) == 0)
+            return i;
+
+    if (n_formats == formats_capacity)
+    {
+        formats_capacity = formats_capacity * 2 + 16;
+        formats = realloc(formats, formats_capacity * sizeof(print_format_t));
+    }
+    formats[n_formats] = (print_format_t) {.text = strdup(text), .line = line};
+    return n_formats++;
+}
+
+bool print_format_is_line(size_t format)
+{
+    return formats[format].line;
+}
+
+const char *print_format_text(size_t format)
+{
+    return formats[format].text;
+}
+
+void generate_print_formats(void)
+{
+    if (n_formats > 0)
+        DIRECTIVE (".section %s", ASM_STRING_SECTION);
+    for (size_t i = 0; i < n_formats; i++)
+    {
+        DIRECTIVE ("format%zu: \t.asciz \"%s\"", i, formats[i].text);
+        free(formats[i].text);
+    }
+    n_formats = 0;
+    free(text);
+    text = NULL;
+    text_capacity = 0;
+}
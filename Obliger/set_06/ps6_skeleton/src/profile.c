@@ -0,0 +1,263 @@
+#include <vslc.h>
+#include "emit.h"
+#include "profile.h"
+
+/* The sites of the program, their counters in generated programs, and the profile read back.
+ * The counters are an array of quadwords in .bss, two for each site in order. write_profile prints them with
+ * print_formatted from the runtime, with a format for each site naming it, after pointing standard out to the
+ * profile file.
+ */
+
+typedef struct site
+{
+    node_t *node;
+    symbol_t *function;
+    size_t number;      // Among the sites of the function
+    bool profiled;      // Whether the profile read has counts for it
+    int64_t counts[2];  // Indexed by profile_counter_t
+} site_t;
+
+static site_t *sites;       // In order through the program
+static size_t n_sites, sites_capacity;
+static site_t **sorted;     // The sites sorted by node, for looking them up
+static bool numbered;
+static size_t last_found;   // The index after the site read_profile found last
+
+/* Returns the name the profile uses for the kind of site, or NULL if the node is not a site */
+static const char *site_kind(node_t *node)
+{
+    switch (node->type)
+    {
+        case IF_STATEMENT:
+            return "if";
+        case WHILE_STATEMENT:
+            return "while";
+        case FOR_STATEMENT:
+            return "for";
+        case EXPRESSION:
+            return strcmp(node->data, "call") == 0 ? "call" : NULL;
+        default:
+            return NULL;
+    }
+}
+
+static void find_sites(node_t *node, symbol_t *function, size_t *number)
+{
+    if (site_kind(node) != NULL)
+    {
+        if (n_sites == sites_capacity)
+        {
+            sites_capacity = sites_capacity * 2 + 16;
+            sites = realloc(sites, sites_capacity * sizeof(site_t));
+        }
+        sites[n_sites++] = (site_t) {.node = node, .function = function, .number = (*number)++};
+    }
+    for (size_t i = 0; i < node->n_children; i++)
+        if (node->children[i] != NULL)
+            find_sites(node->children[i], function, number);
+}
+
+static int compare_nodes(const void *a, const void *b)
+{
+    uintptr_t x = (uintptr_t) (*(site_t * const *) a)->node, y = (uintptr_t) (*(site_t * const *) b)->node;
+    return (x > y) - (x < y);
+}
+
+static void number_sites(void)
+{
+    if (numbered)
+        return;
+    numbered = true;
+    for (size_t i = 0; i < global_symbols->n_symbols; i++)
+    {
+        symbol_t *symbol = global_symbols->symbols[i];
+        size_t number = 0;
+        if (symbol->type == SYMBOL_FUNCTION)
+            find_sites(symbol->node->children[2], symbol, &number);
+    }
+
+    sorted = malloc((n_sites + 1) * sizeof(site_t *));
+    for (size_t i = 0; i < n_sites; i++)
+        sorted[i] = &sites[i];
+    qsort(sorted, n_sites, sizeof(site_t *), compare_nodes);
+}
+
+static site_t *find_site(node_t *node)
+{
+    number_sites();
+    site_t key = {.node = node}, *pointer = &key;
+    site_t **found = bsearch(&pointer, sorted, n_sites, sizeof(site_t *), compare_nodes);
+    assert (found != NULL && "Not a site");
+    return *found;
+}
+
+size_t profile_counter(node_t *site, profile_counter_t counter)
+{
+    return (find_site(site) - sites) * 2 + counter;
+}
+
+void generate_profile_increment(size_t counter)
+{
+    EMIT ("incq profile_counters+%zu(%s)", counter * 8, RIP);
+}
+
+/* Writes the buffered output up to output_length, and empties the buffer */
+static void generate_write_output(void)
+{
+    EMIT ("leaq output_buffer(%s), %s", RIP, R8);
+    EMIT ("addq output_length(%s), %s", RIP, R8);
+    EMIT ("call flush_output");
+    XORQ (RAX, RAX);
+    MOVQ (RAX, "output_length(%rip)");
+}
+
+void generate_profile_writer(void)
+{
+    number_sites();
+
+    // Keeps the exit code in %rdi for exit_program
+    DIRECTIVE (".text");
+    LABEL ("write_profile");
+    PUSHQ (RDI);
+    PUSHQ (RBX);
+    PUSHQ (R12);
+    generate_write_output();
+    MOVQ (ASM_SYSCALL_OPEN, RAX);
+    EMIT ("leaq profile_path(%s), %s", RIP, RDI);
+    MOVQ (ASM_OPEN_FOR_WRITING, RSI);
+    MOVQ ("$420", RDX); // Readable by everyone, and writable by the owner
+    EMIT ("syscall");
+    // A profile that can't be written is left out, like output to a closed pipe
+    TESTQ (RAX, RAX);
+    EMIT ("js profile_done");
+    MOVQ (RAX, RDI);
+    MOVQ ("$1", RSI);
+    MOVQ (ASM_SYSCALL_DUP2, RAX);
+    EMIT ("syscall");
+
+    // %rbx walks through the formats, which follow each other, and %r12 through the counters
+    EMIT ("leaq profile_formats(%s), %s", RIP, RBX);
+    EMIT ("leaq profile_counters(%s), %s", RIP, R12);
+    LABEL ("profile_next");
+    EMIT ("movzbl (%s), %%eax", RBX);
+    TESTQ (RAX, RAX);
+    EMIT ("je profile_written");
+    MOVQ (RBX, RDI);
+    MOVQ (MEM(R12), RSI);
+    EMIT ("movq 8(%s), %s", R12, RDX);
+    EMIT ("call print_formatted");
+    ADDQ ("$16", R12);
+    LABEL ("profile_skip");
+    EMIT ("movzbl (%s), %%eax", RBX);
+    INCQ (RBX);
+    TESTQ (RAX, RAX);
+    EMIT ("jne profile_skip");
+    EMIT ("jmp profile_next");
+    LABEL ("profile_written");
+    generate_write_output();
+    LABEL ("profile_done");
+    POPQ (R12);
+    POPQ (RBX);
+    POPQ (RDI);
+    RET;
+
+    DIRECTIVE (".section %s", ASM_STRING_SECTION);
+    char path[4 * strlen(profile_generate_path) + 1];
+    size_t length = 0;
+    for (const char *c = profile_generate_path; *c != '\0'; c++)
+    {
+        if (*c == '"' || *c == '\\')
+            length += sprintf(path + length, "\\%c", *c);
+        else if (*c < ' ' || *c > '~')
+            length += sprintf(path + length, "\\%03o", (uint8_t) *c);
+        else
+            path[length++] = *c;
+    }
+    path[length] = '\0';
+    DIRECTIVE ("profile_path: \t.asciz \"%s\"", path);
+    LABEL ("profile_formats");
+    for (size_t i = 0; i < n_sites; i++)
+        DIRECTIVE ("\t.asciz \"%s %zu %s %%ld %%ld\\n\"", sites[i].function->name, sites[i].number,
+                   site_kind(sites[i].node));
+    DIRECTIVE ("\t.asciz \"\"");
+
+    DIRECTIVE (".section %s", ASM_BSS_SECTION);
+    DIRECTIVE (".align 8");
+    LABEL ("profile_counters");
+    if (n_sites > 0)
+        DIRECTIVE ("\t.zero %zu", n_sites * 16);
+}
+
+/* Finds the site by the name of its function and its number. The lines of a profile come in the order of the
+ * sites, so the search starts after the site found last
+ */
+static site_t *find_numbered_site(const char *name, size_t number)
+{
+    for (size_t k = 0; k < n_sites; k++)
+    {
+        size_t i = (last_found + k) % n_sites;
+        if (sites[i].number == number && strcmp(sites[i].function->name, name) == 0)
+        {
+            last_found = i + 1;
+            return &sites[i];
+        }
+    }
+    return NULL;
+}
+
+void read_profile(const char *path)
+{
+    FILE *file = fopen(path, "r");
+    if (file == NULL)
+    {
+        fprintf(stderr, "error: could not read the profile '%s'\n", path);
+        exit(EXIT_FAILURE);
+    }
+    number_sites();
+
+    // Function names can be any length, so every line is read whole, and its words are no longer than it
+    char *line = NULL;
+    size_t capacity = 0;
+    ssize_t length;
+    while ((length = getline(&line, &capacity, file)) != -1)
+    {
+        char name[length + 1], kind[length + 1];
+        size_t number;
+        int64_t reached, taken;
+        int matched = sscanf(line, "%s %zu %s %ld %ld", name, &number, kind, &reached, &taken);
+        if (matched == EOF)
+            continue;
+        if (matched != 5)
+        {
+            fprintf(stderr, "error: the profile '%s' is malformed\n", path);
+            exit(EXIT_FAILURE);
+        }
+        site_t *site = find_numbered_site(name, number);
+        if (site == NULL || strcmp(kind, site_kind(site->node)) != 0)
+            continue;
+        site->profiled = true;
+        site->counts[PROFILE_REACHED] = reached;
+        site->counts[PROFILE_TAKEN] = taken;
+    }
+    free(line);
+    fclose(file);
+}
+
+bool profile_counts(node_t *node, int64_t *reached, int64_t *taken)
+{
+    site_t *site = find_site(node);
+    *reached = site->counts[PROFILE_REACHED];
+    *taken = site->counts[PROFILE_TAKEN];
+    return site->profiled;
+}
+
+void destroy_profile(void)
+{
+    free(sites);
+    free(sorted);
+    sites = NULL;
+    sorted = NULL;
+    n_sites = sites_capacity = 0;
+    last_found = 0;
+    numbered = false;
+}
@@ -0,0 +1,464 @@
+#include <vslc.h>
+#include "ir.h"
+
+/* Value range analysis, removing the bounds checks of -fbounds-check that can never fail.
+ * Every register gets an interval its value always lies in. Like in SCCP, values start out empty, and grow as
+ * the instructions defining them are evaluated, so values going around loops are handled optimistically.
+ * Phis that keep growing are widened to the next constant of the function, or to the end of the range, so the
+ * iteration ends, and a few rounds of evaluating everything again then narrow them back down.
+ * Values flowing into phis, and indices at the checks, are narrowed by the branches on the way there, and by the
+ * checks that passed before them. Arithmetic that may wrap around gives the full range.
+ */
+
+typedef struct range
+{
+    int64_t low, high; // Empty when low > high
+} range_t;
+
+#define FULL_RANGE ((range_t) {INT64_MIN, INT64_MAX})
+#define EMPTY_RANGE ((range_t) {INT64_MAX, INT64_MIN})
+
+// How many times a phi may grow before it is widened
+#define WIDENING_DELAY 2
+#define NARROWING_ROUNDS 2
+// How far the range of an index is followed back through additions of constants
+#define MAX_OFFSET_DEPTH 4
+
+static ir_function_t *function;
+static ir_cfg_t *cfg;
+static range_t *ranges;          // Indexed by virtual register
+static int *n_changes;           // How many times each register has grown
+static ir_instruction_t **definitions;
+static int64_t *thresholds;      // The bounds phis are widened to, sorted
+static size_t n_thresholds;
+
+static bool is_empty(range_t range)
+{
+    return range.low > range.high;
+}
+
+static range_t join(range_t a, range_t b)
+{
+    if (is_empty(a))
+        return b;
+    if (is_empty(b))
+        return a;
+    return (range_t) {a.low < b.low ? a.low : b.low, a.high > b.high ? a.high : b.high};
+}
+
+static range_t meet(range_t a, range_t b)
+{
+    return (range_t) {a.low > b.low ? a.low : b.low, a.high < b.high ? a.high : b.high};
+}
+
+static range_t operand_range(ir_operand_t operand)
+{
+    if (IR_IS_CONSTANT(operand))
+    {
+        int64_t value = ir_constant_value(function, operand);
+        return (range_t) {value, value};
+    }
+    return ranges[operand];
+}
+
+static int64_t array_length(int32_t symbol)
+{
+    return *(int64_t *) global_symbols->symbols[symbol]->node->children[1]->data;
+}
+
+/* Arithmetic on ranges. Each bound is computed from the bounds of the operands, which is exact as long as
+ * none of the computations wrap around
+ */
+
+static range_t add_ranges(range_t a, range_t b)
+{
+    if (is_empty(a) || is_empty(b))
+        return EMPTY_RANGE;
+    range_t result;
+    if (__builtin_add_overflow(a.low, b.low, &result.low) || __builtin_add_overflow(a.high, b.high, &result.high))
+        return FULL_RANGE;
+    return result;
+}
+
+static range_t subtract_ranges(range_t a, range_t b)
+{
+    if (is_empty(a) || is_empty(b))
+        return EMPTY_RANGE;
+    range_t result;
+    if (__builtin_sub_overflow(a.low, b.high, &result.low) || __builtin_sub_overflow(a.high, b.low, &result.high))
+        return FULL_RANGE;
+    return result;
+}
+
+static range_t multiply_ranges(range_t a, range_t b)
+{
+    if (is_empty(a) || is_empty(b))
+        return EMPTY_RANGE;
+    int64_t products[4];
+    if (__builtin_mul_overflow(a.low, b.low, &products[0]) || __builtin_mul_overflow(a.low, b.high, &products[1])
+        || __builtin_mul_overflow(a.high, b.low, &products[2])
+        || __builtin_mul_overflow(a.high, b.high, &products[3]))
+        return FULL_RANGE;
+    range_t result = {products[0], products[0]};
+    for (int i = 1; i < 4; i++)
+        result = join(result, (range_t) {products[i], products[i]});
+    return result;
+}
+
+static range_t negate_range(range_t a)
+{
+    if (is_empty(a))
+        return EMPTY_RANGE;
+    if (a.low == INT64_MIN)
+        return FULL_RANGE;
+    return (range_t) {-a.high, -a.low};
+}
+
+/* Only division by constants is followed. Division truncates towards zero, which keeps the order of the
+ * dividends, or reverses it for negative divisors
+ */
+static range_t divide_range(range_t a, ir_operand_t divisor)
+{
+    if (is_empty(a))
+        return EMPTY_RANGE;
+    if (!IR_IS_CONSTANT(divisor))
+        return FULL_RANGE;
+    int64_t value = ir_constant_value(function, divisor);
+    if (value > 0)
+        return (range_t) {a.low / value, a.high / value};
+    if (value == -1)
+        return negate_range(a);
+    if (value < 0)
+        return (range_t) {a.high / value, a.low / value};
+    return FULL_RANGE;
+}
+
+/* Narrows the range of a value known to stand in the relation to a value in the other range */
+static range_t apply_relation(range_t range, ir_relation_t relation, range_t other)
+{
+    if (is_empty(other))
+        return range;
+    switch (relation)
+    {
+        case IR_EQ:
+            return meet(range, other);
+        case IR_NE:
+            // Only a single value can be cut off, and only from the ends
+            if (other.low == other.high && range.low == other.low && range.low != INT64_MAX)
+                range.low++;
+            else if (other.low == other.high && range.high == other.low && range.high != INT64_MIN)
+                range.high--;
+            return range;
+        case IR_LT:
+            if (other.high == INT64_MIN)
+                return EMPTY_RANGE;
+            return meet(range, (range_t) {INT64_MIN, other.high - 1});
+        case IR_LE:
+            return meet(range, (range_t) {INT64_MIN, other.high});
+        case IR_GT:
+            if (other.low == INT64_MAX)
+                return EMPTY_RANGE;
+            return meet(range, (range_t) {other.low + 1, INT64_MAX});
+        case IR_GE:
+            return meet(range, (range_t) {other.low, INT64_MAX});
+    }
+    return range;
+}
+
+/* Narrows the range of the value by the branch ending the block, when it continues to the successor */
+static range_t refine_by_edge(ir_operand_t value, range_t range, int block, int successor)
+{
+    ir_block_t *b = &function->blocks[block];
+    ir_instruction_t *branch = &b->instructions[b->n_instructions - 1];
+    if (branch->opcode != IR_BRANCH || b->successors[0] == b->successors[1])
+        return range;
+
+    ir_relation_t relation = branch->relation;
+    if (b->successors[1] == successor)
+        relation = ir_negate_relation(relation);
+    if (branch->a == value)
+        range = apply_relation(range, relation, operand_range(branch->b));
+    if (branch->b == value)
+        range = apply_relation(range, ir_swap_relation(relation), operand_range(branch->a));
+    return range;
+}
+
+/* Narrows the range of the value by the checks of it among the first end instructions of the block */
+static range_t refine_by_checks(ir_operand_t value, range_t range, int block, size_t end)
+{
+    for (size_t j = 0; j < end; j++)
+    {
+        ir_instruction_t *instruction = &function->blocks[block].instructions[j];
+        if (instruction->opcode == IR_CHECK_BOUNDS && instruction->a == value)
+            range = meet(range, (range_t) {0, array_length(instruction->symbol) - 1});
+    }
+    return range;
+}
+
+/* Narrows the range of the value by what is known about it in front of instruction number position of the block:
+ * the checks in the blocks dominating it that passed before, and the branches into those of the blocks that can
+ * only be entered from their immediate dominator
+ */
+static range_t refine_at(ir_operand_t value, range_t range, int block, size_t position)
+{
+    range = refine_by_checks(value, range, block, position);
+    while (block != 0)
+    {
+        int dominator = cfg->immediate_dominator[block];
+        if (dominator < 0)
+            break;
+        if (cfg->n_predecessors[block] == 1)
+            range = refine_by_edge(value, range, dominator, block);
+        range = refine_by_checks(value, range, dominator, function->blocks[dominator].n_instructions);
+        block = dominator;
+    }
+    return range;
+}
+
+static range_t evaluate(ir_instruction_t *instruction, int block)
+{
+    switch (instruction->opcode)
+    {
+        case IR_COPY:
+            return operand_range(instruction->a);
+        case IR_ADD:
+            return add_ranges(operand_range(instruction->a), operand_range(instruction->b));
+        case IR_SUB:
+            return subtract_ranges(operand_range(instruction->a), operand_range(instruction->b));
+        case IR_MUL:
+            return multiply_ranges(operand_range(instruction->a), operand_range(instruction->b));
+        case IR_DIV:
+            return divide_range(operand_range(instruction->a), instruction->b);
+        case IR_NEG:
+            return negate_range(operand_range(instruction->a));
+        case IR_SELECT:
+        {
+            ir_operand_t *operands = &function->arguments[instruction->a];
+            ir_relation_t relation = instruction->relation;
+            range_t x = operand_range(operands[0]), y = operand_range(operands[1]);
+            range_t chosen[2];
+            for (int i = 0; i < 2; i++)
+            {
+                ir_operand_t value = operands[2 + i];
+                chosen[i] = operand_range(value);
+                if (value == operands[0])
+                    chosen[i] = apply_relation(chosen[i], relation, y);
+                if (value == operands[1])
+                    chosen[i] = apply_relation(chosen[i], ir_swap_relation(relation), x);
+                relation = ir_negate_relation(relation);
+            }
+            return join(chosen[0], chosen[1]);
+        }
+        case IR_PHI:
+        {
+            range_t result = EMPTY_RANGE;
+            for (int32_t i = 0; i < instruction->b; i++)
+            {
+                int predecessor = function->arguments[instruction->a + 2 * i];
+                ir_operand_t value = function->arguments[instruction->a + 2 * i + 1];
+                if (cfg->immediate_dominator[predecessor] < 0)
+                    continue;
+                range_t incoming = operand_range(value);
+                if (IR_IS_REGISTER(value))
+                {
+                    incoming = refine_by_edge(value, incoming, predecessor, block);
+                    incoming = refine_at(value, incoming, predecessor,
+                                         function->blocks[predecessor].n_instructions);
+                }
+                result = join(result, incoming);
+            }
+            return result;
+        }
+        default:
+            return FULL_RANGE;
+    }
+}
+
+/* Moves the bounds that grew out to the next threshold */
+static range_t widen(range_t old, range_t range)
+{
+    if (is_empty(old))
+        return range;
+    if (range.high > old.high)
+    {
+        size_t i = 0;
+        while (thresholds[i] < range.high)
+            i++;
+        range.high = thresholds[i];
+    }
+    if (range.low < old.low)
+    {
+        size_t i = n_thresholds - 1;
+        while (thresholds[i] > range.low)
+            i--;
+        range.low = thresholds[i];
+    }
+    return range;
+}
+
+static int compare_values(const void *a, const void *b)
+{
+    int64_t x = *(const int64_t *) a, y = *(const int64_t *) b;
+    return (x > y) - (x < y);
+}
+
+/* The constants of the function, one more and one less than each, and the ends of the range */
+static void find_thresholds(void)
+{
+    thresholds = malloc((function->n_constants * 3 + 2) * sizeof(int64_t));
+    n_thresholds = 0;
+    thresholds[n_thresholds++] = INT64_MIN;
+    thresholds[n_thresholds++] = INT64_MAX;
+    for (size_t i = 0; i < function->n_constants; i++)
+    {
+        int64_t value = function->constants[i];
+        thresholds[n_thresholds++] = value;
+        if (value != INT64_MIN)
+            thresholds[n_thresholds++] = value - 1;
+        if (value != INT64_MAX)
+            thresholds[n_thresholds++] = value + 1;
+    }
+    qsort(thresholds, n_thresholds, sizeof(int64_t), compare_values);
+}
+
+static void analyze_ranges(void)
+{
+    // Registers without a definition could hold anything
+    for (size_t r = 0; r < function->n_registers; r++)
+        ranges[r] = definitions[r] == NULL ? FULL_RANGE : EMPTY_RANGE;
+
+    bool changed = true;
+    while (changed)
+    {
+        changed = false;
+        for (size_t i = 0; i < cfg->n_reachable; i++)
+        {
+            int block = cfg->reverse_postorder[i];
+            for (size_t j = 0; j < function->blocks[block].n_instructions; j++)
+            {
+                ir_instruction_t *instruction = &function->blocks[block].instructions[j];
+                if (!ir_has_dst(instruction))
+                    continue;
+                range_t old = ranges[instruction->dst];
+                range_t range = join(old, evaluate(instruction, block));
+                if (range.low == old.low && range.high == old.high)
+                    continue;
+                if (instruction->opcode == IR_PHI && n_changes[instruction->dst]++ >= WIDENING_DELAY)
+                    range = widen(old, range);
+                ranges[instruction->dst] = range;
+                changed = true;
+            }
+        }
+    }
+
+    for (int round = 0; round < NARROWING_ROUNDS; round++)
+    {
+        for (size_t i = 0; i < cfg->n_reachable; i++)
+        {
+            int block = cfg->reverse_postorder[i];
+            for (size_t j = 0; j < function->blocks[block].n_instructions; j++)
+            {
+                ir_instruction_t *instruction = &function->blocks[block].instructions[j];
+                if (ir_has_dst(instruction))
+                    ranges[instruction->dst] = meet(ranges[instruction->dst], evaluate(instruction, block));
+            }
+        }
+    }
+}
+
+/* The range of the index in front of instruction number position of the block. Indices that are another
+ * register plus or minus a constant are also narrowed by what is known about that register there
+ */
+static range_t index_range(ir_operand_t index, int block, size_t position, int depth)
+{
+    range_t range = operand_range(index);
+    if (IR_IS_CONSTANT(index))
+        return range;
+    range = refine_at(index, range, block, position);
+
+    ir_instruction_t *definition = definitions[index];
+    if (depth < MAX_OFFSET_DEPTH && definition != NULL
+        && (definition->opcode == IR_ADD || definition->opcode == IR_SUB))
+    {
+        ir_operand_t reg = definition->a, offset = definition->b;
+        if (definition->opcode == IR_ADD && IR_IS_CONSTANT(reg))
+        {
+            reg = definition->b;
+            offset = definition->a;
+        }
+        if (IR_IS_REGISTER(reg) && IR_IS_CONSTANT(offset))
+        {
+            range_t from = index_range(reg, block, position, depth + 1);
+            if (definition->opcode == IR_ADD)
+                range = meet(range, add_ranges(from, operand_range(offset)));
+            else
+                range = meet(range, subtract_ranges(from, operand_range(offset)));
+        }
+    }
+    return range;
+}
+
+bool ir_eliminate_bounds_checks(ir_function_t *ir_function)
+{
+    function = ir_function;
+    bool has_checks = false;
+    for (size_t i = 0; i < function->n_blocks && !has_checks; i++)
+        for (size_t j = 0; j < function->blocks[i].n_instructions && !has_checks; j++)
+            has_checks = function->blocks[i].instructions[j].opcode == IR_CHECK_BOUNDS;
+    if (!has_checks)
+        return false;
+
+    cfg = ir_analyze_cfg(function);
+    ranges = malloc(function->n_registers * sizeof(range_t));
+    n_changes = calloc(function->n_registers, sizeof(int));
+    definitions = calloc(function->n_registers, sizeof(ir_instruction_t *));
+    for (size_t i = 0; i < function->n_blocks; i++)
+        for (size_t j = 0; j < function->blocks[i].n_instructions; j++)
+            if (ir_has_dst(&function->blocks[i].instructions[j]))
+                definitions[function->blocks[i].instructions[j].dst] = &function->blocks[i].instructions[j];
+    find_thresholds();
+    analyze_ranges();
+
+    // A check that is removed was always passed, so the checks after it may still count on what it tells.
+    // The instructions are only moved once all checks are decided, as the definitions point to them
+    size_t n_checks = 0;
+    ir_instruction_t **redundant = NULL;
+    for (size_t i = 0; i < cfg->n_reachable; i++)
+    {
+        int block = cfg->reverse_postorder[i];
+        for (size_t j = 0; j < function->blocks[block].n_instructions; j++)
+        {
+            ir_instruction_t *instruction = &function->blocks[block].instructions[j];
+            if (instruction->opcode != IR_CHECK_BOUNDS)
+                continue;
+            range_t range = index_range(instruction->a, block, j, 0);
+            if (!is_empty(range) && range.low >= 0 && range.high < array_length(instruction->symbol))
+            {
+                redundant = realloc(redundant, (n_checks + 1) * sizeof(ir_instruction_t *));
+                redundant[n_checks++] = instruction;
+            }
+        }
+    }
+    for (size_t c = 0; c < n_checks; c++)
+        redundant[c]->opcode = IR_JUMP;
+    for (size_t i = 0; i < function->n_blocks && n_checks > 0; i++)
+    {
+        ir_block_t *block = &function->blocks[i];
+        size_t n = 0;
+        for (size_t j = 0; j + 1 < block->n_instructions; j++)
+            if (block->instructions[j].opcode != IR_JUMP)
+                block->instructions[n++] = block->instructions[j];
+        block->instructions[n++] = block->instructions[block->n_instructions - 1];
+        block->n_instructions = n;
+    }
+    free(redundant);
+
+    ir_destroy_cfg(cfg);
+    free(ranges);
+    free(n_changes);
+    free(definitions);
+    free(thresholds);
+    function = NULL;
+    cfg = NULL;
+    return n_checks > 0;
+}
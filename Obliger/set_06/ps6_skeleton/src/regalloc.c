@@ -0,0 +1,279 @@
+#include <vslc.h>
+#include "emit.h"
+#include "regalloc.h"
+
+// RAX, RDX and R11 are never allocated, as the code generator needs them for division, addresses and
+// moving between memory operands. Caller-saved registers are preferred for values not live across calls,
+// so that the function doesn't have to save them.
+#define NUM_CALLER_SAVED_REGISTERS 6
+static const char *CALLER_SAVED_REGISTERS[NUM_CALLER_SAVED_REGISTERS] = {RCX, RSI, RDI, R8, R9, R10};
+static const char *CALLEE_SAVED_REGISTERS[NUM_CALLEE_SAVED_REGISTERS] = {RBX, R12, R13, R14, R15};
+#define NUM_ALLOCATABLE_REGISTERS (NUM_CALLER_SAVED_REGISTERS + NUM_CALLEE_SAVED_REGISTERS)
+
+// Uses inside loops are weighted by this factor for each level of nesting, up to a maximum depth
+#define LOOP_WEIGHT_FACTOR 8
+#define MAX_LOOP_WEIGHT_DEPTH 6
+
+// Parameters after the first six are passed on the stack, above the return address
+#define NUM_REGISTER_PARAMS 6
+
+/* The range of positions where a virtual register is live, in the linear order of the blocks.
+ * Instruction number i reads its operands at position 2i, and writes its result at 2i+1,
+ * so a value used for the last time can share a register with the result.
+ */
+typedef struct live_interval
+{
+    ir_operand_t value;
+    int start, end;
+    int64_t weight; // Estimate of how often the value is used. Low weight intervals are spilled first
+    bool crosses_call;
+} live_interval_t;
+
+static live_interval_t *intervals; // Indexed by virtual register, start = -1 until the value is seen
+static int64_t current_weight;
+
+static void extend(ir_operand_t value, int position)
+{
+    live_interval_t *interval = &intervals[value];
+    if (interval->start == -1 || position < interval->start)
+        interval->start = position;
+    if (position > interval->end)
+        interval->end = position;
+}
+
+static void extend_use(ir_operand_t *operand, void *context)
+{
+    if (!IR_IS_REGISTER(*operand))
+        return;
+    extend(*operand, *(int *) context);
+    intervals[*operand].weight += current_weight;
+}
+
+static int compare_interval_start(const void *a, const void *b)
+{
+    const live_interval_t *x = *(live_interval_t *const *) a;
+    const live_interval_t *y = *(live_interval_t *const *) b;
+    if (x->start != y->start)
+        return x->start - y->start;
+    return x->value - y->value;
+}
+
+/* Builds the live intervals, and returns the positions of the calls through n_calls */
+static int *build_intervals(ir_function_t *function, size_t *n_calls)
+{
+    ir_liveness_t *liveness = ir_compute_liveness(function);
+    size_t n_instructions = 0;
+    for (size_t i = 0; i < function->n_blocks; i++)
+        n_instructions += function->blocks[i].n_instructions;
+    int *calls = malloc((n_instructions + 1) * sizeof(int));
+    *n_calls = 0;
+
+    int position = 0;
+    for (size_t i = 0; i < function->n_blocks; i++)
+    {
+        ir_block_t *block = &function->blocks[i];
+        int depth = block->loop_depth < MAX_LOOP_WEIGHT_DEPTH ? block->loop_depth : MAX_LOOP_WEIGHT_DEPTH;
+        current_weight = 1;
+        for (int d = 0; d < depth; d++)
+            current_weight *= LOOP_WEIGHT_FACTOR;
+
+        int block_start = position;
+        int block_end = position + 2 * (int) block->n_instructions - 1;
+        for (size_t r = 0; r < function->n_registers; r++)
+        {
+            if (IR_SET_CONTAINS(liveness->live_in[i], r))
+                extend(r, block_start);
+            if (IR_SET_CONTAINS(liveness->live_out[i], r))
+                extend(r, block_end);
+        }
+
+        for (size_t j = 0; j < block->n_instructions; j++, position += 2)
+        {
+            ir_instruction_t *instruction = &block->instructions[j];
+            ir_for_each_use(function, instruction, extend_use, &position);
+            if (ir_has_dst(instruction))
+            {
+                extend(instruction->dst, position + 1);
+                intervals[instruction->dst].weight += current_weight;
+            }
+            if (ir_is_call(instruction))
+                calls[(*n_calls)++] = position;
+        }
+    }
+
+    ir_destroy_liveness(liveness);
+    return calls;
+}
+
+/* Linear scan register allocation, as described by Poletto and Sarkar.
+ * When registers run out, the interval with the lowest weight is spilled to the stack.
+ */
+static void linear_scan(live_interval_t **sorted, size_t n_sorted, register_allocation_t *allocation)
+{
+    live_interval_t *active[NUM_ALLOCATABLE_REGISTERS];
+    size_t n_active = 0;
+
+    for (size_t i = 0; i < n_sorted; i++)
+    {
+        live_interval_t *current = sorted[i];
+
+        // Free the registers of intervals that have ended
+        for (size_t j = 0; j < n_active;)
+        {
+            if (active[j]->end < current->start)
+                active[j] = active[--n_active];
+            else
+                j++;
+        }
+
+        // Values live across a call can only be kept in callee-saved registers
+        const char *candidates[NUM_ALLOCATABLE_REGISTERS];
+        size_t n_candidates = 0;
+        if (!current->crosses_call)
+            for (int r = 0; r < NUM_CALLER_SAVED_REGISTERS; r++)
+                candidates[n_candidates++] = CALLER_SAVED_REGISTERS[r];
+        for (int r = 0; r < NUM_CALLEE_SAVED_REGISTERS; r++)
+            candidates[n_candidates++] = CALLEE_SAVED_REGISTERS[r];
+
+        // Pick the first candidate not held by any active interval
+        const char *reg = NULL;
+        for (size_t r = 0; r < n_candidates && reg == NULL; r++)
+        {
+            bool taken = false;
+            for (size_t j = 0; j < n_active; j++)
+                taken |= allocation->registers[active[j]->value] == candidates[r];
+            if (!taken)
+                reg = candidates[r];
+        }
+
+        if (reg == NULL)
+        {
+            // Spill whichever of the current interval and the active ones holding a candidate is used the least
+            live_interval_t **cheapest = NULL;
+            for (size_t j = 0; j < n_active; j++)
+            {
+                const char *held = allocation->registers[active[j]->value];
+                bool is_candidate = false;
+                for (size_t r = 0; r < n_candidates; r++)
+                    is_candidate |= held == candidates[r];
+                if (is_candidate && (cheapest == NULL || active[j]->weight < (*cheapest)->weight))
+                    cheapest = &active[j];
+            }
+            if (cheapest == NULL || (*cheapest)->weight >= current->weight)
+                continue;
+
+            reg = allocation->registers[(*cheapest)->value];
+            allocation->registers[(*cheapest)->value] = NULL;
+            *cheapest = active[--n_active];
+        }
+
+        allocation->registers[current->value] = reg;
+        active[n_active++] = current;
+    }
+}
+
+/* Gives every spilled value a stack slot. Values whose intervals don't overlap share slots */
+static int assign_stack_slots(ir_function_t *function, live_interval_t **sorted, size_t n_sorted,
+                              register_allocation_t *allocation)
+{
+    // Spilled parameters passed on the stack stay where the caller put them
+    bool *on_caller_stack = calloc(function->n_registers, sizeof(bool));
+    ir_block_t *entry = &function->blocks[0];
+    for (size_t j = 0; j < entry->n_instructions; j++)
+    {
+        ir_instruction_t *instruction = &entry->instructions[j];
+        if (instruction->opcode == IR_PARAM && instruction->a >= NUM_REGISTER_PARAMS)
+        {
+            on_caller_stack[instruction->dst] = true;
+            allocation->stack_offsets[instruction->dst] = 16 + (instruction->a - NUM_REGISTER_PARAMS) * 8;
+        }
+    }
+
+    int *slot_end = malloc((n_sorted + 1) * sizeof(int));
+    int n_slots = 0;
+    for (size_t i = 0; i < n_sorted; i++)
+    {
+        live_interval_t *interval = sorted[i];
+        if (allocation->registers[interval->value] != NULL || on_caller_stack[interval->value])
+            continue;
+
+        int slot = 0;
+        while (slot < n_slots && slot_end[slot] >= interval->start)
+            slot++;
+        if (slot == n_slots)
+            n_slots++;
+        slot_end[slot] = interval->end;
+
+        // The callee-saved registers are stored right below %rbp, and the slots below them
+        int position = (int) allocation->n_used_callee_saved + slot;
+        allocation->stack_offsets[interval->value] = -8 * (position + 1);
+    }
+
+    free(slot_end);
+    free(on_caller_stack);
+    return n_slots;
+}
+
+register_allocation_t *allocate_registers(ir_function_t *function)
+{
+    register_allocation_t *allocation = malloc(sizeof(register_allocation_t));
+    *allocation = (register_allocation_t) {
+        .registers = calloc(function->n_registers, sizeof(const char *)),
+        .stack_offsets = calloc(function->n_registers, sizeof(int)),
+        .n_registers = function->n_registers,
+        .n_used_callee_saved = 0,
+        .frame_size = 0
+    };
+
+    intervals = malloc(function->n_registers * sizeof(live_interval_t));
+    for (size_t r = 0; r < function->n_registers; r++)
+        intervals[r] = (live_interval_t) {.value = r, .start = -1, .end = -1, .weight = 0, .crosses_call = false};
+
+    size_t n_calls;
+    int *calls = build_intervals(function, &n_calls);
+
+    live_interval_t **sorted = malloc((function->n_registers + 1) * sizeof(live_interval_t *));
+    size_t n_sorted = 0;
+    for (size_t r = 0; r < function->n_registers; r++)
+    {
+        live_interval_t *interval = &intervals[r];
+        if (interval->start == -1)
+            continue;
+        // Arguments are read by the call, and its result written after it, so those don't count
+        for (size_t c = 0; c < n_calls && !interval->crosses_call; c++)
+            interval->crosses_call = interval->start < calls[c] && interval->end > calls[c] + 1;
+        sorted[n_sorted++] = interval;
+    }
+    qsort(sorted, n_sorted, sizeof(live_interval_t *), compare_interval_start);
+
+    linear_scan(sorted, n_sorted, allocation);
+
+    // Every callee-saved register holding a value at some point must be saved by the function
+    for (int r = 0; r < NUM_CALLEE_SAVED_REGISTERS; r++)
+    {
+        bool used = false;
+        for (size_t i = 0; i < function->n_registers && !used; i++)
+            used = allocation->registers[i] == CALLEE_SAVED_REGISTERS[r];
+        if (used)
+            allocation->used_callee_saved[allocation->n_used_callee_saved++] = CALLEE_SAVED_REGISTERS[r];
+    }
+
+    int n_slots = assign_stack_slots(function, sorted, n_sorted, allocation);
+    allocation->frame_size = ((int) (allocation->n_used_callee_saved + n_slots) * 8 + 15) / 16 * 16;
+
+    free(sorted);
+    free(calls);
+    free(intervals);
+    intervals = NULL;
+    return allocation;
+}
+
+void destroy_register_allocation(register_allocation_t *allocation)
+{
+    if (allocation == NULL)
+        return;
+
+    free(allocation->registers);
+    free(allocation->stack_offsets);
+    free(allocation);
+}
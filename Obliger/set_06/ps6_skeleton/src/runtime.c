@@ -0,0 +1,345 @@
+#include <vslc.h>
+#include "emit.h"
+#include "profile.h"
+
+/* The runtime library emitted into every program, so generated code needs nothing from libc.
+ * Output is collected in a large buffer, which is written with the write system call when it fills up,
+ * and when the program exits. When standard out is a terminal, it is also written after every print, so
+ * the lines are seen as they are printed. Otherwise, output still in the buffer is lost if the program dies
+ * from a fault instead, like dividing by zero or running out of stack.
+ * Integers are converted two digits at a time, with a table of the pairs.
+ *
+ * The routines only use the caller-saved registers, and don't need the stack to be aligned, so generated code
+ * calls them directly:
+ *  print_formatted  prints the format in %rdi, with "%ld" replaced by the integers in %rsi, %rdx, %rcx, %r8 and
+ *                   %r9 in turn, and "%%" by a percent sign. See print_format.h
+ *  print_line       prints the text in %rdi and a newline
+ *  find_terminal    checks if standard out is a terminal, which main does before anything is printed
+ *  parse_integer    returns the integer in the string in %rdi, which is parsed like strtol parses base 10
+ *  exit_program     writes out the buffered output, and ends the program with the exit code in %rdi.
+ *                   With -fprofile-generate, it writes the profile first, see profile.h
+ *  bounds_error     prints that an array was indexed out of bounds, and ends the program with exit code 1.
+ *                   Only emitted with -fbounds-check, where generated code jumps to it when a check fails
+ */
+
+#define OUTPUT_BUFFER_SIZE 65536
+
+// The routines writing to the buffer flush it once they are closer to its end than this, before writing more.
+// The longest integer, with its sign, is 20 characters, and 24 bytes are copied for it
+#define OUTPUT_SLACK 32
+
+/* Writes the buffered output up to %r8 to standard out, and sets %r8 to the start of the buffer again.
+ * Clobbers %rax, %rcx, %rdx, %rsi and %r11
+ */
+static void generate_flush_output(void)
+{
+    LABEL ("flush_output");
+    PUSHQ (RDI);
+    EMIT ("leaq output_buffer(%s), %s", RIP, RSI);
+    MOVQ (R8, RDX);
+    SUBQ (RSI, RDX);
+    LABEL ("flush_next");
+    TESTQ (RDX, RDX);
+    EMIT ("je flush_done");
+    MOVQ ("$1", RDI);
+    MOVQ (ASM_SYSCALL_WRITE, RAX);
+    EMIT ("syscall");
+    // Output that can't be written, like to a closed pipe, is dropped
+    TESTQ (RAX, RAX);
+    EMIT ("jle flush_done");
+    ADDQ (RAX, RSI);
+    SUBQ (RAX, RDX);
+    EMIT ("jmp flush_next");
+    LABEL ("flush_done");
+    POPQ (RDI);
+    EMIT ("leaq output_buffer(%s), %s", RIP, R8);
+    RET;
+}
+
+/* Writes the buffered output up to %r8 right away when standard out is a terminal. Clobbers what flush_output does */
+static void generate_flush_terminal(const char *done)
+{
+    MOVQ ("output_to_terminal(%rip)", RAX);
+    TESTQ (RAX, RAX);
+    EMIT ("je %s", done);
+    EMIT ("call flush_output");
+    LABEL ("%s", done);
+}
+
+/* Sets output_to_terminal when the terminal settings of standard out can be read */
+static void generate_find_terminal(void)
+{
+    LABEL ("find_terminal");
+    PUSHQ (RDI);
+    PUSHQ (RSI);
+    MOVQ (ASM_SYSCALL_IOCTL, RAX);
+    MOVQ ("$1", RDI);
+    MOVQ (ASM_IOCTL_GET_TERMINAL, RSI);
+    // The settings are read into the red zone, and not needed after
+    EMIT ("leaq -128(%s), %s", RSP, RDX);
+    EMIT ("syscall");
+    TESTQ (RAX, RAX);
+    EMIT ("jne terminal_done");
+    EMIT ("incq output_to_terminal(%s)", RIP);
+    LABEL ("terminal_done");
+    POPQ (RSI);
+    POPQ (RDI);
+    RET;
+}
+
+/* Sets %r8 to where the buffered output ends, and %r9 to where it should be flushed */
+static void generate_output_position(void)
+{
+    EMIT ("leaq output_buffer(%s), %s", RIP, R8);
+    MOVQ (R8, R9);
+    EMIT ("addq output_length(%s), %s", RIP, R8);
+    EMIT ("addq $%d, %s", OUTPUT_BUFFER_SIZE - OUTPUT_SLACK, R9);
+}
+
+/* Remembers %r8 as where the buffered output ends */
+static void generate_save_output_position(void)
+{
+    EMIT ("leaq output_buffer(%s), %s", RIP, RAX);
+    SUBQ (RAX, R8);
+    MOVQ (R8, "output_length(%rip)");
+}
+
+/* Writes the integer in %rax at %r8, and moves %r8 past it.
+ * The digits are produced from the end, into the red zone below the stack pointer, and copied over after.
+ * Clobbers %rax, %rcx, %rdx, %rsi and %r11
+ */
+static void generate_format_integer(void)
+{
+    LABEL ("format_integer");
+    TESTQ (RAX, RAX);
+    EMIT ("jns format_digits");
+    EMIT ("movb $'-', (%s)", R8);
+    INCQ (R8);
+    // The magnitude of the most negative number only fits when seen as unsigned, which the rest treats it as
+    NEGQ (RAX);
+    LABEL ("format_digits");
+    MOVQ (RSP, RSI);
+    EMIT ("leaq digit_pairs(%s), %s", RIP, R11);
+    LABEL ("format_pair");
+    CMPQ ("$100", RAX);
+    EMIT ("jb format_last");
+    // Divides by 100 with a multiplication by its reciprocal, and takes the remainder as the next two digits
+    MOVQ (RAX, RCX);
+    EMIT ("shrq $2, %s", RAX);
+    EMIT ("movabsq $2951479051793528259, %s", RDX);
+    EMIT ("mulq %s", RDX);
+    EMIT ("shrq $2, %s", RDX);
+    EMIT ("imulq $100, %s, %s", RDX, RAX);
+    SUBQ (RAX, RCX);
+    MOVQ (RDX, RAX);
+    SUBQ ("$2", RSI);
+    EMIT ("movzbl 1(%s,%s,2), %%edx", R11, RCX);
+    EMIT ("movb %%dl, 1(%s)", RSI);
+    EMIT ("movzbl (%s,%s,2), %%edx", R11, RCX);
+    EMIT ("movb %%dl, (%s)", RSI);
+    EMIT ("jmp format_pair");
+    LABEL ("format_last");
+    CMPQ ("$10", RAX);
+    EMIT ("jb format_digit");
+    SUBQ ("$2", RSI);
+    EMIT ("movzbl 1(%s,%s,2), %%edx", R11, RAX);
+    EMIT ("movb %%dl, 1(%s)", RSI);
+    EMIT ("movzbl (%s,%s,2), %%edx", R11, RAX);
+    EMIT ("movb %%dl, (%s)", RSI);
+    EMIT ("jmp format_copy");
+    LABEL ("format_digit");
+    ADDQ ("$'0'", RAX);
+    SUBQ ("$1", RSI);
+    EMIT ("movb %%al, (%s)", RSI);
+    // There are at most 20 digits, so three quadwords cover them all
+    LABEL ("format_copy");
+    for (int i = 0; i < 3; i++)
+    {
+        EMIT ("movq %d(%s), %s", i * 8, RSI, RCX);
+        EMIT ("movq %s, %d(%s)", RCX, i * 8, R8);
+    }
+    MOVQ (RSP, RCX);
+    SUBQ (RSI, RCX);
+    ADDQ (RCX, R8);
+    RET;
+}
+
+static void generate_print_formatted(void)
+{
+    LABEL ("print_formatted");
+    // The integers are placed on the stack in order, and %r10 points to the next one
+    PUSHQ (R9);
+    PUSHQ (R8);
+    PUSHQ (RCX);
+    PUSHQ (RDX);
+    PUSHQ (RSI);
+    MOVQ (RSP, R10);
+    generate_output_position();
+    LABEL ("print_next");
+    CMPQ (R9, R8);
+    EMIT ("jae print_flush");
+    LABEL ("print_character");
+    EMIT ("movzbl (%s), %%eax", RDI);
+    INCQ (RDI);
+    EMIT ("cmpl $'%%', %%eax");
+    EMIT ("je print_conversion");
+    EMIT ("movb %%al, (%s)", R8);
+    TESTQ (RAX, RAX);
+    EMIT ("je print_done");
+    INCQ (R8);
+    EMIT ("jmp print_next");
+    LABEL ("print_conversion");
+    EMIT ("movzbl (%s), %%eax", RDI);
+    EMIT ("cmpl $'%%', %%eax");
+    EMIT ("jne print_integer");
+    INCQ (RDI);
+    EMIT ("movb %%al, (%s)", R8);
+    INCQ (R8);
+    EMIT ("jmp print_next");
+    LABEL ("print_integer");
+    // The only other conversion in formats is %ld
+    ADDQ ("$2", RDI);
+    MOVQ (MEM(R10), RAX);
+    ADDQ ("$8", R10);
+    EMIT ("call format_integer");
+    EMIT ("jmp print_next");
+    LABEL ("print_flush");
+    EMIT ("call flush_output");
+    EMIT ("jmp print_character");
+    LABEL ("print_done");
+    generate_flush_terminal("print_saved");
+    generate_save_output_position();
+    ADDQ ("$40", RSP);
+    RET;
+}
+
+static void generate_print_line(void)
+{
+    LABEL ("print_line");
+    generate_output_position();
+    LABEL ("line_next");
+    CMPQ (R9, R8);
+    EMIT ("jae line_flush");
+    LABEL ("line_character");
+    EMIT ("movzbl (%s), %%eax", RDI);
+    INCQ (RDI);
+    TESTQ (RAX, RAX);
+    EMIT ("je line_done");
+    EMIT ("movb %%al, (%s)", R8);
+    INCQ (R8);
+    EMIT ("jmp line_next");
+    LABEL ("line_flush");
+    EMIT ("call flush_output");
+    EMIT ("jmp line_character");
+    LABEL ("line_done");
+    EMIT ("movb $'\\n', (%s)", R8);
+    INCQ (R8);
+    generate_flush_terminal("line_saved");
+    generate_save_output_position();
+    RET;
+}
+
+/* The number is accumulated as a negative number, which has room for the most negative one.
+ * Like strtol, leading whitespace is skipped, and numbers out of range give the closest one in range
+ */
+static void generate_parse_integer(void)
+{
+    LABEL ("parse_integer");
+    XORQ (RAX, RAX);
+    XORQ (RCX, RCX); // 1 if the number is negative
+    LABEL ("parse_space");
+    EMIT ("movzbl (%s), %%edx", RDI);
+    EMIT ("cmpl $32, %%edx"); // A space
+    EMIT ("je parse_skip");
+    EMIT ("subl $'\\t', %%edx");
+    EMIT ("cmpl $4, %%edx"); // \t, \n, \v, \f and \r
+    EMIT ("ja parse_sign");
+    LABEL ("parse_skip");
+    INCQ (RDI);
+    EMIT ("jmp parse_space");
+    LABEL ("parse_sign");
+    EMIT ("movzbl (%s), %%edx", RDI);
+    EMIT ("cmpl $'+', %%edx");
+    EMIT ("je parse_signed");
+    EMIT ("cmpl $'-', %%edx");
+    EMIT ("jne parse_digit");
+    MOVQ ("$1", RCX);
+    LABEL ("parse_signed");
+    INCQ (RDI);
+    LABEL ("parse_digit");
+    EMIT ("movzbl (%s), %%edx", RDI);
+    EMIT ("subl $'0', %%edx");
+    EMIT ("cmpl $9, %%edx");
+    EMIT ("ja parse_end");
+    INCQ (RDI);
+    EMIT ("imulq $10, %s", RAX);
+    EMIT ("jo parse_overflow");
+    SUBQ (RDX, RAX);
+    EMIT ("jno parse_digit");
+    LABEL ("parse_overflow");
+    MOVQ ("$1", RAX);
+    EMIT ("shlq $63, %s", RAX);
+    LABEL ("parse_end");
+    TESTQ (RCX, RCX);
+    EMIT ("jne parse_done");
+    NEGQ (RAX);
+    EMIT ("jno parse_done");
+    // The most negative number has no positive counterpart, so the largest number is the closest
+    EMIT ("decq %s", RAX);
+    LABEL ("parse_done");
+    RET;
+}
+
+static void generate_exit_program(void)
+{
+    LABEL ("exit_program");
+    if (profile_generate_path != NULL)
+        EMIT ("call write_profile");
+    EMIT ("leaq output_buffer(%s), %s", RIP, R8);
+    EMIT ("addq output_length(%s), %s", RIP, R8);
+    EMIT ("call flush_output");
+    MOVQ (ASM_SYSCALL_EXIT, RAX);
+    EMIT ("syscall");
+}
+
+/* Jumped to by the failing check rather than called, and never returns */
+static void generate_bounds_error(void)
+{
+    LABEL ("bounds_error");
+    EMIT ("leaq bounds_message(%s), %s", RIP, RDI);
+    EMIT ("call print_line");
+    MOVQ ("$1", RDI);
+    EMIT ("call exit_program");
+}
+
+void generate_runtime(void)
+{
+    DIRECTIVE (".text");
+    generate_print_formatted();
+    generate_print_line();
+    generate_format_integer();
+    generate_flush_output();
+    generate_find_terminal();
+    generate_parse_integer();
+    generate_exit_program();
+    if (check_array_bounds)
+        generate_bounds_error();
+
+    DIRECTIVE (".section %s", ASM_STRING_SECTION);
+    char pairs[201];
+    for (int i = 0; i < 100; i++)
+        snprintf(&pairs[2 * i], 3, "%02d", i);
+    DIRECTIVE ("digit_pairs: \t.ascii \"%s\"", pairs);
+    if (check_array_bounds)
+        DIRECTIVE ("bounds_message: \t.asciz \"Array index out of bounds\"");
+
+    // The buffer goes in front of the global variables, so indexing past the end of the last array doesn't read it
+    DIRECTIVE (".section %s", ASM_BSS_SECTION);
+    DIRECTIVE (".align 16");
+    DIRECTIVE ("output_buffer: \t.zero %d", OUTPUT_BUFFER_SIZE);
+    DIRECTIVE ("output_length: \t.zero 8");
+    DIRECTIVE ("output_to_terminal: \t.zero 8");
+
+    if (profile_generate_path != NULL)
+        generate_profile_writer();
+}
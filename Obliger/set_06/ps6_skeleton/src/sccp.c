@@ -0,0 +1,309 @@
+#include <vslc.h>
+#include "ir.h"
+
+/* Sparse conditional constant propagation, as described by Wegman and Zadeck.
+ * Every value starts out undefined, and is lowered to a constant, and then to varying, as the instructions
+ * defining it are found to be reachable. Only the successors a branch can actually take are considered reachable.
+ */
+
+typedef enum
+{
+    UNDEFINED, CONSTANT, VARYING
+} lattice_state_t;
+
+typedef struct lattice_value
+{
+    lattice_state_t state;
+    int64_t constant;
+} lattice_value_t;
+
+// An instruction reading a value, found through the use lists
+typedef struct use_site
+{
+    int block;
+    int index;
+} use_site_t;
+
+static ir_function_t *function;
+static lattice_value_t *values; // Indexed by virtual register
+static bool *reachable;         // Indexed by block
+static bool *edge_taken;        // Indexed by block * 2 + successor slot
+
+static use_site_t **uses;       // The instructions reading each virtual register
+static size_t *n_uses, *uses_capacity;
+
+static int *block_worklist;     // Blocks with a newly taken incoming edge
+static size_t n_block_worklist;
+static ir_operand_t *value_worklist;
+static size_t n_value_worklist;
+
+static lattice_value_t operand_value(ir_operand_t operand)
+{
+    if (IR_IS_CONSTANT(operand))
+        return (lattice_value_t) {.state = CONSTANT, .constant = ir_constant_value(function, operand)};
+    return values[operand];
+}
+
+/* Lowers the value of the register to the given value, if it is lower */
+static void lower_value(ir_operand_t dst, lattice_value_t value)
+{
+    lattice_value_t *old = &values[dst];
+    if (value.state == UNDEFINED || old->state == VARYING)
+        return;
+    if (old->state == CONSTANT && value.state == CONSTANT && old->constant == value.constant)
+        return;
+    if (old->state == CONSTANT)
+        value.state = VARYING;
+    *old = value;
+    value_worklist[n_value_worklist++] = dst;
+}
+
+static void take_edge(int block, int slot)
+{
+    if (edge_taken[block * 2 + slot])
+        return;
+    edge_taken[block * 2 + slot] = true;
+    block_worklist[n_block_worklist++] = function->blocks[block].successors[slot];
+}
+
+/* The wrapping arithmetic of the generated code, without undefined behaviour in the compiler */
+static lattice_value_t fold(ir_opcode_t opcode, int64_t a, int64_t b)
+{
+    lattice_value_t result = {.state = CONSTANT};
+    switch (opcode)
+    {
+        case IR_ADD:
+            result.constant = (int64_t) ((uint64_t) a + (uint64_t) b);
+            break;
+        case IR_SUB:
+            result.constant = (int64_t) ((uint64_t) a - (uint64_t) b);
+            break;
+        case IR_MUL:
+            result.constant = (int64_t) ((uint64_t) a * (uint64_t) b);
+            break;
+        case IR_DIV:
+            // Division by zero, and overflowing division, must still trap when the program runs
+            if (b == 0 || (a == INT64_MIN && b == -1))
+                result.state = VARYING;
+            else
+                result.constant = a / b;
+            break;
+        default:
+            assert (false && "Not a binary operation");
+    }
+    return result;
+}
+
+static void evaluate_phi(int block, ir_instruction_t *phi)
+{
+    lattice_value_t result = {.state = UNDEFINED};
+    for (int32_t k = 0; k < phi->b && result.state != VARYING; k++)
+    {
+        int predecessor = function->arguments[phi->a + 2 * k];
+        ir_block_t *p = &function->blocks[predecessor];
+        bool taken = false;
+        for (int s = 0; s < ir_successor_count(p); s++)
+            taken |= p->successors[s] == block && edge_taken[predecessor * 2 + s];
+        if (!taken)
+            continue;
+
+        lattice_value_t value = operand_value(function->arguments[phi->a + 2 * k + 1]);
+        if (value.state == UNDEFINED)
+            continue;
+        if (result.state == UNDEFINED || value.state == VARYING)
+            result = value;
+        else if (result.constant != value.constant)
+            result.state = VARYING;
+    }
+    lower_value(phi->dst, result);
+}
+
+static void evaluate(int block, ir_instruction_t *instruction)
+{
+    lattice_value_t a, b;
+    switch (instruction->opcode)
+    {
+        case IR_PHI:
+            evaluate_phi(block, instruction);
+            break;
+        case IR_COPY:
+            lower_value(instruction->dst, operand_value(instruction->a));
+            break;
+        case IR_NEG:
+            a = operand_value(instruction->a);
+            if (a.state == CONSTANT)
+                a.constant = (int64_t) -(uint64_t) a.constant;
+            lower_value(instruction->dst, a);
+            break;
+        case IR_ADD:
+        case IR_SUB:
+        case IR_MUL:
+        case IR_DIV:
+            a = operand_value(instruction->a);
+            b = operand_value(instruction->b);
+            if (instruction->opcode == IR_MUL
+                && ((a.state == CONSTANT && a.constant == 0) || (b.state == CONSTANT && b.constant == 0)))
+                lower_value(instruction->dst, (lattice_value_t) {.state = CONSTANT, .constant = 0});
+            else if (a.state == VARYING || b.state == VARYING)
+                lower_value(instruction->dst, (lattice_value_t) {.state = VARYING});
+            else if (a.state == CONSTANT && b.state == CONSTANT)
+                lower_value(instruction->dst, fold(instruction->opcode, a.constant, b.constant));
+            break;
+        case IR_SELECT:
+        {
+            ir_operand_t *operands = &function->arguments[instruction->a];
+            a = operand_value(operands[0]);
+            b = operand_value(operands[1]);
+            if (a.state == CONSTANT && b.state == CONSTANT)
+            {
+                bool holds = ir_relation_holds(instruction->relation, a.constant, b.constant);
+                lower_value(instruction->dst, operand_value(operands[holds ? 2 : 3]));
+            }
+            else if (a.state == VARYING || b.state == VARYING)
+                lower_value(instruction->dst, (lattice_value_t) {.state = VARYING});
+            break;
+        }
+        case IR_JUMP:
+            take_edge(block, 0);
+            break;
+        case IR_BRANCH:
+            a = operand_value(instruction->a);
+            b = operand_value(instruction->b);
+            if (a.state == CONSTANT && b.state == CONSTANT)
+                take_edge(block, ir_relation_holds(instruction->relation, a.constant, b.constant) ? 0 : 1);
+            else if (a.state == VARYING || b.state == VARYING)
+            {
+                take_edge(block, 0);
+                take_edge(block, 1);
+            }
+            break;
+        default:
+            // Parameters, loads and calls can produce anything
+            if (ir_has_dst(instruction))
+                lower_value(instruction->dst, (lattice_value_t) {.state = VARYING});
+            break;
+    }
+}
+
+static void record_use(ir_operand_t *operand, void *context)
+{
+    if (!IR_IS_REGISTER(*operand))
+        return;
+    ir_operand_t r = *operand;
+    if (n_uses[r] == uses_capacity[r])
+    {
+        uses_capacity[r] = uses_capacity[r] * 2 + 4;
+        uses[r] = realloc(uses[r], uses_capacity[r] * sizeof(use_site_t));
+    }
+    uses[r][n_uses[r]++] = *(use_site_t *) context;
+}
+
+static void replace_constant_use(ir_operand_t *operand, void *context)
+{
+    bool *changed = context;
+    if (IR_IS_REGISTER(*operand) && values[*operand].state == CONSTANT)
+    {
+        *operand = ir_constant(function, values[*operand].constant);
+        *changed = true;
+    }
+}
+
+/* Replaces uses of constant values by the constants, and branches that always go the same way by jumps */
+static bool rewrite(void)
+{
+    bool changed = false;
+    for (size_t i = 0; i < function->n_blocks; i++)
+    {
+        if (!reachable[i])
+            continue;
+        ir_block_t *block = &function->blocks[i];
+        for (size_t j = 0; j < block->n_instructions; j++)
+            ir_for_each_use(function, &block->instructions[j], replace_constant_use, &changed);
+
+        ir_instruction_t *terminator = &block->instructions[block->n_instructions - 1];
+        if (terminator->opcode == IR_BRANCH && edge_taken[i * 2] != edge_taken[i * 2 + 1])
+        {
+            block->successors[0] = block->successors[edge_taken[i * 2] ? 0 : 1];
+            *terminator = (ir_instruction_t) {
+                .opcode = IR_JUMP, .dst = IR_NO_OPERAND, .a = IR_NO_OPERAND, .b = IR_NO_OPERAND
+            };
+            changed = true;
+        }
+    }
+    return changed;
+}
+
+bool ir_propagate_constants(ir_function_t *ir_function)
+{
+    function = ir_function;
+    size_t n_registers = function->n_registers;
+    size_t n_instructions = 0;
+    for (size_t i = 0; i < function->n_blocks; i++)
+        n_instructions += function->blocks[i].n_instructions;
+
+    values = calloc(n_registers, sizeof(lattice_value_t));
+    reachable = calloc(function->n_blocks, sizeof(bool));
+    edge_taken = calloc(function->n_blocks * 2, sizeof(bool));
+    uses = calloc(n_registers, sizeof(use_site_t *));
+    n_uses = calloc(n_registers, sizeof(size_t));
+    uses_capacity = calloc(n_registers, sizeof(size_t));
+
+    for (size_t i = 0; i < function->n_blocks; i++)
+    {
+        ir_block_t *block = &function->blocks[i];
+        for (size_t j = 0; j < block->n_instructions; j++)
+        {
+            use_site_t site = {.block = i, .index = j};
+            ir_for_each_use(function, &block->instructions[j], record_use, &site);
+        }
+    }
+
+    // Each edge is taken at most once, and each value lowered at most twice
+    block_worklist = malloc((2 * function->n_blocks + 1) * sizeof(int));
+    value_worklist = malloc((2 * n_registers + 1) * sizeof(ir_operand_t));
+    n_block_worklist = n_value_worklist = 0;
+    block_worklist[n_block_worklist++] = 0;
+
+    while (n_block_worklist > 0 || n_value_worklist > 0)
+    {
+        if (n_block_worklist > 0)
+        {
+            int b = block_worklist[--n_block_worklist];
+            ir_block_t *block = &function->blocks[b];
+            if (reachable[b])
+            {
+                // Only the phis can change because of another incoming edge
+                for (size_t j = 0; j < block->n_instructions && block->instructions[j].opcode == IR_PHI; j++)
+                    evaluate(b, &block->instructions[j]);
+                continue;
+            }
+            reachable[b] = true;
+            for (size_t j = 0; j < block->n_instructions; j++)
+                evaluate(b, &block->instructions[j]);
+            continue;
+        }
+
+        ir_operand_t r = value_worklist[--n_value_worklist];
+        for (size_t u = 0; u < n_uses[r]; u++)
+            if (reachable[uses[r][u].block])
+                evaluate(uses[r][u].block, &function->blocks[uses[r][u].block].instructions[uses[r][u].index]);
+    }
+
+    bool changed = rewrite();
+    for (size_t i = 0; i < function->n_blocks && !changed; i++)
+        changed = !reachable[i];
+    ir_remove_unreachable_blocks(function);
+
+    for (size_t r = 0; r < n_registers; r++)
+        free(uses[r]);
+    free(uses);
+    free(n_uses);
+    free(uses_capacity);
+    free(values);
+    free(reachable);
+    free(edge_taken);
+    free(block_worklist);
+    free(value_worklist);
+    function = NULL;
+    return changed;
+}
@@ -0,0 +1,543 @@
+#include <vslc.h>
+#include "asm.h"
+
+/* List scheduling of the buffered assembly of one function, after the peephole optimizer.
+ * The code generators emit instructions in the order they walk the program, so a value is often used by the
+ * very next instruction, even when it comes from a load or a multiplication taking several cycles.
+ * Within each run of instructions without labels, jumps, calls or stack pointer changes, the instructions are
+ * ordered by a simulated core: each cycle, it starts the ready instructions heading the longest chains of
+ * latency still to come, as long as there are execution ports free for them.
+ */
+
+// Groups of execution ports on a Skylake-like core, and how many instructions each can start per cycle
+typedef enum
+{
+    UNIT_ALU, UNIT_SHIFT, UNIT_MULTIPLY, UNIT_DIVIDE, UNIT_LOAD, UNIT_STORE, NUM_UNITS
+} unit_t;
+static const int UNIT_WIDTH[NUM_UNITS] = {4, 2, 1, 1, 2, 1};
+
+// Instructions started per cycle, and cycles until a loaded value can be used
+#define ISSUE_WIDTH 4
+#define LOAD_LATENCY 5
+
+// Longer runs are scheduled in pieces, to bound the time spent on them
+#define REGION_LIMIT 256
+
+// How an instruction uses its operands
+typedef enum
+{
+    FORM_MOVE,              // Reads the source, writes the destination
+    FORM_ARITHMETIC,        // Reads both, writes the destination and the flags
+    FORM_COMPARE,           // Reads both, writes the flags
+    FORM_UNARY,             // Reads and writes its operand, and writes the flags
+    FORM_ADDRESS,           // Writes the address of its source to the destination, without accessing memory
+    FORM_MULTIPLY,          // Arithmetic with two operands, dst := a * b with three, rdx:rax := rax * a with one
+    FORM_DIVIDE,            // rax := rdx:rax / a, rdx := rdx:rax % a
+    FORM_SIGN_EXTEND,       // rdx := the sign of rax
+    FORM_SET,               // Writes the low byte of its operand from the flags
+    FORM_CONDITIONAL_MOVE   // Writes the source to the destination, if the flags say so
+} form_t;
+
+// How many operands each form has. Multiplication has from one to three
+static const int EXPECTED_OPERANDS[] = {2, 2, 2, 1, 2, 1, 1, 0, 1, 2};
+
+typedef struct instruction_info
+{
+    const char *mnemonic;
+    form_t form;
+    unit_t unit;
+    int latency;
+} instruction_info_t;
+
+static const instruction_info_t INSTRUCTIONS[] = {
+    {"movq", FORM_MOVE, UNIT_ALU, 1},
+    {"movabsq", FORM_MOVE, UNIT_ALU, 1},
+    {"movzbl", FORM_MOVE, UNIT_ALU, 1},
+    {"leaq", FORM_ADDRESS, UNIT_ALU, 1},
+    {"addq", FORM_ARITHMETIC, UNIT_ALU, 1},
+    {"subq", FORM_ARITHMETIC, UNIT_ALU, 1},
+    {"andq", FORM_ARITHMETIC, UNIT_ALU, 1},
+    {"orq", FORM_ARITHMETIC, UNIT_ALU, 1},
+    {"xorq", FORM_ARITHMETIC, UNIT_ALU, 1},
+    {"xorl", FORM_ARITHMETIC, UNIT_ALU, 1},
+    {"cmpq", FORM_COMPARE, UNIT_ALU, 1},
+    {"testq", FORM_COMPARE, UNIT_ALU, 1},
+    {"negq", FORM_UNARY, UNIT_ALU, 1},
+    {"incq", FORM_UNARY, UNIT_ALU, 1},
+    {"shlq", FORM_ARITHMETIC, UNIT_SHIFT, 1},
+    {"sarq", FORM_ARITHMETIC, UNIT_SHIFT, 1},
+    {"shrq", FORM_ARITHMETIC, UNIT_SHIFT, 1},
+    {"imulq", FORM_MULTIPLY, UNIT_MULTIPLY, 3},
+    {"idivq", FORM_DIVIDE, UNIT_DIVIDE, 42},
+    {"cqo", FORM_SIGN_EXTEND, UNIT_ALU, 1},
+};
+#define NUM_INSTRUCTIONS (sizeof(INSTRUCTIONS) / sizeof(INSTRUCTIONS[0]))
+
+// Instructions named by a prefix followed by a condition code
+static const instruction_info_t SET = {"set", FORM_SET, UNIT_ALU, 1};
+static const instruction_info_t CONDITIONAL_MOVE = {"cmov", FORM_CONDITIONAL_MOVE, UNIT_ALU, 1};
+
+// Each register is a bit in a set of resources, along with the flags
+static const char *REGISTER_NAMES[][3] = {
+    {"%rax", "%eax", "%al"}, {"%rbx", "%ebx", "%bl"}, {"%rcx", "%ecx", "%cl"}, {"%rdx", "%edx", "%dl"},
+    {"%rsi", "%esi", "%sil"}, {"%rdi", "%edi", "%dil"}, {"%rbp", "%ebp", "%bpl"}, {"%rsp", "%esp", "%spl"},
+    {"%r8", "%r8d", "%r8b"}, {"%r9", "%r9d", "%r9b"}, {"%r10", "%r10d", "%r10b"}, {"%r11", "%r11d", "%r11b"},
+    {"%r12", "%r12d", "%r12b"}, {"%r13", "%r13d", "%r13b"}, {"%r14", "%r14d", "%r14b"}, {"%r15", "%r15d", "%r15b"}
+};
+#define NUM_REGISTERS 16
+#define REGISTER_RAX 0
+#define REGISTER_RDX 3
+#define REGISTER_RBP 6
+#define REGISTER_RSP 7
+#define FLAGS NUM_REGISTERS
+#define BIT(resource) (1u << (resource))
+
+typedef struct schedule_node
+{
+    asm_line_t line;
+    const instruction_info_t *info;
+    uint32_t reads, writes;
+    bool loads, stores;
+    const char *memory;     // The memory operand, if it loads or stores
+    int latency;            // Cycles until what it writes can be used
+    bool units[NUM_UNITS];
+
+    // For the scheduling itself
+    int height;             // Cycles from starting it until the region is done, along its longest chain
+    int n_predecessors;     // Not scheduled yet
+    int earliest;           // The first cycle all its operands are ready
+    bool scheduled;
+} schedule_node_t;
+
+static schedule_node_t *nodes;
+static int *edges;          // The latency from node i to node j at [i * n + j], or -1 if j doesn't depend on i
+static size_t n;
+
+static int register_index(const char *name)
+{
+    for (int r = 0; r < NUM_REGISTERS; r++)
+        for (int size = 0; size < 3; size++)
+            if (strcmp(name, REGISTER_NAMES[r][size]) == 0)
+                return r;
+    return -1;
+}
+
+/* Returns the registers used to address memory with the operand */
+static uint32_t address_registers(const char *operand)
+{
+    uint32_t result = 0;
+    const char *p = strchr(operand, '(') + 1;
+    while (*p != '\0' && *p != ')')
+    {
+        while (*p == ' ' || *p == ',')
+            p++;
+        size_t length = strcspn(p, " ,)");
+        char name[8] = "";
+        if (length < sizeof(name))
+            memcpy(name, p, length), name[length] = '\0';
+        int r = register_index(name);
+        if (r >= 0)
+            result |= BIT(r);
+        p += length;
+    }
+    return result;
+}
+
+/* Adds what the instruction reads and writes through the operand */
+static void use_operand(schedule_node_t *node, const char *operand, bool read, bool write)
+{
+    if (asm_is_memory(operand))
+    {
+        node->reads |= address_registers(operand);
+        node->loads |= read;
+        node->stores |= write;
+        node->memory = operand;
+        return;
+    }
+    int r = register_index(operand);
+    if (r < 0)
+        return;
+    if (read)
+        node->reads |= BIT(r);
+    if (write)
+        node->writes |= BIT(r);
+}
+
+static const instruction_info_t *find_info(const char *mnemonic)
+{
+    for (size_t i = 0; i < NUM_INSTRUCTIONS; i++)
+        if (strcmp(mnemonic, INSTRUCTIONS[i].mnemonic) == 0)
+            return &INSTRUCTIONS[i];
+    if (strncmp(mnemonic, SET.mnemonic, strlen(SET.mnemonic)) == 0)
+        return &SET;
+    if (strncmp(mnemonic, CONDITIONAL_MOVE.mnemonic, strlen(CONDITIONAL_MOVE.mnemonic)) == 0)
+        return &CONDITIONAL_MOVE;
+    return NULL;
+}
+
+/* Fills in what the instruction reads, writes and needs. Returns false if it can't be moved at all */
+static bool analyze_instruction(schedule_node_t *node, asm_line_t *line)
+{
+    *node = (schedule_node_t) {.line = *line, .info = find_info(line->mnemonic), .memory = NULL};
+    if (node->info == NULL)
+        return false;
+
+    char **operands = line->operands;
+    int n_operands = line->n_operands;
+    if (n_operands != EXPECTED_OPERANDS[node->info->form]
+        && !(node->info->form == FORM_MULTIPLY && n_operands >= 1 && n_operands <= 3))
+        return false;
+
+    // Only the general purpose registers are tracked, so moves to and from vector registers stay in place
+    for (int i = 0; i < n_operands; i++)
+        if (asm_is_register(operands[i]) && register_index(operands[i]) < 0)
+            return false;
+    switch (node->info->form)
+    {
+        case FORM_MOVE:
+            use_operand(node, operands[0], true, false);
+            use_operand(node, operands[1], false, true);
+            break;
+        case FORM_ARITHMETIC:
+            // xorl %r, %r only zeroes the register, without reading it
+            if (strcmp(operands[0], operands[1]) == 0 && register_index(operands[0]) >= 0)
+                use_operand(node, operands[1], false, true);
+            else
+            {
+                use_operand(node, operands[0], true, false);
+                use_operand(node, operands[1], true, true);
+            }
+            node->writes |= BIT(FLAGS);
+            break;
+        case FORM_COMPARE:
+            use_operand(node, operands[0], true, false);
+            use_operand(node, operands[1], true, false);
+            node->writes |= BIT(FLAGS);
+            break;
+        case FORM_UNARY:
+            use_operand(node, operands[0], true, true);
+            node->writes |= BIT(FLAGS);
+            break;
+        case FORM_ADDRESS:
+            node->reads |= address_registers(operands[0]);
+            use_operand(node, operands[1], false, true);
+            break;
+        case FORM_MULTIPLY:
+            use_operand(node, operands[0], true, false);
+            if (n_operands == 1)
+            {
+                node->reads |= BIT(REGISTER_RAX);
+                node->writes |= BIT(REGISTER_RAX) | BIT(REGISTER_RDX);
+            }
+            else if (n_operands == 2)
+                use_operand(node, operands[1], true, true);
+            else
+            {
+                use_operand(node, operands[1], true, false);
+                use_operand(node, operands[2], false, true);
+            }
+            node->writes |= BIT(FLAGS);
+            break;
+        case FORM_DIVIDE:
+            use_operand(node, operands[0], true, false);
+            node->reads |= BIT(REGISTER_RAX) | BIT(REGISTER_RDX);
+            node->writes |= BIT(REGISTER_RAX) | BIT(REGISTER_RDX) | BIT(FLAGS);
+            break;
+        case FORM_SIGN_EXTEND:
+            node->reads |= BIT(REGISTER_RAX);
+            node->writes |= BIT(REGISTER_RDX);
+            break;
+        case FORM_SET:
+            // Only the low byte is written, so the rest of the register is read
+            use_operand(node, operands[0], true, true);
+            node->reads |= BIT(FLAGS);
+            break;
+        case FORM_CONDITIONAL_MOVE:
+            use_operand(node, operands[0], true, false);
+            use_operand(node, operands[1], true, true);
+            node->reads |= BIT(FLAGS);
+            break;
+    }
+
+    // The stack pointer and frame pointer only change around calls and in the prologue and epilogue,
+    // and the stack slots are told apart by their offsets from them
+    if (node->writes & (BIT(REGISTER_RSP) | BIT(REGISTER_RBP)))
+        return false;
+
+    if (node->info->form == FORM_MOVE && (node->loads || node->stores))
+    {
+        node->latency = node->loads ? LOAD_LATENCY : node->info->latency;
+        node->units[node->loads ? UNIT_LOAD : UNIT_STORE] = true;
+    }
+    else
+    {
+        node->latency = node->info->latency + (node->loads ? LOAD_LATENCY : 0);
+        node->units[node->info->unit] = true;
+        node->units[UNIT_ALU] = true;
+        node->units[UNIT_LOAD] = node->loads;
+        node->units[UNIT_STORE] = node->stores;
+    }
+    return true;
+}
+
+/* Returns true if the flags can be read by the instructions from the position on, before they are set again */
+static bool flags_live_at(asm_buffer_t *buffer, size_t position)
+{
+    for (size_t i = position; i < buffer->n_lines; i++)
+    {
+        asm_line_t *line = &buffer->lines[i];
+        if (line->kind != ASM_INSTRUCTION)
+            continue;
+        if (asm_reads_flags(line->mnemonic))
+            return true;
+        if (strcmp(line->mnemonic, "jmp") == 0 || strcmp(line->mnemonic, "call") == 0
+            || strcmp(line->mnemonic, "ret") == 0)
+            return false;
+        // Instructions that can't be scheduled still tell what they write, when they are known at all
+        schedule_node_t node;
+        analyze_instruction(&node, line);
+        if (node.info != NULL && (node.writes & BIT(FLAGS)))
+            return false;
+    }
+    return false;
+}
+
+/* Splits a memory operand into its displacement, and the register it is relative to */
+static void split_memory(const char *operand, char *displacement, size_t size, int *base)
+{
+    size_t length = strchr(operand, '(') - operand;
+    if (length >= size)
+        length = size - 1;
+    memcpy(displacement, operand, length);
+    displacement[length] = '\0';
+
+    uint32_t registers = address_registers(operand);
+    *base = -1;
+    if (registers == BIT(REGISTER_RSP))
+        *base = REGISTER_RSP;
+    else if (registers == BIT(REGISTER_RBP))
+        *base = REGISTER_RBP;
+    else if (registers == 0 && strstr(operand, "(%rip)") != NULL)
+        *base = NUM_REGISTERS;
+}
+
+/* Returns true if the two memory operands could refer to overlapping quadwords.
+ * Stack slots are told apart by their offsets, and globals by their names. Arrays are only reached through
+ * registers holding addresses, which may point anywhere but the stack
+ */
+static bool may_alias(const char *a, const char *b)
+{
+    char displacement_a[64], displacement_b[64];
+    int base_a, base_b;
+    split_memory(a, displacement_a, sizeof(displacement_a), &base_a);
+    split_memory(b, displacement_b, sizeof(displacement_b), &base_b);
+
+    bool stack_a = base_a == REGISTER_RSP || base_a == REGISTER_RBP;
+    bool stack_b = base_b == REGISTER_RSP || base_b == REGISTER_RBP;
+    if (stack_a != stack_b)
+        return false;
+    if (stack_a)
+    {
+        if (base_a != base_b)
+            return true;
+        long offset_a = strtol(displacement_a, NULL, 10), offset_b = strtol(displacement_b, NULL, 10);
+        return labs(offset_a - offset_b) < 8;
+    }
+    if (base_a == NUM_REGISTERS && base_b == NUM_REGISTERS)
+    {
+        size_t length_a = strcspn(displacement_a, "+-"), length_b = strcspn(displacement_b, "+-");
+        return length_a == length_b && strncmp(displacement_a, displacement_b, length_a) == 0;
+    }
+    return true;
+}
+
+static void add_edge(size_t from, size_t to, int latency)
+{
+    if (latency > edges[from * n + to])
+        edges[from * n + to] = latency;
+}
+
+/* Finds the dependencies between the instructions of the region. Returns the instruction setting the flags
+ * read after the region, or -1
+ */
+static int build_dependencies(bool flags_live_out)
+{
+    int last_writer[NUM_REGISTERS];
+    for (int r = 0; r < NUM_REGISTERS; r++)
+        last_writer[r] = -1;
+
+    // The flags are set by one instruction and read by the ones after it. Instructions setting flags nobody
+    // reads can move around freely, but never in between those
+    int flags_owner = -1;
+    size_t flags_readers_start = 0;
+    bool live_flags[n];
+
+    for (size_t i = 0; i < n; i++)
+    {
+        live_flags[i] = false;
+        if (!(nodes[i].writes & BIT(FLAGS)))
+            continue;
+        live_flags[i] = flags_live_out;
+        for (size_t j = i + 1; j < n; j++)
+        {
+            if (nodes[j].reads & BIT(FLAGS))
+            {
+                live_flags[i] = true;
+                break;
+            }
+            if (nodes[j].writes & BIT(FLAGS))
+            {
+                live_flags[i] = false;
+                break;
+            }
+        }
+    }
+
+    for (size_t i = 0; i < n; i++)
+    {
+        schedule_node_t *node = &nodes[i];
+        for (int r = 0; r < NUM_REGISTERS; r++)
+        {
+            if ((node->reads & BIT(r)) && last_writer[r] >= 0)
+                add_edge(last_writer[r], i, nodes[last_writer[r]].latency);
+            if (!(node->writes & BIT(r)))
+                continue;
+            int start = last_writer[r] >= 0 ? last_writer[r] : 0;
+            if (last_writer[r] >= 0)
+                add_edge(last_writer[r], i, 0);
+            for (size_t k = start; k < i; k++)
+                if (nodes[k].reads & BIT(r))
+                    add_edge(k, i, 0);
+        }
+        for (int r = 0; r < NUM_REGISTERS; r++)
+            if (node->writes & BIT(r))
+                last_writer[r] = i;
+
+        if (node->loads || node->stores)
+        {
+            for (size_t k = 0; k < i; k++)
+                if ((nodes[k].stores || (node->stores && nodes[k].loads)) && may_alias(nodes[k].memory, node->memory))
+                    add_edge(k, i, nodes[k].stores ? nodes[k].latency : 0);
+        }
+
+        if ((node->reads & BIT(FLAGS)) && flags_owner >= 0)
+            add_edge(flags_owner, i, nodes[flags_owner].latency);
+        if (node->writes & BIT(FLAGS))
+        {
+            // Stay after the readers of the flags set before, and before the next instruction whose flags are read
+            for (size_t k = flags_readers_start; k < i; k++)
+                if ((int) k == flags_owner || (nodes[k].reads & BIT(FLAGS)))
+                    add_edge(k, i, 0);
+            if (live_flags[i])
+            {
+                for (size_t k = flags_readers_start; k < i; k++)
+                    if (nodes[k].writes & BIT(FLAGS))
+                        add_edge(k, i, 0);
+                flags_owner = i;
+                flags_readers_start = i;
+            }
+        }
+    }
+
+    return flags_live_out && flags_owner >= 0 && live_flags[flags_owner] ? flags_owner : -1;
+}
+
+static bool fits(schedule_node_t *node, const int *used)
+{
+    for (int u = 0; u < NUM_UNITS; u++)
+        if (node->units[u] && used[u] == UNIT_WIDTH[u])
+            return false;
+    return true;
+}
+
+/* Schedules the n instructions starting at the position, and puts them back in their new order */
+static void schedule_region(asm_buffer_t *buffer, size_t position)
+{
+    bool flags_live_out = flags_live_at(buffer, position + n);
+    edges = malloc(n * n * sizeof(int));
+    for (size_t i = 0; i < n * n; i++)
+        edges[i] = -1;
+    int flags_setter = build_dependencies(flags_live_out);
+
+    for (size_t i = n; i-- > 0;)
+    {
+        nodes[i].height = nodes[i].latency;
+        for (size_t k = i + 1; k < n; k++)
+            if (edges[i * n + k] >= 0 && edges[i * n + k] + nodes[k].height > nodes[i].height)
+                nodes[i].height = edges[i * n + k] + nodes[k].height;
+        for (size_t k = 0; k < i; k++)
+            nodes[i].n_predecessors += edges[k * n + i] >= 0;
+    }
+
+    int order[n];
+    size_t n_scheduled = 0;
+    for (int cycle = 0; n_scheduled < n; cycle++)
+    {
+        int used[NUM_UNITS] = {0};
+        int issued = 0;
+        while (issued < ISSUE_WIDTH)
+        {
+            // The instruction with the longest chain after it goes first, and the earliest one of equals
+            int best = -1;
+            for (size_t i = 0; i < n; i++)
+            {
+                schedule_node_t *node = &nodes[i];
+                if (node->scheduled || node->n_predecessors > 0 || node->earliest > cycle || !fits(node, used))
+                    continue;
+                if (best < 0 || node->height > nodes[best].height)
+                    best = i;
+            }
+            if (best < 0)
+                break;
+
+            schedule_node_t *node = &nodes[best];
+            node->scheduled = true;
+            order[n_scheduled++] = best;
+            issued++;
+            for (int u = 0; u < NUM_UNITS; u++)
+                used[u] += node->units[u];
+            for (size_t k = 0; k < n; k++)
+            {
+                int latency = edges[best * n + k];
+                if (latency < 0)
+                    continue;
+                nodes[k].n_predecessors--;
+                if (cycle + latency > nodes[k].earliest)
+                    nodes[k].earliest = cycle + latency;
+            }
+        }
+    }
+
+    // The comparison for a branch after the region moves down to it, where the two are fused into one
+    for (size_t p = 0; flags_setter >= 0 && p + 1 < n; p++)
+    {
+        if (order[p] == flags_setter && edges[flags_setter * n + order[p + 1]] < 0)
+        {
+            order[p] = order[p + 1];
+            order[p + 1] = flags_setter;
+        }
+    }
+
+    for (size_t i = 0; i < n; i++)
+        buffer->lines[position + i] = nodes[order[i]].line;
+    free(edges);
+    edges = NULL;
+}
+
+void schedule_instructions(asm_buffer_t *buffer)
+{
+    nodes = malloc(REGION_LIMIT * sizeof(schedule_node_t));
+    for (size_t start = 0; start < buffer->n_lines;)
+    {
+        n = 0;
+        while (start + n < buffer->n_lines && n < REGION_LIMIT && buffer->lines[start + n].kind == ASM_INSTRUCTION
+               && analyze_instruction(&nodes[n], &buffer->lines[start + n]))
+            n++;
+        if (n > 1)
+            schedule_region(buffer, start);
+        start += n > 0 ? n : 1;
+    }
+    free(nodes);
+    nodes = NULL;
+    n = 0;
+}
@@ -0,0 +1,554 @@
+#include <vslc.h>
+#include "ir.h"
+
+/* Conversion into and out of SSA form, following Cytron et al.
+ * Phis are placed at the iterated dominance frontier of the blocks assigning a variable,
+ * but only where the variable is live, and the assignments are renamed by a walk over the dominator tree.
+ */
+
+static ir_function_t *function;
+static ir_cfg_t *cfg;
+
+// While renaming, the current register holding each renamed variable
+static ir_operand_t **name_stacks;
+static size_t *n_names, *names_capacity;
+
+/* Returns the dominance frontier of every block, as lists of blocks, with their lengths in n_frontiers */
+static int **compute_dominance_frontiers(size_t *n_frontiers)
+{
+    int **frontiers = malloc(function->n_blocks * sizeof(int *));
+    size_t *capacity = calloc(function->n_blocks, sizeof(size_t));
+    for (size_t i = 0; i < function->n_blocks; i++)
+    {
+        frontiers[i] = NULL;
+        n_frontiers[i] = 0;
+    }
+
+    // Each runner stops at the immediate dominator of the block, so it adds the block at most once
+    for (size_t i = 0; i < function->n_blocks; i++)
+    {
+        if (cfg->n_predecessors[i] < 2 || cfg->immediate_dominator[i] == -1)
+            continue;
+        for (size_t p = 0; p < cfg->n_predecessors[i]; p++)
+        {
+            int runner = cfg->predecessors[i][p];
+            if (cfg->immediate_dominator[runner] == -1)
+                continue;
+            while (runner != cfg->immediate_dominator[i])
+            {
+                if (n_frontiers[runner] > 0 && frontiers[runner][n_frontiers[runner] - 1] == (int) i)
+                    break;
+                if (n_frontiers[runner] == capacity[runner])
+                {
+                    capacity[runner] = capacity[runner] * 2 + 2;
+                    frontiers[runner] = realloc(frontiers[runner], capacity[runner] * sizeof(int));
+                }
+                frontiers[runner][n_frontiers[runner]++] = i;
+                runner = cfg->immediate_dominator[runner];
+            }
+        }
+    }
+    free(capacity);
+    return frontiers;
+}
+
+/* Inserts an empty phi for the variable at the start of the block, with one pair per predecessor */
+static void insert_phi(int block, ir_operand_t variable)
+{
+    size_t n_pairs = cfg->n_predecessors[block];
+    ir_operand_t pairs[2 * n_pairs + 1];
+    for (size_t p = 0; p < n_pairs; p++)
+    {
+        pairs[2 * p] = cfg->predecessors[block][p];
+        pairs[2 * p + 1] = IR_NO_OPERAND;
+    }
+
+    ir_instruction_t phi = {
+        .opcode = IR_PHI,
+        .symbol = variable,
+        .dst = variable,
+        .a = ir_add_arguments(function, pairs, 2 * n_pairs),
+        .b = n_pairs
+    };
+    ir_block_t *b = &function->blocks[block];
+    ir_append(b, phi);
+    memmove(b->instructions + 1, b->instructions, (b->n_instructions - 1) * sizeof(ir_instruction_t));
+    b->instructions[0] = phi;
+}
+
+static void place_phis(bool *renamed)
+{
+    size_t n_registers = function->n_registers;
+    size_t n_blocks = function->n_blocks;
+    size_t *n_frontiers = malloc(n_blocks * sizeof(size_t));
+    int **frontiers = compute_dominance_frontiers(n_frontiers);
+    ir_liveness_t *liveness = ir_compute_liveness(function);
+
+    // The blocks assigning each variable, as one list of (variable, block) pairs sorted by variable.
+    // A block assigning a variable several times is listed once per assignment
+    size_t *n_definitions = calloc(n_registers + 1, sizeof(size_t));
+    for (size_t i = 0; i < n_blocks; i++)
+        for (size_t j = 0; j < function->blocks[i].n_instructions; j++)
+            if (ir_has_dst(&function->blocks[i].instructions[j]))
+                n_definitions[function->blocks[i].instructions[j].dst + 1]++;
+    for (size_t r = 0; r < n_registers; r++)
+        n_definitions[r + 1] += n_definitions[r];
+    int *definition_blocks = malloc((n_definitions[n_registers] + 1) * sizeof(int));
+    size_t *next = malloc((n_registers + 1) * sizeof(size_t));
+    memcpy(next, n_definitions, (n_registers + 1) * sizeof(size_t));
+    for (size_t i = 0; i < n_blocks; i++)
+        for (size_t j = 0; j < function->blocks[i].n_instructions; j++)
+            if (ir_has_dst(&function->blocks[i].instructions[j]))
+                definition_blocks[next[function->blocks[i].instructions[j].dst]++] = i;
+
+    // Marks of the last variable each block got a phi for, and was put on the worklist for,
+    // so they never need clearing between variables
+    int *worklist = malloc((n_blocks + 1) * sizeof(int));
+    ir_operand_t *has_phi = malloc(n_blocks * sizeof(ir_operand_t));
+    ir_operand_t *added = malloc(n_blocks * sizeof(ir_operand_t));
+    for (size_t i = 0; i < n_blocks; i++)
+        has_phi[i] = added[i] = IR_NO_OPERAND;
+
+    // Values assigned only once are already in SSA form, as every use is reached by the assignment
+    for (size_t r = 0; r < n_registers; r++)
+    {
+        renamed[r] = n_definitions[r + 1] - n_definitions[r] > 1;
+        if (!renamed[r])
+            continue;
+
+        size_t n_worklist = 0;
+        for (size_t d = n_definitions[r]; d < n_definitions[r + 1]; d++)
+        {
+            int block = definition_blocks[d];
+            if (added[block] != (ir_operand_t) r)
+            {
+                added[block] = r;
+                worklist[n_worklist++] = block;
+            }
+        }
+
+        while (n_worklist > 0)
+        {
+            int block = worklist[--n_worklist];
+            for (size_t k = 0; k < n_frontiers[block]; k++)
+            {
+                int f = frontiers[block][k];
+                if (has_phi[f] == (ir_operand_t) r || !IR_SET_CONTAINS(liveness->live_in[f], r))
+                    continue;
+                has_phi[f] = r;
+                insert_phi(f, r);
+                if (added[f] != (ir_operand_t) r)
+                {
+                    added[f] = r;
+                    worklist[n_worklist++] = f;
+                }
+            }
+        }
+    }
+
+    for (size_t i = 0; i < n_blocks; i++)
+        free(frontiers[i]);
+    free(frontiers);
+    free(n_frontiers);
+    free(definition_blocks);
+    free(n_definitions);
+    free(next);
+    free(worklist);
+    free(has_phi);
+    free(added);
+    ir_destroy_liveness(liveness);
+}
+
+static void push_name(ir_operand_t variable, ir_operand_t name)
+{
+    if (n_names[variable] == names_capacity[variable])
+    {
+        names_capacity[variable] = names_capacity[variable] * 2 + 4;
+        name_stacks[variable] = realloc(name_stacks[variable], names_capacity[variable] * sizeof(ir_operand_t));
+    }
+    name_stacks[variable][n_names[variable]++] = name;
+}
+
+static void rename_use(ir_operand_t *operand, void *context)
+{
+    (void) context;
+    if (IR_IS_REGISTER(*operand) && n_names[*operand] > 0)
+        *operand = name_stacks[*operand][n_names[*operand] - 1];
+}
+
+static void rename_block(int block, bool *renamed)
+{
+    ir_block_t *b = &function->blocks[block];
+
+    // The variables given new names in this block, whose names are popped again afterwards
+    ir_operand_t pushed[b->n_instructions + 1];
+    size_t n_pushed = 0;
+
+    for (size_t j = 0; j < b->n_instructions; j++)
+    {
+        ir_instruction_t *instruction = &b->instructions[j];
+        if (instruction->opcode != IR_PHI)
+            ir_for_each_use(function, instruction, rename_use, NULL);
+        if (!ir_has_dst(instruction))
+            continue;
+
+        // Phis remember the variable they were placed for in their symbol
+        ir_operand_t variable = instruction->opcode == IR_PHI ? instruction->symbol : instruction->dst;
+        if (renamed[variable])
+        {
+            ir_operand_t name = ir_new_register(function);
+            instruction->dst = name;
+            push_name(variable, name);
+            pushed[n_pushed++] = variable;
+        }
+    }
+
+    // Fill in the values the phis of the successors receive from this block
+    for (int s = 0; s < ir_successor_count(b); s++)
+    {
+        ir_block_t *successor = &function->blocks[b->successors[s]];
+        for (size_t j = 0; j < successor->n_instructions && successor->instructions[j].opcode == IR_PHI; j++)
+        {
+            ir_instruction_t *phi = &successor->instructions[j];
+            for (int32_t k = 0; k < phi->b; k++)
+            {
+                ir_operand_t *pair = &function->arguments[phi->a + 2 * k];
+                if (pair[0] == block && pair[1] == IR_NO_OPERAND)
+                {
+                    pair[1] = phi->symbol;
+                    rename_use(&pair[1], NULL);
+                    break;
+                }
+            }
+        }
+    }
+
+    for (size_t c = 0; c < cfg->n_dominated[block]; c++)
+        rename_block(cfg->dominated[block][c], renamed);
+
+    while (n_pushed > 0)
+        n_names[pushed[--n_pushed]]--;
+}
+
+void ir_construct_ssa(ir_function_t *ir_function)
+{
+    function = ir_function;
+    cfg = ir_analyze_cfg(function);
+
+    size_t n_variables = function->n_registers;
+    bool *renamed = calloc(n_variables, sizeof(bool));
+    place_phis(renamed);
+
+    name_stacks = calloc(n_variables, sizeof(ir_operand_t *));
+    n_names = calloc(n_variables, sizeof(size_t));
+    names_capacity = calloc(n_variables, sizeof(size_t));
+    rename_block(0, renamed);
+
+    for (size_t r = 0; r < n_variables; r++)
+        free(name_stacks[r]);
+    free(name_stacks);
+    free(n_names);
+    free(names_capacity);
+    free(renamed);
+    ir_destroy_cfg(cfg);
+    cfg = NULL;
+    function = NULL;
+}
+
+static void replace_copied_use(ir_operand_t *operand, void *context)
+{
+    ir_operand_t *replacement = context;
+    if (IR_IS_REGISTER(*operand))
+        *operand = replacement[*operand];
+}
+
+bool ir_propagate_copies(ir_function_t *ir_function)
+{
+    function = ir_function;
+    ir_operand_t *replacement = malloc(function->n_registers * sizeof(ir_operand_t));
+    for (size_t r = 0; r < function->n_registers; r++)
+        replacement[r] = r;
+
+    bool changed = false;
+    for (size_t i = 0; i < function->n_blocks; i++)
+    {
+        for (size_t j = 0; j < function->blocks[i].n_instructions; j++)
+        {
+            ir_instruction_t *instruction = &function->blocks[i].instructions[j];
+            if (instruction->opcode == IR_COPY && IR_IS_REGISTER(instruction->a))
+            {
+                replacement[instruction->dst] = instruction->a;
+                changed = true;
+            }
+        }
+    }
+    if (!changed)
+    {
+        free(replacement);
+        function = NULL;
+        return false;
+    }
+
+    // Copies of copies are replaced by the original. Every chain ends, since each copy is dominated by its source
+    for (size_t r = 0; r < function->n_registers; r++)
+        while (replacement[replacement[r]] != replacement[r])
+            replacement[r] = replacement[replacement[r]];
+
+    for (size_t i = 0; i < function->n_blocks; i++)
+    {
+        ir_block_t *block = &function->blocks[i];
+        size_t kept = 0;
+        for (size_t j = 0; j < block->n_instructions; j++)
+        {
+            ir_instruction_t *instruction = &block->instructions[j];
+            if (instruction->opcode == IR_COPY && IR_IS_REGISTER(instruction->a))
+                continue;
+            ir_for_each_use(function, instruction, replace_copied_use, replacement);
+            block->instructions[kept++] = *instruction;
+        }
+        block->n_instructions = kept;
+    }
+    free(replacement);
+    function = NULL;
+    return true;
+}
+
+/* Inserts a copy right before the terminator of the block */
+static void insert_copy(int block, ir_operand_t dst, ir_operand_t src)
+{
+    ir_block_t *b = &function->blocks[block];
+    ir_instruction_t terminator = b->instructions[b->n_instructions - 1];
+    b->instructions[b->n_instructions - 1] = (ir_instruction_t) {
+        .opcode = IR_COPY, .dst = dst, .a = src, .b = IR_NO_OPERAND
+    };
+    ir_append(b, terminator);
+}
+
+/* The copies replacing the phis of one edge happen at the same time, as the phis do.
+ * Order them so that no copy overwrites a value a later copy reads, breaking cycles with a new register.
+ */
+static void insert_parallel_copy(int block, ir_operand_t *destinations, ir_operand_t *sources, size_t n)
+{
+    bool done[n + 1];
+    for (size_t i = 0; i < n; i++)
+        done[i] = destinations[i] == sources[i];
+
+    while (true)
+    {
+        bool pending = false, progress = false;
+        for (size_t i = 0; i < n; i++)
+        {
+            if (done[i])
+                continue;
+            pending = true;
+
+            bool blocked = false;
+            for (size_t j = 0; j < n && !blocked; j++)
+                blocked = j != i && !done[j] && sources[j] == destinations[i];
+            if (!blocked)
+            {
+                insert_copy(block, destinations[i], sources[i]);
+                done[i] = progress = true;
+            }
+        }
+        if (!pending)
+            break;
+        if (progress)
+            continue;
+
+        for (size_t i = 0; i < n; i++)
+        {
+            if (done[i])
+                continue;
+            ir_operand_t saved = ir_new_register(function);
+            insert_copy(block, saved, destinations[i]);
+            for (size_t j = 0; j < n; j++)
+                if (!done[j] && sources[j] == destinations[i])
+                    sources[j] = saved;
+            break;
+        }
+    }
+}
+
+static void count_use(ir_operand_t *operand, void *context)
+{
+    if (IR_IS_REGISTER(*operand))
+        ((size_t *) context)[*operand]++;
+}
+
+typedef struct register_search
+{
+    ir_operand_t target;
+    bool found;
+} register_search_t;
+
+static void find_register(ir_operand_t *operand, void *context)
+{
+    register_search_t *search = context;
+    search->found |= *operand == search->target;
+}
+
+static bool reads_register(ir_instruction_t *instruction, ir_operand_t r)
+{
+    register_search_t search = {.target = r, .found = false};
+    ir_for_each_use(function, instruction, find_register, &search);
+    return search.found;
+}
+
+/* When the copies go in front of a branch, the branch may compare a value that was also copied, like
+ * i2 := i1 + 1, i1 := i2, branching on i2 < n. Comparing the copy instead leaves i2 with no other use
+ */
+static void branch_on_copies(ir_block_t *block)
+{
+    ir_instruction_t *terminator = &block->instructions[block->n_instructions - 1];
+    ir_operand_t *operands[2] = {&terminator->a, &terminator->b};
+    for (int o = 0; o < 2; o++)
+    {
+        for (size_t k = block->n_instructions - 1; k-- > 0 && block->instructions[k].opcode == IR_COPY;)
+        {
+            ir_instruction_t *copy = &block->instructions[k];
+            if (copy->dst == *operands[o])
+                break;
+            if (copy->a != *operands[o] || !IR_IS_REGISTER(copy->a))
+                continue;
+
+            // The destination must still hold the value when the branch is reached
+            bool overwritten = false;
+            for (size_t m = k + 1; m + 1 < block->n_instructions; m++)
+                overwritten |= block->instructions[m].dst == copy->dst;
+            if (!overwritten)
+                *operands[o] = copy->dst;
+            break;
+        }
+    }
+}
+
+/* Many of the copies replacing phis copy a value computed just before, like i2 := i1 + 1 followed by i1 := i2.
+ * When nothing else reads the computed value, and the destination of the copy isn't touched in between,
+ * compute the value straight into the destination instead.
+ */
+static void coalesce_copies(void)
+{
+    size_t *n_uses = calloc(function->n_registers, sizeof(size_t));
+    for (size_t i = 0; i < function->n_blocks; i++)
+        for (size_t j = 0; j < function->blocks[i].n_instructions; j++)
+            ir_for_each_use(function, &function->blocks[i].instructions[j], count_use, n_uses);
+
+    for (size_t i = 0; i < function->n_blocks; i++)
+    {
+        ir_block_t *block = &function->blocks[i];
+        size_t n = 0;
+        for (size_t j = 0; j < block->n_instructions; j++)
+        {
+            ir_instruction_t copy = block->instructions[j];
+            block->instructions[n++] = copy;
+            if (copy.opcode != IR_COPY || !IR_IS_REGISTER(copy.a) || copy.a == copy.dst || n_uses[copy.a] != 1)
+                continue;
+
+            // Search backwards for the definition of the copied value, giving up if the destination is touched
+            for (size_t k = n - 1; k-- > 0;)
+            {
+                ir_instruction_t *instruction = &block->instructions[k];
+                if (ir_has_dst(instruction) && instruction->dst == copy.a)
+                {
+                    instruction->dst = copy.dst;
+                    n--;
+                    break;
+                }
+                if (reads_register(instruction, copy.dst) || (ir_has_dst(instruction) && instruction->dst == copy.dst))
+                    break;
+            }
+        }
+        block->n_instructions = n;
+    }
+    free(n_uses);
+}
+
+/* Returns the value the phi takes when arriving from the predecessor */
+static ir_operand_t phi_source(ir_instruction_t *phi, int predecessor)
+{
+    for (int32_t m = 0; m < phi->b; m++)
+        if (function->arguments[phi->a + 2 * m] == predecessor)
+            return function->arguments[phi->a + 2 * m + 1];
+    return IR_NO_OPERAND;
+}
+
+/* Returns true if the copies for the phis of the block can go at the end of the predecessor, in front of
+ * its branch, instead of on a block of their own: the branch doesn't read what they assign, and the other
+ * successor doesn't either, not even through its own phis. Those may get their copies in front of the branch
+ * as well, so neither set of copies may assign what the other reads. That keeps loops ending in a single
+ * branch back, even when leaving them goes to a block with phis
+ */
+static bool can_copy_before_branch(ir_liveness_t *liveness, int predecessor, int block,
+                                   ir_instruction_t *phis, size_t n_phis)
+{
+    ir_block_t *b = &function->blocks[predecessor];
+    int other = b->successors[0] == block ? b->successors[1] : b->successors[0];
+    if (other == block || (size_t) other >= liveness->n_blocks)
+        return false;
+    ir_block_t *o = &function->blocks[other];
+    for (size_t p = 0; p < n_phis; p++)
+    {
+        if (reads_register(&b->instructions[b->n_instructions - 1], phis[p].dst)
+            || IR_SET_CONTAINS(liveness->live_in[other], phis[p].dst))
+            return false;
+        for (size_t q = 0; q < o->n_instructions && o->instructions[q].opcode == IR_PHI; q++)
+        {
+            if (phi_source(&o->instructions[q], predecessor) == phis[p].dst
+                || phi_source(&phis[p], predecessor) == o->instructions[q].dst)
+                return false;
+        }
+    }
+    return true;
+}
+
+void ir_destruct_ssa(ir_function_t *ir_function)
+{
+    function = ir_function;
+    size_t n_blocks = function->n_blocks;
+    ir_liveness_t *liveness = ir_compute_liveness(function);
+
+    for (size_t i = 0; i < n_blocks; i++)
+    {
+        size_t n_phis = 0;
+        while (n_phis < function->blocks[i].n_instructions && function->blocks[i].instructions[n_phis].opcode == IR_PHI)
+            n_phis++;
+        if (n_phis == 0)
+            continue;
+
+        // Every phi has one pair per predecessor, in the same order
+        ir_instruction_t phis[n_phis];
+        memcpy(phis, function->blocks[i].instructions, n_phis * sizeof(ir_instruction_t));
+        ir_operand_t destinations[n_phis], sources[n_phis];
+
+        for (int32_t k = 0; k < phis[0].b; k++)
+        {
+            int predecessor = function->arguments[phis[0].a + 2 * k];
+
+            // Copies can only be placed at the end of a predecessor with another successor, if it doesn't see them
+            int copy_block = predecessor;
+            if (ir_successor_count(&function->blocks[predecessor]) > 1
+                && !can_copy_before_branch(liveness, predecessor, i, phis, n_phis))
+                copy_block = ir_split_edge(function, predecessor, i);
+
+            for (size_t p = 0; p < n_phis; p++)
+            {
+                destinations[p] = phis[p].dst;
+                sources[p] = phi_source(&phis[p], predecessor);
+                assert (sources[p] != IR_NO_OPERAND);
+            }
+            insert_parallel_copy(copy_block, destinations, sources, n_phis);
+            if (copy_block == predecessor && ir_successor_count(&function->blocks[predecessor]) > 1)
+                branch_on_copies(&function->blocks[predecessor]);
+        }
+
+        ir_block_t *block = &function->blocks[i];
+        memmove(block->instructions, block->instructions + n_phis,
+                (block->n_instructions - n_phis) * sizeof(ir_instruction_t));
+        block->n_instructions -= n_phis;
+    }
+
+    ir_destroy_liveness(liveness);
+    coalesce_copies();
+    function = NULL;
+}
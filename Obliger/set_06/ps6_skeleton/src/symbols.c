@@ -59,6 +59,56 @@ void destroy_tables ( void )
     destroy_string_list ( );
 }
 
+/* Returns the array symbol indexed by the ARRAY_INDEXING node */
+symbol_t *get_array_symbol ( node_t *indexing )
+{
+    symbol_t *symbol = indexing->children[0]->symbol;
+    if ( symbol->type != SYMBOL_GLOBAL_ARRAY )
+    {
+        fprintf ( stderr, "error: symbol '%s' is not an array\n", symbol->name );
+        exit ( EXIT_FAILURE );
+    }
+    return symbol;
+}
+
+/* Checks that the identifier refers to a variable, and not a function or array */
+symbol_t *get_variable_symbol ( node_t *identifier )
+{
+    symbol_t *symbol = identifier->symbol;
+    switch ( symbol->type )
+    {
+        case SYMBOL_FUNCTION:
+            fprintf ( stderr, "error: symbol '%s' is a function, not a variable\n", symbol->name );
+            exit ( EXIT_FAILURE );
+        case SYMBOL_GLOBAL_ARRAY:
+            fprintf ( stderr, "error: symbol '%s' is an array, not a variable\n", symbol->name );
+            exit ( EXIT_FAILURE );
+        default:
+            return symbol;
+    }
+}
+
+/* Checks that the call is to a function, with the number of arguments it takes */
+symbol_t *get_called_function ( node_t *call )
+{
+    symbol_t *symbol = call->children[0]->symbol;
+    if ( symbol->type != SYMBOL_FUNCTION )
+    {
+        fprintf ( stderr, "error: '%s' is not a function\n", symbol->name );
+        exit ( EXIT_FAILURE );
+    }
+
+    size_t parameter_count = symbol->node->children[1]->n_children;
+    size_t argument_count = call->children[1]->n_children;
+    if ( parameter_count != argument_count )
+    {
+        fprintf ( stderr, "error: function '%s' expects '%ld' arguments, but '%ld' were given\n",
+                  symbol->name, parameter_count, argument_count );
+        exit ( EXIT_FAILURE );
+    }
+    return symbol;
+}
+
 /* Internal matters */
 
 #define CREATE_AND_INSERT_SYMBOL(table, ...) do {                        \
@@ -178,6 +228,26 @@ static void bind_names ( symbol_table_t *local_symbols, node_t *node )
             }
             break;
 
+        // For statements declare their loop variable, and a hidden variable holding the end value.
+        // Both live in a scope of their own, with the end variable's symbol kept in the for node itself
+        case FOR_STATEMENT:
+            push_local_scope ( local_symbols );
+            CREATE_AND_INSERT_SYMBOL( local_symbols,
+                                      .name = node->children[0]->data,
+                                      .type = SYMBOL_LOCAL_VAR,
+                                      .node = node->children[0],
+                                      .function_symtable = local_symbols );
+            CREATE_AND_INSERT_SYMBOL( local_symbols,
+                                      .name = "__FOR_END__",
+                                      .type = SYMBOL_LOCAL_VAR,
+                                      .node = node,
+                                      .function_symtable = local_symbols );
+            node->symbol = local_symbols->symbols[local_symbols->n_symbols - 1];
+            for (int i = 0; i < node->n_children; i++)
+                bind_names ( local_symbols, node->children[i] );
+            pop_local_scope ( local_symbols );
+            break;
+
         // Strings get inserted into the global string list
         // The STRING_DATA nodes' data field get replaced by the location.
         case STRING_DATA: {
@@ -0,0 +1,127 @@
+#include <vslc.h>
+#include "ir.h"
+
+/* Calls whose result is returned right away.
+ * A function calling itself like that doesn't need a new frame: the arguments become its new parameters,
+ * and it starts over, which makes the recursion a loop. Calls to other functions jump to them instead,
+ * once the frame is taken down, so they return straight to our caller.
+ */
+
+// The System V calling convention passes this many arguments in registers, and the rest on the stack
+#define NUM_REGISTER_PARAMS 6
+
+/* Returns the position of the call in the block, if the block returns the result of the call, or -1 */
+static ssize_t find_tail_call(ir_block_t *block)
+{
+    size_t n = block->n_instructions;
+    ir_instruction_t *terminator = &block->instructions[n - 1];
+    if (terminator->opcode != IR_RETURN || !IR_IS_REGISTER(terminator->a) || n < 2)
+        return -1;
+
+    // The result may have been copied on the way
+    ir_operand_t result = terminator->a;
+    size_t position = n - 2;
+    if (block->instructions[position].opcode == IR_COPY && block->instructions[position].dst == result
+        && position > 0)
+        result = block->instructions[position--].a;
+
+    ir_instruction_t *call = &block->instructions[position];
+    if (call->opcode != IR_CALL || call->dst != result)
+        return -1;
+    return position;
+}
+
+bool ir_eliminate_tail_recursion(ir_function_t *function)
+{
+    size_t n_parameters = ir_count_parameters(function);
+    int32_t self = function->symbol->sequence_number;
+
+    bool found = false;
+    for (size_t i = 0; i < function->n_blocks && !found; i++)
+    {
+        ssize_t position = find_tail_call(&function->blocks[i]);
+        found = position >= 0 && function->blocks[i].instructions[position].symbol == self
+                && (size_t) function->blocks[i].instructions[position].b == n_parameters;
+    }
+    if (!found)
+        return false;
+
+    // The entry block is split after the parameters, so the recursive calls can jump back to the rest of it.
+    // The parameters may have been removed if they were unused
+    ir_operand_t parameters[n_parameters + 1];
+    for (size_t p = 0; p < n_parameters; p++)
+        parameters[p] = IR_NO_OPERAND;
+
+    int start = ir_new_block(function, function->blocks[0].loop_depth);
+    ir_block_t *entry = &function->blocks[0];
+    size_t n_parameter_instructions = 0;
+    while (entry->instructions[n_parameter_instructions].opcode == IR_PARAM)
+    {
+        ir_instruction_t *parameter = &entry->instructions[n_parameter_instructions++];
+        parameters[parameter->a] = parameter->dst;
+    }
+    for (size_t j = n_parameter_instructions; j < entry->n_instructions; j++)
+        ir_append(&function->blocks[start], entry->instructions[j]);
+    function->blocks[start].successors[0] = entry->successors[0];
+    function->blocks[start].successors[1] = entry->successors[1];
+    entry->n_instructions = n_parameter_instructions;
+    ir_append(entry, (ir_instruction_t) {
+        .opcode = IR_JUMP, .dst = IR_NO_OPERAND, .a = IR_NO_OPERAND, .b = IR_NO_OPERAND
+    });
+    entry->successors[0] = start;
+    entry->successors[1] = -1;
+
+    for (size_t i = 1; i < function->n_blocks; i++)
+    {
+        ir_block_t *block = &function->blocks[i];
+        ssize_t position = find_tail_call(block);
+        if (position < 0 || block->instructions[position].symbol != self
+            || (size_t) block->instructions[position].b != n_parameters)
+            continue;
+
+        // The arguments are all read before any parameter is assigned, since they may read the parameters
+        ir_instruction_t call = block->instructions[position];
+        block->n_instructions = position;
+        ir_operand_t values[n_parameters + 1];
+        for (size_t p = 0; p < n_parameters; p++)
+        {
+            values[p] = ir_new_register(function);
+            ir_append(block, (ir_instruction_t) {
+                .opcode = IR_COPY, .dst = values[p], .a = function->arguments[call.a + p], .b = IR_NO_OPERAND
+            });
+        }
+        for (size_t p = 0; p < n_parameters; p++)
+        {
+            if (parameters[p] != IR_NO_OPERAND)
+                ir_append(block, (ir_instruction_t) {
+                    .opcode = IR_COPY, .dst = parameters[p], .a = values[p], .b = IR_NO_OPERAND
+                });
+        }
+        ir_append(block, (ir_instruction_t) {
+            .opcode = IR_JUMP, .dst = IR_NO_OPERAND, .a = IR_NO_OPERAND, .b = IR_NO_OPERAND
+        });
+        block->successors[0] = start;
+        block->successors[1] = -1;
+    }
+    return true;
+}
+
+bool ir_form_tail_calls(ir_function_t *function)
+{
+    bool changed = false;
+    for (size_t i = 0; i < function->n_blocks; i++)
+    {
+        ir_block_t *block = &function->blocks[i];
+        ssize_t position = find_tail_call(block);
+        // Arguments on the stack would need space in our caller's frame
+        if (position < 0 || block->instructions[position].b > NUM_REGISTER_PARAMS)
+            continue;
+
+        ir_instruction_t *call = &block->instructions[position];
+        call->opcode = IR_TAIL_CALL;
+        call->dst = IR_NO_OPERAND;
+        block->n_instructions = position + 1;
+        changed = true;
+    }
+    return changed;
+}
@@ -10,7 +10,6 @@ static void node_finalize ( node_t *discard );
 static void destroy_subtree ( node_t *discard );
 static node_t* simplify_tree ( node_t *node );
 static node_t* constant_fold_expression( node_t *node );
-static node_t* replace_for_statement ( node_t* for_node );
 
 /* External interface */
 void print_syntax_tree ()
@@ -49,6 +48,16 @@ void node_init ( node_t *nd, node_type_t type, void *data, uint64_t n_children,
     va_end ( child_list );
 }
 
+bool contains_call ( node_t *expression )
+{
+    if ( expression->type == EXPRESSION && strcmp ( expression->data, "call" ) == 0 )
+        return true;
+    for ( uint64_t i=0; i<expression->n_children; i++ )
+        if ( contains_call ( expression->children[i] ) )
+            return true;
+    return false;
+}
+
 /* Inner workings */
 /* Prints out the given node and all its children recursively */
 static void node_print ( node_t *node, int nesting )
@@ -175,9 +184,6 @@ static node_t* simplify_tree ( node_t *node )
         case EXPRESSION:
             return constant_fold_expression ( node );
 
-        case FOR_STATEMENT:
-            return replace_for_statement ( node );
-
         default: break;
     }
 
@@ -188,14 +194,6 @@ static node_t* simplify_tree ( node_t *node )
 #define NODE(variable_name, ...)                        \
     node_t *variable_name = malloc(sizeof(node_t));     \
     node_init(variable_name, __VA_ARGS__)
-// After an IDENTIFIER_NODE has been added to the tree, it can't be added again
-// This macro replaces the given variable with a new node, containting a copy of the data
-#define DUPLICATE_VARIABLE(variable) do {                    \
-        char *identifier = strdup(variable->data);           \
-        variable = malloc(sizeof(node_t));                   \
-        node_init(variable, IDENTIFIER_DATA, identifier, 0); \
-    } while (false)
-#define FOR_END_VARIABLE "__FOR_END__"
 
 static node_t* constant_fold_expression( node_t *node )
 {
@@ -265,76 +263,3 @@ static node_t* constant_fold_expression( node_t *node )
     NODE ( result_node, NUMBER_DATA, result_data, 0 );
     return result_node;
 }
-
-// Replaces the FOR_STATEMENT with a BLOCK.
-// The block contains varables, setup, and a while loop
-static node_t* replace_for_statement ( node_t* for_node )
-{
-    assert ( for_node->type == FOR_STATEMENT );
-
-    node_t *variable = for_node->children[0];
-    node_t *start_value = for_node->children[1];
-    node_t *end_value = for_node->children[2];
-    node_t *body = for_node->children[3];
-
-    node_finalize ( for_node );
-
-    // Make the declaration for both variables
-    // var <variable>, __FOR_END__
-    NODE ( end_variable, IDENTIFIER_DATA, strdup(FOR_END_VARIABLE), 0 );
-    NODE ( declaration, DECLARATION, NULL, 2, variable, end_variable );
-    NODE ( declaration_list, DECLARATION_LIST, NULL, 1, declaration );
-
-    // make the assignments
-    // <variable> := <start_value>
-    // __FOR_END__ := <end_value>
-    DUPLICATE_VARIABLE ( variable );
-    NODE ( init_assignment, ASSIGNMENT_STATEMENT, NULL, 2, variable, start_value );
-    DUPLICATE_VARIABLE ( end_variable );
-    NODE ( end_assignment, ASSIGNMENT_STATEMENT, NULL, 2, end_variable, end_value );
-
-    // make the relation
-    // <variable> < __FOR_END__
-    DUPLICATE_VARIABLE ( variable );
-    DUPLICATE_VARIABLE ( end_variable );
-    NODE ( relation, RELATION, strdup("<"), 2, variable, end_variable );
-
-    // make the increment statement
-    // <variable> := <variable> + 1
-    DUPLICATE_VARIABLE ( variable );
-    int64_t *one = malloc ( sizeof(int64_t) );
-    *one = 1;
-    NODE ( one_node, NUMBER_DATA, one, 0 );
-    NODE ( variable_plus_one, EXPRESSION, strdup("+"), 2, variable, one_node );
-    DUPLICATE_VARIABLE ( variable );
-    NODE ( increment, ASSIGNMENT_STATEMENT, NULL, 2, variable, variable_plus_one );
-
-    // make a block statement containing both the original for-loop body, and the increment
-    // begin
-    //     <body>
-    //     <variable> := <variable> + 1
-    // end
-    NODE ( inner_statement_list, STATEMENT_LIST, NULL, 2, body, increment );
-    NODE ( inner_block, BLOCK, NULL, 1, inner_statement_list );
-
-    // Make the while loop like so:
-    // while <variable> < __FOR_END__ begin
-    //     <body>
-    //     <variable> := <variable> + 1
-    // end
-    NODE ( while_node, WHILE_STATEMENT, NULL, 2, relation, inner_block );
-
-    // Put it all together into a statement list
-    // <variable> := <start_value>
-    // __FOR_END__ := <end_value>
-    // while <variable> < __FOR_END__ begin
-    //     <body>
-    //     <variable> := <variable> + 1
-    // end
-    NODE ( result_statement_list, STATEMENT_LIST, NULL, 3, init_assignment, end_assignment, while_node );
-
-    // Include the declaration of the two local variables
-    NODE ( result, BLOCK, NULL, 2, declaration_list, result_statement_list );
-
-    return result;
-}
@@ -0,0 +1,726 @@
+#include <vslc.h>
+#include "emit.h"
+#include "vectorize.h"
+
+/* Vectorization of for loops, see vectorize.h.
+ * The body of a loop is compiled into a kernel: a straight list of operations on vector registers, which are
+ * assigned while compiling, like the stack of a simple expression evaluator. The registers holding invariants,
+ * the counter and the sum are reserved for the whole kernel, while the others are reused as soon as their value
+ * has been consumed. Bodies needing more registers than there are are not vectorized.
+ *
+ * The kernels are kept in a table, like the print formats, and are emitted by the optimizing code generator
+ * wherever its IR_VECTOR_LOOP instructions end up, which may be in several functions once calls are inlined.
+ */
+
+#define NUM_VECTOR_REGISTERS 16
+
+// The addresses of the arrays go in the caller-saved registers left over by the counter and end
+#define MAX_ARRAYS 6
+static const char *ARRAY_REGISTERS[MAX_ARRAYS] = {RSI, RDI, R8, R9, R10, R11};
+
+// Constant offsets from the counter are limited, so the displacements of the element addresses stay small
+#define MAX_OFFSET (1 << 24)
+
+typedef enum
+{
+    VECTOR_LOAD,  // dst := array [counter + offset], for each lane
+    VECTOR_STORE, // array [counter + offset] := a
+    VECTOR_ADD,   // dst := a + b
+    VECTOR_SUB,   // dst := a - b
+    VECTOR_MUL,   // dst := a * b, computing partial products in temporary. dst is neither a nor b
+    VECTOR_NEG    // dst := -a, where dst is not a
+} vector_opcode_t;
+
+typedef struct vector_operation
+{
+    uint8_t opcode;    // vector_opcode_t
+    int8_t dst, a, b;  // Vector registers
+    int8_t temporary;
+    bool small_factor; // Multiplications where each lane of b fits in 32 bits, which takes fewer partial products
+    int8_t array;      // The position of the array among the arrays of the kernel
+    int32_t offset;
+} vector_operation_t;
+
+typedef struct vector_kernel
+{
+    vector_operation_t *operations;
+    size_t n_operations, operations_capacity;
+
+    int8_t *invariants; // The register of each invariant
+    size_t n_invariants;
+
+    int32_t arrays[MAX_ARRAYS]; // Global symbol sequence numbers
+    size_t n_arrays;
+
+    int8_t counter, step; // The counter and the width in each lane, or -1 when the counter isn't used as a value
+    int8_t sum;           // The register summed into, or -1
+} vector_kernel_t;
+
+static vector_kernel_t *kernels;
+static size_t n_kernels, kernels_capacity;
+
+// Set once a kernel uses the counter, which starts out from the steps in vector_steps
+static bool steps_needed;
+
+// How many kernels have been emitted, numbering their labels
+static int n_generated_loops;
+
+/* The state of the loop being vectorized */
+
+static vector_kernel_t kernel;
+static symbol_t *counter, *sum;
+static node_t **invariant_nodes;
+static size_t invariants_capacity;
+
+static bool allocated[NUM_VECTOR_REGISTERS];
+static bool reserved[NUM_VECTOR_REGISTERS]; // Registers kept for the whole kernel
+static bool used[NUM_VECTOR_REGISTERS];     // Registers some operation has written so far
+static bool small_values[NUM_VECTOR_REGISTERS];
+
+// Every element accessed, with the statement doing it, for checking the dependences between iterations
+typedef struct access
+{
+    symbol_t *array;
+    int64_t offset;
+    size_t statement;
+    bool store;
+} access_t;
+
+static access_t *accesses;
+static size_t n_accesses, accesses_capacity;
+static size_t statement_number;
+
+int vector_width(void)
+{
+    return vectorize_with_avx2 ? 4 : 2;
+}
+
+/* Returns a free vector register, or -1 if there are none left */
+static int allocate_register(void)
+{
+    for (int r = 0; r < NUM_VECTOR_REGISTERS; r++)
+    {
+        if (!allocated[r])
+        {
+            allocated[r] = true;
+            used[r] = true;
+            small_values[r] = false;
+            return r;
+        }
+    }
+    return -1;
+}
+
+/* Returns a register to keep for the whole kernel, or -1 if there are none left.
+ * Its value is set before the kernel starts, so it can't be one that earlier operations have used
+ */
+static int reserve_register(void)
+{
+    for (int r = 0; r < NUM_VECTOR_REGISTERS; r++)
+    {
+        if (!used[r])
+        {
+            allocated[r] = used[r] = reserved[r] = true;
+            small_values[r] = false;
+            return r;
+        }
+    }
+    return -1;
+}
+
+/* Frees the register once its value is consumed, unless it is kept for the whole kernel */
+static void release_register(int r)
+{
+    if (!reserved[r])
+        allocated[r] = false;
+}
+
+static void add_operation(vector_operation_t operation)
+{
+    if (kernel.n_operations == kernel.operations_capacity)
+    {
+        kernel.operations_capacity = kernel.operations_capacity * 2 + 16;
+        kernel.operations = realloc(kernel.operations, kernel.operations_capacity * sizeof(vector_operation_t));
+    }
+    kernel.operations[kernel.n_operations++] = operation;
+}
+
+static void add_access(symbol_t *array, int64_t offset, bool store)
+{
+    if (n_accesses == accesses_capacity)
+    {
+        accesses_capacity = accesses_capacity * 2 + 16;
+        accesses = realloc(accesses, accesses_capacity * sizeof(access_t));
+    }
+    accesses[n_accesses++] = (access_t) {.array = array, .offset = offset, .statement = statement_number, .store = store};
+}
+
+static bool same_invariant(node_t *a, node_t *b)
+{
+    if (a->type != b->type)
+        return false;
+    if (a->type == NUMBER_DATA)
+        return *(int64_t *) a->data == *(int64_t *) b->data;
+    return a->symbol == b->symbol;
+}
+
+/* Returns the register holding the constant or variable in every lane, or -1 if there is no register left */
+static int invariant_register(node_t *node)
+{
+    for (size_t i = 0; i < kernel.n_invariants; i++)
+        if (same_invariant(invariant_nodes[i], node))
+            return kernel.invariants[i];
+
+    int r = reserve_register();
+    if (r < 0)
+        return -1;
+    if (kernel.n_invariants == invariants_capacity)
+    {
+        invariants_capacity = invariants_capacity * 2 + 8;
+        invariant_nodes = realloc(invariant_nodes, invariants_capacity * sizeof(node_t *));
+        kernel.invariants = realloc(kernel.invariants, invariants_capacity * sizeof(int8_t));
+    }
+    invariant_nodes[kernel.n_invariants] = node;
+    kernel.invariants[kernel.n_invariants++] = r;
+    if (node->type == NUMBER_DATA)
+        small_values[r] = *(int64_t *) node->data >= 0 && *(int64_t *) node->data <= UINT32_MAX;
+    return r;
+}
+
+/* Returns the register holding the value of the counter in each lane */
+static int counter_register(void)
+{
+    if (kernel.counter < 0)
+    {
+        kernel.counter = reserve_register();
+        kernel.step = reserve_register();
+        if (kernel.step < 0)
+            return -1;
+    }
+    return kernel.counter;
+}
+
+/* Finds the constant the index adds to the counter. Returns false if the index has another form */
+static bool counter_offset(node_t *index, int64_t *offset)
+{
+    if (index->type == IDENTIFIER_DATA && index->symbol == counter)
+    {
+        *offset = 0;
+        return true;
+    }
+    if (index->type != EXPRESSION || index->n_children != 2)
+        return false;
+
+    char operation = *(char *) index->data;
+    node_t *left = index->children[0], *right = index->children[1];
+    if (operation == '+' && left->type == NUMBER_DATA)
+    {
+        node_t *swap = left;
+        left = right;
+        right = swap;
+    }
+    if ((operation != '+' && operation != '-') || left->type != IDENTIFIER_DATA || left->symbol != counter
+        || right->type != NUMBER_DATA)
+        return false;
+    int64_t value = *(int64_t *) right->data;
+    if (value <= -MAX_OFFSET || value >= MAX_OFFSET)
+        return false;
+    *offset = operation == '+' ? value : -value;
+    return true;
+}
+
+/* Returns the position of the array among the arrays of the kernel, or -1 if it can't be accessed */
+static int array_position(node_t *indexing)
+{
+    symbol_t *symbol = indexing->children[0]->symbol;
+    if (symbol->type != SYMBOL_GLOBAL_ARRAY || symbol->node->children[1]->type != NUMBER_DATA)
+        return -1;
+    for (size_t i = 0; i < kernel.n_arrays; i++)
+        if (kernel.arrays[i] == (int32_t) symbol->sequence_number)
+            return i;
+    if (kernel.n_arrays == MAX_ARRAYS)
+        return -1;
+    kernel.arrays[kernel.n_arrays] = symbol->sequence_number;
+    return kernel.n_arrays++;
+}
+
+/* Compiles the expression into the kernel, and returns the register holding its value, or -1 if it can't be */
+static int compile_expression(node_t *expression)
+{
+    switch (expression->type)
+    {
+        case NUMBER_DATA:
+            return invariant_register(expression);
+        case IDENTIFIER_DATA:
+        {
+            symbol_t *symbol = expression->symbol;
+            if (symbol == counter)
+                return counter_register();
+            if (symbol == sum)
+                return -1;
+            if (symbol->type == SYMBOL_GLOBAL_VAR || symbol->type == SYMBOL_LOCAL_VAR
+                || symbol->type == SYMBOL_PARAMETER)
+                return invariant_register(expression);
+            return -1;
+        }
+        case ARRAY_INDEXING:
+        {
+            int64_t offset;
+            int array = array_position(expression);
+            if (array < 0 || !counter_offset(expression->children[1], &offset))
+                return -1;
+            int dst = allocate_register();
+            if (dst < 0)
+                return -1;
+            add_access(expression->children[0]->symbol, offset, false);
+            add_operation((vector_operation_t) {.opcode = VECTOR_LOAD, .dst = dst, .array = array, .offset = offset});
+            return dst;
+        }
+        case EXPRESSION:
+        {
+            char operation = *(char *) expression->data;
+            if (strcmp(expression->data, "call") == 0 || operation == '/')
+                return -1;
+            int a = compile_expression(expression->children[0]);
+            if (a < 0)
+                return -1;
+            if (expression->n_children == 1)
+            {
+                int dst = allocate_register();
+                if (dst < 0)
+                    return -1;
+                add_operation((vector_operation_t) {.opcode = VECTOR_NEG, .dst = dst, .a = a});
+                release_register(a);
+                return dst;
+            }
+
+            int b = compile_expression(expression->children[1]);
+            if (b < 0)
+                return -1;
+            if (operation == '*')
+            {
+                // Only b is taken to fit in 32 bits, so a small factor goes there
+                if (small_values[a] && !small_values[b])
+                {
+                    int swap = a;
+                    a = b;
+                    b = swap;
+                }
+                int dst = allocate_register();
+                int temporary = allocate_register();
+                if (dst < 0 || temporary < 0)
+                    return -1;
+                add_operation((vector_operation_t) {.opcode = VECTOR_MUL, .dst = dst, .a = a, .b = b,
+                                                    .temporary = temporary, .small_factor = small_values[b]});
+                release_register(temporary);
+                release_register(a);
+                release_register(b);
+                return dst;
+            }
+
+            // The result goes in a register holding an operand, where possible
+            int dst;
+            if (!reserved[a])
+                dst = a;
+            else if (operation == '+' && !reserved[b])
+                dst = b;
+            else if ((dst = allocate_register()) < 0)
+                return -1;
+            add_operation((vector_operation_t) {.opcode = operation == '+' ? VECTOR_ADD : VECTOR_SUB,
+                                                .dst = dst, .a = a, .b = b});
+            if (a != dst)
+                release_register(a);
+            if (b != dst)
+                release_register(b);
+            return dst;
+        }
+        default:
+            return -1;
+    }
+}
+
+/* Finds the variable the body sums into. Returns false if it assigns any other variable, or the counter */
+static bool find_sum(node_t *statement)
+{
+    switch (statement->type)
+    {
+        case BLOCK:
+        {
+            node_t *statement_list = statement->children[statement->n_children - 1];
+            for (size_t i = 0; i < statement_list->n_children; i++)
+                if (!find_sum(statement_list->children[i]))
+                    return false;
+            return true;
+        }
+        case ASSIGNMENT_STATEMENT:
+        {
+            node_t *dest = statement->children[0];
+            if (dest->type != IDENTIFIER_DATA)
+                return true;
+            symbol_t *symbol = dest->symbol;
+            if (symbol == counter || (symbol->type != SYMBOL_LOCAL_VAR && symbol->type != SYMBOL_PARAMETER)
+                || (sum != NULL && sum != symbol))
+                return false;
+            sum = symbol;
+            return true;
+        }
+        default:
+            return false;
+    }
+}
+
+/* Compiles the statement into the kernel. Returns false if it can't be */
+static bool compile_statement(node_t *statement)
+{
+    if (statement->type == BLOCK)
+    {
+        node_t *statement_list = statement->children[statement->n_children - 1];
+        for (size_t i = 0; i < statement_list->n_children; i++)
+            if (!compile_statement(statement_list->children[i]))
+                return false;
+        return true;
+    }
+
+    // Only assignments are left, see find_sum
+    node_t *dest = statement->children[0], *value = statement->children[1];
+    statement_number++;
+    if (dest->type == ARRAY_INDEXING)
+    {
+        int64_t offset;
+        int array = array_position(dest);
+        if (array < 0 || !counter_offset(dest->children[1], &offset))
+            return false;
+        int a = compile_expression(value);
+        if (a < 0)
+            return false;
+        add_access(dest->children[0]->symbol, offset, true);
+        add_operation((vector_operation_t) {.opcode = VECTOR_STORE, .a = a, .array = array, .offset = offset});
+        release_register(a);
+        return true;
+    }
+
+    // sum := sum + x, sum := x + sum, or sum := sum - x
+    if (value->type != EXPRESSION || value->n_children != 2)
+        return false;
+    char operation = *(char *) value->data;
+    node_t *left = value->children[0], *right = value->children[1];
+    node_t *term;
+    if ((operation == '+' || operation == '-') && left->type == IDENTIFIER_DATA && left->symbol == sum)
+        term = right;
+    else if (operation == '+' && right->type == IDENTIFIER_DATA && right->symbol == sum)
+        term = left;
+    else
+        return false;
+
+    if (kernel.sum < 0 && (kernel.sum = reserve_register()) < 0)
+        return false;
+    int a = compile_expression(term);
+    if (a < 0)
+        return false;
+    add_operation((vector_operation_t) {.opcode = operation == '+' ? VECTOR_ADD : VECTOR_SUB,
+                                        .dst = kernel.sum, .a = kernel.sum, .b = a});
+    release_register(a);
+    return true;
+}
+
+/* Returns true if running the iterations of the loop a vector at a time reads and writes the same values as
+ * running them one by one. The statements go over a vector of iterations in turn, so a load sees what a store
+ * in an earlier statement wrote for all the iterations of the vector, and a store in a later statement, or the
+ * same one, wrote for none of them
+ */
+static bool independent_iterations(void)
+{
+    int64_t width = vector_width();
+    for (size_t i = 0; i < n_accesses; i++)
+    {
+        access_t *store = &accesses[i];
+        if (!store->store)
+            continue;
+        for (size_t j = 0; j < n_accesses; j++)
+        {
+            access_t *other = &accesses[j];
+            if (other->array != store->array)
+                continue;
+            // Which of several stores to an element comes last is only kept when they go to the same elements
+            if (other->store)
+            {
+                if (other->offset != store->offset)
+                    return false;
+                continue;
+            }
+
+            // The load reads what the store writes distance iterations later
+            int64_t distance = other->offset - store->offset;
+            if (store->statement < other->statement && distance > 0 && distance < width)
+                return false;
+            if (store->statement >= other->statement && distance < 0 && distance > -width)
+                return false;
+        }
+    }
+    return true;
+}
+
+bool vectorize_for_statement(node_t *statement, vector_loop_t *loop)
+{
+    kernel = (vector_kernel_t) {.counter = -1, .step = -1, .sum = -1};
+    counter = statement->children[0]->symbol;
+    sum = NULL;
+    invariant_nodes = NULL;
+    invariants_capacity = 0;
+    memset(allocated, 0, sizeof(allocated));
+    memset(reserved, 0, sizeof(reserved));
+    memset(used, 0, sizeof(used));
+    n_accesses = 0;
+    statement_number = 0;
+
+    bool vectorized = find_sum(statement->children[3]) && compile_statement(statement->children[3])
+                      && n_accesses > 0 && independent_iterations();
+
+    // The counter must stay inside every array it indexes, from the first iteration to the last
+    int64_t first = 0, last = INT64_MAX;
+    for (size_t i = 0; i < n_accesses && vectorized; i++)
+    {
+        int64_t length = *(int64_t *) accesses[i].array->node->children[1]->data;
+        if (-accesses[i].offset > first)
+            first = -accesses[i].offset;
+        if (length - accesses[i].offset < last)
+            last = length - accesses[i].offset;
+    }
+    vectorized &= last - first >= vector_width();
+
+    free(accesses);
+    accesses = NULL;
+    accesses_capacity = 0;
+    if (!vectorized)
+    {
+        free(kernel.operations);
+        free(kernel.invariants);
+        free(invariant_nodes);
+        return false;
+    }
+
+    if (n_kernels == kernels_capacity)
+    {
+        kernels_capacity = kernels_capacity * 2 + 8;
+        kernels = realloc(kernels, kernels_capacity * sizeof(vector_kernel_t));
+    }
+    kernels[n_kernels] = kernel;
+    *loop = (vector_loop_t) {
+        .kernel = n_kernels++,
+        .invariants = invariant_nodes,
+        .n_invariants = kernel.n_invariants,
+        .sum = kernel.sum >= 0 ? sum : NULL,
+        .first = first,
+        .last = last
+    };
+    steps_needed |= kernel.counter >= 0;
+    return true;
+}
+
+/* Code generation */
+
+/* Returns the name of the vector register, for the width of the kernels.
+ * The string is valid until a few more names have been made
+ */
+static const char *vector_register(int r)
+{
+    static char names[8][8];
+    static int next = 0;
+    next = (next + 1) % 8;
+    snprintf(names[next], sizeof(names[next]), "%%%s%d", vectorize_with_avx2 ? "ymm" : "xmm", r);
+    return names[next];
+}
+
+/* The low 128 bits of the register */
+static const char *low_register(int r)
+{
+    static char names[8][8];
+    static int next = 0;
+    next = (next + 1) % 8;
+    snprintf(names[next], sizeof(names[next]), "%%xmm%d", r);
+    return names[next];
+}
+
+/* dst := a <op> b. SSE2 instructions overwrite their second operand, so a is copied into dst first,
+ * unless one of them is there already
+ */
+static void generate_binary(const char *mnemonic, int dst, int a, int b, bool commutative)
+{
+    if (vectorize_with_avx2)
+        EMIT ("v%s %s, %s, %s", mnemonic, vector_register(b), vector_register(a), vector_register(dst));
+    else if (dst == a)
+        EMIT ("%s %s, %s", mnemonic, vector_register(b), vector_register(dst));
+    else if (dst == b && commutative)
+        EMIT ("%s %s, %s", mnemonic, vector_register(a), vector_register(dst));
+    else
+    {
+        EMIT ("movdqa %s, %s", vector_register(a), vector_register(dst));
+        EMIT ("%s %s, %s", mnemonic, vector_register(b), vector_register(dst));
+    }
+}
+
+/* dst := a shifted by count */
+static void generate_shift(const char *mnemonic, int count, int dst, int a)
+{
+    if (vectorize_with_avx2)
+        EMIT ("v%s $%d, %s, %s", mnemonic, count, vector_register(a), vector_register(dst));
+    else
+    {
+        if (dst != a)
+            EMIT ("movdqa %s, %s", vector_register(a), vector_register(dst));
+        EMIT ("%s $%d, %s", mnemonic, count, vector_register(dst));
+    }
+}
+
+/* Multiplies the 64 bit lanes, which neither SSE2 nor AVX2 has an instruction for, from 32 bit products:
+ * the product of the low halves, plus the products of each low half with the other high half, shifted up
+ */
+static void generate_multiplication(vector_operation_t *operation)
+{
+    int dst = operation->dst, a = operation->a, b = operation->b, temporary = operation->temporary;
+    generate_shift("psrlq", 32, temporary, a);
+    generate_binary("pmuludq", temporary, temporary, b, true);
+    if (!operation->small_factor)
+    {
+        generate_shift("psrlq", 32, dst, b);
+        generate_binary("pmuludq", dst, dst, a, true);
+        generate_binary("paddq", temporary, temporary, dst, true);
+    }
+    generate_shift("psllq", 32, dst, temporary);
+    generate_binary("pmuludq", temporary, a, b, true);
+    generate_binary("paddq", dst, dst, temporary, true);
+}
+
+static const char *element_address(vector_operation_t *operation)
+{
+    static char address[32];
+    const char *base = ARRAY_REGISTERS[operation->array];
+    if (operation->offset == 0)
+        snprintf(address, sizeof(address), "(%s, %s, 8)", base, RCX);
+    else
+        snprintf(address, sizeof(address), "%d(%s, %s, 8)", operation->offset * 8, base, RCX);
+    return address;
+}
+
+static void generate_operation(vector_operation_t *operation)
+{
+    const char *move = vectorize_with_avx2 ? "vmovdqu" : "movdqu";
+    switch (operation->opcode)
+    {
+        case VECTOR_LOAD:
+            EMIT ("%s %s, %s", move, element_address(operation), vector_register(operation->dst));
+            break;
+        case VECTOR_STORE:
+            EMIT ("%s %s, %s", move, vector_register(operation->a), element_address(operation));
+            break;
+        case VECTOR_ADD:
+            generate_binary("paddq", operation->dst, operation->a, operation->b, true);
+            break;
+        case VECTOR_SUB:
+            generate_binary("psubq", operation->dst, operation->a, operation->b, false);
+            break;
+        case VECTOR_MUL:
+            generate_multiplication(operation);
+            break;
+        case VECTOR_NEG:
+            generate_binary("pxor", operation->dst, operation->dst, operation->dst, true);
+            generate_binary("psubq", operation->dst, operation->dst, operation->a, false);
+            break;
+    }
+}
+
+/* Broadcasts %rax into every lane of the register */
+static void generate_broadcast(int r)
+{
+    if (vectorize_with_avx2)
+    {
+        EMIT ("vmovq %s, %s", RAX, low_register(r));
+        EMIT ("vpbroadcastq %s, %s", low_register(r), vector_register(r));
+    }
+    else
+    {
+        MOVQ (RAX, low_register(r));
+        EMIT ("punpcklqdq %s, %s", low_register(r), low_register(r));
+    }
+}
+
+void generate_vector_broadcast(size_t kernel_number, size_t invariant)
+{
+    generate_broadcast(kernels[kernel_number].invariants[invariant]);
+}
+
+void generate_vector_loop(size_t kernel_number)
+{
+    vector_kernel_t *k = &kernels[kernel_number];
+    int width = vector_width();
+    for (size_t i = 0; i < k->n_arrays; i++)
+        EMIT ("leaq .%s(%s), %s", global_symbols->symbols[k->arrays[i]]->name, RIP, ARRAY_REGISTERS[i]);
+    if (k->sum >= 0)
+        generate_binary("pxor", k->sum, k->sum, k->sum, true);
+    if (k->counter >= 0)
+    {
+        MOVQ (RCX, RAX);
+        generate_broadcast(k->counter);
+        if (vectorize_with_avx2)
+            EMIT ("vpaddq vector_steps(%s), %s, %s", RIP, vector_register(k->counter), vector_register(k->counter));
+        else
+            EMIT ("paddq vector_steps(%s), %s", RIP, vector_register(k->counter));
+        EMIT ("movq $%d, %s", width, RAX);
+        generate_broadcast(k->step);
+    }
+
+    int label = n_generated_loops++;
+    DIRECTIVE (".p2align 4,,10");
+    LABEL ("_VL%d", label);
+    for (size_t i = 0; i < k->n_operations; i++)
+        generate_operation(&k->operations[i]);
+    if (k->counter >= 0)
+        generate_binary("paddq", k->counter, k->counter, k->step, true);
+    EMIT ("addq $%d, %s", width, RCX);
+    CMPQ (RDX, RCX);
+    EMIT ("jl _VL%d", label);
+
+    // Adds the lanes of the sum together
+    if (k->sum >= 0)
+    {
+        int other = k->sum == 0 ? 1 : 0;
+        const char *sum_low = low_register(k->sum), *other_low = low_register(other);
+        if (vectorize_with_avx2)
+        {
+            EMIT ("vextracti128 $1, %s, %s", vector_register(k->sum), other_low);
+            EMIT ("vpaddq %s, %s, %s", other_low, sum_low, sum_low);
+            EMIT ("vpshufd $0x4E, %s, %s", sum_low, other_low);
+            EMIT ("vpaddq %s, %s, %s", other_low, sum_low, sum_low);
+            EMIT ("vmovq %s, %s", sum_low, RAX);
+        }
+        else
+        {
+            EMIT ("pshufd $0x4E, %s, %s", sum_low, other_low);
+            EMIT ("paddq %s, %s", other_low, sum_low);
+            MOVQ (sum_low, RAX);
+        }
+    }
+    // With the upper halves of the ymm registers left in use, SSE instructions run after the kernel pay for a
+    // transition of the register state, or a dependency on the upper halves
+    if (vectorize_with_avx2)
+        EMIT ("vzeroupper");
+}
+
+void generate_vector_constants(void)
+{
+    if (steps_needed)
+    {
+        DIRECTIVE (".section %s", ASM_STRING_SECTION);
+        DIRECTIVE (".align 32");
+        DIRECTIVE ("vector_steps: \t.quad 0, 1, 2, 3");
+    }
+    for (size_t i = 0; i < n_kernels; i++)
+    {
+        free(kernels[i].operations);
+        free(kernels[i].invariants);
+    }
+    free(kernels);
+    kernels = NULL;
+    n_kernels = kernels_capacity = 0;
+    steps_needed = false;
+}
@@ -0,0 +1,253 @@
+#include <vslc.h>
+#include <signal.h>
+#include "bytecode.h"
+
+/* The interpreter for the bytecode from bytecode.c.
+ * Dispatch is threaded: before running, every instruction gets the address of the code handling its opcode,
+ * and each handler ends by jumping straight to the handler of the next instruction, with GCC's computed goto.
+ * Output goes through printf and putchar, and faults like division by zero raise the signals the native code
+ * would get, so runs are indistinguishable from those of the compiled program.
+ */
+
+// Registers are allocated for frames as calls go deeper. Beyond this, the native stack would have overflowed
+#define MAX_REGISTERS (1 << 24)
+
+// Indexing out of bounds in the native code reads and writes whatever is next to .bss, without faulting.
+// The globals get a page of padding on each side, so only accesses further off than that fault here
+#define GLOBALS_PADDING 512
+
+typedef struct call_record
+{
+    const bc_instruction_t *return_to;
+    size_t base;        // Where the caller's frame starts
+    int32_t destination; // The caller's register for the returned value
+} call_record_t;
+
+/* Runs the function with the arguments in the first registers, and returns its return value */
+static int64_t interpret(bc_program_t *program, bc_function_t *entry, int64_t *arguments)
+{
+    static const void *HANDLERS[BC_NUM_OPCODES] = {
+        [BC_MOVE] = &&move,
+        [BC_LOAD_INT] = &&load_int,
+        [BC_LOAD_CONSTANT] = &&load_constant,
+        [BC_LOAD_GLOBAL] = &&load_global,
+        [BC_STORE_GLOBAL] = &&store_global,
+        [BC_LOAD_ELEMENT] = &&load_element,
+        [BC_STORE_ELEMENT] = &&store_element,
+        [BC_CHECK_BOUNDS] = &&check_bounds,
+        [BC_ADD] = &&add,
+        [BC_SUB] = &&sub,
+        [BC_MUL] = &&mul,
+        [BC_DIV] = &&div,
+        [BC_ADD_INT] = &&add_int,
+        [BC_MUL_INT] = &&mul_int,
+        [BC_NEG] = &&neg,
+        [BC_JUMP] = &&jump,
+        [BC_JUMP_EQ] = &&jump_eq,
+        [BC_JUMP_NE] = &&jump_ne,
+        [BC_JUMP_LT] = &&jump_lt,
+        [BC_JUMP_GE] = &&jump_ge,
+        [BC_JUMP_GT] = &&jump_gt,
+        [BC_JUMP_LE] = &&jump_le,
+        [BC_FOR_LOOP] = &&for_loop,
+        [BC_CALL] = &&call,
+        [BC_RETURN] = &&return_,
+        [BC_PRINT_INT] = &&print_int,
+        [BC_PRINT_STRING] = &&print_string,
+        [BC_PRINT_NEWLINE] = &&print_newline
+    };
+
+    bc_instruction_t *code = program->code;
+    for (size_t i = 0; i < program->n_instructions; i++)
+        code[i].handler = HANDLERS[code[i].opcode];
+
+    size_t n_globals = program->n_globals + 2 * GLOBALS_PADDING;
+    int64_t *global_memory = calloc(n_globals, sizeof(int64_t));
+    int64_t *globals = global_memory + GLOBALS_PADDING;
+
+    size_t capacity = 4096;
+    while (capacity < (size_t) entry->frame_size)
+        capacity *= 2;
+    int64_t *registers = calloc(capacity, sizeof(int64_t));
+    memcpy(registers, arguments, entry->n_parameters * sizeof(int64_t));
+    int64_t *r = registers;
+
+    call_record_t *calls = NULL;
+    size_t n_calls = 0, calls_capacity = 0;
+
+    const bc_instruction_t *ip = &code[entry->start];
+
+#define DISPATCH() goto *ip->handler
+#define NEXT() do { ip++; DISPATCH(); } while (false)
+// Arithmetic wraps around, like the machine's does
+#define WRAP(a, op, b) ((int64_t) ((uint64_t) (a) op (uint64_t) (b)))
+
+    DISPATCH();
+
+move:
+    r[ip->a] = r[ip->b];
+    NEXT();
+load_int:
+    r[ip->a] = ip->b;
+    NEXT();
+load_constant:
+    r[ip->a] = program->constants[ip->b];
+    NEXT();
+load_global:
+    r[ip->a] = globals[ip->b];
+    NEXT();
+store_global:
+    globals[ip->a] = r[ip->b];
+    NEXT();
+load_element:
+{
+    uint64_t position = (uint64_t) ip->b + (uint64_t) r[ip->c];
+    if (position + GLOBALS_PADDING >= n_globals)
+        raise(SIGSEGV);
+    r[ip->a] = globals[position];
+    NEXT();
+}
+store_element:
+{
+    uint64_t position = (uint64_t) ip->a + (uint64_t) r[ip->b];
+    if (position + GLOBALS_PADDING >= n_globals)
+        raise(SIGSEGV);
+    globals[position] = r[ip->c];
+    NEXT();
+}
+check_bounds:
+    // Like the native code, which stops with the same message
+    if ((uint64_t) r[ip->a] >= (uint64_t) program->constants[ip->b])
+    {
+        puts("Array index out of bounds");
+        exit(1);
+    }
+    NEXT();
+add:
+    r[ip->a] = WRAP(r[ip->b], +, r[ip->c]);
+    NEXT();
+sub:
+    r[ip->a] = WRAP(r[ip->b], -, r[ip->c]);
+    NEXT();
+mul:
+    r[ip->a] = WRAP(r[ip->b], *, r[ip->c]);
+    NEXT();
+div:
+    // idivq faults on both of these
+    if (r[ip->c] == 0 || (r[ip->b] == INT64_MIN && r[ip->c] == -1))
+        raise(SIGFPE);
+    r[ip->a] = r[ip->b] / r[ip->c];
+    NEXT();
+add_int:
+    r[ip->a] = WRAP(r[ip->b], +, (int64_t) ip->c);
+    NEXT();
+mul_int:
+    r[ip->a] = WRAP(r[ip->b], *, (int64_t) ip->c);
+    NEXT();
+neg:
+    r[ip->a] = WRAP(0, -, r[ip->b]);
+    NEXT();
+jump:
+    ip = &code[ip->a];
+    DISPATCH();
+jump_eq:
+    ip = r[ip->a] == r[ip->b] ? &code[ip->c] : ip + 1;
+    DISPATCH();
+jump_ne:
+    ip = r[ip->a] != r[ip->b] ? &code[ip->c] : ip + 1;
+    DISPATCH();
+jump_lt:
+    ip = r[ip->a] < r[ip->b] ? &code[ip->c] : ip + 1;
+    DISPATCH();
+jump_ge:
+    ip = r[ip->a] >= r[ip->b] ? &code[ip->c] : ip + 1;
+    DISPATCH();
+jump_gt:
+    ip = r[ip->a] > r[ip->b] ? &code[ip->c] : ip + 1;
+    DISPATCH();
+jump_le:
+    ip = r[ip->a] <= r[ip->b] ? &code[ip->c] : ip + 1;
+    DISPATCH();
+for_loop:
+    r[ip->a] = WRAP(r[ip->a], +, 1);
+    ip = r[ip->a] < r[ip->b] ? &code[ip->c] : ip + 1;
+    DISPATCH();
+call:
+{
+    bc_function_t *callee = &program->functions[ip->b];
+    size_t base = (r - registers) + ip->c;
+    if (base + callee->frame_size > capacity)
+    {
+        while (base + callee->frame_size > capacity)
+            capacity *= 2;
+        if (capacity > MAX_REGISTERS)
+            raise(SIGSEGV);
+        size_t current = r - registers;
+        registers = realloc(registers, capacity * sizeof(int64_t));
+        r = registers + current;
+    }
+
+    if (n_calls == calls_capacity)
+    {
+        calls_capacity = calls_capacity * 2 + 64;
+        calls = realloc(calls, calls_capacity * sizeof(call_record_t));
+    }
+    calls[n_calls++] = (call_record_t) {.return_to = ip + 1, .base = r - registers, .destination = ip->a};
+
+    // The arguments are in place, and local variables start out as 0
+    r = registers + base;
+    for (int i = callee->n_parameters; i < callee->n_variables; i++)
+        r[i] = 0;
+    ip = &code[callee->start];
+    DISPATCH();
+}
+return_:
+{
+    int64_t value = r[ip->a];
+    if (n_calls == 0)
+    {
+        free(calls);
+        free(registers);
+        free(global_memory);
+        return value;
+    }
+    call_record_t *record = &calls[--n_calls];
+    r = registers + record->base;
+    r[record->destination] = value;
+    ip = record->return_to;
+    DISPATCH();
+}
+print_int:
+    printf("%ld ", r[ip->a]);
+    NEXT();
+print_string:
+    printf("%s ", program->strings[ip->a]);
+    NEXT();
+print_newline:
+    putchar('\n');
+    NEXT();
+
+#undef DISPATCH
+#undef NEXT
+#undef WRAP
+}
+
+int bc_run_program(bc_program_t *program, int argc, char **argv)
+{
+    bc_function_t *entry = NULL;
+    for (size_t i = 0; i < program->n_functions && entry == NULL; i++)
+        if (program->functions[i].symbol != NULL)
+            entry = &program->functions[i];
+
+    // Like the native main, check the number of arguments and parse them, then exit with the return value
+    if (argc - 1 != entry->n_parameters)
+    {
+        puts("Wrong number of arguments");
+        exit(1);
+    }
+    int64_t arguments[entry->n_parameters + 1];
+    for (int i = 0; i < entry->n_parameters; i++)
+        arguments[i] = strtol(argv[i + 1], NULL, 10);
+
+    return interpret(program, entry, arguments);
+}
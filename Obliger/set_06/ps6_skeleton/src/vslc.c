@@ -2,6 +2,9 @@
 #include <stdlib.h>
 #include <getopt.h>
 #include <vslc.h>
+#include "assembler.h"
+#include "bytecode.h"
+#include "profile.h"
 
 /* Command line option parsing for the main function */
 static void options(int argc, char **argv);
@@ -10,7 +13,33 @@ static bool
         print_full_tree = false,
         print_simplified_tree = false,
         print_symbol_table_contents = false,
-        print_generated_program = false;
+        print_generated_program = false,
+        print_intermediate_code = false,
+        run_bytecode = false;
+
+/* Set by the -O option, read by the code generator */
+bool optimize_generated_code = false;
+
+/* Set by the -mavx2 option, read by vectorize.c */
+bool vectorize_with_avx2 = false;
+
+/* Set by the -fbounds-check option, read by the code generators */
+bool check_array_bounds = false;
+
+/* Set by the -fprofile-generate and -fprofile-use options, see profile.h */
+const char *profile_generate_path = NULL;
+const char *profile_use_path = NULL;
+
+// The profile file of the options not naming one
+#define DEFAULT_PROFILE_PATH "vsl.profile"
+
+/* Set by the -e option, read by asm_flush */
+bool emit_object_file = false;
+
+/* Set by the -r option, read by asm_flush. The arguments after it, or after -b, are passed to the program */
+bool run_in_process = false;
+static int program_argc;
+static char **program_argv;
 
 /* Entry point */
 int main(int argc, char **argv)
@@ -31,11 +60,59 @@ int main(int argc, char **argv)
     create_tables();
     if (print_symbol_table_contents)
         print_tables();
+
+    // Operations in profile.c
+    if (profile_use_path != NULL)
+        read_profile(profile_use_path);
     
+    // Operations in ir.c
+    if (print_intermediate_code)
+        print_intermediate_representation();
+
+    // Operations in bytecode.c and vm.c
+    if (run_bytecode)
+    {
+        if (profile_generate_path != NULL)
+        {
+            fprintf(stderr, "error: -fprofile-generate can't be used with -b\n");
+            exit(EXIT_FAILURE);
+        }
+        bc_program_t *program = bc_compile_program();
+        int result = bc_run_program(program, program_argc, program_argv);
+        bc_destroy_program(program);
+        destroy_profile();
+        destroy_tables();
+        destroy_syntax_tree();
+        return result;
+    }
+
     // Operations in generator.c
     if (print_generated_program)
         generate_program();
+
+    // Operations in assembler.c and elf.c
+    if (emit_object_file)
+    {
+        object_t *object = assemble_program(&asm_program);
+        write_elf_object(object, stdout);
+        destroy_object(object);
+        asm_clear_buffer(&asm_program);
+    }
+
+    // Operations in assembler.c and jit.c
+    if (run_in_process)
+    {
+        object_t *object = assemble_program(&asm_program);
+        asm_clear_buffer(&asm_program);
+        destroy_profile();
+        destroy_tables();
+        destroy_syntax_tree();
+        int result = run_object(object, program_argc, program_argv);
+        destroy_object(object);
+        return result;
+    }
     
+    destroy_profile();         // In profile.c
     destroy_tables();          // In symbols.c
     destroy_syntax_tree();     // In tree.c
 }
@@ -46,13 +123,24 @@ static const char *usage =
         "\t-t\tOutput the full syntax tree\n"
         "\t-T\tOutput the simplified syntax tree\n"
         "\t-s\tOutput the symbol table contents\n"
-        "\t-c\tCompile and generate assembly output\n";
+        "\t-i\tOutput the intermediate representation used by -O\n"
+        "\t-c\tCompile and generate assembly output\n"
+        "\t-e\tCompile and generate an ELF object file instead of assembly\n"
+        "\t-O\tOptimize the generated assembly\n"
+        "\t-mavx2\tVectorize loops with AVX2 instructions, instead of SSE2, when optimizing\n"
+        "\t-fbounds-check\tStop the program with an error when it indexes outside an array\n"
+        "\t-fprofile-generate[=file]\tMake the program count the paths it takes, and write them to the file when it"
+        " exits (" DEFAULT_PROFILE_PATH " if not given)\n"
+        "\t-fprofile-use[=file]\tOptimize for the paths counted in the file (" DEFAULT_PROFILE_PATH
+        " if not given)\n"
+        "\t-r\tCompile and run the program, with the arguments following -r\n"
+        "\t-b\tInterpret the program as bytecode, with the arguments following -b\n";
 
 
 static void options(int argc, char **argv)
 {
     int o;
-    while ((o = getopt(argc, argv, "htTsc")) != -1)
+    while ((o = getopt(argc, argv, "htTsiceOm:f:rb")) != -1)
     {
         switch (o)
         {
@@ -69,9 +157,56 @@ static void options(int argc, char **argv)
             case 's':
                 print_symbol_table_contents = true;
                 break;
+            case 'i':
+                print_intermediate_code = true;
+                break;
             case 'c':
                 print_generated_program = true;
                 break;
+            case 'e':
+                print_generated_program = true;
+                emit_object_file = true;
+                break;
+            case 'O':
+                optimize_generated_code = true;
+                break;
+            case 'm':
+                if (strcmp(optarg, "avx2") != 0)
+                {
+                    fprintf(stderr, "error: unknown target option '-m%s'\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                vectorize_with_avx2 = true;
+                break;
+            case 'f':
+                if (strcmp(optarg, "bounds-check") == 0)
+                    check_array_bounds = true;
+                else if (strcmp(optarg, "profile-generate") == 0)
+                    profile_generate_path = DEFAULT_PROFILE_PATH;
+                else if (strncmp(optarg, "profile-generate=", 17) == 0)
+                    profile_generate_path = optarg + 17;
+                else if (strcmp(optarg, "profile-use") == 0)
+                    profile_use_path = DEFAULT_PROFILE_PATH;
+                else if (strncmp(optarg, "profile-use=", 12) == 0)
+                    profile_use_path = optarg + 12;
+                else
+                {
+                    fprintf(stderr, "error: unknown option '-f%s'\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'r':
+                // The rest of the arguments are the program's, with the -r in place of its name
+                print_generated_program = true;
+                run_in_process = true;
+                program_argc = argc - optind + 1;
+                program_argv = &argv[optind - 1];
+                return;
+            case 'b':
+                run_bytecode = true;
+                program_argc = argc - optind + 1;
+                program_argv = &argv[optind - 1];
+                return;
         }
     }
 }
@@ -0,0 +1,130 @@
+#!/bin/sh
+# usage: check.sh vslc program.vsl...
+#
+# Runs the programs, and compares what they print with the expected output in their comments, which starts
+# with a line "// Expected output", and ends at the first line that isn't a comment.
+# Every line "// Check: <options>" in a program checks it once, compiled by vslc with the options:
+#  with -c, the assembly is assembled and linked by gcc, and with -e the object is linked by gcc.
+#  With -r and -b, vslc runs the program itself.
+#  With -fprofile-use, the program is first checked with -fprofile-generate instead, to write the profile.
+# Programs without any are checked with the options in DEFAULT_CHECKS.
+# "// Arguments: <arguments>" gives the arguments to run the program with, and "// Exit code: <n>" the code it
+# should end with, 0 if not given.
+# "// Assembly lines with <text>: <n>" checks that the assembly of each check with -c has n lines containing
+# the text.
+
+DEFAULT_CHECKS="-c
+-O -c
+-e
+-O -r
+-b"
+
+VSLC=$(cd "$(dirname "$1")" && pwd)/$(basename "$1")
+shift
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+sources=""
+for program in "$@"; do
+    sources="$sources $(cd "$(dirname "$program")" && pwd)/$(basename "$program")"
+done
+# Programs are compiled and run where they can leave their files, like profiles
+cd "$WORK" || exit 1
+failures=0
+
+fail()
+{
+    echo "FAIL: $program [$options]: $1"
+    failures=$((failures + 1))
+}
+
+# Runs the program compiled with the options, leaving what it printed in output, and its exit code in code.
+# Only standard out is compared, since the shell reports programs killed by a signal on standard error
+run()
+{
+    case " $options " in
+        *" -c "*)
+            "$VSLC" $options < "$source" > program.S && gcc -no-pie -z noexecstack program.S -o program || return 1
+            ./program $arguments < /dev/null > output 2> errors
+            ;;
+        *" -e "*)
+            "$VSLC" $options < "$source" > program.o && gcc -no-pie -z noexecstack program.o -o program || return 1
+            ./program $arguments < /dev/null > output 2> errors
+            ;;
+        *)
+            "$VSLC" $options $arguments < "$source" > output 2> errors
+            ;;
+    esac
+    code=$?
+    return 0
+}
+
+# Compares what the program printed with the expected output, ignoring the spaces print leaves at line ends
+compare()
+{
+    sed 's/ *$//' output > printed
+    if ! diff expected printed > difference; then
+        fail "unexpected output"
+        head -10 difference
+    elif [ "$code" -ne "$expected_code" ]; then
+        fail "exit code $code, expected $expected_code"
+    fi
+}
+
+# Checks the lines of the assembly the program states it has
+count_lines()
+{
+    sed -n 's|^// Assembly lines with \(.*\): \([0-9]*\)$|\2 \1|p' "$source" > counts
+    while read -r n text; do
+        found=$(grep -c -F -- "$text" program.S)
+        [ "$found" -eq "$n" ] || fail "$found assembly lines with '$text', expected $n"
+    done < counts
+}
+
+for source in $sources; do
+    program=${source#"$OLDPWD"/}
+    grep -q "^// Expected output" "$source" || continue
+
+    checks=$(sed -n 's|^// Check: ||p' "$source")
+    [ -n "$checks" ] || checks=$DEFAULT_CHECKS
+    arguments=$(sed -n 's|^// Arguments: ||p' "$source")
+    expected_code=$(sed -n 's|^// Exit code: ||p' "$source")
+    [ -n "$expected_code" ] || expected_code=0
+
+    echo "$checks" > checks
+    while read -r options; do
+        # Profiles are only kept from a run with -fprofile-generate to the check using them
+        rm -f program program.S program.o output vsl.profile
+        awk '/^\/\/ Expected output/ { found = 1; next } found && !/^\/\// { exit } found' "$source" \
+            | sed 's|^// \{0,1\}||' > expected
+
+        case " $options " in
+            *" -fprofile-use"*)
+                use=$options
+                options=$(echo "$use" | sed 's/-fprofile-use/-fprofile-generate/')
+                if run; then
+                    compare
+                else
+                    fail "does not compile"
+                fi
+                options=$use
+                ;;
+        esac
+
+        if ! run; then
+            fail "does not compile"
+            continue
+        fi
+        compare
+        case " $options " in
+            *" -c "*)
+                count_lines
+                ;;
+        esac
+    done < checks
+done
+
+if [ "$failures" -gt 0 ]; then
+    echo "$failures checks failed"
+    exit 1
+fi
+echo "All checks passed"